@@ -8,39 +8,83 @@
 
 /*
  * implement binary search tree in <<Introduction to Algorithm>> 3rd Edition, chapter 12
+ *
+ * build with -DRB_TREE=1 for the red-black tree of chapter 13: insert and delete keep the
+ * same api and fix the colors up with rotations afterwards, so the height stays below
+ * 2 * lg(n + 1) whatever order the keys come in. NULL is the black leaf instead of the
+ * sentinel T.nil, the delete fixup carries the parent of x along for when x is NULL
+ *
+ * nothing recurses: searches loop down the tree and the walks step from node to node along
+ * the parent pointers like tree_succesor, so a tree of sorted keys as deep as it is long
+ * takes no stack and no memory to walk
+ *
+ * a tree that is only read can be frozen into an array without pointers: 4 bytes a key
+ * instead of 32. the eytzinger layout stores the keys in breadth first order of a complete
+ * tree, the children of k are 2k and 2k + 1, so a search is a loop of index arithmetic
+ * without branches, and the 16 descendants 4 levels down share one cache line that is
+ * prefetched ahead. the s-tree stores 16 keys in a block of one cache line with 17 children
+ * per block, a block is searched with simd compares and the search reads lg(n) / 4 lines
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
 #include <assert.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifndef RB_TREE
+#define RB_TREE 0
+#endif
+
+#define RED     0
+#define BLACK   1
+
+#define CACHE_LINE_SIZE 64
+#define S_BLOCK         16      // keys in an s-tree block, one cache line
 
 typedef struct node {
     int key;
+    int color;      // only used by the red-black tree, it fills the padding after key
     struct node* parent;
     struct node* left;
     struct node* right;
 } node_t;
 
-void inorder_tree_walk(node_t* root)
-{
-    if (root) {
-        inorder_tree_walk(root->left);
-        printf("%d ", root->key);
-        inorder_tree_walk(root->right);
-    }
-}
+typedef enum {
+    TREE_INORDER,       // left, node, right: the keys in order
+    TREE_PREORDER,      // node, left, right: a copy inserted in this order has the same shape
+    TREE_POSTORDER,     // left, right, node: a node comes after its children, free in this order
+} tree_order_t;
 
-node_t* tree_search(node_t* root, int key)
-{
-    if (root == NULL || root->key == key)
-        return root;
-    
-    if (key < root->key) {
-        return tree_search(root->left, key);
-    } else {
-        return tree_search(root->right, key);
-    }
-}
+// a walk of the whole tree, root is the root of the tree and has no parent
+typedef struct tree_iter {
+    node_t*      node;  // NULL past the end
+    tree_order_t order;
+} tree_iter_t;
+
+// return false to stop the walk
+typedef bool (*tree_visit_fn)(void* ctx, node_t* n);
+
+// keys[1..n] in breadth first order, keys[0] is not used
+typedef struct eytz_tree {
+    int* keys;
+    long n;
+} eytz_tree_t;
+
+// blocks of S_BLOCK sorted keys, block k has the children k * (S_BLOCK + 1) + 1 + i. INT_MAX
+// fills the slots past the last key
+typedef struct s_tree {
+    int (*blocks)[S_BLOCK];
+    long num_blocks;
+    long n;
+    bool has_max;       // INT_MAX is a key and not only the fill
+} s_tree_t;
 
 node_t* iterative_tree_search(node_t* root, int key)
 {
@@ -56,6 +100,12 @@ node_t* iterative_tree_search(node_t* root, int key)
     return n;
 }
 
+// same as iterative_tree_search, a skewed tree would take a stack frame per level
+node_t* tree_search(node_t* root, int key)
+{
+    return iterative_tree_search(root, key);
+}
+
 node_t* tree_minimum(node_t* root)
 {
     node_t* n = root;
@@ -91,6 +141,278 @@ node_t* tree_succesor(node_t* n)
     return p;
 }
 
+static node_t* preorder_next(node_t* n)
+{
+    if (n->left) {
+        return n->left;
+    } else if (n->right) {
+        return n->right;
+    }
+    
+    // up to the first ancestor reached from the left that has a right subtree
+    node_t* p = n->parent;
+    while (p && (p->right == n || p->right == NULL)) {
+        n = p;
+        p = p->parent;
+    }
+    
+    return p ? p->right : NULL;
+}
+
+// the first node of the subtree in post order, the leaf reached preferring left children
+static node_t* postorder_first(node_t* n)
+{
+    while (n->left || n->right) {
+        n = n->left ? n->left : n->right;
+    }
+    
+    return n;
+}
+
+// reads only n->parent and the parent's children, n may be freed once this returns
+static node_t* postorder_next(node_t* n)
+{
+    node_t* p = n->parent;
+    if (p && p->left == n && p->right) {
+        return postorder_first(p->right);
+    }
+    
+    return p;
+}
+
+node_t* tree_iter_first(tree_iter_t* it, node_t* root, tree_order_t order)
+{
+    it->order = order;
+    if (root == NULL) {
+        it->node = NULL;
+    } else if (order == TREE_INORDER) {
+        it->node = tree_minimum(root);
+    } else if (order == TREE_PREORDER) {
+        it->node = root;
+    } else {
+        it->node = postorder_first(root);
+    }
+    
+    return it->node;
+}
+
+node_t* tree_iter_next(tree_iter_t* it)
+{
+    if (it->node == NULL) {
+        return NULL;
+    } else if (it->order == TREE_INORDER) {
+        it->node = tree_succesor(it->node);
+    } else if (it->order == TREE_PREORDER) {
+        it->node = preorder_next(it->node);
+    } else {
+        it->node = postorder_next(it->node);
+    }
+    
+    return it->node;
+}
+
+// call fn for every node in the order until it returns false, return the count of calls.
+// fn may free the node it gets in post order
+long tree_visit(node_t* root, tree_order_t order, tree_visit_fn fn, void* ctx)
+{
+    tree_iter_t it;
+    long count = 0;
+    
+    for (node_t* n = tree_iter_first(&it, root, order); n; ) {
+        // step before the call, the node may be gone after it
+        node_t* next = tree_iter_next(&it);
+        count++;
+        if (!fn(ctx, n)) {
+            break;
+        }
+        n = next;
+    }
+    
+    return count;
+}
+
+// copy at most max keys out in order, return the count
+long tree_to_array(node_t* root, int* keys, long max)
+{
+    long count = 0;
+    for (node_t* n = root ? tree_minimum(root) : NULL; n && count < max; n = tree_succesor(n)) {
+        keys[count++] = n->key;
+    }
+    
+    return count;
+}
+
+void inorder_tree_walk(node_t* root)
+{
+    for (node_t* n = root ? tree_minimum(root) : NULL; n; n = tree_succesor(n)) {
+        printf("%d ", n->key);
+    }
+}
+
+static int color_of(node_t* n)
+{
+    return n ? n->color : BLACK;
+}
+
+#if RB_TREE
+// return root
+static node_t* left_rotate(node_t* root, node_t* x)
+{
+    node_t* y = x->right;
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        root = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+    
+    y->left = x;
+    x->parent = y;
+    return root;
+}
+
+// return root
+static node_t* right_rotate(node_t* root, node_t* x)
+{
+    node_t* y = x->left;
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        root = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+    
+    y->right = x;
+    x->parent = y;
+    return root;
+}
+
+// return root
+static node_t* rb_insert_fixup(node_t* root, node_t* z)
+{
+    while (color_of(z->parent) == RED) {
+        // a red parent is not the root, so the grandparent exists
+        node_t* g = z->parent->parent;
+        if (z->parent == g->left) {
+            node_t* y = g->right;
+            if (color_of(y) == RED) {
+                z->parent->color = BLACK;
+                y->color = BLACK;
+                g->color = RED;
+                z = g;
+            } else {
+                if (z == z->parent->right) {
+                    z = z->parent;
+                    root = left_rotate(root, z);
+                }
+                z->parent->color = BLACK;
+                g->color = RED;
+                root = right_rotate(root, g);
+            }
+        } else {
+            node_t* y = g->left;
+            if (color_of(y) == RED) {
+                z->parent->color = BLACK;
+                y->color = BLACK;
+                g->color = RED;
+                z = g;
+            } else {
+                if (z == z->parent->left) {
+                    z = z->parent;
+                    root = right_rotate(root, z);
+                }
+                z->parent->color = BLACK;
+                g->color = RED;
+                root = left_rotate(root, g);
+            }
+        }
+    }
+    
+    root->color = BLACK;
+    return root;
+}
+
+// x took the place of a black node and carries an extra black, parent is its parent. x may
+// be NULL, its sibling is not: the other side has a black node more. return root
+static node_t* rb_delete_fixup(node_t* root, node_t* x, node_t* parent)
+{
+    while (x != root && color_of(x) == BLACK) {
+        if (x == parent->left) {
+            node_t* w = parent->right;
+            if (color_of(w) == RED) {
+                w->color = BLACK;
+                parent->color = RED;
+                root = left_rotate(root, parent);
+                w = parent->right;
+            }
+            
+            if (color_of(w->left) == BLACK && color_of(w->right) == BLACK) {
+                w->color = RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (color_of(w->right) == BLACK) {
+                    w->left->color = BLACK;
+                    w->color = RED;
+                    root = right_rotate(root, w);
+                    w = parent->right;
+                }
+                w->color = parent->color;
+                parent->color = BLACK;
+                w->right->color = BLACK;
+                root = left_rotate(root, parent);
+                x = root;
+            }
+        } else {
+            node_t* w = parent->left;
+            if (color_of(w) == RED) {
+                w->color = BLACK;
+                parent->color = RED;
+                root = right_rotate(root, parent);
+                w = parent->left;
+            }
+            
+            if (color_of(w->left) == BLACK && color_of(w->right) == BLACK) {
+                w->color = RED;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (color_of(w->left) == BLACK) {
+                    w->right->color = BLACK;
+                    w->color = RED;
+                    root = left_rotate(root, w);
+                    w = parent->left;
+                }
+                w->color = parent->color;
+                parent->color = BLACK;
+                w->left->color = BLACK;
+                root = right_rotate(root, parent);
+                x = root;
+            }
+        }
+    }
+    
+    if (x) {
+        x->color = BLACK;
+    }
+    return root;
+}
+#endif
+
 node_t* tree_insert(node_t* root, int key)
 {
     node_t* parent = NULL;
@@ -109,21 +431,22 @@ node_t* tree_insert(node_t* root, int key)
     node_t* new_n = malloc(sizeof(node_t));
     assert(new_n != NULL);
     new_n->key = key;
+    new_n->color = RED;
     new_n->parent = parent;
     new_n->left = new_n->right = NULL;
     
     // root is NULL
     if (parent == NULL) {
         root = new_n;
-        return root;
-    }
-    
-    if (key < parent->key) {
+    } else if (key < parent->key) {
         parent->left = new_n;
     } else {
         parent->right = new_n;
     }
-    
+
+#if RB_TREE
+    root = rb_insert_fixup(root, new_n);
+#endif
     return root;
 }
 
@@ -131,7 +454,7 @@ node_t* tree_insert(node_t* root, int key)
 node_t* transplant(node_t* root, node_t* u, node_t* v)
 {
     if (u->parent == NULL) {
-        return v;
+        root = v;
     } else if (u->parent->left == u) {
         u->parent->left = v;
     } else {
@@ -147,18 +470,30 @@ node_t* transplant(node_t* root, node_t* u, node_t* v)
 
 node_t* tree_delete(node_t* root, int key)
 {
-    node_t* z = tree_search(root, key);
+    node_t* z = iterative_tree_search(root, key);
     if (!z) {
         return root;
     }
     
+    // x moves into the place of the node that leaves its position, y or z itself
+    int removed_color = z->color;
+    node_t* x;
+    node_t* x_parent;
     if (z->left == NULL) {
+        x = z->right;
+        x_parent = z->parent;
         root = transplant(root, z, z->right);
     } else if (z->right == NULL) {
+        x = z->left;
+        x_parent = z->parent;
         root = transplant(root, z, z->left);
     } else {
         node_t* y = tree_minimum(z->right);
+        removed_color = y->color;
+        x = y->right;
+        x_parent = y;
         if (y->parent != z) {
+            x_parent = y->parent;
             root = transplant(root, y, y->right);
             y->right = z->right;
             y->right->parent = y;
@@ -167,14 +502,691 @@ node_t* tree_delete(node_t* root, int key)
         root = transplant(root, z, y);
         y->left = z->left;
         y->left->parent = y;
+        y->color = z->color;
     }
-    
+
+#if RB_TREE
+    if (removed_color == BLACK) {
+        root = rb_delete_fixup(root, x, x_parent);
+    }
+#else
+    (void)removed_color;
+    (void)x;
+    (void)x_parent;
+#endif
+
     free(z);
     return root;
 }
 
+//////////// frozen trees
+
+// the keys of the tree in order in one walk, *count set to their number. NULL if out of memory
+static int* tree_keys(node_t* root, long* count)
+{
+    long cap = 1024;
+    int* keys = malloc(cap * sizeof(int));
+    
+    *count = 0;
+    for (node_t* n = root ? tree_minimum(root) : NULL; n && keys; n = tree_succesor(n)) {
+        if (*count == cap) {
+            cap *= 2;
+            int* bigger = realloc(keys, cap * sizeof(int));
+            if (!bigger) {
+                free(keys);
+                return NULL;
+            }
+            keys = bigger;
+        }
+        keys[(*count)++] = n->key;
+    }
+    
+    return keys;
+}
+
+// the in order walk of the implicit tree: the leftmost node below k
+static long eytz_leftmost(long k, long n)
+{
+    while (2 * k <= n) {
+        k = 2 * k;
+    }
+    
+    return k;
+}
+
+// copy the tree into a new array, the tree is left as it is. return NULL if out of memory
+eytz_tree_t* tree_freeze(node_t* root)
+{
+    long n;
+    int* sorted = tree_keys(root, &n);
+    eytz_tree_t* t = malloc(sizeof(eytz_tree_t));
+    
+    // keys[16k .. 16k + 15], the descendants of k 4 levels down, are one aligned line
+    size_t size = ((n + 1) * sizeof(int) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    int* keys = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (!sorted || !t || !keys) {
+        free(sorted);
+        free(t);
+        free(keys);
+        return NULL;
+    }
+    
+    // visit the implicit tree in order and hand out the sorted keys
+    long k = n > 0 ? eytz_leftmost(1, n) : 0;
+    for (long i = 0; i < n; i++) {
+        keys[k] = sorted[i];
+        if (2 * k + 1 <= n) {
+            k = eytz_leftmost(2 * k + 1, n);
+        } else {
+            // up while coming from a right child, then once more
+            k >>= __builtin_ctzl(~k) + 1;
+        }
+    }
+    
+    free(sorted);
+    keys[0] = 0;
+    t->keys = keys;
+    t->n = n;
+    return t;
+}
+
+void eytz_free(eytz_tree_t* t)
+{
+    if (t) {
+        free(t->keys);
+        free(t);
+    }
+}
+
+// the index of the first key >= key, 0 if all keys are smaller
+long eytz_lower_bound(const eytz_tree_t* t, int key)
+{
+    const int* keys = t->keys;
+    long k = 1;
+    while (k <= t->n) {
+        __builtin_prefetch(keys + k * 16);
+        k = 2 * k + (keys[k] < key);
+    }
+    
+    // the path went right after the answer every time since, drop those steps and the left one
+    return k >> (__builtin_ctzl(~k) + 1);
+}
+
+bool eytz_search(const eytz_tree_t* t, int key)
+{
+    long k = eytz_lower_bound(t, key);
+    return k != 0 && t->keys[k] == key;
+}
+
+static long s_child(long k, int i)
+{
+    return k * (S_BLOCK + 1) + 1 + i;
+}
+
+// copy the tree into a new s-tree, the tree is left as it is. return NULL if out of memory
+s_tree_t* tree_freeze_s_tree(node_t* root)
+{
+    long n;
+    int* sorted = tree_keys(root, &n);
+    s_tree_t* t = malloc(sizeof(s_tree_t));
+    long num_blocks = (n + S_BLOCK - 1) / S_BLOCK;
+    int (*blocks)[S_BLOCK] = aligned_alloc(CACHE_LINE_SIZE, (num_blocks > 0 ? num_blocks : 1) * sizeof(*blocks));
+    if (!sorted || !t || !blocks) {
+        free(sorted);
+        free(t);
+        free(blocks);
+        return NULL;
+    }
+    
+    // the in order walk of the implicit tree with a stack of (block, next slot), as deep as the
+    // tree: a slot is written after the child left of it is done
+    long stack_block[64];
+    int stack_slot[64];
+    int top = 0;
+    long next = 0;
+    for (long k = 0; k < num_blocks; k = s_child(k, 0)) {
+        stack_block[top] = k;
+        stack_slot[top++] = 0;
+    }
+    while (top > 0) {
+        long k = stack_block[top - 1];
+        int i = stack_slot[top - 1];
+        if (i == S_BLOCK) {
+            top--;
+            continue;
+        }
+        
+        blocks[k][i] = next < n ? sorted[next++] : INT_MAX;
+        stack_slot[top - 1] = i + 1;
+        for (long c = s_child(k, i + 1); c < num_blocks; c = s_child(c, 0)) {
+            stack_block[top] = c;
+            stack_slot[top++] = 0;
+        }
+    }
+    
+    t->has_max = n > 0 && sorted[n - 1] == INT_MAX;
+    free(sorted);
+    t->blocks = blocks;
+    t->num_blocks = num_blocks;
+    t->n = n;
+    return t;
+}
+
+void s_tree_free(s_tree_t* t)
+{
+    if (t) {
+        free(t->blocks);
+        free(t);
+    }
+}
+
+// the count of keys < key in a sorted block, the child to go down to
+static int s_rank(const int* block, int key)
+{
+#if defined(__AVX2__)
+    __m256i x = _mm256_set1_epi32(key);
+    __m256i lo = _mm256_cmpgt_epi32(x, _mm256_load_si256((const __m256i*)block));
+    __m256i hi = _mm256_cmpgt_epi32(x, _mm256_load_si256((const __m256i*)(block + 8)));
+    unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(lo)) |
+                    ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(hi)) << 8);
+    return __builtin_popcount(mask);
+#elif defined(__SSE2__)
+    __m128i x = _mm_set1_epi32(key);
+    unsigned mask = 0;
+    for (int j = 0; j < S_BLOCK; j += 4) {
+        __m128i lt = _mm_cmpgt_epi32(x, _mm_load_si128((const __m128i*)(block + j)));
+        mask |= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(lt)) << j;
+    }
+    return __builtin_popcount(mask);
+#else
+    int count = 0;
+    for (int j = 0; j < S_BLOCK; j++) {
+        count += block[j] < key;
+    }
+    return count;
+#endif
+}
+
+bool s_tree_search(const s_tree_t* t, int key)
+{
+    int found = INT_MAX;    // the smallest key >= key seen on the way down
+    long k = 0;
+    while (k < t->num_blocks) {
+        int i = s_rank(t->blocks[k], key);
+        if (i < S_BLOCK) {
+            found = t->blocks[k][i];
+        }
+        k = s_child(k, i);
+    }
+    
+    return found == key && (key != INT_MAX || t->has_max);
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// the next node of a walk over the whole tree that needs no stack, prev is the node it came
+// from: down from the parent, up from the left child or up from the right child
+static node_t* walk_next(node_t* n, node_t* prev)
+{
+    if (prev == n->parent) {
+        return n->left ? n->left : (n->right ? n->right : n->parent);
+    } else if (prev == n->left && n->right) {
+        return n->right;
+    }
+    
+    return n->parent;
+}
+
+// the nodes on the longest path from the root to a leaf
+static int tree_height(node_t* root)
+{
+    int height = 0;
+    int depth = 0;
+    node_t* prev = NULL;
+    for (node_t* n = root; n; ) {
+        if (prev == n->parent && ++depth > height) {
+            height = depth;
+        }
+        
+        node_t* next = walk_next(n, prev);
+        if (next == n->parent) {
+            depth--;
+        }
+        prev = n;
+        n = next;
+    }
+    
+    return height;
+}
+
+static bool free_fn(void* ctx, node_t* n)
+{
+    (void)ctx;
+    free(n);
+    return true;
+}
+
+static void free_tree(node_t* root)
+{
+    tree_visit(root, TREE_POSTORDER, free_fn, NULL);
+}
+
+// parent links, key order, no red node with a red child and the same count of black nodes
+// on the way from every NULL leaf up to the root
+static int check_tree(node_t* root, int count)
+{
+    int errors = root && root->parent != NULL;
+    int n = 0;
+#if RB_TREE
+    int black_height = -1;
+#endif
+
+    for (node_t* x = root ? tree_minimum(root) : NULL; x; x = tree_succesor(x)) {
+        node_t* next = tree_succesor(x);
+        errors += next && next->key < x->key;
+        errors += (x->left && x->left->parent != x) || (x->right && x->right->parent != x);
+        n++;
+
+#if RB_TREE
+        errors += x->color == RED && (color_of(x->left) == RED || color_of(x->right) == RED);
+        if (!x->left || !x->right) {
+            int blacks = 0;
+            for (node_t* y = x; y; y = y->parent) {
+                blacks += y->color == BLACK;
+            }
+            if (black_height < 0) {
+                black_height = blacks;
+            }
+            errors += blacks != black_height;
+        }
+#endif
+    }
+    errors += root && color_of(root) != BLACK && RB_TREE;
+    
+    return errors + (n != count);
+}
+
+// random inserts and deletes against a count of every key, the tree checked along the way
+static int run_test(int key_range, int ops)
+{
+    int* counts = calloc(key_range, sizeof(int));
+    node_t* root = NULL;
+    uint64_t seed = 3;
+    int total = 0;
+    int errors = 0;
+    
+    for (int i = 0; i < ops; i++) {
+        uint64_t r = xorshift(&seed);
+        int k = (int)((r >> 8) % key_range);
+        if (r % 3 != 0) {
+            root = tree_insert(root, k);
+            counts[k]++;
+            total++;
+        } else {
+            root = tree_delete(root, k);
+            if (counts[k] > 0) {
+                counts[k]--;
+                total--;
+            }
+        }
+        
+        if (i % (ops / 10) == 0) {
+            errors += check_tree(root, total);
+        }
+    }
+    
+    errors += check_tree(root, total);
+    for (int k = 0; k < key_range; k++) {
+        errors += (iterative_tree_search(root, k) != NULL) != (counts[k] > 0);
+    }
+    
+    printf("%d keys, %d ops, height %d: %s\n", key_range, ops, tree_height(root), errors ? "FAILED" : "ok");
+    free_tree(root);
+    free(counts);
+    return errors ? 1 : 0;
+}
+
+typedef struct {
+    int* keys;
+    long count;
+    long stop;      // stop the walk after this many nodes
+} collect_t;
+
+static bool collect_fn(void* ctx, node_t* n)
+{
+    collect_t* c = ctx;
+    c->keys[c->count++] = n->key;
+    return c->count < c->stop;
+}
+
+// the three orders with an explicit stack, to check the walks against
+static long stack_walk(node_t* root, tree_order_t order, node_t** stack, int* keys)
+{
+    long count = 0;
+    int top = 0;
+    node_t* last = NULL;
+    node_t* n = root;
+    
+    while (n || top > 0) {
+        if (n) {
+            if (order == TREE_PREORDER) {
+                keys[count++] = n->key;
+            }
+            stack[top++] = n;
+            n = n->left;
+            continue;
+        }
+        
+        node_t* x = stack[top - 1];
+        if (order != TREE_POSTORDER) {
+            top--;
+            if (order == TREE_INORDER) {
+                keys[count++] = x->key;
+            }
+            n = x->right;
+        } else if (x->right && last != x->right) {
+            n = x->right;
+        } else {
+            keys[count++] = x->key;
+            last = x;
+            top--;
+        }
+    }
+    
+    return count;
+}
+
+// a tree that is one path down, every node the right (or left) child of the one before, as
+// sorted inserts build it without the red-black fixups
+static node_t* make_chain(int n, bool right)
+{
+    node_t* root = NULL;
+    node_t* last = NULL;
+    for (int i = 0; i < n; i++) {
+        node_t* x = malloc(sizeof(node_t));
+        assert(x != NULL);
+        x->key = right ? i : n - 1 - i;
+        x->color = BLACK;
+        x->parent = last;
+        x->left = x->right = NULL;
+        if (last == NULL) {
+            root = x;
+        } else if (right) {
+            last->right = x;
+        } else {
+            last->left = x;
+        }
+        last = x;
+    }
+    
+    return root;
+}
+
+// the iterators, visit and to_array against the stack walks on a random tree, then on chains
+// deeper than any call stack
+static int run_iter_test(int n, int chain)
+{
+    node_t* root = NULL;
+    uint64_t seed = 21;
+    int errors = 0;
+    
+    for (int i = 0; i < n; i++) {
+        root = tree_insert(root, (int)(xorshift(&seed) % (n * 2)));
+    }
+    
+    node_t** stack = malloc(n * sizeof(node_t*));
+    int* expected = malloc(n * sizeof(int));
+    int* keys = malloc(n * sizeof(int));
+    for (tree_order_t order = TREE_INORDER; order <= TREE_POSTORDER; order++) {
+        errors += stack_walk(root, order, stack, expected) != n;
+        
+        tree_iter_t it;
+        long count = 0;
+        for (node_t* x = tree_iter_first(&it, root, order); x; x = tree_iter_next(&it)) {
+            errors += count >= n || x->key != expected[count];
+            count++;
+        }
+        errors += count != n || tree_iter_next(&it) != NULL;
+        
+        collect_t c = {keys, 0, n};
+        errors += tree_visit(root, order, collect_fn, &c) != n || memcmp(keys, expected, n * sizeof(int)) != 0;
+        c.count = 0;
+        c.stop = n / 3;
+        errors += tree_visit(root, order, collect_fn, &c) != n / 3;
+    }
+    
+    stack_walk(root, TREE_INORDER, stack, expected);
+    errors += tree_to_array(root, keys, n) != n || memcmp(keys, expected, n * sizeof(int)) != 0;
+    errors += tree_to_array(root, keys, 10) != 10 || tree_to_array(NULL, keys, n) != 0;
+    free_tree(root);
+    
+    for (int right = 0; right < 2; right++) {
+        root = make_chain(chain, right);
+        int* all = malloc(chain * sizeof(int));
+        errors += tree_to_array(root, all, chain) != chain || all[0] != 0 || all[chain - 1] != chain - 1;
+        
+        collect_t c = {all, 0, chain};
+        errors += tree_visit(root, TREE_PREORDER, collect_fn, &c) != chain || all[0] != (right ? 0 : chain - 1);
+        c.count = 0;
+        errors += tree_visit(root, TREE_POSTORDER, collect_fn, &c) != chain || all[0] != (right ? chain - 1 : 0);
+        
+        // a chain breaks the red-black rules the delete fixup relies on
+        if (!RB_TREE) {
+            root = tree_delete(root, right ? chain - 1 : 0);
+            errors += tree_search(root, right ? chain - 2 : 1) == NULL || tree_search(root, right ? chain - 1 : 0) != NULL;
+        }
+        free_tree(root);
+        free(all);
+    }
+    
+    printf("iterators: %d keys, chains of %d: %s\n", n, chain, errors ? "FAILED" : "ok");
+    free(stack);
+    free(expected);
+    free(keys);
+    return errors ? 1 : 0;
+}
+
+// every key near the ones in a random tree in the frozen trees and the pointer tree, then the
+// ends of the int range and an empty tree
+static int run_freeze_test(int n)
+{
+    node_t* root = NULL;
+    uint64_t seed = 41;
+    int errors = 0;
+    
+    for (int i = 0; i < n; i++) {
+        root = tree_insert(root, (int)(xorshift(&seed) % (n * 3)) - n);
+    }
+    root = tree_insert(root, INT_MIN);
+    root = tree_insert(root, INT_MAX - 1);
+    
+    long count;
+    int* sorted = tree_keys(root, &count);
+    eytz_tree_t* e = tree_freeze(root);
+    s_tree_t* st = tree_freeze_s_tree(root);
+    errors += e->n != n + 2 || st->n != n + 2;
+    
+    long pos = 0;
+    int queries[] = {INT_MIN, INT_MIN + 1, INT_MAX - 2, INT_MAX - 1, INT_MAX};
+    for (long q = -n - 1; q < 2 * n + 6; q++) {
+        int key = q < 2 * n + 1 ? (int)q : queries[q - 2 * n - 1];
+        bool found = iterative_tree_search(root, key) != NULL;
+        errors += eytz_search(e, key) != found || s_tree_search(st, key) != found;
+        
+        // the lower bound is the first of the sorted keys >= key
+        if (q == 2 * n + 1) {
+            pos = 0;
+        }
+        while (pos < count && sorted[pos] < key) {
+            pos++;
+        }
+        long k = eytz_lower_bound(e, key);
+        errors += pos < count ? (k == 0 || e->keys[k] != sorted[pos]) : k != 0;
+    }
+    eytz_free(e);
+    s_tree_free(st);
+    free(sorted);
+    free_tree(root);
+    
+    root = tree_insert(NULL, INT_MAX);
+    e = tree_freeze(root);
+    st = tree_freeze_s_tree(root);
+    errors += !eytz_search(e, INT_MAX) || !s_tree_search(st, INT_MAX) || s_tree_search(st, 0);
+    eytz_free(e);
+    s_tree_free(st);
+    free_tree(root);
+    
+    e = tree_freeze(NULL);
+    st = tree_freeze_s_tree(NULL);
+    errors += eytz_search(e, 0) || eytz_lower_bound(e, 0) != 0 || s_tree_search(st, 0) || s_tree_search(st, INT_MAX);
+    eytz_free(e);
+    s_tree_free(st);
+    
+    printf("freeze: %d keys: %s\n", n, errors ? "FAILED" : "ok");
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+// insert n keys in sorted and in random order, then search each once. a plain tree of sorted
+// keys is a chain that takes n^2 / 2 steps to build, it gets at most 20000 keys
+static void bench(int n)
+{
+    const char* orders[] = {"sorted", "random"};
+    int* keys = malloc(n * sizeof(int));
+    
+    printf("%s tree\n", RB_TREE ? "red-black" : "plain");
+    printf("%8s %10s %8s %12s %12s\n", "input", "keys", "height", "insert ns", "search ns");
+    for (int o = 0; o < 2; o++) {
+        int count = (o == 0 && !RB_TREE && n > 20000) ? 20000 : n;
+        uint64_t state = 88172645463325252ULL;
+        for (int i = 0; i < count; i++) {
+            keys[i] = o == 0 ? i : (int)(xorshift(&state) >> 33);
+        }
+        
+        node_t* root = NULL;
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < count; i++) {
+            root = tree_insert(root, keys[i]);
+        }
+        uint64_t insert_ns = get_nano_tick() - start;
+        
+        long found = 0;
+        start = get_nano_tick();
+        for (int i = 0; i < count; i++) {
+            found += iterative_tree_search(root, keys[i]) != NULL;
+        }
+        uint64_t search_ns = get_nano_tick() - start;
+        
+        printf("%8s %10d %8d %12.1f %12.1f\n", orders[o], count, tree_height(root),
+               (double)insert_ns / count, (double)search_ns / count);
+        if (found != count) {
+            printf("search FAILED\n");
+        }
+        free_tree(root);
+    }
+    
+    free(keys);
+}
+
+// n random keys, searched for num_lookups times in the pointer tree and the two frozen layouts,
+// half of the searches for keys that are in the tree
+static void bench_freeze(int n, int num_lookups)
+{
+    const char* names[] = {"iterative_tree_search", "eytzinger + prefetch", "s-tree"};
+    int* queries = malloc(num_lookups * sizeof(int));
+    node_t* root = NULL;
+    uint64_t state = 88172645463325252ULL;
+    
+    for (int i = 0; i < n; i++) {
+        int key = (int)(xorshift(&state) >> 33);
+        root = tree_insert(root, key);
+        if (i < num_lookups / 2) {
+            queries[i * 2] = key;
+        }
+    }
+    for (int i = 0; i < num_lookups; i++) {
+        if (i % 2 == 1 || i / 2 >= n) {
+            queries[i] = (int)(xorshift(&state) >> 33);
+        }
+    }
+    // the tree inserted in order of the queries would be warm in the cache, shuffle them
+    for (int i = num_lookups - 1; i > 0; i--) {
+        int j = (int)(xorshift(&state) % (i + 1));
+        int x = queries[i];
+        queries[i] = queries[j];
+        queries[j] = x;
+    }
+    
+    uint64_t start = get_nano_tick();
+    eytz_tree_t* e = tree_freeze(root);
+    uint64_t eytz_build_ns = get_nano_tick() - start;
+    start = get_nano_tick();
+    s_tree_t* st = tree_freeze_s_tree(root);
+    uint64_t s_build_ns = get_nano_tick() - start;
+    if (!e || !st) {
+        printf("freeze FAILED, out of memory\n");
+        return;
+    }
+    
+    printf("%d keys, height %d, %d lookups, %s, %.1f MiB of nodes\n", n, tree_height(root), num_lookups,
+           RB_TREE ? "red-black" : "plain", (double)n * sizeof(node_t) / (1 << 20));
+    printf("freeze %.1f ms (eytzinger), %.1f ms (s-tree)\n", eytz_build_ns / 1e6, s_build_ns / 1e6);
+    printf("%24s %12s %8s\n", "search", "ns", "found");
+    for (int m = 0; m < 3; m++) {
+        long found = 0;
+        start = get_nano_tick();
+        for (int i = 0; i < num_lookups; i++) {
+            if (m == 0) {
+                found += iterative_tree_search(root, queries[i]) != NULL;
+            } else if (m == 1) {
+                found += eytz_search(e, queries[i]);
+            } else {
+                found += s_tree_search(st, queries[i]);
+            }
+        }
+        uint64_t ns = get_nano_tick() - start;
+        printf("%24s %12.1f %8ld\n", names[m], (double)ns / num_lookups, found);
+    }
+    
+    eytz_free(e);
+    s_tree_free(st);
+    free_tree(root);
+    free(queries);
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: binary_search_tree bench [num_keys]
+        bench(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "bench-freeze") == 0) {
+        // usage: binary_search_tree bench-freeze [num_keys] [num_lookups]
+        bench_freeze(argc >= 3 ? atoi(argv[2]) : 1000000, argc >= 4 ? atoi(argv[3]) : 4000000);
+        return 0;
+    }
+    
     node_t* root = NULL;
     root = tree_insert(root, 12);
     root = tree_insert(root, 10);
@@ -198,6 +1210,14 @@ int main(int argc, char* argv[])
     printf("inorder_tree_walk\n");
     inorder_tree_walk(root);
     printf("\n");
+    free_tree(root);
+    
+    int failed = 0;
+    failed |= run_test(1000, 20000);
+    failed |= run_test(100000, 300000);
+    failed |= run_iter_test(100000, 5000000);
+    failed |= run_freeze_test(1000);
+    failed |= run_freeze_test(200000);
     
-    return 0;
+    return failed;
 }
@@ -9,666 +9,4606 @@
 /*
  B+ Tree Implementation as described in <<Database System Concept>> 6th Edition chapter 11.3
  order is the max pointer number in one node
+
+ the order is chosen when the tree is created, every node is one cache line aligned block:
+ the node_t header is followed by the keys array and the pointers array, so a node visit
+ touches one allocation instead of three
+
+ a leaf keeps its values in a second array next to the keys (struct of arrays), every value
+ slot is value_size bytes, so a lookup ends in the leaf instead of one more cache miss on a
+ record. large values can stay out of line: the slot then holds a pointer to a record
+
+ nodes come from per-tree slabs with one free list per node size, the split scratch arrays are
+ allocated once with the tree, so inserts in steady state never call the system allocator and
+ bptree_destroy releases the arena slab by slab instead of node by node
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// the simd kernels compare keys in the integer order, a custom BPT_KEY_CMP goes without them
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(BPT_KEY_CMP)
+#include <immintrin.h>
+#define HAVE_X86_SIMD   1
+#endif
 
 #define DEFAULT_ORDER   4
+#define MIN_ORDER       3
+#define CACHE_LINE_SIZE 64
+
+// intra-node key search, NODE_SEARCH_AUTO picks the best kernel the cpu supports at runtime,
+// build with -DNODE_SEARCH=<kind> to pin one kernel
+#define NODE_SEARCH_AUTO    0
+#define NODE_SEARCH_LINEAR  1
+#define NODE_SEARCH_BINARY  2
+#define NODE_SEARCH_SSE42   3
+#define NODE_SEARCH_AVX2    4
+
+#ifndef NODE_SEARCH
+#define NODE_SEARCH NODE_SEARCH_AUTO
+#endif
+
+// build with -DNODE_POOL=0 to take every node from aligned_alloc, for comparison
+#ifndef NODE_POOL
+#define NODE_POOL       1
+#endif
+
+#define SLAB_SIZE       (256 * 1024)
+
+// build with -DBPT_COUNTERS=1 to count descents, node visits and structure changes,
+// off by default so the hot paths carry no extra stores
+#ifndef BPT_COUNTERS
+#define BPT_COUNTERS    0
+#endif
+
+#if BPT_COUNTERS
+#define COUNT(t, field, n)  ((t)->counters.field += (n))
+#else
+#define COUNT(t, field, n)  ((void)0)
+#endif
+
+// a node has at least 2 children, so no tree is higher than this
+#define BPT_MAX_HEIGHT  64
+#define FILL_BUCKETS    10
+
+// find_batch and insert_batch descend this many sorted keys together
+#define BATCH_GROUP     32
+
+// the simd kernels narrow the node with a branchless binary search down to this many keys,
+// then count the keys <= search key in the window with vector compares
+#define SIMD_WINDOW     16
+
+// key type, int keys by default, build with -DBPT_KEY_INT64 for 64-bit keys. the key type is
+// fixed at compile time so the compares and the simd kernels stay specialized to it
+#ifdef BPT_KEY_INT64
+typedef int64_t  bpt_key_t;
+typedef uint64_t bpt_ukey_t;
+#define KEY_FMT         "%" PRId64
+#else
+typedef int32_t  bpt_key_t;
+typedef uint32_t bpt_ukey_t;
+#define KEY_FMT         "%d"
+#endif
+
+#define KEY_BITS        (sizeof(bpt_key_t) * 8)
+#define KEY_SIGN_BIT    ((bpt_ukey_t)1 << (KEY_BITS - 1))
+
+// build with -DBPT_KEY_CMP(a, b)=<expr> to order the keys by another compare, negative, zero or
+// positive like SL_KEY_CMP of skiplist.c. the built-in order stays a single compare and keeps
+// the simd node search and the radix sort of a batch, both only know the integer order
+#ifdef BPT_KEY_CMP
+#define KEY_LT(a, b)    (BPT_KEY_CMP(a, b) < 0)
+#define KEY_LE(a, b)    (BPT_KEY_CMP(a, b) <= 0)
+#define KEY_EQ(a, b)    (BPT_KEY_CMP(a, b) == 0)
+#else
+#define KEY_LT(a, b)    ((a) < (b))
+#define KEY_LE(a, b)    ((a) <= (b))
+#define KEY_EQ(a, b)    ((a) == (b))
+#endif
 
 typedef struct record {
     int value;
 } record_t;
 
 typedef struct node {
-    void**  pointers;
-    int*    keys;
+    union {
+        void**  pointers;       // internal node: num_keys + 1 children
+        char*   values;         // leaf: num_keys value slots of value_slot bytes
+    };
+    bpt_key_t* keys;
     int     num_keys;
     bool    is_leaf;
     struct node* parent;
-    struct node* next;
+    struct node* next;          // queue link of print_tree
+    struct node* sibling;       // leaf: the next leaf
 } node_t;
 
-// help function for print_tree, avoid recurive calls
-void enqueue(node_t** queue, node_t* n)
-{
-    if (!*queue) {
-        *queue = n;
-        n->next = NULL;
-    } else {
-        node_t* c = *queue;
-        while (c->next) {
-            c = c->next;
-        }
-        
-        c->next = n;
-        n->next = NULL;
-    }
-}
+typedef struct slab {
+    struct slab* next;
+} slab_t;
 
-node_t* dequeue(node_t** queue)
+// fixed size blocks cut from slabs, a freed block is linked through its first word
+typedef struct node_pool {
+    size_t  block_size;
+    size_t  slab_size;
+    slab_t* slabs;
+    char*   bump;           // next unused block of the newest slab
+    char*   bump_end;
+    void*   free_list;
+} node_pool_t;
+
+typedef struct bptree_alloc_stats {
+    long    mallocs;        // calls into the system allocator
+    long    frees;
+    long    slabs;
+    long    node_allocs;
+    long    node_reuses;    // nodes taken from a free list
+} bptree_alloc_stats_t;
+
+// zero unless built with BPT_COUNTERS
+typedef struct bptree_counters {
+    long    descents;           // root to leaf walks, a batch group is one walk
+    long    visits;             // nodes searched on the way down
+    long    leaf_splits;
+    long    internal_splits;
+    long    root_splits;        // the tree grew one level
+    long    merges;
+    long    redistributions;
+    long    compactions;
+} bptree_counters_t;
+
+typedef struct bptree {
+    node_t* root;
+    int     order;
+    size_t  node_size;          // bytes of one internal node block, multiple of CACHE_LINE_SIZE
+    size_t  leaf_size;          // bytes of one leaf block, multiple of CACHE_LINE_SIZE
+    size_t  pointers_offset;    // offset of pointers/values array from the start of the block
+    size_t  value_size;         // bytes of one value
+    size_t  value_slot;         // bytes of one leaf slot, value_size or a record pointer
+    bool    inline_values;
+    bool    split_layout;       // bench only: node, keys and pointers in three mallocs like before
+    long    num_nodes;
+    long    num_leaves;
+    node_pool_t inner_pool;
+    node_pool_t leaf_pool;
+    bpt_key_t* split_keys;      // scratch of an internal node split, order keys
+    void**  split_pointers;     // and order + 1 pointers
+    bptree_alloc_stats_t alloc;
+    bool    lazy_delete;        // delete leaves underfull and empty leaves to compact
+    long    lazy_deletes;       // entries removed without rebalancing since the last compact
+    bptree_counters_t counters;
+} bptree_t;
+
+typedef struct bptree_stats {
+    int     height;
+    int     order;
+    long    num_keys;                       // entries in the leaves
+    long    nodes[BPT_MAX_HEIGHT];          // per level, level 0 is the root
+    long    keys[BPT_MAX_HEIGHT];
+    long    leaf_fill[FILL_BUCKETS];        // leaves by num_keys / (order - 1) in tenths
+    long    internal_fill[FILL_BUCKETS];    // the last bucket includes full nodes
+    long    empty_leaves;
+    double  avg_leaf_fill;
+    double  avg_internal_fill;
+    size_t  node_bytes;                     // blocks of the nodes in the tree
+    size_t  record_bytes;                   // out of line records
+    size_t  pool_bytes;                     // slabs of the node pools, used or free
+    size_t  total_bytes;                    // all memory of the tree
+} bptree_stats_t;
+
+// api
+bptree_t* bptree_create(int order);
+bptree_t* bptree_create_ex(int order, size_t value_size, bool inline_values);
+void bptree_destroy(bptree_t* t);
+int bptree_order_for_node_size(size_t node_size);
+int bptree_set_node_search(int kind);
+void bptree_stats(bptree_t* t, bptree_stats_t* s);
+void bptree_stats_json(bptree_t* t, FILE* f);
+void bptree_reset_counters(bptree_t* t);
+record_t* find(bptree_t* t, bpt_key_t key);
+void* find_value(bptree_t* t, bpt_key_t key);
+int insert(bptree_t* t, bpt_key_t key, int value);
+int insert_value(bptree_t* t, bpt_key_t key, const void* value);
+int delete(bptree_t* t, bpt_key_t key);
+void bptree_set_lazy_delete(bptree_t* t, bool lazy);
+long compact(bptree_t* t, double fill_factor);
+typedef bool (*bulk_next_fn)(void* ctx, bpt_key_t* key, const void** value);
+int bulk_load(bptree_t* t, const bpt_key_t* keys, const void* values, long n, double fill_factor);
+int bulk_load_iter(bptree_t* t, bulk_next_fn next, void* ctx, double fill_factor);
+
+typedef struct bpt_cursor {
+    bptree_t* t;
+    node_t*   leaf;     // NULL when the cursor is past either end
+    int       idx;
+} bpt_cursor_t;
+
+typedef bool (*scan_fn)(void* ctx, bpt_key_t key, const void* value);
+bool cursor_seek(bpt_cursor_t* c, bptree_t* t, bpt_key_t key);
+bool cursor_first(bpt_cursor_t* c, bptree_t* t);
+bool cursor_last(bpt_cursor_t* c, bptree_t* t);
+bool cursor_next(bpt_cursor_t* c);
+bool cursor_prev(bpt_cursor_t* c);
+bool cursor_valid(bpt_cursor_t* c);
+bpt_key_t cursor_key(bpt_cursor_t* c);
+void* cursor_value(bpt_cursor_t* c);
+record_t* cursor_record(bpt_cursor_t* c);
+long scan(bptree_t* t, bpt_key_t lo, bpt_key_t hi, scan_fn fn, void* ctx);
+long scan_into(bptree_t* t, bpt_key_t lo, bpt_key_t hi, bpt_key_t* keys, void* values, long max);
+long find_batch(bptree_t* t, const bpt_key_t* keys, long n, void** values);
+long insert_batch(bptree_t* t, const bpt_key_t* keys, const void* values, long n);
+
+typedef struct durable durable_t;
+durable_t* durable_open(const char* dir, int order, size_t value_size, int group_size, long checkpoint_records);
+int durable_insert(durable_t* d, bpt_key_t key, const void* value);
+int durable_delete(durable_t* d, bpt_key_t key);
+int durable_commit(durable_t* d);
+int durable_checkpoint(durable_t* d);
+int durable_close(durable_t* d);
+
+////////
+
+static size_t round_up(size_t n, size_t align)
 {
-    node_t* n = NULL;
-    if (*queue) {
-        n = *queue;
-        *queue = n->next;
-    }
-    
-    return n;
+    return (n + align - 1) / align * align;
 }
 
-node_t* make_node()
+// layout: | node_t | keys[order] | pad | pointers[order] | pad to cache line |
+// a leaf: | node_t | keys[order] | pad | values[order - 1] | pad to cache line |
+static size_t calc_pointers_offset(int order)
 {
-    node_t* n = malloc(sizeof(node_t));
-    if (n == NULL) {
-        perror("malloc failed\n");
-        exit(1);
-    }
-    
-    n->pointers = malloc(DEFAULT_ORDER * sizeof(void*));
-    if (n->pointers == NULL) {
-        perror("malloc failed\n");
-        exit(1);
-    }
-    
-    n->keys = malloc(DEFAULT_ORDER * sizeof(int));
-    if (n->keys == NULL) {
-        perror("malloc failed\n");
-        exit(1);
-    }
-    
-    n->num_keys = 0;
-    n->is_leaf = false;
-    n->parent = NULL;
-    n->next = NULL;
-    
-    return n;
+    return round_up(sizeof(node_t) + order * sizeof(bpt_key_t), sizeof(void*));
 }
 
-void free_node(node_t* n)
+static size_t calc_node_size(int order)
 {
-    free(n->keys);
-    free(n->pointers);
-    free(n);
+    return round_up(calc_pointers_offset(order) + order * sizeof(void*), CACHE_LINE_SIZE);
 }
 
-node_t* make_leaf()
+static size_t calc_leaf_size(int order, size_t value_slot)
 {
-    node_t* n = make_node();
-    n->is_leaf = true;
-    return n;
+    return round_up(calc_pointers_offset(order) + (order - 1) * value_slot, CACHE_LINE_SIZE);
 }
 
-record_t* make_record(int value)
+// the largest order whose node block still fits in node_size bytes, e.g. a 4 KiB page
+int bptree_order_for_node_size(size_t node_size)
 {
-    record_t* record = malloc(sizeof(record_t));
-    if (!record) {
-        perror("malloc failed\n");
-        return NULL;
+    if (node_size < calc_node_size(MIN_ORDER)) {
+        return MIN_ORDER;
     }
     
-    record->value = value;
-    return record;
+    int order = (int)((node_size - sizeof(node_t)) / (sizeof(bpt_key_t) + sizeof(void*)));
+    while (order > MIN_ORDER && calc_node_size(order) > node_size) {
+        order--;
+    }
+    
+    return order;
 }
 
-int level_to_root(node_t* root, node_t* n)
+// node search kernels, all return the number of keys <= key in the sorted keys[0..n),
+// which is the child index in an internal node and the insert index in a leaf
+typedef int (*node_search_fn)(const bpt_key_t* keys, int n, bpt_key_t key);
+
+static int search_linear(const bpt_key_t* keys, int n, bpt_key_t key)
 {
-    int level = 0;
-    while (n != root) {
-        level++;
-        n = n->parent;
+    int i = 0;
+    for ( ; i < n; ++i) {
+        if (KEY_LT(key, keys[i])) {
+            break;
+        }
     }
     
-    return level;
+    return i;
 }
 
-void print_tree(node_t* root)
+static int search_binary(const bpt_key_t* keys, int n, bpt_key_t key)
 {
-    if (!root) {
-        printf("empty tree\n");
-        return;
+    if (n == 0) {
+        return 0;
     }
     
-    int cur_level = 0;
-    node_t* queue = NULL;
-    enqueue(&queue, root);
-    
-    while (queue != NULL) {
-        node_t* n = dequeue(&queue);
-        
-        if (n->parent && (n->parent->pointers[0] == n)) {
-            // 一点优化，只有node是parent的第一个子节点才判断是否开始了下一层
-            int level = level_to_root(root, n);
-            if (level > cur_level) {
-                printf("\n");
-                cur_level = level;
-            }
-        }
-        
-        //printf("*(0x%lx)* ", (long)n);
-        for (int i = 0; i < n->num_keys; i++) {
-            printf(" %d ", n->keys[i]);
-        }
-        //if (!n->is_leaf)
-        //    printf("(0x%lx)", (long)n->pointers[n->num_keys]);
-        printf("|");
-        
-        if (!n->is_leaf) {
-            for (int i = 0; i <= n->num_keys; i++) {
-                enqueue(&queue, n->pointers[i]);
-            }
-        }
+    // the answer is always in [base - keys, base - keys + len], multiply by the compare
+    // result instead of branching on it so the compiler can not emit a jump
+    const bpt_key_t* base = keys;
+    int len = n;
+    while (len > 1) {
+        int half = len / 2;
+        base += KEY_LE(base[half - 1], key) * half;
+        len -= half;
     }
     
-    printf("\n");
+    return (int)(base - keys) + KEY_LE(*base, key);
 }
 
-node_t* find_leaf(node_t* root, int key)
+#ifdef HAVE_X86_SIMD
+// lanes of one vector compare, pcmpgtq of sse4.2 covers the 64-bit keys
+#ifdef BPT_KEY_INT64
+#define LANES_128       2
+#define LANES_256       4
+#define set1_128(k)     _mm_set1_epi64x(k)
+#define cmpgt_128(a, b) _mm_castsi128_pd(_mm_cmpgt_epi64(a, b))
+#define movemask_128    _mm_movemask_pd
+#define set1_256(k)     _mm256_set1_epi64x(k)
+#define cmpgt_256(a, b) _mm256_castsi256_pd(_mm256_cmpgt_epi64(a, b))
+#define movemask_256    _mm256_movemask_pd
+#else
+#define LANES_128       4
+#define LANES_256       8
+#define set1_128(k)     _mm_set1_epi32(k)
+#define cmpgt_128(a, b) _mm_castsi128_ps(_mm_cmpgt_epi32(a, b))
+#define movemask_128    _mm_movemask_ps
+#define set1_256(k)     _mm256_set1_epi32(k)
+#define cmpgt_256(a, b) _mm256_castsi256_ps(_mm256_cmpgt_epi32(a, b))
+#define movemask_256    _mm256_movemask_ps
+#endif
+
+__attribute__((target("sse4.2,popcnt")))
+static int search_sse42(const bpt_key_t* keys, int n, bpt_key_t key)
 {
-    if (!root) {
-        return NULL;
+    const bpt_key_t* base = keys;
+    int len = n;
+    while (len > SIMD_WINDOW) {
+        int half = len / 2;
+        base += (base[half - 1] <= key) * half;
+        len -= half;
     }
     
-    node_t* c = root;
-    while (!c->is_leaf) {
-        int i = 0;
-        for ( ; i < c->num_keys; ++i) {
-            if (key < c->keys[i]) {
-                break;
-            }
-        }
-        
-        c = c->pointers[i];
+    __m128i k = set1_128(key);
+    int count = 0;
+    int i = 0;
+    for ( ; i + LANES_128 <= len; i += LANES_128) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(base + i));
+        int gt = movemask_128(cmpgt_128(v, k));
+        count += LANES_128 - _mm_popcnt_u32(gt);
+    }
+    for ( ; i < len; i++) {
+        count += (base[i] <= key);
     }
     
-    return c;
+    return (int)(base - keys) + count;
 }
 
-record_t* find(node_t* root, int key)
+__attribute__((target("avx2,popcnt")))
+static int search_avx2(const bpt_key_t* keys, int n, bpt_key_t key)
 {
-    node_t* l = find_leaf(root, key);
-    if (!l) {
-        return NULL;
+    const bpt_key_t* base = keys;
+    int len = n;
+    while (len > SIMD_WINDOW) {
+        int half = len / 2;
+        base += (base[half - 1] <= key) * half;
+        len -= half;
     }
     
+    __m256i k = set1_256(key);
+    int count = 0;
     int i = 0;
-    for ( ; i < l->num_keys; i++) {
-        if (key == l->keys[i]) {
-            return l->pointers[i];
-        }
+    for ( ; i + LANES_256 <= len; i += LANES_256) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(base + i));
+        int gt = movemask_256(cmpgt_256(v, k));
+        count += LANES_256 - _mm_popcnt_u32(gt);
+    }
+    for ( ; i < len; i++) {
+        count += (base[i] <= key);
     }
     
-    return NULL;
+    return (int)(base - keys) + count;
 }
+#endif
 
-int cut(int order)
+static node_search_fn node_search = NULL;
+
+static bool cpu_supports(int kind)
 {
-    if (order % 2 == 0) {
-        return order / 2;
-    } else {
-        return order / 2 + 1;
+    switch (kind) {
+        case NODE_SEARCH_LINEAR:
+        case NODE_SEARCH_BINARY:
+            return true;
+#ifdef HAVE_X86_SIMD
+        case NODE_SEARCH_SSE42:
+            return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+        case NODE_SEARCH_AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+        default:
+            return false;
     }
 }
 
-node_t* start_new_root(int key, int value)
+// select the node search kernel for all trees, return the kind actually used,
+// a kernel the cpu can not run falls back to the next best one
+int bptree_set_node_search(int kind)
 {
-    node_t* root = make_leaf();
-    record_t* record = make_record(value);
+    if (kind == NODE_SEARCH_AUTO) {
+        kind = NODE_SEARCH_AVX2;
+    }
+    
+    while (kind > NODE_SEARCH_BINARY && !cpu_supports(kind)) {
+        kind--;
+    }
+    
+    switch (kind) {
+#ifdef HAVE_X86_SIMD
+        case NODE_SEARCH_AVX2:
+            node_search = search_avx2;
+            break;
+        case NODE_SEARCH_SSE42:
+            node_search = search_sse42;
+            break;
+#endif
+        case NODE_SEARCH_LINEAR:
+            node_search = search_linear;
+            break;
+        default:
+            kind = NODE_SEARCH_BINARY;
+            node_search = search_binary;
+            break;
+    }
     
-    root->keys[0] = key;
-    root->pointers[0] = record;
-    root->num_keys = 1;
-    return root;
+    return kind;
 }
 
-int calc_insert_index(node_t* n, int key)
+//////////// node pool
+
+// every call into the system allocator goes through here to be counted
+static void* tree_malloc(bptree_t* t, size_t size)
 {
-    int insert_idx = n->num_keys;
-    for (int i = 0; i < n->num_keys; i++) {
-        if (key < n->keys[i]) {
-            insert_idx = i;
-            break;
-        }
+    void* p = malloc(size);
+    if (!p) {
+        perror("malloc failed\n");
+        exit(1);
     }
     
-    return insert_idx;
+    t->alloc.mallocs++;
+    return p;
 }
 
-void insert_in_leaf(node_t* l, int key, int value)
+static void tree_free(bptree_t* t, void* p)
 {
-    record_t* record = make_record(value);
-    
-    int insert_idx = calc_insert_index(l, key);
-    
-    for (int i = l->num_keys; i > insert_idx; i--) {
-        l->keys[i + 1] = l->keys[i];
-        l->pointers[i + 1] = l->pointers[i];
+    if (p) {
+        t->alloc.frees++;
+        free(p);
     }
-    
-    l->keys[insert_idx] = key;
-    l->pointers[insert_idx] = record;
-    l->num_keys++;
 }
 
-void insert_in_node(node_t* n, int key, void* pointer)
+static void pool_init(node_pool_t* p, size_t block_size)
 {
-    int insert_idx = calc_insert_index(n, key);
-    
-    for (int i = n->num_keys; i > insert_idx; i--) {
-        n->keys[i + 1] = n->keys[i];
+    p->block_size = block_size;
+    p->slab_size = SLAB_SIZE;
+    if (p->slab_size < CACHE_LINE_SIZE + 8 * block_size) {
+        p->slab_size = CACHE_LINE_SIZE + 8 * block_size;
     }
-    n->keys[insert_idx] = key;
     
-    // pointer index is 1 offset from key
-    for (int i = n->num_keys + 1; i > insert_idx + 1; i--) {
-        n->pointers[i + 1] = n->pointers[i];
+    p->slabs = NULL;
+    p->bump = NULL;
+    p->bump_end = NULL;
+    p->free_list = NULL;
+}
+
+#if NODE_POOL
+// the slab header takes the first cache line, the blocks follow it
+static void pool_grow(bptree_t* t, node_pool_t* p)
+{
+    char* slab = aligned_alloc(CACHE_LINE_SIZE, p->slab_size);
+    if (!slab) {
+        perror("malloc failed\n");
+        exit(1);
     }
-    n->pointers[insert_idx + 1] = pointer;
     
-    n->num_keys++;
+    t->alloc.mallocs++;
+    t->alloc.slabs++;
+    ((slab_t*)slab)->next = p->slabs;
+    p->slabs = (slab_t*)slab;
+    p->bump = slab + CACHE_LINE_SIZE;
+    p->bump_end = p->bump + (p->slab_size - CACHE_LINE_SIZE) / p->block_size * p->block_size;
 }
+#endif
 
-node_t* insert_in_parent(node_t* root, node_t* left, int key, node_t* right)
+static void* pool_alloc(bptree_t* t, node_pool_t* p)
 {
-    if (left == root) {
-        node_t* new_root = make_node();
-        
-        new_root->keys[0] = key;
-        new_root->pointers[0] = left;
-        new_root->pointers[1] = right;
-        new_root->num_keys = 1;
-        left->parent = new_root;
-        right->parent = new_root;
-        return new_root;
+    t->alloc.node_allocs++;
+
+#if NODE_POOL
+    if (p->free_list) {
+        void* block = p->free_list;
+        p->free_list = *(void**)block;
+        t->alloc.node_reuses++;
+        return block;
     }
     
-    node_t* P = left->parent;
-    if (P->num_keys < DEFAULT_ORDER - 1) {
-        insert_in_node(P, key, right);
-        return root;
+    if (p->bump == p->bump_end) {
+        pool_grow(t, p);
     }
     
-    // case: no space in internal node, split the internal node
-    
-    // copy P and (key, right) to tempory memory
-    int* tmp_keys = malloc(DEFAULT_ORDER * sizeof(int));
-    void** tmp_pointers = malloc((DEFAULT_ORDER + 1) * sizeof(void*));
-    if (!tmp_keys || !tmp_pointers) {
+    void* block = p->bump;
+    p->bump += p->block_size;
+    return block;
+#else
+    void* block = aligned_alloc(CACHE_LINE_SIZE, p->block_size);
+    if (!block) {
         perror("malloc failed\n");
         exit(1);
     }
     
-    int insert_idx = calc_insert_index(P, key);
-    int i = 0;
-    int j = 0;
-    for (i = 0, j = 0; i < P->num_keys; i++, j++) {
-        if (i == insert_idx) {
-            j++;
-            continue;
-        }
-        
-        tmp_keys[j] = P->keys[i];
+    t->alloc.mallocs++;
+    return block;
+#endif
+}
+
+static void pool_free(bptree_t* t, node_pool_t* p, void* block)
+{
+#if NODE_POOL
+    *(void**)block = p->free_list;
+    p->free_list = block;
+#else
+    tree_free(t, block);
+#endif
+}
+
+// give every slab back at once, the blocks in them need no walk
+static void pool_release(bptree_t* t, node_pool_t* p)
+{
+    while (p->slabs) {
+        slab_t* next = p->slabs->next;
+        tree_free(t, p->slabs);
+        p->slabs = next;
     }
     
-    for (i = 0, j = 0; i < P->num_keys + 1; i++, j++) {
-        if (i == (insert_idx + 1)) {
-            j++;
-            continue;
-        }
-        
-        tmp_pointers[j] = P->pointers[i];
+    pool_init(p, p->block_size);
+}
+////////////
+
+// value_size bytes per value, stored in the leaf if inline_values, else in a record of its own
+bptree_t* bptree_create_ex(int order, size_t value_size, bool inline_values)
+{
+    if (order < MIN_ORDER || value_size == 0) {
+        return NULL;
     }
     
-    tmp_keys[insert_idx] = key;
-    tmp_pointers[insert_idx + 1] = right;
-    
-    // erase pointer in P
-    for (i = 0; i < P->num_keys + 1; i++) {
-        P->pointers[i] = NULL;
+    bptree_t* t = calloc(1, sizeof(bptree_t));
+    if (!t) {
+        return NULL;
     }
     
-    // create a new node
-    node_t* P_prime = make_node();
-    P_prime->parent = P->parent;
-    
-    // copy from tmp_keys, tmp_pointers to P and P_prime
-    int split_idx = cut(DEFAULT_ORDER);
-    for (i = 0; i < split_idx - 1; i++) {
-        P->keys[i] = tmp_keys[i];
-        P->pointers[i] = tmp_pointers[i];
-    }
-    P->pointers[i] = tmp_pointers[i];
-    P->num_keys = split_idx - 1;
+    t->order = order;
+    t->value_size = value_size;
+    t->inline_values = inline_values;
+    t->value_slot = inline_values ? value_size : sizeof(record_t*);
+    t->node_size = calc_node_size(order);
+    t->leaf_size = calc_leaf_size(order, t->value_slot);
+    t->pointers_offset = calc_pointers_offset(order);
+    pool_init(&t->inner_pool, t->node_size);
+    pool_init(&t->leaf_pool, t->leaf_size);
     
-    int k_prime = tmp_keys[split_idx - 1];
+    t->split_keys = tree_malloc(t, order * sizeof(bpt_key_t));
+    t->split_pointers = tree_malloc(t, (order + 1) * sizeof(void*));
     
-    for (i++, j = 0; i < DEFAULT_ORDER; i++, j++) {
-        P_prime->keys[j] = tmp_keys[i];
-        P_prime->pointers[j] = tmp_pointers[i];
+    if (!node_search) {
+        bptree_set_node_search(NODE_SEARCH);
     }
-    P_prime->pointers[j] = tmp_pointers[i];
-    P_prime->num_keys = DEFAULT_ORDER - split_idx;
     
-    // set all child of P_prime's parent to P_prime
-    for (i = 0; i < P_prime->num_keys + 1; i++) {
-        node_t* child = P_prime->pointers[i];
-        child->parent = P_prime;
+    return t;
+}
+
+// int values inline in the leaves
+bptree_t* bptree_create(int order)
+{
+    return bptree_create_ex(order, sizeof(int), true);
+}
+
+// help function for print_tree, avoid recurive calls
+void enqueue(node_t** queue, node_t** tail, node_t* n)
+{
+    n->next = NULL;
+    if (!*queue) {
+        *queue = n;
+    } else {
+        (*tail)->next = n;
     }
-    
-    free(tmp_keys);
-    free(tmp_pointers);
-    
-    return insert_in_parent(root, P, k_prime, P_prime);
+    *tail = n;
 }
 
-node_t* insert(node_t* root, int key, int value)
+node_t* dequeue(node_t** queue)
 {
-    // case: the first key in the root
-    if (!root) {
-        return start_new_root(key, value);
+    node_t* n = NULL;
+    if (*queue) {
+        n = *queue;
+        *queue = n->next;
     }
     
-    // no duplicate key allowed
-    record_t* record = find(root, key);
-    if (record) {
-        return root;
+    return n;
+}
+
+// the old make_node, kept for bench_lookup: a node visit touches three allocations
+static node_t* alloc_split_node(bptree_t* t, bool is_leaf)
+{
+    node_t* n = tree_malloc(t, sizeof(node_t));
+    n->keys = tree_malloc(t, t->order * sizeof(bpt_key_t));
+    n->pointers = tree_malloc(t, is_leaf ? (t->order - 1) * t->value_slot : t->order * sizeof(void*));
+    return n;
+}
+
+static node_t* alloc_node(bptree_t* t, bool is_leaf)
+{
+    node_t* n = NULL;
+    if (t->split_layout) {
+        n = alloc_split_node(t, is_leaf);
+    } else {
+        char* block = pool_alloc(t, is_leaf ? &t->leaf_pool : &t->inner_pool);
+        n = (node_t*)block;
+        n->keys = (bpt_key_t*)(block + sizeof(node_t));
+        n->pointers = (void**)(block + t->pointers_offset);
     }
     
-    node_t* L = find_leaf(root, key);
-    if (!L) {
-        return root;
-    }
+    n->num_keys = 0;
+    n->is_leaf = is_leaf;
+    n->parent = NULL;
+    n->next = NULL;
+    n->sibling = NULL;
     
-    // case: have space in leaf node
-    if (L->num_keys < DEFAULT_ORDER - 1) {
-        insert_in_leaf(L, key, value);
-        return root;
-    }
+    t->num_nodes++;
+    t->num_leaves += is_leaf;
+    return n;
+}
+
+node_t* make_node(bptree_t* t)
+{
+    return alloc_node(t, false);
+}
+
+void free_node(bptree_t* t, node_t* n)
+{
+    t->num_nodes--;
+    t->num_leaves -= n->is_leaf;
+    if (t->split_layout) {
+        tree_free(t, n->keys);
+        tree_free(t, n->pointers);
+        tree_free(t, n);
+        return;
+    }
+    
+    pool_free(t, n->is_leaf ? &t->leaf_pool : &t->inner_pool, n);
+}
+
+node_t* make_leaf(bptree_t* t)
+{
+    return alloc_node(t, true);
+}
+
+record_t* make_record(bptree_t* t, const void* value)
+{
+    record_t* record = tree_malloc(t, t->value_size);
+    
+    memcpy(record, value, t->value_size);
+    return record;
+}
+
+//////////// leaf slots
+
+static char* leaf_slot(bptree_t* t, node_t* l, int i)
+{
+    return l->values + (size_t)i * t->value_slot;
+}
+
+// the value of entry i, in the leaf or in its record
+static void* leaf_value(bptree_t* t, node_t* l, int i)
+{
+    char* slot = leaf_slot(t, l, i);
+    return t->inline_values ? (void*)slot : *(void**)slot;
+}
+
+static void set_leaf_value(bptree_t* t, node_t* l, int i, const void* value)
+{
+    char* slot = leaf_slot(t, l, i);
+    if (t->inline_values) {
+        memcpy(slot, value, t->value_size);
+    } else {
+        *(record_t**)slot = make_record(t, value);
+    }
+}
+
+static void free_leaf_value(bptree_t* t, node_t* l, int i)
+{
+    if (!t->inline_values) {
+        tree_free(t, *(void**)leaf_slot(t, l, i));
+    }
+}
+
+// move count (key, value) entries from src[si] to dst[di], the ranges may overlap
+static void move_entries(bptree_t* t, node_t* dst, int di, node_t* src, int si, int count)
+{
+    if (count <= 0) {
+        return;
+    }
+    
+    memmove(dst->keys + di, src->keys + si, count * sizeof(bpt_key_t));
+    memmove(leaf_slot(t, dst, di), leaf_slot(t, src, si), count * t->value_slot);
+}
+
+static void insert_at(bptree_t* t, node_t* l, int idx, bpt_key_t key, const void* value)
+{
+    move_entries(t, l, idx + 1, l, idx, l->num_keys - idx);
+    l->keys[idx] = key;
+    set_leaf_value(t, l, idx, value);
+    l->num_keys++;
+}
+
+static void remove_at(bptree_t* t, node_t* l, int idx)
+{
+    free_leaf_value(t, l, idx);
+    move_entries(t, l, idx, l, idx + 1, l->num_keys - idx - 1);
+    l->num_keys--;
+}
+////////////
+
+static void destroy_node(bptree_t* t, node_t* n)
+{
+    if (n->is_leaf) {
+        for (int i = 0; i < n->num_keys; i++) {
+            free_leaf_value(t, n, i);
+        }
+    } else {
+        for (int i = 0; i <= n->num_keys; i++) {
+            destroy_node(t, n->pointers[i]);
+        }
+    }
+    
+    free_node(t, n);
+}
+
+void bptree_destroy(bptree_t* t)
+{
+    if (!t) {
+        return;
+    }
+    
+    if (t->split_layout && t->root) {
+        // the nodes of the old layout are not in the pools
+        destroy_node(t, t->root);
+        t->root = NULL;
+    }
+
+#if NODE_POOL
+    // the nodes go with their slabs, only out of line records need the leaf chain walk
+    if (t->root && !t->inline_values) {
+        node_t* l = t->root;
+        while (!l->is_leaf) {
+            l = l->pointers[0];
+        }
+        
+        for ( ; l; l = l->sibling) {
+            for (int i = 0; i < l->num_keys; i++) {
+                free_leaf_value(t, l, i);
+            }
+        }
+    }
+    t->root = NULL;
+#else
+    if (t->root) {
+        destroy_node(t, t->root);
+    }
+#endif
+
+    pool_release(t, &t->inner_pool);
+    pool_release(t, &t->leaf_pool);
+    tree_free(t, t->split_keys);
+    tree_free(t, t->split_pointers);
+    free(t);
+}
+
+int level_to_root(node_t* root, node_t* n)
+{
+    int level = 0;
+    while (n != root) {
+        level++;
+        n = n->parent;
+    }
+    
+    return level;
+}
+
+void print_tree(bptree_t* t)
+{
+    node_t* root = t->root;
+    if (!root) {
+        printf("empty tree\n");
+        return;
+    }
+    
+    int cur_level = 0;
+    node_t* queue = NULL;
+    node_t* tail = NULL;
+    enqueue(&queue, &tail, root);
+    
+    while (queue != NULL) {
+        node_t* n = dequeue(&queue);
+        
+        if (n->parent && (n->parent->pointers[0] == n)) {
+            // 一点优化，只有node是parent的第一个子节点才判断是否开始了下一层
+            int level = level_to_root(root, n);
+            if (level > cur_level) {
+                printf("\n");
+                cur_level = level;
+            }
+        }
+        
+        //printf("*(0x%lx)* ", (long)n);
+        for (int i = 0; i < n->num_keys; i++) {
+            printf(" " KEY_FMT " ", n->keys[i]);
+        }
+        //if (!n->is_leaf)
+        //    printf("(0x%lx)", (long)n->pointers[n->num_keys]);
+        printf("|");
+        
+        if (!n->is_leaf) {
+            for (int i = 0; i <= n->num_keys; i++) {
+                enqueue(&queue, &tail, n->pointers[i]);
+            }
+        }
+    }
+    
+    printf("\n");
+}
+
+int tree_height(bptree_t* t)
+{
+    int height = 0;
+    for (node_t* c = t->root; c; c = c->is_leaf ? NULL : c->pointers[0]) {
+        height++;
+    }
+    
+    return height;
+}
+
+//////////// statistics
+
+static int fill_bucket(bptree_t* t, node_t* n)
+{
+    int b = n->num_keys * FILL_BUCKETS / (t->order - 1);
+    return b < FILL_BUCKETS ? b : FILL_BUCKETS - 1;
+}
+
+static void stats_node(bptree_t* t, node_t* n, int level, bptree_stats_t* s)
+{
+    s->nodes[level]++;
+    s->keys[level] += n->num_keys;
+    if (level + 1 > s->height) {
+        s->height = level + 1;
+    }
+    
+    if (n->is_leaf) {
+        s->leaf_fill[fill_bucket(t, n)]++;
+        s->empty_leaves += (n->num_keys == 0);
+        s->num_keys += n->num_keys;
+        s->node_bytes += t->leaf_size;
+        if (!t->inline_values) {
+            s->record_bytes += n->num_keys * t->value_size;
+        }
+        return;
+    }
+    
+    s->internal_fill[fill_bucket(t, n)]++;
+    s->node_bytes += t->node_size;
+    for (int i = 0; i <= n->num_keys; i++) {
+        stats_node(t, n->pointers[i], level + 1, s);
+    }
+}
+
+static size_t pool_bytes(node_pool_t* p)
+{
+    size_t bytes = 0;
+    for (slab_t* slab = p->slabs; slab; slab = slab->next) {
+        bytes += p->slab_size;
+    }
+    
+    return bytes;
+}
+
+// one walk over every node, O(n) and no output, usable on a large tree
+void bptree_stats(bptree_t* t, bptree_stats_t* s)
+{
+    memset(s, 0, sizeof(*s));
+    s->order = t->order;
+    if (t->root) {
+        stats_node(t, t->root, 0, s);
+    }
+    
+    long num_leaves = s->height ? s->nodes[s->height - 1] : 0;
+    long num_internal = t->num_nodes - num_leaves;
+    if (num_leaves > 0) {
+        s->avg_leaf_fill = (double)s->num_keys / (num_leaves * (t->order - 1));
+    }
+    if (num_internal > 0) {
+        long internal_keys = 0;
+        for (int level = 0; level < s->height - 1; level++) {
+            internal_keys += s->keys[level];
+        }
+        s->avg_internal_fill = (double)internal_keys / (num_internal * (t->order - 1));
+    }
+    
+    s->pool_bytes = pool_bytes(&t->inner_pool) + pool_bytes(&t->leaf_pool);
+    s->total_bytes = sizeof(bptree_t) + t->order * sizeof(bpt_key_t) + (t->order + 1) * sizeof(void*) +
+                     s->record_bytes + (NODE_POOL ? s->pool_bytes : s->node_bytes);
+}
+
+void bptree_reset_counters(bptree_t* t)
+{
+    memset(&t->counters, 0, sizeof(t->counters));
+}
+
+static void json_array(FILE* f, const char* name, const long* a, int n)
+{
+    fprintf(f, "  \"%s\": [", name);
+    for (int i = 0; i < n; i++) {
+        fprintf(f, "%s%ld", i ? ", " : "", a[i]);
+    }
+    fprintf(f, "],\n");
+}
+
+// the stats and the counters as one json object
+void bptree_stats_json(bptree_t* t, FILE* f)
+{
+    bptree_stats_t s;
+    bptree_stats(t, &s);
+    bptree_counters_t* c = &t->counters;
+    
+    fprintf(f, "{\n");
+    fprintf(f, "  \"order\": %d,\n  \"key_bytes\": %zu,\n  \"value_bytes\": %zu,\n", t->order, sizeof(bpt_key_t),
+            t->value_size);
+    fprintf(f, "  \"inline_values\": %s,\n", t->inline_values ? "true" : "false");
+    fprintf(f, "  \"height\": %d,\n  \"keys\": %ld,\n", s.height, s.num_keys);
+    fprintf(f, "  \"nodes\": %ld,\n  \"leaves\": %ld,\n  \"empty_leaves\": %ld,\n", t->num_nodes, t->num_leaves,
+            s.empty_leaves);
+    json_array(f, "nodes_per_level", s.nodes, s.height);
+    json_array(f, "keys_per_level", s.keys, s.height);
+    json_array(f, "leaf_fill_histogram", s.leaf_fill, FILL_BUCKETS);
+    json_array(f, "internal_fill_histogram", s.internal_fill, FILL_BUCKETS);
+    fprintf(f, "  \"avg_leaf_fill\": %.4f,\n  \"avg_internal_fill\": %.4f,\n", s.avg_leaf_fill, s.avg_internal_fill);
+    fprintf(f, "  \"bytes\": {\"nodes\": %zu, \"records\": %zu, \"pools\": %zu, \"total\": %zu},\n", s.node_bytes,
+            s.record_bytes, s.pool_bytes, s.total_bytes);
+    fprintf(f, "  \"counters\": {\"enabled\": %s, \"descents\": %ld, \"visits\": %ld, \"leaf_splits\": %ld, "
+            "\"internal_splits\": %ld, \"root_splits\": %ld, \"merges\": %ld, \"redistributions\": %ld, "
+            "\"compactions\": %ld}\n", BPT_COUNTERS ? "true" : "false", c->descents, c->visits, c->leaf_splits,
+            c->internal_splits, c->root_splits, c->merges, c->redistributions, c->compactions);
+    fprintf(f, "}\n");
+}
+
+////////
+
+node_t* find_leaf(bptree_t* t, bpt_key_t key)
+{
+    if (!t->root) {
+        return NULL;
+    }
+    
+    node_t* c = t->root;
+    COUNT(t, descents, 1);
+    while (!c->is_leaf) {
+        int i = node_search(c->keys, c->num_keys, key);
+        c = c->pointers[i];
+        COUNT(t, visits, 1);
+    }
+    COUNT(t, visits, 1);
+    
+    return c;
+}
+
+// the value stored for key, NULL if not found
+void* find_value(bptree_t* t, bpt_key_t key)
+{
+    node_t* l = find_leaf(t, key);
+    if (!l) {
+        return NULL;
+    }
+    
+    int i = node_search(l->keys, l->num_keys, key);
+    if (i > 0 && KEY_EQ(l->keys[i - 1], key)) {
+        return leaf_value(t, l, i - 1);
+    }
+    
+    return NULL;
+}
+
+// record_t is one int, so this is the int value in the leaf slot or in its record
+record_t* find(bptree_t* t, bpt_key_t key)
+{
+    return find_value(t, key);
+}
+
+int cut(int order)
+{
+    if (order % 2 == 0) {
+        return order / 2;
+    } else {
+        return order / 2 + 1;
+    }
+}
+
+void start_new_root(bptree_t* t, bpt_key_t key, const void* value)
+{
+    node_t* root = make_leaf(t);
+    insert_at(t, root, 0, key, value);
+    t->root = root;
+}
+
+int calc_insert_index(node_t* n, bpt_key_t key)
+{
+    return node_search(n->keys, n->num_keys, key);
+}
+
+void insert_in_node(node_t* n, bpt_key_t key, void* pointer)
+{
+    int insert_idx = calc_insert_index(n, key);
+    
+    for (int i = n->num_keys; i > insert_idx; i--) {
+        n->keys[i] = n->keys[i - 1];
+    }
+    n->keys[insert_idx] = key;
+    
+    // pointer index is 1 offset from key
+    for (int i = n->num_keys + 1; i > insert_idx + 1; i--) {
+        n->pointers[i] = n->pointers[i - 1];
+    }
+    n->pointers[insert_idx + 1] = pointer;
+    
+    n->num_keys++;
+}
+
+void insert_in_parent(bptree_t* t, node_t* left, bpt_key_t key, node_t* right)
+{
+    int order = t->order;
+    
+    if (left == t->root) {
+        COUNT(t, root_splits, 1);
+        node_t* new_root = make_node(t);
+        
+        new_root->keys[0] = key;
+        new_root->pointers[0] = left;
+        new_root->pointers[1] = right;
+        new_root->num_keys = 1;
+        left->parent = new_root;
+        right->parent = new_root;
+        t->root = new_root;
+        return;
+    }
+    
+    node_t* P = left->parent;
+    if (P->num_keys < order - 1) {
+        insert_in_node(P, key, right);
+        return;
+    }
+    
+    // case: no space in internal node, split the internal node
+    COUNT(t, internal_splits, 1);
+    
+    // copy P and (key, right) to the scratch arrays of the tree, they are free again
+    // before the recursive call
+    bpt_key_t* tmp_keys = t->split_keys;
+    void** tmp_pointers = t->split_pointers;
+    
+    int insert_idx = calc_insert_index(P, key);
+    int i = 0;
+    int j = 0;
+    for (i = 0, j = 0; i < P->num_keys; i++, j++) {
+        if (j == insert_idx) {
+            j++;
+        }
+        
+        tmp_keys[j] = P->keys[i];
+    }
+    
+    for (i = 0, j = 0; i < P->num_keys + 1; i++, j++) {
+        if (j == (insert_idx + 1)) {
+            j++;
+        }
+        
+        tmp_pointers[j] = P->pointers[i];
+    }
+    
+    tmp_keys[insert_idx] = key;
+    tmp_pointers[insert_idx + 1] = right;
+    
+    // create a new node
+    node_t* P_prime = make_node(t);
+    P_prime->parent = P->parent;
+    
+    // copy from tmp_keys, tmp_pointers to P and P_prime
+    int split_idx = cut(order);
+    for (i = 0; i < split_idx - 1; i++) {
+        P->keys[i] = tmp_keys[i];
+        P->pointers[i] = tmp_pointers[i];
+    }
+    P->pointers[i] = tmp_pointers[i];
+    P->num_keys = split_idx - 1;
+    
+    bpt_key_t k_prime = tmp_keys[split_idx - 1];
+    
+    for (i++, j = 0; i < order; i++, j++) {
+        P_prime->keys[j] = tmp_keys[i];
+        P_prime->pointers[j] = tmp_pointers[i];
+    }
+    P_prime->pointers[j] = tmp_pointers[i];
+    P_prime->num_keys = order - split_idx;
+    
+    // set all child of P_prime's parent to P_prime
+    for (i = 0; i < P_prime->num_keys + 1; i++) {
+        node_t* child = P_prime->pointers[i];
+        child->parent = P_prime;
+    }
+    
+    insert_in_parent(t, P, k_prime, P_prime);
+}
+
+// put (key, value) at idx of leaf L, split L if it is full, return true if it split
+static bool insert_into_leaf(bptree_t* t, node_t* L, int idx, bpt_key_t key, const void* value)
+{
+    int order = t->order;
+    
+    // case: have space in leaf node
+    if (L->num_keys < order - 1) {
+        insert_at(t, L, idx, key, value);
+        return false;
+    }
+    
+    // case: no space in leaf node, split the leaf
+    COUNT(t, leaf_splits, 1);
+    node_t* L_prime = make_leaf(t);
+    L_prime->parent = L->parent;
+    
+    L_prime->sibling = L->sibling;
+    L->sibling = L_prime;
+    
+    // L keeps the first split_idx of the order entries, move the rest straight to L_prime
+    // and put the new entry in its half, no temporary copy of the leaf
+    int split_idx = cut(order);
+    if (idx < split_idx) {
+        move_entries(t, L_prime, 0, L, split_idx - 1, order - split_idx);
+        L_prime->num_keys = order - split_idx;
+        L->num_keys = split_idx - 1;
+        insert_at(t, L, idx, key, value);
+    } else {
+        move_entries(t, L_prime, 0, L, split_idx, order - 1 - split_idx);
+        L_prime->num_keys = order - 1 - split_idx;
+        L->num_keys = split_idx;
+        insert_at(t, L_prime, idx - split_idx, key, value);
+    }
+    
+    insert_in_parent(t, L, L_prime->keys[0], L_prime);
+    return true;
+}
+
+// return 0 if the key is inserted, -1 if the key already exists
+int insert_value(bptree_t* t, bpt_key_t key, const void* value)
+{
+    // case: the first key in the root
+    if (!t->root) {
+        start_new_root(t, key, value);
+        return 0;
+    }
+    
+    node_t* L = find_leaf(t, key);
+    if (!L) {
+        return -1;
+    }
+    
+    // no duplicate key allowed, check in the leaf instead of a second descent with find()
+    int idx = calc_insert_index(L, key);
+    if (idx > 0 && KEY_EQ(L->keys[idx - 1], key)) {
+        return -1;
+    }
+    
+    insert_into_leaf(t, L, idx, key, value);
+    return 0;
+}
+
+// int value api, only for trees created with value_size == sizeof(int)
+int insert(bptree_t* t, bpt_key_t key, int value)
+{
+    if (t->value_size != sizeof(int)) {
+        return -1;
+    }
+    
+    return insert_value(t, key, &value);
+}
+
+/////////////
+
+/*
+ bottom-up bulk load from keys in strictly increasing order
+
+ every level keeps the node being filled (cur) and the last full node (pending). a node
+ is pushed to the parent level only when the node after the next one is started, so at the
+ end the two rightmost nodes of a level are siblings that have no entry in the parent yet
+ and can be balanced or merged without touching the separator keys above them
+ */
+#define BULK_MAX_HEIGHT BPT_MAX_HEIGHT
+
+typedef struct bulk_level {
+    node_t* pending;
+    bpt_key_t pending_sep;
+    node_t* cur;
+    bpt_key_t cur_sep;
+} bulk_level_t;
+
+typedef struct bulk_state {
+    bptree_t*    t;
+    int          leaf_fill;         // keys in a packed leaf
+    int          internal_fill;     // keys in a packed internal node
+    bpt_key_t    last_key;
+    long         count;
+    bulk_level_t levels[BULK_MAX_HEIGHT];
+} bulk_state_t;
+
+static int min_keys(bptree_t* t, bool is_leaf)
+{
+    return is_leaf ? cut(t->order - 1) : cut(t->order) - 1;
+}
+
+static int fill_keys(bptree_t* t, double fill_factor, bool is_leaf)
+{
+    int max_keys = t->order - 1;
+    int n = (int)(fill_factor * max_keys + 0.5);
+    if (n > max_keys) {
+        n = max_keys;
+    }
+    if (n < min_keys(t, is_leaf)) {
+        n = min_keys(t, is_leaf);
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    
+    return n;
+}
+
+static void bulk_add_entry(bulk_state_t* st, int level, bpt_key_t sep, void* pointer);
+
+// hand a finished node to the parent level
+static void bulk_push(bulk_state_t* st, int level, bpt_key_t sep, node_t* n)
+{
+    if (level + 1 >= BULK_MAX_HEIGHT) {
+        printf("bulk load: tree too high\n");
+        exit(1);
+    }
+    
+    bulk_add_entry(st, level + 1, sep, n);
+}
+
+// append (sep, pointer) at level, a value for a leaf and a child node for an internal node
+static void bulk_add_entry(bulk_state_t* st, int level, bpt_key_t sep, void* pointer)
+{
+    bptree_t* t = st->t;
+    bulk_level_t* lv = &st->levels[level];
+    bool is_leaf = (level == 0);
+    node_t* c = lv->cur;
+    
+    if (c && c->num_keys == (is_leaf ? st->leaf_fill : st->internal_fill)) {
+        if (lv->pending) {
+            bulk_push(st, level, lv->pending_sep, lv->pending);
+        }
+        
+        lv->pending = c;
+        lv->pending_sep = lv->cur_sep;
+        c = NULL;
+    }
+    
+    if (!c) {
+        c = is_leaf ? make_leaf(t) : make_node(t);
+        if (is_leaf && lv->pending) {
+            lv->pending->sibling = c;
+        }
+        
+        lv->cur = c;
+        lv->cur_sep = sep;
+        
+        if (!is_leaf) {
+            // the first child of an internal node has no key in front of it
+            c->pointers[0] = pointer;
+            ((node_t*)pointer)->parent = c;
+            return;
+        }
+    }
+    
+    if (is_leaf) {
+        c->keys[c->num_keys] = sep;
+        set_leaf_value(t, c, c->num_keys, pointer);
+    } else {
+        c->keys[c->num_keys] = sep;
+        c->pointers[c->num_keys + 1] = pointer;
+        ((node_t*)pointer)->parent = c;
+    }
+    c->num_keys++;
+}
+
+// make the two rightmost nodes of a level legal, return false if cur is merged into pending
+static bool bulk_balance(bulk_state_t* st, bulk_level_t* lv)
+{
+    bptree_t* t = st->t;
+    node_t* P = lv->pending;
+    node_t* C = lv->cur;
+    int a = P->num_keys;
+    int b = C->num_keys;
+    int i = 0;
+    
+    if (b >= min_keys(t, C->is_leaf)) {
+        return true;
+    }
+    
+    if (C->is_leaf) {
+        if (a + b <= t->order - 1) {
+            move_entries(t, P, a, C, 0, b);
+            P->num_keys = a + b;
+            P->sibling = C->sibling;
+            free_node(t, C);
+            return false;
+        }
+        
+        // move the tail of P to the front of C
+        int m = a - (a + b + 1) / 2;
+        move_entries(t, C, m, C, 0, b);
+        move_entries(t, C, 0, P, a - m, m);
+        P->num_keys = a - m;
+        C->num_keys = b + m;
+        lv->cur_sep = C->keys[0];
+        return true;
+    }
+    
+    if (a + b + 1 <= t->order - 1) {
+        // pull the separator down and append C to P
+        P->keys[a] = lv->cur_sep;
+        for (i = 0; i < b; i++) {
+            P->keys[a + 1 + i] = C->keys[i];
+        }
+        for (i = 0; i <= b; i++) {
+            P->pointers[a + 1 + i] = C->pointers[i];
+            ((node_t*)C->pointers[i])->parent = P;
+        }
+        P->num_keys = a + b + 1;
+        free_node(t, C);
+        return false;
+    }
+    
+    // P keeps kl keys, the key after them goes up, the rest rotates into C through the separator
+    int kl = (a + b + 1) / 2;
+    int m = a - kl;
+    for (i = b - 1; i >= 0; i--) {
+        C->keys[i + m] = C->keys[i];
+    }
+    for (i = b; i >= 0; i--) {
+        C->pointers[i + m] = C->pointers[i];
+    }
+    C->keys[m - 1] = lv->cur_sep;
+    for (i = 0; i < m - 1; i++) {
+        C->keys[i] = P->keys[kl + 1 + i];
+    }
+    for (i = 0; i < m; i++) {
+        C->pointers[i] = P->pointers[kl + 1 + i];
+        ((node_t*)C->pointers[i])->parent = C;
+    }
+    lv->cur_sep = P->keys[kl];
+    P->num_keys = kl;
+    C->num_keys = b + m;
+    return true;
+}
+
+// close every level from the leaves up, the last level with a single node gives the root
+static void bulk_finish(bulk_state_t* st)
+{
+    bptree_t* t = st->t;
+    
+    for (int level = 0; level < BULK_MAX_HEIGHT; level++) {
+        bulk_level_t* lv = &st->levels[level];
+        if (!lv->cur) {
+            break;
+        }
+        
+        if (!lv->pending) {
+            // only one node at this level and nothing above it, an internal node left with
+            // a single child by the merge below is dropped
+            node_t* root = lv->cur;
+            if (!root->is_leaf && root->num_keys == 0) {
+                node_t* child = root->pointers[0];
+                free_node(t, root);
+                root = child;
+            }
+            root->parent = NULL;
+            t->root = root;
+            return;
+        }
+        
+        if (bulk_balance(st, lv)) {
+            bulk_push(st, level, lv->pending_sep, lv->pending);
+            bulk_push(st, level, lv->cur_sep, lv->cur);
+        } else {
+            bulk_push(st, level, lv->pending_sep, lv->pending);
+        }
+    }
+}
+
+// return 0 on success, -1 if the tree is not empty or the input is not strictly increasing,
+// in which case the tree is left empty
+int bulk_load_iter(bptree_t* t, bulk_next_fn next, void* ctx, double fill_factor)
+{
+    if (t->root) {
+        return -1;
+    }
+    
+    bulk_state_t* st = calloc(1, sizeof(bulk_state_t));
+    if (!st) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    st->t = t;
+    st->leaf_fill = fill_keys(t, fill_factor, true);
+    st->internal_fill = fill_keys(t, fill_factor, false);
+    
+    int ret = 0;
+    bpt_key_t key = 0;
+    const void* value = NULL;
+    while (next(ctx, &key, &value)) {
+        if (st->count > 0 && KEY_LE(key, st->last_key)) {
+            ret = -1;
+            break;
+        }
+        
+        bulk_add_entry(st, 0, key, (void*)value);
+        st->last_key = key;
+        st->count++;
+    }
+    
+    if (st->count > 0) {
+        bulk_finish(st);
+    }
+    
+    if (ret != 0 && t->root) {
+        destroy_node(t, t->root);
+        t->root = NULL;
+    }
+    
+    free(st);
+    return ret;
+}
+
+typedef struct array_iter {
+    const bpt_key_t* keys;
+    const char* values;
+    size_t      value_size;
+    long        n;
+    long        pos;
+} array_iter_t;
+
+static bool array_next(void* ctx, bpt_key_t* key, const void** value)
+{
+    array_iter_t* it = ctx;
+    if (it->pos >= it->n) {
+        return false;
+    }
+    
+    *key = it->keys[it->pos];
+    *value = it->values ? (const void*)(it->values + it->pos * it->value_size) : (const void*)&it->keys[it->pos];
+    it->pos++;
+    return true;
+}
+
+// values is an array of n values of value_size bytes, for an int tree it may be NULL,
+// then every key is its own value
+int bulk_load(bptree_t* t, const bpt_key_t* keys, const void* values, long n, double fill_factor)
+{
+    if (!values && t->value_size != sizeof(int)) {
+        return -1;
+    }
+    
+    array_iter_t it = {keys, values, t->value_size, n, 0};
+    return bulk_load_iter(t, array_next, &it, fill_factor);
+}
+/////////////
+
+// cursor over the leaf chain, the leaves are linked through sibling
+
+static node_t* next_leaf(bptree_t* t, node_t* leaf)
+{
+    return leaf->sibling;
+}
+
+// there is no back link, go up until the leaf is not the first child and down the right edge
+// of the left sibling subtree, amortized O(1) over a full backward walk
+static node_t* prev_leaf(node_t* leaf)
+{
+    node_t* n = leaf;
+    int idx = 0;
+    while (n->parent) {
+        if (n->num_keys > 0) {
+            idx = node_search(n->parent->keys, n->parent->num_keys, n->keys[0]);
+        } else {
+            // an empty leaf has no key to search with
+            for (idx = 0; n->parent->pointers[idx] != n; idx++) {
+            }
+        }
+        n = n->parent;
+        if (idx > 0) {
+            break;
+        }
+    }
+    
+    if (idx == 0) {
+        return NULL;
+    }
+    
+    n = n->pointers[idx - 1];
+    while (!n->is_leaf) {
+        n = n->pointers[n->num_keys];
+    }
+    
+    return n;
+}
+
+// pull the header, the first keys and the first pointers or values of a node into the cache,
+// e.g. the next leaf while the current leaf is consumed
+static void prefetch_node(bptree_t* t, node_t* n)
+{
+    if (n) {
+        __builtin_prefetch(n);
+        __builtin_prefetch((char*)n + CACHE_LINE_SIZE);
+        __builtin_prefetch((char*)n + t->pointers_offset);
+    }
+}
+
+static bool cursor_enter(bpt_cursor_t* c, node_t* leaf, int idx)
+{
+    // lazy deletion can leave empty leaves in the chain
+    while (leaf && idx >= leaf->num_keys) {
+        leaf = next_leaf(c->t, leaf);
+        idx = 0;
+    }
+    
+    c->leaf = leaf;
+    c->idx = idx;
+    if (leaf) {
+        prefetch_node(c->t, next_leaf(c->t, leaf));
+    }
+    
+    return leaf != NULL;
+}
+
+// position at the first key >= key, return false if there is none
+bool cursor_seek(bpt_cursor_t* c, bptree_t* t, bpt_key_t key)
+{
+    c->t = t;
+    node_t* l = find_leaf(t, key);
+    if (!l) {
+        return cursor_enter(c, NULL, 0);
+    }
+    
+    int i = node_search(l->keys, l->num_keys, key);
+    if (i > 0 && KEY_EQ(l->keys[i - 1], key)) {
+        i--;
+    }
+    
+    if (i == l->num_keys) {
+        return cursor_enter(c, next_leaf(t, l), 0);
+    }
+    
+    return cursor_enter(c, l, i);
+}
+
+bool cursor_first(bpt_cursor_t* c, bptree_t* t)
+{
+    c->t = t;
+    node_t* n = t->root;
+    while (n && !n->is_leaf) {
+        n = n->pointers[0];
+    }
+    
+    return cursor_enter(c, n, 0);
+}
+
+bool cursor_last(bpt_cursor_t* c, bptree_t* t)
+{
+    c->t = t;
+    node_t* n = t->root;
+    while (n && !n->is_leaf) {
+        n = n->pointers[n->num_keys];
+    }
+    while (n && n->num_keys == 0) {
+        n = prev_leaf(n);
+    }
+    
+    return cursor_enter(c, n, n ? n->num_keys - 1 : 0);
+}
+
+bool cursor_valid(bpt_cursor_t* c)
+{
+    return c->leaf != NULL;
+}
+
+bpt_key_t cursor_key(bpt_cursor_t* c)
+{
+    return c->leaf->keys[c->idx];
+}
+
+void* cursor_value(bpt_cursor_t* c)
+{
+    return leaf_value(c->t, c->leaf, c->idx);
+}
+
+record_t* cursor_record(bpt_cursor_t* c)
+{
+    return cursor_value(c);
+}
+
+bool cursor_next(bpt_cursor_t* c)
+{
+    if (!c->leaf) {
+        return false;
+    }
+    
+    if (++c->idx < c->leaf->num_keys) {
+        return true;
+    }
+    
+    return cursor_enter(c, next_leaf(c->t, c->leaf), 0);
+}
+
+bool cursor_prev(bpt_cursor_t* c)
+{
+    if (!c->leaf) {
+        return false;
+    }
+    
+    if (--c->idx >= 0) {
+        return true;
+    }
+    
+    node_t* l = prev_leaf(c->leaf);
+    while (l && l->num_keys == 0) {
+        l = prev_leaf(l);
+    }
+    c->leaf = l;
+    c->idx = l ? l->num_keys - 1 : 0;
+    return l != NULL;
+}
+
+// call fn for every key in [lo, hi) in order until it returns false, return the number of calls
+long scan(bptree_t* t, bpt_key_t lo, bpt_key_t hi, scan_fn fn, void* ctx)
+{
+    bpt_cursor_t c;
+    long count = 0;
+    
+    if (!KEY_LT(lo, hi) || !cursor_seek(&c, t, lo)) {
+        return 0;
+    }
+    
+    // walk the leaf chain directly, the cursor only finds the start
+    node_t* l = c.leaf;
+    int i = c.idx;
+    for ( ; l; l = next_leaf(t, l), i = 0) {
+        prefetch_node(t, next_leaf(t, l));
+        
+        for ( ; i < l->num_keys; i++) {
+            if (!KEY_LT(l->keys[i], hi)) {
+                return count;
+            }
+            
+            count++;
+            if (!fn(ctx, l->keys[i], leaf_value(t, l, i))) {
+                return count;
+            }
+        }
+    }
+    
+    return count;
+}
+
+// copy at most max (key, value) pairs in [lo, hi) out, values is an array of value_size
+// slots and may be NULL, return the count
+long scan_into(bptree_t* t, bpt_key_t lo, bpt_key_t hi, bpt_key_t* keys, void* values, long max)
+{
+    bpt_cursor_t c;
+    long count = 0;
+    
+    if (!KEY_LT(lo, hi) || max <= 0 || !cursor_seek(&c, t, lo)) {
+        return 0;
+    }
+    
+    node_t* l = c.leaf;
+    int i = c.idx;
+    for ( ; l; l = next_leaf(t, l), i = 0) {
+        prefetch_node(t, next_leaf(t, l));
+        
+        int end = l->num_keys;
+        if (end > 0 && !KEY_LT(l->keys[end - 1], hi)) {
+            // the range ends in this leaf, before the keys >= hi
+            end = node_search(l->keys, l->num_keys, hi);
+            if (end > 0 && KEY_EQ(l->keys[end - 1], hi)) {
+                end--;
+            }
+        }
+        if (end - i > max - count) {
+            end = i + (int)(max - count);
+        }
+        
+        // inline values are contiguous like the keys, copy the whole run at once
+        if (i < end) {
+            memcpy(keys + count, l->keys + i, (end - i) * sizeof(bpt_key_t));
+            char* out = (char*)values + count * t->value_size;
+            if (values && t->inline_values) {
+                memcpy(out, leaf_slot(t, l, i), (end - i) * t->value_size);
+            } else if (values) {
+                for (int j = i; j < end; j++, out += t->value_size) {
+                    memcpy(out, leaf_value(t, l, j), t->value_size);
+                }
+            }
+            count += end - i;
+            i = end;
+        }
+        
+        if (end < l->num_keys) {
+            break;
+        }
+    }
+    
+    return count;
+}
+
+//////////// batch
+
+// a batch is sorted as (key, position) pairs, the key with its sign bit flipped so the
+// unsigned order is the key order. the sort is stable, equal keys keep their input order
+typedef struct batch_entry {
+    bpt_ukey_t key;
+    uint32_t   pos;
+} batch_entry_t;
+
+static bpt_key_t batch_key(batch_entry_t e)
+{
+    return (bpt_key_t)(e.key ^ KEY_SIGN_BIT);
+}
+
+static long batch_pos(batch_entry_t e)
+{
+    return e.pos;
+}
+
+#ifdef BPT_KEY_CMP
+// the radix sort only knows the integer order, a custom compare sorts by (key, position) so
+// equal keys still keep their input order
+static int batch_cmp(const void* a, const void* b)
+{
+    const batch_entry_t* x = a;
+    const batch_entry_t* y = b;
+    int c = BPT_KEY_CMP(batch_key(*x), batch_key(*y));
+    if (c != 0) {
+        return c < 0 ? -1 : 1;
+    }
+    
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static batch_entry_t* batch_sort(batch_entry_t* a, batch_entry_t* tmp, long n)
+{
+    qsort(a, n, sizeof(batch_entry_t), batch_cmp);
+    return a;
+}
+#else
+// lsd radix sort of a[0..n) on the key, 11 bits per pass, tmp holds n entries,
+// return the array that holds the result
+static batch_entry_t* batch_sort(batch_entry_t* a, batch_entry_t* tmp, long n)
+{
+    if (n <= 64) {
+        for (long i = 1; i < n; i++) {
+            batch_entry_t e = a[i];
+            long j = i;
+            for ( ; j > 0 && a[j - 1].key > e.key; j--) {
+                a[j] = a[j - 1];
+            }
+            a[j] = e;
+        }
+        
+        return a;
+    }
+    
+    long count[1 << 11];
+    for (int shift = 0; shift < KEY_BITS; shift += 11) {
+        memset(count, 0, sizeof(count));
+        for (long i = 0; i < n; i++) {
+            count[(a[i].key >> shift) & 2047]++;
+        }
+        
+        long sum = 0;
+        for (int d = 0; d < (1 << 11); d++) {
+            long c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        
+        for (long i = 0; i < n; i++) {
+            tmp[count[(a[i].key >> shift) & 2047]++] = a[i];
+        }
+        
+        batch_entry_t* swap = a;
+        a = tmp;
+        tmp = swap;
+    }
+    
+    return a;
+}
+#endif
+
+static batch_entry_t* batch_prepare(const bpt_key_t* keys, long n)
+{
+    batch_entry_t* e = malloc(2 * n * sizeof(batch_entry_t));
+    if (!e) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    for (long i = 0; i < n; i++) {
+        e[i].key = (bpt_ukey_t)keys[i] ^ KEY_SIGN_BIT;
+        e[i].pos = (uint32_t)i;
+    }
+    
+    return e;
+}
+
+typedef struct batch_span {
+    node_t* node;
+    long    lo;     // the sorted keys [lo, hi) go through node
+    long    hi;
+} batch_span_t;
+
+// descend the sorted keys [lo, hi) together one level at a time: a node is searched once for a
+// run of keys that goes to the same child, and the children of a level are all prefetched
+// before the first of them is searched, so their cache misses overlap. a and b hold
+// hi - lo spans each, return the leaf level spans and their count
+static batch_span_t* batch_descend(bptree_t* t, const batch_entry_t* e, long lo, long hi,
+                                   batch_span_t* a, batch_span_t* b, int* count)
+{
+    int n = 1;
+    a[0].node = t->root;
+    a[0].lo = lo;
+    a[0].hi = hi;
+    COUNT(t, descents, 1);
+    
+    while (!a[0].node->is_leaf) {
+        int m = 0;
+        COUNT(t, visits, n);
+        for (int s = 0; s < n; s++) {
+            node_t* c = a[s].node;
+            long j = a[s].lo;
+            while (j < a[s].hi) {
+                int i = node_search(c->keys, c->num_keys, batch_key(e[j]));
+                long end = a[s].hi;
+                if (i < c->num_keys) {
+                    end = j + 1;
+                    while (end < a[s].hi && KEY_LT(batch_key(e[end]), c->keys[i])) {
+                        end++;
+                    }
+                }
+                
+                b[m].node = c->pointers[i];
+                b[m].lo = j;
+                b[m].hi = end;
+                prefetch_node(t, b[m].node);
+                m++;
+                j = end;
+            }
+        }
+        
+        batch_span_t* swap = a;
+        a = b;
+        b = swap;
+        n = m;
+    }
+    
+    *count = n;
+    return a;
+}
+
+// look up n keys at once, values[i] is the value of keys[i] or NULL, return the number found
+long find_batch(bptree_t* t, const bpt_key_t* keys, long n, void** values)
+{
+    if (n <= 0) {
+        return 0;
+    }
+    
+    if (!t->root || n > UINT32_MAX) {
+        // the positions of a batch are 32 bit, a larger batch is looked up key by key
+        long found = 0;
+        for (long i = 0; i < n; i++) {
+            values[i] = t->root ? find_value(t, keys[i]) : NULL;
+            found += (values[i] != NULL);
+        }
+        
+        return found;
+    }
+    
+    batch_entry_t* e = batch_prepare(keys, n);
+    batch_entry_t* sorted = batch_sort(e, e + n, n);
+    batch_span_t a[BATCH_GROUP];
+    batch_span_t b[BATCH_GROUP];
+    long found = 0;
+    
+    for (long lo = 0; lo < n; lo += BATCH_GROUP) {
+        long hi = (lo + BATCH_GROUP < n) ? lo + BATCH_GROUP : n;
+        int count = 0;
+        batch_span_t* leaves = batch_descend(t, sorted, lo, hi, a, b, &count);
+        
+        for (int s = 0; s < count; s++) {
+            node_t* l = leaves[s].node;
+            for (long j = leaves[s].lo; j < leaves[s].hi; j++) {
+                bpt_key_t key = batch_key(sorted[j]);
+                int i = node_search(l->keys, l->num_keys, key);
+                void* value = NULL;
+                if (i > 0 && KEY_EQ(l->keys[i - 1], key)) {
+                    value = leaf_value(t, l, i - 1);
+                    found++;
+                }
+                
+                values[batch_pos(sorted[j])] = value;
+            }
+        }
+    }
+    
+    free(e);
+    return found;
+}
+
+// the leaf of key and the first separator to its right, the sorted keys below fence share it.
+// fenced is false for the last leaf, it takes every larger key
+static node_t* find_leaf_fence(bptree_t* t, bpt_key_t key, bpt_key_t* fence, bool* fenced)
+{
+    *fenced = false;
+    node_t* c = t->root;
+    COUNT(t, descents, 1);
+    while (!c->is_leaf) {
+        int i = node_search(c->keys, c->num_keys, key);
+        if (i < c->num_keys) {
+            *fence = c->keys[i];
+            *fenced = true;
+        }
+        c = c->pointers[i];
+        COUNT(t, visits, 1);
+    }
+    COUNT(t, visits, 1);
+    
+    return c;
+}
+
+// insert n (key, value) pairs, values is an array of n value_size slots, or NULL for an int tree
+// and every key is its own value. keys in the tree or repeated in the batch are skipped as
+// insert_value does, return the number inserted, -1 on bad arguments
+long insert_batch(bptree_t* t, const bpt_key_t* keys, const void* values, long n)
+{
+    if ((!values && t->value_size != sizeof(int)) || n > UINT32_MAX) {
+        return -1;
+    }
+    
+    if (n <= 0) {
+        return 0;
+    }
+    
+    batch_entry_t* e = batch_prepare(keys, n);
+    batch_entry_t* sorted = batch_sort(e, e + n, n);
+    batch_span_t a[BATCH_GROUP];
+    batch_span_t b[BATCH_GROUP];
+    long inserted = 0;
+    node_t* l = NULL;
+    bpt_key_t fence = 0;
+    bool fenced = false;
+    
+    for (long lo = 0; lo < n; lo += BATCH_GROUP) {
+        long hi = (lo + BATCH_GROUP < n) ? lo + BATCH_GROUP : n;
+        
+        // a read only pass over the group pulls its paths into the cache with overlapped misses,
+        // the inserts below then descend through cached nodes
+        if (t->root) {
+            int count = 0;
+            batch_descend(t, sorted, lo, hi, a, b, &count);
+        }
+        
+        for (long j = lo; j < hi; j++) {
+            bpt_key_t key = batch_key(sorted[j]);
+            long pos = batch_pos(sorted[j]);
+            const void* value = values ? (const char*)values + pos * t->value_size : (const void*)&keys[pos];
+            
+            if (!t->root) {
+                start_new_root(t, key, value);
+                inserted++;
+                continue;
+            }
+            
+            // the sorted keys stay in the last leaf until they pass its fence
+            if (!l || (fenced && !KEY_LT(key, fence))) {
+                l = find_leaf_fence(t, key, &fence, &fenced);
+            }
+            
+            int idx = calc_insert_index(l, key);
+            if (idx > 0 && KEY_EQ(l->keys[idx - 1], key)) {
+                continue;
+            }
+            
+            if (insert_into_leaf(t, l, idx, key, value)) {
+                // the key is in one of the halves, the keys after it are not in the left half
+                // once they pass the new separator
+                node_t* right = l->sibling;
+                if (!KEY_LT(key, right->keys[0])) {
+                    l = right;
+                } else {
+                    fence = right->keys[0];
+                    fenced = true;
+                }
+            }
+            inserted++;
+        }
+    }
+    
+    free(e);
+    return inserted;
+}
+/////////////
+
+void delete_in_node(bptree_t* t, node_t* n, bpt_key_t key, void* pointer)
+{
+    int i = 0;
+    
+    // remove key and shift keys
+    while (!KEY_EQ(key, n->keys[i])) {
+        ++i;
+    }
+    
+    if (n->is_leaf) {
+        // the value slot goes with its key
+        remove_at(t, n, i);
+        return;
+    }
+    
+    for (++i; i < n->num_keys; i++) {
+        n->keys[i - 1] = n->keys[i];
+    }
+    
+    // remove pointers and shift pointers
+    int num_pointers = n->num_keys + 1;
+    i = 0;
+    while (pointer != n->pointers[i]) {
+        ++i;
+    }
+    
+    for (++i; i < num_pointers; i++) {
+        n->pointers[i - 1] = n->pointers[i];
+    }
+    n->pointers[i - 1] = NULL;
+    
+    n->num_keys--;
+}
+
+void adjust_root(bptree_t* t)
+{
+    node_t* root = t->root;
+    if (root->num_keys > 0) {
+        return;
+    }
+    
+    // case: the last key is deleted, the tree is empty now
+    node_t* new_root = NULL;
+    if (!root->is_leaf) {
+        new_root = root->pointers[0];
+        new_root->parent = NULL;
+    }
+    
+    free_node(t, root);
+    t->root = new_root;
+}
+
+int get_neighbor_index(node_t* n)
+{
+    node_t* p = n->parent;
+    
+    int idx = 0;
+    for (int i = 0; i < p->num_keys + 1; i++) {
+        if (n == p->pointers[i]) {
+            idx = i - 1;
+            break;
+        }
+    }
+    
+    return idx;
+}
+
+void delete_entry(bptree_t* t, node_t* N, bpt_key_t key, void* pointer);
+
+void coalesce_nodes(bptree_t* t, node_t* N, bpt_key_t k_prime, node_t* N_prime, int neighbor_idx)
+{
+    if (neighbor_idx == -1) {
+        // swap the node so than N_prime is always the node before N
+        node_t* tmp = N_prime;
+        N_prime = N;
+        N = tmp;
+    }
+    
+    int i = 0;
+    int j = 0;
+    if (!N->is_leaf) {
+        // append K_prime and all keys and pointer in N to N_prime
+        N_prime->keys[N_prime->num_keys] = k_prime;
+        N_prime->num_keys++;
+        
+        for (i = N_prime->num_keys, j = 0; j < N->num_keys; i++, j++) {
+            N_prime->keys[i] = N->keys[j];
+            N_prime->pointers[i] = N->pointers[j];
+            N_prime->num_keys++;
+        }
+        
+        N_prime->pointers[N_prime->num_keys] = N->pointers[N->num_keys];
+        
+        // the moved children have a new parent
+        for (i = N_prime->num_keys - N->num_keys; i <= N_prime->num_keys; i++) {
+            node_t* child = N_prime->pointers[i];
+            child->parent = N_prime;
+        }
+    } else {
+        // append all keys and values in N to N_prime
+        move_entries(t, N_prime, N_prime->num_keys, N, 0, N->num_keys);
+        N_prime->num_keys += N->num_keys;
+        N_prime->sibling = N->sibling;
+    }
+    
+    delete_entry(t, N->parent, k_prime, N);
+    free_node(t, N);
+}
+
+// borrow an entry for N_prime
+void redistribute_nodes(bptree_t* t, node_t* N, bpt_key_t k_prime, node_t* N_prime, int neighbor_idx)
+{
+    int m = 0;
+    if (neighbor_idx != -1) {
+        // N_prime is a predecessor of N
+        if (!N->is_leaf) {
+            m = N_prime->num_keys;
+            
+            // shift all N (key,pointers) right 1 position
+            N->pointers[N->num_keys + 1] = N->pointers[N->num_keys];
+            for (int i = N->num_keys; i > 0; i--) {
+                N->keys[i] = N->keys[i - 1];
+                N->pointers[i] = N->pointers[i - 1];
+            }
+            
+            // k_prime comes down into N, the last key of N_prime goes up
+            N->keys[0] = k_prime;
+            N->pointers[0] = N_prime->pointers[m];
+            
+            node_t* tmp = N->pointers[0];
+            tmp->parent = N;
+            
+            N->parent->keys[neighbor_idx] = N_prime->keys[m - 1];
+        } else {
+            m = N_prime->num_keys - 1;
+            
+            move_entries(t, N, 1, N, 0, N->num_keys);
+            move_entries(t, N, 0, N_prime, m, 1);
+            
+            N->parent->keys[neighbor_idx] = N->keys[0];
+        }
+    } else {
+        // N_prime is a successor of N
+        if (!N->is_leaf) {
+            N->keys[N->num_keys] = k_prime;
+            N->pointers[N->num_keys + 1] = N_prime->pointers[0];
+            N->parent->keys[0] = N_prime->keys[0];
+            
+            node_t* tmp = N->pointers[N->num_keys + 1];
+            tmp->parent = N;
+            
+            int i = 0;
+            for ( ;i < N_prime->num_keys - 1; i++) {
+                N_prime->keys[i] = N_prime->keys[i + 1];
+                N_prime->pointers[i] = N_prime->pointers[i + 1];
+            }
+            N_prime->pointers[i] = N_prime->pointers[i + 1];
+        } else {
+            move_entries(t, N, N->num_keys, N_prime, 0, 1);
+            N->parent->keys[0] = N_prime->keys[1];
+            move_entries(t, N_prime, 0, N_prime, 1, N_prime->num_keys - 1);
+        }
+    }
+    
+    N->num_keys++;
+    N_prime->num_keys--;
+}
+
+void delete_entry(bptree_t* t, node_t* N, bpt_key_t key, void* pointer)
+{
+    int order = t->order;
+    
+    delete_in_node(t, N, key, pointer);
+    
+    // case: only 1 pointer in root
+    if (N == t->root) {
+        adjust_root(t);
+        return;
+    }
+    
+    int min_key = N->is_leaf ? cut(order - 1) : cut(order) - 1;
+    
+    // case: enough keys in the node
+    if (N->num_keys >= min_key) {
+        return;
+    }
+    
+    // case: not enough keys in the node
+    int neighbor_idx = get_neighbor_index(N);
+    node_t* N_prime = (neighbor_idx == -1) ? N->parent->pointers[1] : N->parent->pointers[neighbor_idx];
+    bpt_key_t k_prime = (neighbor_idx == -1) ? N->parent->keys[0] : N->parent->keys[neighbor_idx];
+    
+    int capacity = N->is_leaf ? order : (order - 1);
+    
+    if (N->num_keys + N_prime->num_keys < capacity) {
+        COUNT(t, merges, 1);
+        coalesce_nodes(t, N, k_prime, N_prime, neighbor_idx);
+    } else {
+        COUNT(t, redistributions, 1);
+        redistribute_nodes(t, N, k_prime, N_prime, neighbor_idx);
+    }
+}
+
+// return 0 if the key is deleted, -1 if the key is not found
+int delete(bptree_t* t, bpt_key_t key)
+{
+    node_t* leaf = find_leaf(t, key);
+    if (!leaf) {
+        return -1;
+    }
+    
+    int i = node_search(leaf->keys, leaf->num_keys, key);
+    if (i == 0 || !KEY_EQ(leaf->keys[i - 1], key)) {
+        return -1;
+    }
+    
+    if (t->lazy_delete) {
+        // no rebalancing, the leaf may stay underfull or empty until compact
+        remove_at(t, leaf, i - 1);
+        t->lazy_deletes++;
+        if (leaf == t->root && leaf->num_keys == 0) {
+            free_node(t, leaf);
+            t->root = NULL;
+        }
+        
+        return 0;
+    }
+    
+    // a leaf entry is removed by its key, the value slot and its record go with it
+    delete_entry(t, leaf, key, NULL);
+    return 0;
+}
+
+// with lazy deletion on, delete only removes the entry from its leaf: no neighbor lookups,
+// merges or parent updates. the tree stays correct with underfull and empty leaves, compact
+// packs it again in one sweep. insert always splits as usual
+void bptree_set_lazy_delete(bptree_t* t, bool lazy)
+{
+    t->lazy_delete = lazy;
+}
+
+static void free_internal_nodes(bptree_t* t, node_t* n)
+{
+    if (n->is_leaf) {
+        return;
+    }
+    
+    for (int i = 0; i <= n->num_keys; i++) {
+        free_internal_nodes(t, n->pointers[i]);
+    }
+    free_node(t, n);
+}
+
+// append a packed leaf to the bottom level of the rebuild
+static void compact_push_leaf(bulk_state_t* st, node_t* l)
+{
+    bulk_level_t* lv = &st->levels[0];
+    if (lv->cur) {
+        if (lv->pending) {
+            bulk_push(st, 0, lv->pending_sep, lv->pending);
+        }
+        
+        lv->pending = lv->cur;
+        lv->pending_sep = lv->cur_sep;
+        lv->pending->sibling = l;
+    }
+    
+    lv->cur = l;
+    lv->cur_sep = l->keys[0];
+    l->sibling = NULL;
+}
+
+// pack the leaves left to right to fill_factor in place, free the emptied ones and build new
+// internal levels over the packed leaves like bulk load. values and records move slot by slot,
+// nothing is copied out. return the number of nodes freed
+long compact(bptree_t* t, double fill_factor)
+{
+    if (!t->root) {
+        return 0;
+    }
+    
+    COUNT(t, compactions, 1);
+    long num_nodes = t->num_nodes;
+    node_t* l = t->root;
+    while (!l->is_leaf) {
+        l = l->pointers[0];
+    }
+    free_internal_nodes(t, t->root);
+    t->root = NULL;
+    
+    bulk_state_t* st = calloc(1, sizeof(bulk_state_t));
+    if (!st) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    st->t = t;
+    st->leaf_fill = fill_keys(t, fill_factor, true);
+    st->internal_fill = fill_keys(t, fill_factor, false);
+    
+    // w is the leaf being filled, always at or before l in the chain
+    node_t* w = NULL;
+    while (l) {
+        node_t* next = l->sibling;
+        int from = 0;
+        while (from < l->num_keys) {
+            if (!w) {
+                // the leaf takes over its own remaining entries
+                move_entries(t, l, 0, l, from, l->num_keys - from);
+                l->num_keys -= from;
+                from = l->num_keys;
+                w = l;
+            } else {
+                int m = st->leaf_fill - w->num_keys;
+                if (m > l->num_keys - from) {
+                    m = l->num_keys - from;
+                }
+                move_entries(t, w, w->num_keys, l, from, m);
+                w->num_keys += m;
+                from += m;
+            }
+            
+            if (w->num_keys >= st->leaf_fill) {
+                compact_push_leaf(st, w);
+                w = NULL;
+            }
+        }
+        
+        if (l != w && l != st->levels[0].cur) {
+            l->num_keys = 0;
+            free_node(t, l);
+        }
+        l = next;
+    }
+    
+    if (w) {
+        compact_push_leaf(st, w);
+    }
+    
+    if (st->levels[0].cur) {
+        bulk_finish(st);
+    }
+    
+    free(st);
+    t->lazy_deletes = 0;
+    return num_nodes - t->num_nodes;
+}
+
+//////////// durable mode
+
+// every insert and delete of a durable tree is appended to a redo log of logical records, a
+// group of group_size records is written with one fdatasync. a checkpoint writes all entries in
+// key order to a new file that replaces the old one by rename, then starts the next log.
+// recovery bulk loads the checkpoint and replays the log up to the first torn record
+
+#define WAL_MAGIC       0x4C415750      // "PWAL"
+#define CKPT_MAGIC      0x54504B43      // "CKPT"
+#define WAL_INSERT      1
+#define WAL_DELETE      2
+
+typedef struct wal_file_header {
+    uint32_t magic;
+    uint32_t key_size;
+    uint64_t value_size;
+    uint64_t generation;
+    uint64_t count;         // checkpoint: number of entries, log: unused
+} wal_file_header_t;
+
+struct durable {
+    bptree_t* tree;
+    char*     dir;
+    int       log_fd;
+    uint64_t  generation;           // the log wal.<generation> follows the checkpoint
+    size_t    record_size;          // crc, op, key, value
+    char*     group;                // records not written yet
+    int       group_size;
+    int       group_count;
+    long      log_records;          // records in the log since the checkpoint
+    long      checkpoint_records;   // checkpoint when the log has this many records, 0 never
+    long      fsyncs;
+    bool      failed;               // a write failed, the log may miss records
+};
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const void* data, size_t len)
+{
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+    
+    const uint8_t* p = data;
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    
+    return ~crc;
+}
+
+static char* durable_path(durable_t* d, const char* name, uint64_t generation)
+{
+    static char path[4096];
+    if (generation) {
+        snprintf(path, sizeof(path), "%s/%s.%" PRIu64, d->dir, name, generation);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", d->dir, name);
+    }
+    
+    return path;
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write failed\n");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// a rename or a new file is durable once its directory is synced
+static int sync_dir(durable_t* d)
+{
+    int fd = open(d->dir, O_RDONLY);
+    if (fd < 0) {
+        perror("open dir failed\n");
+        return -1;
+    }
+    
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+static void durable_header(durable_t* d, wal_file_header_t* h, uint32_t magic, uint64_t count)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = magic;
+    h->key_size = sizeof(bpt_key_t);
+    h->value_size = d->tree->value_size;
+    h->generation = d->generation;
+    h->count = count;
+}
+
+static bool header_ok(durable_t* d, const wal_file_header_t* h, uint32_t magic)
+{
+    return h->magic == magic && h->key_size == sizeof(bpt_key_t) && h->value_size == d->tree->value_size &&
+           h->generation == d->generation;
+}
+
+// write the buffered group and make it durable. a failed write may leave part of the group in
+// the log, the handle is failed then and takes no more changes, reopen recovers the log
+int durable_commit(durable_t* d)
+{
+    if (d->failed) {
+        return -1;
+    }
+    
+    if (d->group_count == 0) {
+        return 0;
+    }
+    
+    if (write_all(d->log_fd, d->group, d->group_count * d->record_size) != 0 || fdatasync(d->log_fd) != 0) {
+        d->failed = true;
+        return -1;
+    }
+    
+    d->fsyncs++;
+    d->group_count = 0;
+    return 0;
+}
+
+// start an empty log for the current generation
+static int open_new_log(durable_t* d)
+{
+    int fd = open(durable_path(d, "wal", d->generation), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        perror("open log failed\n");
+        return -1;
+    }
+    
+    wal_file_header_t h;
+    durable_header(d, &h, WAL_MAGIC, 0);
+    if (write_all(fd, &h, sizeof(h)) != 0 || fdatasync(fd) != 0 || sync_dir(d) != 0) {
+        close(fd);
+        return -1;
+    }
+    
+    d->log_fd = fd;
+    d->log_records = 0;
+    return 0;
+}
+
+static void append_record(durable_t* d, uint32_t op, bpt_key_t key, const void* value)
+{
+    char* r = d->group + d->group_count * d->record_size;
+    memcpy(r + 4, &op, 4);
+    memcpy(r + 8, &key, sizeof(key));
+    if (value) {
+        memcpy(r + 8 + sizeof(key), value, d->tree->value_size);
+    } else {
+        memset(r + 8 + sizeof(key), 0, d->tree->value_size);
+    }
+    
+    uint32_t crc = crc32(0, r + 4, d->record_size - 4);
+    memcpy(r, &crc, 4);
+    d->group_count++;
+}
+
+static bool checkpoint_due(durable_t* d)
+{
+    return d->checkpoint_records > 0 && d->log_records >= d->checkpoint_records;
+}
+
+// log a change before it is applied to the tree, the group is written when it is full or when
+// a checkpoint is due, so the tree never holds a change the log refused
+static int log_change(durable_t* d, uint32_t op, bpt_key_t key, const void* value)
+{
+    if (d->failed || d->group_count == d->group_size) {
+        return -1;
+    }
+    
+    append_record(d, op, key, value);
+    d->log_records++;
+    
+    if ((d->group_count == d->group_size || checkpoint_due(d)) && durable_commit(d) != 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// return 0 if the key is inserted, -1 if it exists, -2 if the log can not be written, then the
+// tree is not changed and every later change returns -2 too. the insert is durable after
+// durable_commit or once its group is full
+int durable_insert(durable_t* d, bpt_key_t key, const void* value)
+{
+    if (d->failed) {
+        return -2;
+    }
+    
+    if (find_value(d->tree, key)) {
+        return -1;
+    }
+    
+    if (log_change(d, WAL_INSERT, key, value) != 0) {
+        return -2;
+    }
+    
+    insert_value(d->tree, key, value);
+    if (checkpoint_due(d)) {
+        // the change is committed already, a failed checkpoint is tried again on the next change
+        durable_checkpoint(d);
+    }
+    
+    return 0;
+}
+
+int durable_delete(durable_t* d, bpt_key_t key)
+{
+    if (d->failed) {
+        return -2;
+    }
+    
+    if (!find_value(d->tree, key)) {
+        return -1;
+    }
+    
+    if (log_change(d, WAL_DELETE, key, NULL) != 0) {
+        return -2;
+    }
+    
+    delete(d->tree, key);
+    if (checkpoint_due(d)) {
+        durable_checkpoint(d);
+    }
+    
+    return 0;
+}
+
+// dump the tree in key order to checkpoint.tmp, rename it over the checkpoint and switch to
+// the log of the next generation. a crash before the rename recovers from the old checkpoint
+// and the old log, which is complete because it is committed first
+int durable_checkpoint(durable_t* d)
+{
+    if (durable_commit(d) != 0) {
+        return -1;
+    }
+    
+    bptree_t* t = d->tree;
+    uint64_t count = 0;
+    bpt_cursor_t c;
+    for (bool ok = cursor_first(&c, t); ok; ok = cursor_next(&c)) {
+        count++;
+    }
+    
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s", durable_path(d, "checkpoint.tmp", 0));
+    FILE* f = fopen(tmp, "wb");
+    if (!f) {
+        perror("open checkpoint failed\n");
+        return -1;
+    }
+    
+    d->generation++;
+    wal_file_header_t h;
+    durable_header(d, &h, CKPT_MAGIC, count);
+    uint32_t crc = 0;
+    fwrite(&h, sizeof(h), 1, f);
+    for (bool ok = cursor_first(&c, t); ok; ok = cursor_next(&c)) {
+        bpt_key_t key = cursor_key(&c);
+        void* value = cursor_value(&c);
+        crc = crc32(crc, &key, sizeof(key));
+        crc = crc32(crc, value, t->value_size);
+        fwrite(&key, sizeof(key), 1, f);
+        fwrite(value, t->value_size, 1, f);
+    }
+    fwrite(&crc, sizeof(crc), 1, f);
+    
+    if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0) {
+        perror("write checkpoint failed\n");
+        fclose(f);
+        d->generation--;
+        return -1;
+    }
+    fclose(f);
+    
+    if (rename(tmp, durable_path(d, "checkpoint", 0)) != 0) {
+        perror("rename checkpoint failed\n");
+        d->generation--;
+        return -1;
+    }
+    
+    // the checkpoint names the new generation now, the old log is not needed any more. past
+    // this point a failure leaves no log the next open would read, the handle is failed
+    close(d->log_fd);
+    d->log_fd = -1;
+    unlink(durable_path(d, "wal", d->generation - 1));
+    if (sync_dir(d) != 0 || open_new_log(d) != 0) {
+        d->failed = true;
+        return -1;
+    }
+    
+    return 0;
+}
+
+typedef struct ckpt_iter {
+    FILE*    f;
+    uint64_t left;
+    uint32_t crc;
+    char*    value;
+    size_t   value_size;
+    bool     error;
+} ckpt_iter_t;
+
+static bool ckpt_next(void* ctx, bpt_key_t* key, const void** value)
+{
+    ckpt_iter_t* it = ctx;
+    if (it->left == 0) {
+        return false;
+    }
+    
+    if (fread(key, sizeof(*key), 1, it->f) != 1 || fread(it->value, it->value_size, 1, it->f) != 1) {
+        it->error = true;
+        return false;
+    }
+    
+    it->crc = crc32(it->crc, key, sizeof(*key));
+    it->crc = crc32(it->crc, it->value, it->value_size);
+    *value = it->value;
+    it->left--;
+    return true;
+}
+
+static int load_checkpoint(durable_t* d)
+{
+    FILE* f = fopen(durable_path(d, "checkpoint", 0), "rb");
+    if (!f) {
+        // a new tree, generation 1 has no checkpoint
+        d->generation = 1;
+        return 0;
+    }
+    
+    wal_file_header_t h;
+    if (fread(&h, sizeof(h), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    
+    d->generation = h.generation;
+    if (!header_ok(d, &h, CKPT_MAGIC)) {
+        printf("durable: checkpoint does not match the tree\n");
+        fclose(f);
+        return -1;
+    }
+    
+    ckpt_iter_t it = {f, h.count, 0, malloc(d->tree->value_size), d->tree->value_size, false};
+    if (!it.value) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    int ret = bulk_load_iter(d->tree, ckpt_next, &it, 1.0);
+    uint32_t crc = 0;
+    if (ret != 0 || it.error || it.left != 0 || fread(&crc, sizeof(crc), 1, f) != 1 || crc != it.crc) {
+        printf("durable: checkpoint is damaged\n");
+        ret = -1;
+    }
+    
+    free(it.value);
+    fclose(f);
+    return ret;
+}
+
+// apply the log records up to the first torn or damaged one and cut the log there
+static int replay_log(durable_t* d)
+{
+    int fd = open(durable_path(d, "wal", d->generation), O_RDWR);
+    if (fd < 0) {
+        return open_new_log(d);
+    }
+    
+    wal_file_header_t h;
+    if (read(fd, &h, sizeof(h)) != sizeof(h) || !header_ok(d, &h, WAL_MAGIC)) {
+        // the header is written and synced before any record, a bad one is a crash right
+        // after the log was created
+        close(fd);
+        return open_new_log(d);
+    }
+    
+    // read whole blocks of records, a partial record at the end is a torn write
+    size_t size = d->record_size;
+    size_t cap = (1 << 16) / size * size + size;
+    char* buf = malloc(cap);
+    if (!buf) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    off_t end = sizeof(h);
+    size_t len = 0;
+    bool done = false;
+    while (!done) {
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        
+        size_t off = 0;
+        for (; off + size <= len; off += size) {
+            char* r = buf + off;
+            uint32_t crc = 0;
+            uint32_t op = 0;
+            bpt_key_t key = 0;
+            memcpy(&crc, r, 4);
+            memcpy(&op, r + 4, 4);
+            memcpy(&key, r + 8, sizeof(key));
+            if (crc != crc32(0, r + 4, size - 4)) {
+                done = true;
+                break;
+            }
+            
+            if (op == WAL_INSERT) {
+                insert_value(d->tree, key, r + 8 + sizeof(key));
+            } else if (op == WAL_DELETE) {
+                delete(d->tree, key);
+            } else {
+                done = true;
+                break;
+            }
+            
+            end += size;
+            d->log_records++;
+        }
+        
+        memmove(buf, buf + off, len - off);
+        len -= off;
+    }
+    free(buf);
+    
+    if (ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) != end || fdatasync(fd) != 0) {
+        perror("truncate log failed\n");
+        close(fd);
+        return -1;
+    }
+    
+    d->log_fd = fd;
+    return 0;
+}
+
+// a crash between the rename of a checkpoint and the unlink of the log before it leaves that
+// log behind, the checkpoint already covers it. remove every wal.<n> older than the checkpoint
+static void remove_old_logs(durable_t* d)
+{
+    DIR* dp = opendir(d->dir);
+    if (!dp) {
+        return;
+    }
+    
+    struct dirent* e;
+    while ((e = readdir(dp)) != NULL) {
+        if (strncmp(e->d_name, "wal.", 4) != 0 || e->d_name[4] < '0' || e->d_name[4] > '9') {
+            continue;
+        }
+        
+        char* end = NULL;
+        errno = 0;
+        uint64_t generation = strtoull(e->d_name + 4, &end, 10);
+        if (errno == 0 && *end == '\0' && generation < d->generation) {
+            unlink(durable_path(d, "wal", generation));
+        }
+    }
+    closedir(dp);
+}
+
+// open or create the durable tree in dir, a group of group_size changes shares one fdatasync,
+// a checkpoint is taken when the log holds checkpoint_records records, 0 for never
+durable_t* durable_open(const char* dir, int order, size_t value_size, int group_size, long checkpoint_records)
+{
+    if (group_size < 1) {
+        return NULL;
+    }
+    
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir failed\n");
+        return NULL;
+    }
+    
+    durable_t* d = calloc(1, sizeof(durable_t));
+    if (!d) {
+        return NULL;
+    }
+    
+    d->tree = bptree_create_ex(order, value_size, true);
+    d->dir = strdup(dir);
+    d->log_fd = -1;
+    d->record_size = 8 + sizeof(bpt_key_t) + value_size;
+    d->group_size = group_size;
+    d->checkpoint_records = checkpoint_records;
+    d->group = malloc(group_size * d->record_size);
+    if (!d->tree || !d->dir || !d->group) {
+        bptree_destroy(d->tree);
+        free(d->dir);
+        free(d->group);
+        free(d);
+        return NULL;
+    }
+    
+    if (load_checkpoint(d) != 0 || replay_log(d) != 0) {
+        bptree_destroy(d->tree);
+        free(d->dir);
+        free(d->group);
+        free(d);
+        return NULL;
+    }
+    
+    remove_old_logs(d);
+    return d;
+}
+
+// commit the last group and release the tree, the log stays for the next open
+int durable_close(durable_t* d)
+{
+    int ret = durable_commit(d);
+    if (d->log_fd >= 0) {
+        close(d->log_fd);
+    }
+    bptree_destroy(d->tree);
+    free(d->dir);
+    free(d->group);
+    free(d);
+    return ret;
+}
+
+//////////// benchmark
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_rand(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static bpt_key_t* make_shuffled_keys(int n)
+{
+    bpt_key_t* keys = malloc(n * sizeof(bpt_key_t));
+    if (!keys) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    uint64_t seed = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int)(bench_rand(&seed) % (i + 1));
+        bpt_key_t tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+    
+    return keys;
+}
+
+// lookup ns/op of the old order 4 tree, node, keys and pointers in three mallocs, against
+// single block nodes of order 4, a few cache lines, a 4 KiB and a 16 KiB page
+static void bench_lookup(int n)
+{
+    struct {
+        int  order;
+        bool split;
+    } shapes[] = {
+        {DEFAULT_ORDER, true},
+        {DEFAULT_ORDER, false},
+        {bptree_order_for_node_size(256), true},
+        {bptree_order_for_node_size(256), false},
+        {bptree_order_for_node_size(4096), false},
+        {bptree_order_for_node_size(16384), false},
+    };
+    int num_lookups = 1000000;
+    bpt_key_t* keys = make_shuffled_keys(n);
+    
+    printf("%d keys, %d random lookups\n", n, num_lookups);
+    printf("%8s %10s %10s %8s %10s %12s %12s\n", "order", "layout", "node_size", "height", "nodes", "insert_ns",
+           "lookup_ns");
+    
+    for (int k = 0; k < sizeof(shapes) / sizeof(shapes[0]); k++) {
+        bptree_t* t = bptree_create(shapes[k].order);
+        t->split_layout = shapes[k].split;
+        
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < n; i++) {
+            insert(t, keys[i], keys[i]);
+        }
+        uint64_t insert_ns = get_nano_tick() - start;
+        
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        long sum = 0;
+        start = get_nano_tick();
+        for (int i = 0; i < num_lookups; i++) {
+            record_t* r = find(t, (int)(bench_rand(&seed) % n));
+            sum += r->value;
+        }
+        uint64_t lookup_ns = get_nano_tick() - start;
+        
+        printf("%8d %10s %10zu %8d %10ld %12.1f %12.1f\n", t->order, t->split_layout ? "3 mallocs" : "block",
+               t->node_size, tree_height(t), t->num_nodes, (double)insert_ns / n, (double)lookup_ns / num_lookups);
+        if (sum < 0) {
+            printf("unexpected sum %ld\n", sum);
+        }
+        
+        bptree_destroy(t);
+    }
+    
+    free(keys);
+}
+
+// qsort in the key order of the tree, the built-in one or BPT_KEY_CMP
+static int cmp_key(const void* a, const void* b)
+{
+    bpt_key_t x = *(const bpt_key_t*)a;
+    bpt_key_t y = *(const bpt_key_t*)b;
+    return KEY_LT(x, y) ? -1 : !KEY_EQ(x, y);
+}
+
+static const char* node_search_name(int kind)
+{
+    switch (kind) {
+        case NODE_SEARCH_LINEAR:
+            return "linear";
+        case NODE_SEARCH_BINARY:
+            return "binary";
+        case NODE_SEARCH_SSE42:
+            return "sse4.2";
+        case NODE_SEARCH_AVX2:
+            return "avx2";
+        default:
+            return "auto";
+    }
+}
+
+// ns per search of every kernel over nodes of n keys, the nodes are picked at random so
+// the numbers include the cache misses a real descent would take
+static void bench_node_search()
+{
+    int sizes[] = {8, 16, 32, 64, 128, 256, 512, 1024};
+    int num_nodes = 1024;
+    int num_searches = 4000000;
     
-    // case: no space in leaf node, split the leaf
-    node_t* L_prime = make_leaf();
-    L_prime->parent = L->parent;
+    printf("%8s", "keys");
+    for (int kind = NODE_SEARCH_LINEAR; kind <= NODE_SEARCH_AVX2; kind++) {
+        printf(" %10s", node_search_name(kind));
+    }
+    printf("   (ns/search)\n");
+    
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        bpt_key_t* keys = malloc((size_t)num_nodes * n * sizeof(bpt_key_t));
+        if (!keys) {
+            perror("malloc failed\n");
+            exit(1);
+        }
+        
+        for (int j = 0; j < num_nodes; j++) {
+            for (int i = 0; i < n; i++) {
+                keys[(size_t)j * n + i] = 2 * i + 1;
+            }
+            qsort(keys + (size_t)j * n, n, sizeof(bpt_key_t), cmp_key);
+        }
+        
+        printf("%8d", n);
+        long expected = -1;
+        for (int kind = NODE_SEARCH_LINEAR; kind <= NODE_SEARCH_AVX2; kind++) {
+            if (bptree_set_node_search(kind) != kind) {
+                printf(" %10s", "-");
+                continue;
+            }
+            
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            long sum = 0;
+            uint64_t start = get_nano_tick();
+            for (int i = 0; i < num_searches; i++) {
+                uint64_t r = bench_rand(&seed);
+                const bpt_key_t* node = keys + (r % num_nodes) * n;
+                sum += node_search(node, n, (int)((r >> 32) % (2 * n + 1)));
+            }
+            uint64_t ns = get_nano_tick() - start;
+            
+            if (expected == -1) {
+                expected = sum;
+            } else if (sum != expected) {
+                printf("\n%s returns wrong result\n", node_search_name(kind));
+                exit(1);
+            }
+            printf(" %10.2f", (double)ns / num_searches);
+        }
+        printf("\n");
+        
+        free(keys);
+    }
+    
+    bptree_set_node_search(NODE_SEARCH);
+}
+
+// tree lookup ns/op of every kernel for node sizes from 16 to 256 keys
+static void bench_tree_search(int n)
+{
+    int orders[] = {17, 65, 129, 257};
+    int num_lookups = 1000000;
+    bpt_key_t* keys = make_shuffled_keys(n);
+    
+    printf("%d keys, %d random lookups (ns/op)\n", n, num_lookups);
+    printf("%8s %8s", "order", "height");
+    for (int kind = NODE_SEARCH_LINEAR; kind <= NODE_SEARCH_AVX2; kind++) {
+        printf(" %10s", node_search_name(kind));
+    }
+    printf("\n");
+    
+    for (int k = 0; k < sizeof(orders) / sizeof(orders[0]); k++) {
+        bptree_t* t = bptree_create(orders[k]);
+        for (int i = 0; i < n; i++) {
+            insert(t, keys[i], keys[i]);
+        }
+        
+        printf("%8d %8d", t->order, tree_height(t));
+        for (int kind = NODE_SEARCH_LINEAR; kind <= NODE_SEARCH_AVX2; kind++) {
+            if (bptree_set_node_search(kind) != kind) {
+                printf(" %10s", "-");
+                continue;
+            }
+            
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            long sum = 0;
+            uint64_t start = get_nano_tick();
+            for (int i = 0; i < num_lookups; i++) {
+                record_t* r = find(t, (int)(bench_rand(&seed) % n));
+                sum += r->value;
+            }
+            uint64_t ns = get_nano_tick() - start;
+            printf(" %10.1f", (double)ns / num_lookups);
+            if (sum < 0) {
+                printf("unexpected sum %ld\n", sum);
+            }
+        }
+        printf("\n");
+        
+        bptree_set_node_search(NODE_SEARCH);
+        bptree_destroy(t);
+    }
+    
+    free(keys);
+}
+
+typedef struct seq_iter {
+    int n;
+    int pos;
+    int value;
+} seq_iter_t;
+
+// generate the sorted input on the fly, the streaming load never holds it in memory
+static bool seq_next(void* ctx, bpt_key_t* key, const void** value)
+{
+    seq_iter_t* it = ctx;
+    if (it->pos >= it->n) {
+        return false;
+    }
+    
+    *key = it->pos;
+    it->value = it->pos;
+    *value = &it->value;
+    it->pos++;
+    return true;
+}
+
+// sorted load with one insert() per key against the bottom-up bulk load
+static void bench_bulk_load(int n)
+{
+    int orders[] = {bptree_order_for_node_size(256), bptree_order_for_node_size(4096)};
+    bpt_key_t* keys = malloc(n * sizeof(bpt_key_t));
+    if (!keys) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    
+    printf("%d sorted keys\n", n);
+    printf("%8s %-18s %10s %10s %8s %10s\n", "order", "method", "total_ms", "ns/key", "height", "nodes");
+    
+    for (int k = 0; k < sizeof(orders) / sizeof(orders[0]); k++) {
+        for (int m = 0; m < 4; m++) {
+            bptree_t* t = bptree_create(orders[k]);
+            const char* name = NULL;
+            
+            uint64_t start = get_nano_tick();
+            if (m == 0) {
+                name = "insert loop";
+                for (int i = 0; i < n; i++) {
+                    insert(t, keys[i], keys[i]);
+                }
+            } else if (m == 1) {
+                name = "bulk_load 1.0";
+                bulk_load(t, keys, NULL, n, 1.0);
+            } else if (m == 2) {
+                name = "bulk_load 0.7";
+                bulk_load(t, keys, NULL, n, 0.7);
+            } else {
+                name = "bulk_load_iter 1.0";
+                seq_iter_t it = {n, 0, 0};
+                bulk_load_iter(t, seq_next, &it, 1.0);
+            }
+            uint64_t ns = get_nano_tick() - start;
+            
+            printf("%8d %-18s %10.1f %10.1f %8d %10ld\n", t->order, name, ns / 1e6, (double)ns / n,
+                   tree_height(t), t->num_nodes);
+            bptree_destroy(t);
+        }
+    }
+    
+    free(keys);
+}
+
+static bool sum_fn(void* ctx, bpt_key_t key, const void* value)
+{
+    *(long*)ctx += *(const int*)value;
+    return true;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// a burst that deletes a fraction of random keys: eager rebalancing against lazy deletion
+// with one compact pass at the end, then lookups of the keys that are left
+static void bench_delete(int n)
+{
+    int order = bptree_order_for_node_size(256);
+    bpt_key_t* keys = make_shuffled_keys(n);
+    int percents[] = {50, 90};
+    uint64_t* lat = malloc(n * sizeof(uint64_t));
+    if (!lat) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    printf("%d keys, order %d (delete ns/key, p99 and max per delete, find ns/key after)\n", n, order);
+    printf("%8s %8s %10s %8s %10s %10s %10s %10s\n", "deleted", "mode", "ns/key", "p99", "max", "compact ms",
+           "nodes", "find");
+    
+    for (int p = 0; p < sizeof(percents) / sizeof(percents[0]); p++) {
+        int m = (int)((long)n * percents[p] / 100);
+        for (int lazy = 0; lazy < 2; lazy++) {
+            bptree_t* t = bptree_create(order);
+            for (int i = 0; i < n; i++) {
+                insert(t, keys[i], keys[i]);
+            }
+            bptree_set_lazy_delete(t, lazy);
+            
+            uint64_t start = get_nano_tick();
+            for (int i = 0; i < m; i++) {
+                uint64_t t0 = get_nano_tick();
+                delete(t, keys[i]);
+                lat[i] = get_nano_tick() - t0;
+            }
+            uint64_t ns = get_nano_tick() - start;
+            
+            double compact_ms = 0;
+            if (lazy) {
+                start = get_nano_tick();
+                compact(t, 1.0);
+                compact_ms = (get_nano_tick() - start) / 1e6;
+            }
+            
+            long sum = 0;
+            start = get_nano_tick();
+            for (int i = m; i < n; i++) {
+                sum += *(int*)find_value(t, keys[i]);
+            }
+            uint64_t find_ns = get_nano_tick() - start;
+            
+            qsort(lat, m, sizeof(uint64_t), cmp_u64);
+            printf("%7d%% %8s %10.1f %8" PRIu64 " %10" PRIu64 " %10.2f %10ld %10.1f\n", percents[p],
+                   lazy ? "lazy" : "eager", (double)ns / m, lat[m / 100 * 99], lat[m - 1], compact_ms,
+                   t->num_nodes, (double)find_ns / (n - m));
+            
+            if (sum == 42) {
+                printf("\n");
+            }
+            bptree_destroy(t);
+        }
+    }
+    
+    free(lat);
+    free(keys);
+}
+
+// [lo, hi) range reads with one find() per key against the leaf chain scans
+static void bench_scan(int n)
+{
+    int order = bptree_order_for_node_size(4096);
+    int ranges[] = {100, 10000, 1000000};
+    int rounds = 20;
+    
+    bptree_t* t = bptree_create(order);
+    seq_iter_t it = {n, 0, 0};
+    bulk_load_iter(t, seq_next, &it, 1.0);
+    bpt_key_t* keys = malloc(ranges[2] * sizeof(bpt_key_t));
+    int* values = malloc(ranges[2] * sizeof(int));
+    if (!keys || !values) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    printf("%d keys, order %d (ns/key)\n", n, order);
+    printf("%10s %12s %12s %12s\n", "range", "find loop", "scan", "scan_into");
+    
+    for (int r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        int len = ranges[r];
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        uint64_t find_ns = 0;
+        uint64_t scan_ns = 0;
+        uint64_t into_ns = 0;
+        long sum1 = 0;
+        long sum2 = 0;
+        long sum3 = 0;
+        
+        for (int k = 0; k < rounds; k++) {
+            int lo = (int)(bench_rand(&seed) % (n - len));
+            
+            uint64_t start = get_nano_tick();
+            for (bpt_key_t key = lo; key < lo + len; key++) {
+                sum1 += find(t, key)->value;
+            }
+            find_ns += get_nano_tick() - start;
+            
+            start = get_nano_tick();
+            scan(t, lo, lo + len, sum_fn, &sum2);
+            scan_ns += get_nano_tick() - start;
+            
+            start = get_nano_tick();
+            long count = scan_into(t, lo, lo + len, keys, values, len);
+            for (long i = 0; i < count; i++) {
+                sum3 += values[i];
+            }
+            into_ns += get_nano_tick() - start;
+        }
+        
+        if (sum1 != sum2 || sum1 != sum3) {
+            printf("scan results differ\n");
+            exit(1);
+        }
+        
+        double total = (double)len * rounds;
+        printf("%10d %12.2f %12.2f %12.2f\n", len, find_ns / total, scan_ns / total, into_ns / total);
+    }
+    
+    free(keys);
+    free(values);
+    bptree_destroy(t);
+}
+
+// bytes held by malloc, nodes and records included
+static size_t heap_in_use()
+{
+#ifdef __GLIBC__
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// inline leaf values against one record per key, int values and 32 byte values
+static void bench_values(int n)
+{
+    int order = bptree_order_for_node_size(256);
+    int num_lookups = 1000000;
+    bpt_key_t* keys = make_shuffled_keys(n);
+    size_t value_sizes[] = {sizeof(int), 32};
+    char value[32] = {0};
+    
+    printf("%d keys, order %d, %d random lookups\n", n, order, num_lookups);
+    printf("%8s %8s %10s %10s %12s %12s\n", "value", "layout", "leaf_size", "bytes/key", "insert_ns", "lookup_ns");
+    
+    for (int v = 0; v < sizeof(value_sizes) / sizeof(value_sizes[0]); v++) {
+        for (int inl = 0; inl <= 1; inl++) {
+            size_t base = heap_in_use();
+            bptree_t* t = bptree_create_ex(order, value_sizes[v], inl);
+            
+            uint64_t start = get_nano_tick();
+            for (int i = 0; i < n; i++) {
+                int v = (int)keys[i];
+                memcpy(value, &v, sizeof(int));
+                insert_value(t, keys[i], value);
+            }
+            uint64_t insert_ns = get_nano_tick() - start;
+            size_t bytes = heap_in_use() - base;
+            
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            long sum = 0;
+            start = get_nano_tick();
+            for (int i = 0; i < num_lookups; i++) {
+                int* r = find_value(t, (int)(bench_rand(&seed) % n));
+                sum += *r;
+            }
+            uint64_t lookup_ns = get_nano_tick() - start;
+            
+            printf("%8zu %8s %10zu %10.1f %12.1f %12.1f\n", value_sizes[v], inl ? "inline" : "record", t->leaf_size,
+                   (double)bytes / n, (double)insert_ns / n, (double)lookup_ns / num_lookups);
+            if (sum < 0) {
+                printf("unexpected sum %ld\n", sum);
+            }
+            
+            bptree_destroy(t);
+        }
+    }
+    
+    free(keys);
+}
+
+// insert, delete half and insert again, count the calls into the system allocator per phase
+static void bench_alloc(int n)
+{
+    int order = bptree_order_for_node_size(256);
+    bpt_key_t* keys = make_shuffled_keys(n);
+    bptree_t* t = bptree_create(order);
+    const char* phases[] = {"insert", "delete half", "insert again"};
+    
+    printf("%d keys, order %d, node pool %s\n", n, order, NODE_POOL ? "on" : "off");
+    printf("%-14s %10s %10s %10s %10s %12s\n", "phase", "ns/op", "mallocs", "frees", "slabs", "node_reuses");
+    
+    for (int p = 0; p < 3; p++) {
+        bptree_alloc_stats_t before = t->alloc;
+        int ops = (p == 0) ? n : n / 2;
+        
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < ops; i++) {
+            if (p == 1) {
+                delete(t, keys[i]);
+            } else {
+                insert(t, keys[i], keys[i]);
+            }
+        }
+        uint64_t ns = get_nano_tick() - start;
+        
+        printf("%-14s %10.1f %10ld %10ld %10ld %12ld\n", phases[p], (double)ns / ops,
+               t->alloc.mallocs - before.mallocs, t->alloc.frees - before.frees,
+               t->alloc.slabs - before.slabs, t->alloc.node_reuses - before.node_reuses);
+    }
+    
+    long num_nodes = t->num_nodes;
+    uint64_t start = get_nano_tick();
+    bptree_destroy(t);
+    printf("destroy %ld nodes: %.2f ms\n", num_nodes, (get_nano_tick() - start) / 1e6);
+    
+    free(keys);
+}
+
+// per key find and insert loops against find_batch and insert_batch, the tree holds the even
+// keys of [0, 2n), the lookups hit and miss, the inserts add random odd keys
+static void bench_batch(int n)
+{
+    int order = bptree_order_for_node_size(256);
+    int batch_sizes[] = {16, 128, 1024, 10000, 100000};
+    int total = 1000000;
+    bpt_key_t* even = malloc(n * sizeof(bpt_key_t));
+    bpt_key_t* keys = malloc(total * sizeof(bpt_key_t));
+    void** values = malloc(total * sizeof(void*));
+    if (!even || !keys || !values) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    for (int i = 0; i < n; i++) {
+        even[i] = 2 * i;
+    }
+    
+    printf("%d keys, order %d, %d ops per row (ns/key)\n", n, order, total);
+    printf("%8s %12s %12s %12s %12s\n", "batch", "find loop", "find_batch", "insert loop", "insert_batch");
+    
+    for (int k = 0; k < sizeof(batch_sizes) / sizeof(batch_sizes[0]); k++) {
+        int size = batch_sizes[k];
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        uint64_t ns[4] = {0};
+        long sum[2] = {0};
+        
+        for (int m = 0; m < 4; m++) {
+            bptree_t* t = bptree_create(order);
+            bulk_load(t, even, NULL, n, 0.7);
+            for (int i = 0; m % 2 == 0 && i < total; i++) {
+                int r = (int)(bench_rand(&seed) % (2 * n));
+                keys[i] = (m < 2) ? r : r | 1;
+            }
+            
+            uint64_t start = get_nano_tick();
+            for (int lo = 0; lo < total; lo += size) {
+                int len = (lo + size < total) ? size : total - lo;
+                if (m == 0) {
+                    for (int i = lo; i < lo + len; i++) {
+                        values[i] = find_value(t, keys[i]);
+                    }
+                } else if (m == 1) {
+                    find_batch(t, keys + lo, len, values + lo);
+                } else if (m == 2) {
+                    for (int i = lo; i < lo + len; i++) {
+                        insert(t, keys[i], keys[i]);
+                    }
+                } else {
+                    insert_batch(t, keys + lo, NULL, len);
+                }
+            }
+            ns[m] = get_nano_tick() - start;
+            
+            if (m < 2) {
+                for (int i = 0; i < total; i++) {
+                    sum[m] += values[i] ? *(int*)values[i] : 0;
+                }
+            }
+            
+            bptree_destroy(t);
+        }
+        
+        if (sum[0] != sum[1]) {
+            printf("find_batch results differ\n");
+            exit(1);
+        }
+        
+        printf("%8d %12.1f %12.1f %12.1f %12.1f\n", size, (double)ns[0] / total, (double)ns[1] / total,
+               (double)ns[2] / total, (double)ns[3] / total);
+    }
+    
+    free(even);
+    free(keys);
+    free(values);
+}
+
+// remove the files of a durable tree so a test or benchmark starts empty
+static void durable_remove_files(const char* dir)
+{
+    DIR* dp = opendir(dir);
+    if (!dp) {
+        return;
+    }
+    
+    char path[4096];
+    struct dirent* e;
+    while ((e = readdir(dp)) != NULL) {
+        if (strncmp(e->d_name, "wal.", 4) == 0 || strncmp(e->d_name, "checkpoint", 10) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dp);
+}
+
+// drop the durable tree like a crash, the records of the unwritten group are lost
+static void durable_crash(durable_t* d)
+{
+    if (d->log_fd >= 0) {
+        close(d->log_fd);
+    }
+    bptree_destroy(d->tree);
+    free(d->dir);
+    free(d->group);
+    free(d);
+}
+
+#define WAL_TEST_KEYS   4096
+#define WAL_TEST_VALUE  16
+
+typedef struct wal_ref {
+    bool present[WAL_TEST_KEYS];
+    char values[WAL_TEST_KEYS][WAL_TEST_VALUE];
+    int  count;
+} wal_ref_t;
+
+typedef struct wal_undo {
+    int  key;
+    bool present;
+    char value[WAL_TEST_VALUE];
+} wal_undo_t;
+
+static void wal_check(durable_t* d, wal_ref_t* ref, const char* step)
+{
+    long count = 0;
+    bpt_cursor_t c;
+    for (bool ok = cursor_first(&c, d->tree); ok; ok = cursor_next(&c)) {
+        count++;
+    }
+    
+    bool ok = (count == ref->count);
+    for (int k = 0; ok && k < WAL_TEST_KEYS; k++) {
+        char* value = find_value(d->tree, k);
+        ok = ref->present[k] ? (value && memcmp(value, ref->values[k], WAL_TEST_VALUE) == 0) : !value;
+    }
+    
+    if (!ok) {
+        printf("wal test: %s, tree has %ld keys, expected %d\n", step, count, ref->count);
+        exit(1);
+    }
+}
+
+static void wal_undo(wal_ref_t* ref, wal_undo_t* undo, int n)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        int k = undo[i].key;
+        ref->count += (int)undo[i].present - (int)ref->present[k];
+        ref->present[k] = undo[i].present;
+        memcpy(ref->values[k], undo[i].value, WAL_TEST_VALUE);
+    }
+}
+
+// random inserts and deletes with checkpoints, crashes that lose the unwritten group, a torn
+// log tail and a damaged record, the recovered tree must match the reference every time
+static void wal_test(const char* dir)
+{
+    int group_size = 8;
+    wal_ref_t* ref = calloc(1, sizeof(wal_ref_t));
+    wal_undo_t* undo = calloc(group_size, sizeof(wal_undo_t));
+    if (!ref || !undo) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    durable_remove_files(dir);
+    durable_t* d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 3000);
+    if (!d) {
+        printf("wal test: can not open %s\n", dir);
+        exit(1);
+    }
+    
+    uint64_t seed = 12345;
+    int pending = 0;
+    for (int i = 1; i <= 40000; i++) {
+        int k = (int)(bench_rand(&seed) % WAL_TEST_KEYS);
+        undo[pending].key = k;
+        undo[pending].present = ref->present[k];
+        memcpy(undo[pending].value, ref->values[k], WAL_TEST_VALUE);
+        pending++;
+        
+        if (ref->present[k]) {
+            if (durable_delete(d, k) != 0) {
+                printf("wal test: delete %d failed\n", k);
+                exit(1);
+            }
+            ref->present[k] = false;
+            ref->count--;
+        } else {
+            char value[WAL_TEST_VALUE];
+            snprintf(value, sizeof(value), "%d/%d", k, i);
+            if (durable_insert(d, k, value) != 0) {
+                printf("wal test: insert %d failed\n", k);
+                exit(1);
+            }
+            memcpy(ref->values[k], value, WAL_TEST_VALUE);
+            ref->present[k] = true;
+            ref->count++;
+        }
+        
+        if (d->group_count == 0) {
+            pending = 0;
+        }
+        
+        if (i % 5000 == 0) {
+            // a crash loses the changes of the open group
+            durable_crash(d);
+            wal_undo(ref, undo, pending);
+            pending = 0;
+            d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 3000);
+            wal_check(d, ref, "recovery after crash");
+        } else if (i % 7001 == 0) {
+            durable_close(d);
+            pending = 0;
+            d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 3000);
+            wal_check(d, ref, "reopen after close");
+        }
+    }
+    
+    // a torn write leaves a partial record at the end of the log
+    durable_commit(d);
+    uint64_t generation = d->generation;
+    durable_crash(d);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/wal.%" PRIu64, dir, generation);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    char garbage[37];
+    memset(garbage, 0x5a, sizeof(garbage));
+    if (fd < 0 || write(fd, garbage, sizeof(garbage)) != sizeof(garbage)) {
+        printf("wal test: can not append to %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    
+    d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 0);
+    wal_check(d, ref, "recovery of a torn tail");
+    
+    // a damaged last record is dropped, the log is cut before it
+    int k = ref->present[1] ? 1 : 2;
+    if (!ref->present[k]) {
+        memset(ref->values[k], 'x', WAL_TEST_VALUE);
+        durable_insert(d, k, ref->values[k]);
+        ref->present[k] = true;
+        ref->count++;
+    }
+    durable_delete(d, k);
+    durable_commit(d);
+    durable_crash(d);
+    
+    struct stat st;
+    fd = open(path, O_WRONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || pwrite(fd, garbage, 1, st.st_size - 1) != 1) {
+        printf("wal test: can not damage %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    
+    d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 0);
+    wal_check(d, ref, "recovery of a damaged record");
+    durable_delete(d, k);
+    ref->present[k] = false;
+    ref->count--;
+    durable_close(d);
+    
+    d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 0);
+    wal_check(d, ref, "reopen after a cut log");
+    
+    // a crash between the rename of the checkpoint and the unlink of the old log, the next
+    // open removes the old log
+    durable_checkpoint(d);
+    generation = d->generation;
+    durable_crash(d);
+    snprintf(path, sizeof(path), "%s/wal.%" PRIu64, dir, generation - 1);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, garbage, sizeof(garbage)) != sizeof(garbage)) {
+        printf("wal test: can not create %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    
+    d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 0);
+    wal_check(d, ref, "recovery with an old log left");
+    if (access(path, F_OK) == 0 || d->generation != generation) {
+        printf("wal test: the old log %s is not removed\n", path);
+        exit(1);
+    }
+    
+    // a write error on the log: the insert that fills the group fails and is not applied, the
+    // handle refuses every later change and the group is lost like in a crash
+    int log_fd = d->log_fd;
+    d->log_fd = open("/dev/null", O_RDONLY);
+    pending = 0;
+    int ret = 0;
+    char value[WAL_TEST_VALUE];
+    for (k = 0; k < WAL_TEST_KEYS && ret == 0; k++) {
+        if (ref->present[k]) {
+            continue;
+        }
+        
+        snprintf(value, sizeof(value), "fail/%d", k);
+        ret = durable_insert(d, k, value);
+        if (ret == 0) {
+            undo[pending].key = k;
+            undo[pending].present = false;
+            pending++;
+            memcpy(ref->values[k], value, WAL_TEST_VALUE);
+            ref->present[k] = true;
+            ref->count++;
+        }
+    }
+    
+    // k - 1 is the key of the failed insert
+    if (ret != -2 || pending != group_size - 1 || find_value(d->tree, k - 1) ||
+        durable_insert(d, k - 1, value) != -2 || durable_delete(d, undo[0].key) != -2 || durable_commit(d) != -1 ||
+        durable_checkpoint(d) != -1 || d->group_count > d->group_size) {
+        printf("wal test: a failed write is not reported\n");
+        exit(1);
+    }
+    wal_check(d, ref, "tree after a failed write");
+    close(log_fd);
+    durable_crash(d);
+    wal_undo(ref, undo, pending);
+    
+    d = durable_open(dir, 8, WAL_TEST_VALUE, group_size, 0);
+    wal_check(d, ref, "recovery after a failed write");
+    printf("wal test passed, %d keys, generation %" PRIu64 "\n", ref->count, d->generation);
+    durable_close(d);
+    
+    durable_remove_files(dir);
+    free(ref);
+    free(undo);
+}
+
+// durable inserts with group commit against the in-memory tree, then the time of a checkpoint
+// and of recovery from the log alone and from the checkpoint
+static void bench_wal(int n, const char* dir)
+{
+    int order = bptree_order_for_node_size(256);
+    int group_sizes[] = {1, 16, 256, 4096};
+    bpt_key_t* keys = make_shuffled_keys(n);
+    uint64_t value = 0;
+    
+    uint64_t start = get_nano_tick();
+    bptree_t* t = bptree_create_ex(order, sizeof(value), true);
+    for (int i = 0; i < n; i++) {
+        value = keys[i];
+        insert_value(t, keys[i], &value);
+    }
+    uint64_t base = get_nano_tick() - start;
+    bptree_destroy(t);
+    
+    printf("%d keys, order %d, 8 byte values, log in %s\n", n, order, dir);
+    printf("%10s %10s %10s %10s %12s\n", "group", "ops", "ns/op", "fsyncs", "vs memory");
+    printf("%10s %10d %10.1f %10d %12s\n", "memory", n, (double)base / n, 0, "1.0x");
+    
+    for (int g = 0; g < sizeof(group_sizes) / sizeof(group_sizes[0]); g++) {
+        // one fdatasync per insert is slow, a tenth of the keys is enough to measure it
+        int ops = (group_sizes[g] == 1) ? n / 10 : n;
+        durable_remove_files(dir);
+        durable_t* d = durable_open(dir, order, sizeof(value), group_sizes[g], 0);
+        if (!d) {
+            printf("can not open %s\n", dir);
+            exit(1);
+        }
+        
+        start = get_nano_tick();
+        for (int i = 0; i < ops; i++) {
+            value = keys[i];
+            durable_insert(d, keys[i], &value);
+        }
+        durable_commit(d);
+        uint64_t ns = get_nano_tick() - start;
+        
+        printf("%10d %10d %10.1f %10ld %11.1fx\n", group_sizes[g], ops, (double)ns / ops, d->fsyncs,
+               ((double)ns / ops) / ((double)base / n));
+        
+        if (g == sizeof(group_sizes) / sizeof(group_sizes[0]) - 1) {
+            durable_close(d);
+            
+            start = get_nano_tick();
+            d = durable_open(dir, order, sizeof(value), 4096, 0);
+            printf("recover %d log records: %.2f ms\n", n, (get_nano_tick() - start) / 1e6);
+            
+            start = get_nano_tick();
+            durable_checkpoint(d);
+            printf("checkpoint %d keys: %.2f ms\n", n, (get_nano_tick() - start) / 1e6);
+            durable_close(d);
+            
+            start = get_nano_tick();
+            d = durable_open(dir, order, sizeof(value), 4096, 0);
+            printf("recover from checkpoint: %.2f ms\n", (get_nano_tick() - start) / 1e6);
+        }
+        durable_close(d);
+    }
     
-    // copy leaf and (key,value) to tempory memory of (key,pointer) pairs
-    int* tmp_keys = malloc(DEFAULT_ORDER * sizeof(int));
-    void** tmp_pointers = malloc(DEFAULT_ORDER * sizeof(void*));
-    if (!tmp_keys || !tmp_pointers) {
+    durable_remove_files(dir);
+    free(keys);
+}
+
+//////////// test
+
+// the reference for the tests, the entries of the tree as a sorted array
+typedef struct model {
+    bpt_key_t* keys;
+    int*       values;
+    long       n;
+    long       cap;
+} model_t;
+
+static void model_init(model_t* m, long cap)
+{
+    m->keys = malloc(cap * sizeof(bpt_key_t));
+    m->values = malloc(cap * sizeof(int));
+    if (!m->keys || !m->values) {
         perror("malloc failed\n");
         exit(1);
     }
     
-    record = make_record(value);
-    int insert_index = L->num_keys;
-    int i = 0;
-    int j = 0;
-    for (; i < L->num_keys; i++, j++) {
-        if ((key < L->keys[i]) && (insert_index != L->num_keys)) {
-            insert_index = j++;
+    m->n = 0;
+    m->cap = cap;
+}
+
+static void model_free(model_t* m)
+{
+    free(m->keys);
+    free(m->values);
+}
+
+// the position of the first key >= key
+static long model_lower_bound(model_t* m, bpt_key_t key)
+{
+    long lo = 0;
+    long hi = m->n;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (KEY_LT(m->keys[mid], key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        
-        tmp_keys[j] = L->keys[i];
-        tmp_pointers[j] = L->pointers[i];
     }
     
-    tmp_keys[insert_index] = key;
-    tmp_pointers[insert_index] = record;
-    
-    // set last pointer
-    L_prime->pointers[DEFAULT_ORDER - 1] = L->pointers[DEFAULT_ORDER - 1];
-    L->pointers[DEFAULT_ORDER - 1] = L_prime;
+    return lo;
+}
+
+static int* model_find(model_t* m, bpt_key_t key)
+{
+    long i = model_lower_bound(m, key);
+    return (i < m->n && KEY_EQ(m->keys[i], key)) ? &m->values[i] : NULL;
+}
+
+static bool model_insert(model_t* m, bpt_key_t key, int value)
+{
+    long i = model_lower_bound(m, key);
+    if ((i < m->n && KEY_EQ(m->keys[i], key)) || m->n == m->cap) {
+        return false;
+    }
     
-    // erase pointer in L
-    for (i = 0; i < L->num_keys; i++) {
-        L->pointers[i] = NULL;
-        L->num_keys = 0;
+    memmove(m->keys + i + 1, m->keys + i, (m->n - i) * sizeof(bpt_key_t));
+    memmove(m->values + i + 1, m->values + i, (m->n - i) * sizeof(int));
+    m->keys[i] = key;
+    m->values[i] = value;
+    m->n++;
+    return true;
+}
+
+static bool model_delete(model_t* m, bpt_key_t key)
+{
+    long i = model_lower_bound(m, key);
+    if (i == m->n || !KEY_EQ(m->keys[i], key)) {
+        return false;
     }
     
-    // copy from tmp_keys, tmp_pointers to L and L_prime
-    int split_idx = cut(DEFAULT_ORDER);
-    for (i = 0; i < split_idx; i++) {
-        L->keys[i] = tmp_keys[i];
-        L->pointers[i] = tmp_pointers[i];
+    memmove(m->keys + i, m->keys + i + 1, (m->n - i - 1) * sizeof(bpt_key_t));
+    memmove(m->values + i, m->values + i + 1, (m->n - i - 1) * sizeof(int));
+    m->n--;
+    return true;
+}
+
+typedef struct check_state {
+    bptree_t* t;
+    bool      strict_leaves;    // false after lazy deletes, a leaf may be underfull or empty
+    int       leaf_depth;
+    node_t*   last_leaf;
+    long      keys;
+    long      nodes;
+    long      leaves;
+    int       errors;
+    const char* what;           // the first broken invariant
+} check_state_t;
+
+static void check_fail(check_state_t* cs, const char* what)
+{
+    if (cs->errors++ == 0) {
+        cs->what = what;
     }
-    L->num_keys = split_idx;
+}
+
+// every key of n is in [lo, hi), NULL for no bound
+static void check_node(check_state_t* cs, node_t* n, node_t* parent, int depth, const bpt_key_t* lo,
+                       const bpt_key_t* hi)
+{
+    bptree_t* t = cs->t;
+    cs->nodes++;
     
-    for (i = split_idx, j = 0; i < DEFAULT_ORDER; i++, j++) {
-        L_prime->keys[j] = tmp_keys[i];
-        L_prime->pointers[j] = tmp_pointers[i];
+    if (n->parent != parent) {
+        check_fail(cs, "parent link");
+    }
+    if (n->num_keys > t->order - 1) {
+        check_fail(cs, "node overfull");
+    }
+    int min = min_keys(t, n->is_leaf);
+    if (n == t->root) {
+        min = 1;
+    } else if (n->is_leaf && !cs->strict_leaves) {
+        min = 0;
+    }
+    if (n->num_keys < min) {
+        check_fail(cs, "node underfull");
     }
-    L_prime->num_keys = DEFAULT_ORDER - split_idx;
     
-    int k_prime = L_prime->keys[0];
+    for (int i = 0; i < n->num_keys; i++) {
+        if ((i > 0 && !KEY_LT(n->keys[i - 1], n->keys[i])) || (lo && KEY_LT(n->keys[i], *lo)) ||
+            (hi && !KEY_LT(n->keys[i], *hi))) {
+            check_fail(cs, "key order");
+        }
+    }
     
-    free(tmp_keys);
-    free(tmp_pointers);
+    if (n->is_leaf) {
+        cs->leaves++;
+        cs->keys += n->num_keys;
+        if (cs->leaf_depth < 0) {
+            cs->leaf_depth = depth;
+        } else if (cs->leaf_depth != depth) {
+            check_fail(cs, "leaf depth");
+        }
+        
+        if (cs->last_leaf && cs->last_leaf->sibling != n) {
+            check_fail(cs, "leaf chain");
+        }
+        cs->last_leaf = n;
+        return;
+    }
     
-    return insert_in_parent(root, L, k_prime, L_prime);
+    for (int i = 0; i <= n->num_keys; i++) {
+        node_t* child = n->pointers[i];
+        if (!child) {
+            check_fail(cs, "missing child");
+            continue;
+        }
+        
+        check_node(cs, child, n, depth + 1, i > 0 ? &n->keys[i - 1] : lo, i < n->num_keys ? &n->keys[i] : hi);
+    }
 }
-/////////////
 
-void delete_in_node(node_t* n, int key, void* pointer)
+// the tree invariants and the entries against the model: lookups, both cursor directions,
+// seeks and range copies. return the number of errors, the first one is printed
+static int check_tree(bptree_t* t, model_t* m, bool strict_leaves, const char* step)
 {
-    int i = 0;
+    check_state_t cs = {t, strict_leaves, -1, NULL, 0, 0, 0, 0, NULL};
     
-    // remove key and shift keys
-    while (key != n->keys[i]) {
-        ++i;
+    if (t->root) {
+        check_node(&cs, t->root, NULL, 0, NULL, NULL);
+        if (cs.last_leaf->sibling) {
+            check_fail(&cs, "leaf chain end");
+        }
+    }
+    if (cs.keys != m->n) {
+        check_fail(&cs, "key count");
+    }
+    if (cs.nodes != t->num_nodes || cs.leaves != t->num_leaves) {
+        check_fail(&cs, "node count");
+    }
+    if (cs.errors) {
+        // the cursors follow parent links, do not walk a broken tree
+        printf("%s: %s broken, order %d, %ld keys\n", step, cs.what, t->order, m->n);
+        return cs.errors;
     }
     
-    for (++i; i < n->num_keys; i++) {
-        n->keys[i - 1] = n->keys[i];
+    for (long i = 0; i < m->n; i++) {
+        int* value = find_value(t, m->keys[i]);
+        if (!value || *value != m->values[i]) {
+            check_fail(&cs, "find");
+        }
+        if (!model_find(m, m->keys[i] + 1) && find_value(t, m->keys[i] + 1)) {
+            check_fail(&cs, "find of a missing key");
+        }
     }
- 
-    // remove pointers and shift pointers
-    int num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
-    i = 0;
-    while (pointer != n->pointers[i]) {
-        ++i;
+    
+    bpt_cursor_t c;
+    long i = 0;
+    for (bool ok = cursor_first(&c, t); ok; ok = cursor_next(&c), i++) {
+        if (i >= m->n || !KEY_EQ(cursor_key(&c), m->keys[i]) || *(int*)cursor_value(&c) != m->values[i]) {
+            check_fail(&cs, "forward cursor");
+            break;
+        }
+    }
+    if (i != m->n) {
+        check_fail(&cs, "forward cursor length");
     }
     
-    for (++i; i < num_pointers; i++) {
-        n->pointers[i - 1] = n->pointers[i];
+    i = m->n - 1;
+    for (bool ok = cursor_last(&c, t); ok; ok = cursor_prev(&c), i--) {
+        if (i < 0 || !KEY_EQ(cursor_key(&c), m->keys[i]) || *(int*)cursor_value(&c) != m->values[i]) {
+            check_fail(&cs, "backward cursor");
+            break;
+        }
+    }
+    if (i != -1) {
+        check_fail(&cs, "backward cursor length");
     }
-    n->pointers[i - 1] = NULL;
     
-    n->num_keys--;
+    // seek to every key and between the keys, then step back once and forward twice
+    for (long j = 0; j <= m->n; j++) {
+        bpt_key_t key = j < m->n ? m->keys[j] - (j % 2) : (m->n ? m->keys[m->n - 1] + 1 : 0);
+        long pos = model_lower_bound(m, key);
+        bool ok = cursor_seek(&c, t, key);
+        if (ok != (pos < m->n) || (ok && !KEY_EQ(cursor_key(&c), m->keys[pos]))) {
+            check_fail(&cs, "seek");
+            continue;
+        }
+        if (ok && (cursor_prev(&c) != (pos > 0) || (pos > 0 && !KEY_EQ(cursor_key(&c), m->keys[pos - 1])))) {
+            check_fail(&cs, "prev after seek");
+            continue;
+        }
+        if (ok && pos > 0 && (!cursor_next(&c) || !KEY_EQ(cursor_key(&c), m->keys[pos]) ||
+                              cursor_next(&c) != (pos + 1 < m->n))) {
+            check_fail(&cs, "next after prev");
+        }
+    }
+    
+    // a few ranges, cut by max too
+    bpt_key_t keys[64];
+    int values[64];
+    for (long j = 0; j < m->n; j += 1 + m->n / 16) {
+        bpt_key_t lo = m->keys[j] - 1;
+        bpt_key_t hi = m->keys[j] + 3 * (bpt_key_t)(j % 40);
+        long from = model_lower_bound(m, lo);
+        long expected = model_lower_bound(m, hi) - from;
+        if (expected > 64) {
+            expected = 64;
+        }
+        if (expected < 0) {
+            // hi is before lo in a custom key order
+            expected = 0;
+        }
+        
+        long count = scan_into(t, lo, hi, keys, values, 64);
+        if (count != expected || memcmp(keys, m->keys + from, count * sizeof(bpt_key_t)) != 0 ||
+            memcmp(values, m->values + from, count * sizeof(int)) != 0) {
+            check_fail(&cs, "scan_into");
+        }
+    }
+    
+    if (cs.errors) {
+        printf("%s: %s broken, order %d, %ld keys\n", step, cs.what, t->order, m->n);
+    }
+    return cs.errors;
 }
 
-node_t* adjust_root(node_t* root)
+static int test_orders[] = {3, 4, 5, 6, 7, 8, 16, 0};
+
+// the order of a 256 byte node for the 0 in test_orders
+static int test_order(int k)
 {
-    if (root->num_keys > 0) {
-        return root;
+    return test_orders[k] ? test_orders[k] : bptree_order_for_node_size(256);
+}
+
+#define NUM_TEST_ORDERS (int)(sizeof(test_orders) / sizeof(test_orders[0]))
+
+// random inserts, deletes and lookups against the model, checked as the tree grows and shrinks
+static int run_random_test(int ops, int key_range)
+{
+    int errors = 0;
+    for (int k = 0; k < NUM_TEST_ORDERS && !errors; k++) {
+        bptree_t* t = bptree_create_ex(test_order(k), sizeof(int), k % 2 == 0);
+        model_t m;
+        model_init(&m, key_range);
+        uint64_t seed = 1000 + k;
+        
+        for (int i = 0; i < ops && !errors; i++) {
+            uint64_t r = bench_rand(&seed);
+            bpt_key_t key = (bpt_key_t)((r >> 8) % key_range) - key_range / 2;
+            // grow for the first half and shrink for the second
+            bool add = (r % 8) < ((i < ops / 2) ? 5 : 3);
+            if (add) {
+                int value = i;
+                errors += (insert_value(t, key, &value) == 0) != model_insert(&m, key, value);
+            } else {
+                errors += (delete(t, key) == 0) != model_delete(&m, key);
+            }
+            
+            if ((i + 1) % (ops / 8) == 0) {
+                errors += check_tree(t, &m, true, "random");
+            }
+        }
+        
+        // delete everything left, the tree must end empty
+        while (m.n > 0 && !errors) {
+            bpt_key_t key = m.keys[(m.n * 7) / 13];
+            errors += delete(t, key) != 0 || !model_delete(&m, key);
+        }
+        errors += check_tree(t, &m, true, "random, emptied") + (t->root != NULL);
+        
+        bptree_destroy(t);
+        model_free(&m);
     }
     
-    node_t* new_root = root->pointers[0];
-    new_root->parent = NULL;
-    
-    free(root->keys);
-    free(root->pointers);
-    free(root);
-    return new_root;
+    printf("random ops: %d orders, %d ops, %d keys: %s\n", NUM_TEST_ORDERS, ops, key_range,
+           errors ? "FAILED" : "ok");
+    return errors ? 1 : 0;
 }
 
-int get_neighbor_index(node_t* n)
+// the i-th of n keys in one of the orders that broke the first tree: the shifts in
+// insert_in_leaf and insert_in_node and the split copies dropped keys on inserts that were not
+// ascending, and merging internal nodes left the moved children with their old parent
+static bpt_key_t pattern_key(int pattern, int i, int n)
 {
-    node_t* p = n->parent;
+    switch (pattern) {
+        case 0:
+            return i;
+        case 1:
+            return n - 1 - i;
+        case 2:
+            // both ends toward the middle
+            return (i % 2) ? n - 1 - i / 2 : i / 2;
+        case 3:
+            // the even keys, then the odd ones
+            return (i < (n + 1) / 2) ? 2 * i : 2 * (i - (n + 1) / 2) + 1;
+        default:
+            // a stride that is prime to n, n is small
+            return (bpt_key_t)((i * 7919L) % n);
+    }
+}
+
+#define NUM_PATTERNS 5
+
+// every insert order against every delete order, the tree checked after each single change
+static int run_pattern_test()
+{
+    int sizes[] = {1, 2, 3, 5, 8, 13, 21, 34, 55, 89};
+    int errors = 0;
+    int trees = 0;
+    model_t m;
+    model_init(&m, 100);
     
-    int idx = 0;
-    for (int i = 0; i < p->num_keys + 1; i++) {
-        if (n == p->pointers[i]) {
-            idx = i - 1;
-            break;
+    for (int order = MIN_ORDER; order <= 10 && !errors; order++) {
+        for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && !errors; s++) {
+            int n = sizes[s];
+            for (int p = 0; p < NUM_PATTERNS * NUM_PATTERNS && !errors; p++) {
+                bptree_t* t = bptree_create(order);
+                // the old three malloc layout of bench_lookup on every other tree
+                t->split_layout = (p % 2 == 1);
+                m.n = 0;
+                
+                for (int i = 0; i < n && !errors; i++) {
+                    bpt_key_t key = pattern_key(p / NUM_PATTERNS, i, n);
+                    errors += insert(t, key, i) != 0 || !model_insert(&m, key, i);
+                    errors += check_tree(t, &m, true, "insert pattern");
+                }
+                for (int i = 0; i < n && !errors; i++) {
+                    bpt_key_t key = pattern_key(p % NUM_PATTERNS, i, n);
+                    errors += delete(t, key) != 0 || !model_delete(&m, key);
+                    errors += check_tree(t, &m, true, "delete pattern");
+                }
+                
+                // deleting from the emptied tree finds no root
+                errors += t->root != NULL || t->num_nodes != 0 || delete(t, 0) != -1;
+                bptree_destroy(t);
+                trees++;
+            }
         }
     }
     
-    return idx;
+    printf("insert and delete patterns: %d trees: %s\n", trees, errors ? "FAILED" : "ok");
+    model_free(&m);
+    return errors ? 1 : 0;
 }
 
-node_t* delete_entry(node_t* root, node_t* N, int key, void* pointer);
-
-node_t* coalesce_nodes(node_t* root, node_t* N, int k_prime, node_t* N_prime, int neighbor_idx)
+// bulk load every n up to a few levels of small nodes at several fill factors, so every shape of
+// the two rightmost nodes of every level is balanced or merged by bulk_finish, then update the
+// loaded tree
+static int run_bulk_test()
 {
-    if (neighbor_idx == -1) {
-        // swap the node so than N_prime is always the node before N
-        node_t* tmp = N_prime;
-        N_prime = N;
-        N = tmp;
+    double fills[] = {0.0, 0.5, 0.7, 1.0};
+    int max_n = 400;
+    int errors = 0;
+    int trees = 0;
+    model_t m;
+    model_init(&m, 2 * max_n + 1);
+    bpt_key_t* keys = malloc(max_n * sizeof(bpt_key_t));
+    int* values = malloc(max_n * sizeof(int));
+    if (!keys || !values) {
+        perror("malloc failed\n");
+        exit(1);
     }
     
-    int i = 0;
-    int j = 0;
-    if (!N->is_leaf) {
-        // append K_prime and all keys and pointer in N to N_prime
-        N_prime->keys[N_prime->num_keys] = k_prime;
-        N_prime->num_keys++;
-        
-        for (i = N_prime->num_keys, j = 0; j < N->num_keys; i++, j++) {
-            N_prime->keys[i] = N->keys[j];
-            N_prime->pointers[i] = N->pointers[j];
-            N_prime->num_keys++;
+    for (int k = 0; k < NUM_TEST_ORDERS && !errors; k++) {
+        for (int f = 0; f < sizeof(fills) / sizeof(fills[0]) && !errors; f++) {
+            for (int n = 0; n <= max_n && !errors; n++) {
+                bptree_t* t = bptree_create(test_order(k));
+                m.n = 0;
+                for (int i = 0; i < n; i++) {
+                    keys[i] = 2 * (bpt_key_t)i - n;
+                }
+                // already sorted in the built-in order
+                qsort(keys, n, sizeof(bpt_key_t), cmp_key);
+                for (int i = 0; i < n; i++) {
+                    values[i] = i;
+                    model_insert(&m, keys[i], i);
+                }
+                
+                errors += bulk_load(t, keys, values, n, fills[f]) != 0;
+                errors += check_tree(t, &m, true, "bulk load");
+                
+                // the odd keys go between the loaded ones, then every third key is deleted
+                for (int i = 0; i < n && !errors; i += 2) {
+                    errors += insert(t, keys[i] + 1, -i) != 0 || !model_insert(&m, keys[i] + 1, -i);
+                }
+                for (int i = 0; i < n && !errors; i += 3) {
+                    errors += delete(t, keys[i]) != 0 || !model_delete(&m, keys[i]);
+                }
+                errors += check_tree(t, &m, true, "bulk load, updated");
+                
+                bptree_destroy(t);
+                trees++;
+            }
         }
+    }
+    
+    // unsorted input and a repeated key leave the tree empty
+    bptree_t* t = bptree_create(4);
+    bpt_key_t bad[] = {1, 2, 3, 5, 4};
+    bpt_key_t repeated[] = {1, 2, 3, 3};
+    errors += bulk_load(t, bad, NULL, 5, 1.0) != -1 || t->root != NULL || t->num_nodes != 0;
+    errors += bulk_load(t, repeated, NULL, 4, 1.0) != -1 || t->root != NULL || t->num_nodes != 0;
+    bptree_destroy(t);
+    
+    printf("bulk load: %d trees of up to %d keys: %s\n", trees, max_n, errors ? "FAILED" : "ok");
+    model_free(&m);
+    free(keys);
+    free(values);
+    return errors ? 1 : 0;
+}
+
+// lazy and eager deletes mixed, both cursor directions over the empty leaves they leave, then
+// compact and keep going on the packed tree
+static int run_lazy_test(int ops, int key_range)
+{
+    double fills[] = {1.0, 0.7, 0.5};
+    int errors = 0;
+    long empty_leaves = 0;
+    for (int k = 0; k < NUM_TEST_ORDERS && !errors; k++) {
+        bptree_t* t = bptree_create(test_order(k));
+        model_t m;
+        model_init(&m, key_range);
+        uint64_t seed = 2000 + k;
+        bool strict = true;
         
-        N_prime->pointers[N_prime->num_keys] = N->pointers[N->num_keys];
-    } else {
-        // append all keys and point in N to N_prime
-        for (i = N_prime->num_keys, j = 0; j < N->num_keys; i++, j++) {
-            N_prime->keys[i] = N->keys[j];
-            N_prime->pointers[i] = N->pointers[j];
-            N_prime->num_keys++;
+        for (int round = 0; round < 6 && !errors; round++) {
+            for (int i = 0; i < key_range; i++) {
+                if (model_insert(&m, i, round * key_range + i)) {
+                    errors += insert(t, i, round * key_range + i) != 0;
+                }
+            }
+            errors += check_tree(t, &m, strict, "lazy, refilled");
+            
+            // runs of deletes empty whole leaves, the mode flips every 512 ops
+            for (int i = 0; i < ops && !errors; i++) {
+                bool lazy = (i / 512 + round) % 2 == 0;
+                bptree_set_lazy_delete(t, lazy);
+                strict = strict && !lazy;
+                
+                uint64_t r = bench_rand(&seed);
+                bpt_key_t key = (bpt_key_t)((r >> 8) % key_range);
+                if (r % 4 == 0) {
+                    key = (key & ~63) + i % 64;
+                }
+                if (r % 16 == 1) {
+                    errors += (insert(t, key, i) == 0) != model_insert(&m, key, i);
+                } else {
+                    errors += (delete(t, key) == 0) != model_delete(&m, key);
+                }
+            }
+            errors += check_tree(t, &m, strict, "lazy deletes");
+            
+            bptree_stats_t s;
+            bptree_stats(t, &s);
+            empty_leaves += s.empty_leaves;
+            
+            compact(t, fills[round % 3]);
+            strict = true;
+            errors += t->lazy_deletes != 0;
+            errors += check_tree(t, &m, true, "compact");
         }
         
-        N_prime->pointers[DEFAULT_ORDER - 1] = N->pointers[DEFAULT_ORDER - 1];
+        bptree_destroy(t);
+        model_free(&m);
     }
     
-    root = delete_entry(root, N->parent, k_prime, N);
-    free_node(N);
-    return root;
+    // the cursors must have walked over empty leaves
+    errors += empty_leaves == 0;
+    printf("lazy delete and compact: %d orders, %d keys, %ld empty leaves: %s\n", NUM_TEST_ORDERS, key_range,
+           empty_leaves, errors ? "FAILED" : "ok");
+    return errors ? 1 : 0;
 }
 
-// borrow an entry for N_prime
-node_t* redistribute_nodes(node_t* root, node_t* N, int k_prime, node_t* N_prime, int neighbor_idx)
+// batches with repeated keys, keys already in the tree and missing keys, against one insert
+// or lookup at a time in input order
+static int run_batch_test(int key_range)
 {
-    int m = 0;
-    if (neighbor_idx != -1) {
-        // N_prime is a predecessor of N
-        if (!N->is_leaf) {
-            m = N_prime->num_keys;
-            
-            // shift all N (key,pointers) right 1 position
-            N->pointers[N->num_keys + 1] = N->pointers[N->num_keys];
-            for (int i = N->num_keys; i > 0; i--) {
-                N->keys[i] = N->keys[i - 1];
-                N->pointers[i] = N->pointers[i - 1];
+    long sizes[] = {0, 1, 2, 7, 63, 64, 65, 500, 4000};
+    int errors = 0;
+    for (int k = 0; k < NUM_TEST_ORDERS && !errors; k++) {
+        bptree_t* t = bptree_create(test_order(k));
+        model_t m;
+        model_init(&m, key_range);
+        uint64_t seed = 3000 + k;
+        int next_value = 0;
+        
+        for (int s = 0; s < 3 * sizeof(sizes) / sizeof(sizes[0]) && !errors; s++) {
+            long n = sizes[s % (sizeof(sizes) / sizeof(sizes[0]))];
+            bpt_key_t* keys = malloc((n + 1) * sizeof(bpt_key_t));
+            int* values = malloc((n + 1) * sizeof(int));
+            void** found = malloc((n + 1) * sizeof(void*));
+            if (!keys || !values || !found) {
+                perror("malloc failed\n");
+                exit(1);
             }
             
-            N->keys[0] = N_prime->keys[m - 1];
-            N->pointers[0] = N_prime->pointers[m];
-            
-            node_t* tmp = N->pointers[0];
-            tmp->parent = N;
+            // a narrow window of keys repeats keys within the batch
+            int window = 1 + (int)(bench_rand(&seed) % key_range);
+            for (long i = 0; i < n; i++) {
+                keys[i] = (bpt_key_t)(bench_rand(&seed) % window) - key_range / 2;
+                values[i] = next_value++;
+            }
             
-            N->parent->keys[neighbor_idx] = N->keys[0];
-        } else {
-            m = N_prime->num_keys - 1;
+            // find before the insert sees the missing ones, the empty tree takes the key by key path
+            long ret = find_batch(t, keys, n, found);
+            long expected = 0;
+            for (long i = 0; i < n; i++) {
+                int* value = model_find(&m, keys[i]);
+                expected += value != NULL;
+                errors += value ? (!found[i] || *(int*)found[i] != *value) : found[i] != NULL;
+            }
+            errors += ret != expected;
             
-            for (int i = N->num_keys; i > 0; i--) {
-                N->keys[i] = N->keys[i - 1];
-                N->pointers[i] = N->pointers[i - 1];
+            long inserted = 0;
+            for (long i = 0; i < n; i++) {
+                inserted += model_insert(&m, keys[i], values[i]);
             }
+            errors += insert_batch(t, keys, values, n) != inserted;
+            errors += check_tree(t, &m, true, "insert_batch");
             
-            N->keys[0] = N_prime->keys[m];
-            N->pointers[0] = N_prime->pointers[m];
+            errors += find_batch(t, keys, n, found) != n;
+            for (long i = 0; i < n; i++) {
+                int* value = model_find(&m, keys[i]);
+                errors += !found[i] || *(int*)found[i] != *value;
+            }
             
-            N->parent->keys[neighbor_idx] = N->keys[0];
-        }
-    } else {
-        // N_prime is a successor of N
-        if (!N->is_leaf) {
-            N->keys[N->num_keys] = k_prime;
-            N->pointers[N->num_keys + 1] = N_prime->pointers[0];
-            N->parent->keys[0] = N_prime->keys[0];
+            // thin the tree out for the next batch
+            for (long i = 0; i < n; i += 3) {
+                errors += (delete(t, keys[i]) == 0) != model_delete(&m, keys[i]);
+            }
             
-            node_t* tmp = N->pointers[N->num_keys + 1];
-            tmp->parent = N;
-        } else {
-            N->keys[N->num_keys] = N_prime->keys[0];
-            N->pointers[N->num_keys] = N_prime->pointers[0];
-            N->parent->keys[0] = N_prime->keys[1];
-        }
-        
-        int i = 0;
-        for ( ;i < N_prime->num_keys - 1; i++) {
-            N_prime->keys[i] = N_prime->keys[i + 1];
-            N_prime->pointers[i] = N_prime->pointers[i + 1];
+            free(keys);
+            free(values);
+            free(found);
         }
         
-        if (!N_prime->is_leaf) {
-            N_prime->pointers[i] = N_prime->pointers[i + 1];
-        }
+        errors += check_tree(t, &m, true, "batch");
+        bptree_destroy(t);
+        model_free(&m);
     }
     
-    N->num_keys++;
-    N_prime->num_keys--;
-    
-    return root;
+    printf("batch: %d orders: %s\n", NUM_TEST_ORDERS, errors ? "FAILED" : "ok");
+    return errors ? 1 : 0;
 }
 
-node_t* delete_entry(node_t* root, node_t* N, int key, void* pointer)
+// for test
+int main(int argc, char* argv[])
 {
-    delete_in_node(N, key, pointer);
-    
-    // case: only 1 pointer in root
-    if (N == root) {
-        return adjust_root(root);
+    if (argc >= 2 && strcmp(argv[1], "test") == 0) {
+        // usage: bptree test [num_ops], every operation checked against a sorted array
+        int ops = argc >= 3 ? atoi(argv[2]) : 200000;
+        int failed = 0;
+        failed |= run_pattern_test();
+        failed |= run_random_test(ops, ops / 8 + 16);
+        failed |= run_bulk_test();
+        failed |= run_lazy_test(ops / 40 + 64, ops / 40 + 64);
+        failed |= run_batch_test(ops / 20 + 16);
+        return failed;
     }
+    
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: bptree bench [num_keys ...]
+        if (argc == 2) {
+            bench_lookup(1000000);
+            bench_lookup(10000000);
+        }
+        for (int i = 2; i < argc; i++) {
+            bench_lookup(atoi(argv[i]));
+        }
         
-    int min_key = N->is_leaf ? cut(DEFAULT_ORDER - 1) : cut(DEFAULT_ORDER) - 1;
+        return 0;
+    }
     
-    // case: enough keys in the node
-    if (N->num_keys >= min_key) {
-        return root;
+    if (argc >= 2 && strcmp(argv[1], "bench-search") == 0) {
+        // usage: bptree bench-search [num_keys]
+        bench_node_search();
+        bench_tree_search(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
+#ifdef BPT_KEY_CMP
+    // these two generate their sorted input and ranges in the integer order
+    if (argc >= 2 && (strcmp(argv[1], "bench-bulk") == 0 || strcmp(argv[1], "bench-scan") == 0)) {
+        printf("%s needs the built-in key order\n", argv[1]);
+        return 1;
+    }
+#endif
+
+    if (argc >= 2 && strcmp(argv[1], "bench-bulk") == 0) {
+        // usage: bptree bench-bulk [num_keys]
+        bench_bulk_load(argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
     }
     
-    // case: not enough keys in the node
-    int neighbor_idx = get_neighbor_index(N);
-    node_t* N_prime = (neighbor_idx == -1) ? N->parent->pointers[1] : N->parent->pointers[neighbor_idx];
-    int k_prime = (neighbor_idx == -1) ? N->parent->keys[0] : N->parent->keys[neighbor_idx];
+    if (argc >= 2 && strcmp(argv[1], "bench-values") == 0) {
+        // usage: bptree bench-values [num_keys]
+        bench_values(argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
     
-    int capacity = N->is_leaf ? DEFAULT_ORDER : (DEFAULT_ORDER - 1);
+    if (argc >= 2 && strcmp(argv[1], "bench-alloc") == 0) {
+        // usage: bptree bench-alloc [num_keys]
+        bench_alloc(argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
     
-    if (N->num_keys + N_prime->num_keys < capacity) {
-        return coalesce_nodes(root, N, k_prime, N_prime, neighbor_idx);
-    } else {
-        return redistribute_nodes(root, N, k_prime, N_prime, neighbor_idx);
+    if (argc >= 2 && strcmp(argv[1], "bench-batch") == 0) {
+        // usage: bptree bench-batch [num_keys]
+        bench_batch(argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
     }
-}
-
-node_t* delete(node_t* root, int key)
-{
-    node_t* leaf = find_leaf(root, key);
-    record_t* record = find(root, key);
     
-    if (leaf && record) {
-        root = delete_entry(root, leaf, key, record);
-        free(record);
+    if (argc >= 2 && strcmp(argv[1], "bench-scan") == 0) {
+        // usage: bptree bench-scan [num_keys]
+        bench_scan(argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "bench-delete") == 0) {
+        // usage: bptree bench-delete [num_keys]
+        bench_delete(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "stats") == 0) {
+        // usage: bptree stats [num_keys] [order], random inserts then every third key deleted,
+        // build with -DBPT_COUNTERS=1 for the counters
+        int n = argc >= 3 ? atoi(argv[2]) : 1000000;
+        bptree_t* t = bptree_create(argc >= 4 ? atoi(argv[3]) : bptree_order_for_node_size(256));
+        if (!t) {
+            printf("order must be at least %d\n", MIN_ORDER);
+            return 1;
+        }
+        
+        bpt_key_t* keys = make_shuffled_keys(n);
+        for (int i = 0; i < n; i++) {
+            insert(t, keys[i], keys[i]);
+        }
+        for (int i = 0; i < n; i += 3) {
+            delete(t, keys[i]);
+        }
+        for (int i = 0; i < n; i++) {
+            find_value(t, keys[i]);
+        }
+        
+        bptree_stats_json(t, stdout);
+        bptree_destroy(t);
+        free(keys);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "wal-test") == 0) {
+        // usage: bptree wal-test [dir]
+        wal_test(argc >= 3 ? argv[2] : "/tmp/bptree_wal_test");
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "bench-wal") == 0) {
+        // usage: bptree bench-wal [num_keys] [dir]
+        bench_wal(argc >= 3 ? atoi(argv[2]) : 200000, argc >= 4 ? argv[3] : "/tmp/bptree_wal_bench");
+        return 0;
     }
     
-    return root;
-}
-
-// for test
-int main(int argc, char* argv[])
-{
     int max_num = 10;
     if (argc >= 2) {
         max_num = atoi(argv[1]);
     }
     
-    node_t* root = NULL;
+    int order = DEFAULT_ORDER;
+    if (argc >= 4) {
+        order = atoi(argv[3]);
+    }
+    
+    bptree_t* t = bptree_create(order);
+    if (!t) {
+        printf("order must be at least %d\n", MIN_ORDER);
+        return 1;
+    }
+    
     for (int i = 1; i < max_num; i++) {
-        root = insert(root, i, i);
+        insert(t, i, i);
     }
-    print_tree(root);
+    print_tree(t);
     
     printf("---------\n\n");
     
@@ -677,12 +4617,11 @@ int main(int argc, char* argv[])
         min_num = atoi(argv[2]);
     }
     for (int i = 1; i < min_num; i++) {
-        root = delete(root, i);
+        delete(t, i);
     }
     
-    print_tree(root);
+    print_tree(t);
     
+    bptree_destroy(t);
     return 0;
 }
-
-
@@ -0,0 +1,1025 @@
+//
+//  bptree_cow.c
+//  bptree
+//
+//  Created by jianqing.du on 16-3-20.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ copy-on-write B+ Tree with O(1) snapshots, shadowing with reference counts as described in
+ <<B-trees, Shadowing, and Clones>> (Rodeh, ACM TOS 2008)
+
+ a node counts the parents, trees and snapshots that point to it. a snapshot only takes one
+ more reference on the root, so it costs O(1) and sees the tree as it was. a writer walks down
+ from the root and copies every node on its path that is shared (more than one reference):
+ the copy takes a reference on each child, the old node drops the one of the slot that now
+ points to the copy. a node with one reference under a node the writer owns is not shared and
+ is changed in place, so a tree without snapshots copies nothing.
+
+ nodes have no parent pointer and leaves have no sibling link: both would make a copy spread to
+ the neighbors. range scans walk a cursor with the path from the root instead.
+
+ there is one writer. snapshots are taken by the writer, a snapshot can be read and released
+ by any thread, the last release frees the nodes only it still holds
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEFAULT_ORDER   64
+#define MIN_ORDER       4       // a full internal node split on the way down needs 3 keys
+#define CACHE_LINE_SIZE 64
+#define MAX_HEIGHT      64
+
+typedef struct node {
+    atomic_int refs;
+    int     num_keys;
+    bool    is_leaf;
+    int*    keys;
+    struct node** children;     // internal node: num_keys + 1 children
+    int*    values;             // leaf: num_keys values, share the space of children
+} node_t;
+
+typedef struct cow_tree {
+    node_t* root;
+    int     order;
+    size_t  node_size;
+    size_t  children_offset;
+    long    num_keys;
+    atomic_long num_nodes;      // nodes of the tree and of all snapshots
+    long    copies;             // shared nodes copied by writers
+} cow_tree_t;
+
+typedef struct cow_snapshot {
+    cow_tree_t* t;
+    node_t*     root;
+    long        num_keys;
+} cow_snapshot_t;
+
+// a position in a snapshot, the path from the root to the current leaf
+typedef struct cow_cursor {
+    node_t* path[MAX_HEIGHT];
+    int     idx[MAX_HEIGHT];    // child index, the key index at the leaf
+    int     depth;              // level of the leaf, -1 when past the end
+} cow_cursor_t;
+
+// api
+cow_tree_t* cow_create(int order);
+void cow_destroy(cow_tree_t* t);
+bool cow_lookup(cow_tree_t* t, int key, int* value);
+int cow_insert(cow_tree_t* t, int key, int value);
+int cow_delete(cow_tree_t* t, int key);
+cow_snapshot_t* cow_snapshot(cow_tree_t* t);
+void cow_release(cow_snapshot_t* s);
+bool cow_snapshot_lookup(cow_snapshot_t* s, int key, int* value);
+bool cow_cursor_seek(cow_cursor_t* c, cow_snapshot_t* s, int key);
+bool cow_cursor_next(cow_cursor_t* c);
+bool cow_cursor_valid(cow_cursor_t* c);
+int cow_cursor_key(cow_cursor_t* c);
+int cow_cursor_value(cow_cursor_t* c);
+typedef bool (*cow_scan_fn)(void* ctx, int key, int value);
+long cow_scan(cow_snapshot_t* s, int lo, int hi, cow_scan_fn fn, void* ctx);
+
+////////
+
+static size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+static node_t* make_node(cow_tree_t* t, bool is_leaf)
+{
+    char* block = aligned_alloc(CACHE_LINE_SIZE, t->node_size);
+    if (block == NULL) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    node_t* n = (node_t*)block;
+    atomic_init(&n->refs, 1);
+    n->num_keys = 0;
+    n->is_leaf = is_leaf;
+    n->keys = (int*)(block + sizeof(node_t));
+    n->children = (node_t**)(block + t->children_offset);
+    n->values = (int*)n->children;
+    atomic_fetch_add_explicit(&t->num_nodes, 1, memory_order_relaxed);
+    return n;
+}
+
+// free a node whose children were moved to another node
+static void free_node(cow_tree_t* t, node_t* n)
+{
+    atomic_fetch_sub_explicit(&t->num_nodes, 1, memory_order_relaxed);
+    free(n);
+}
+
+// drop one reference, the last one frees the node and drops its references on the children
+static void node_release(cow_tree_t* t, node_t* n)
+{
+    if (atomic_fetch_sub_explicit(&n->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    
+    if (!n->is_leaf) {
+        for (int i = 0; i <= n->num_keys; i++) {
+            node_release(t, n->children[i]);
+        }
+    }
+    free_node(t, n);
+}
+
+cow_tree_t* cow_create(int order)
+{
+    if (order < MIN_ORDER) {
+        return NULL;
+    }
+    
+    cow_tree_t* t = malloc(sizeof(cow_tree_t));
+    if (!t) {
+        return NULL;
+    }
+    
+    t->root = NULL;
+    t->order = order;
+    t->children_offset = round_up(sizeof(node_t) + order * sizeof(int), sizeof(void*));
+    t->node_size = round_up(t->children_offset + order * sizeof(void*), CACHE_LINE_SIZE);
+    t->num_keys = 0;
+    t->copies = 0;
+    atomic_init(&t->num_nodes, 0);
+    return t;
+}
+
+// release all snapshots first
+void cow_destroy(cow_tree_t* t)
+{
+    if (t->root) {
+        node_release(t, t->root);
+    }
+    free(t);
+}
+
+//////////// node operations
+
+// the number of keys <= key, the child index in an internal node
+static int node_search(const int* keys, int n, int key)
+{
+    if (n == 0) {
+        return 0;
+    }
+    
+    const int* base = keys;
+    int len = n;
+    while (len > 1) {
+        int half = len / 2;
+        base += (base[half - 1] <= key) * half;
+        len -= half;
+    }
+    
+    return (int)(base - keys) + (*base <= key);
+}
+
+// the number of keys < key, the first key >= key in a leaf
+static int lower_bound(const int* keys, int n, int key)
+{
+    int lo = 0;
+    int hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo;
+}
+
+static bool is_full(cow_tree_t* t, node_t* n)
+{
+    return n->num_keys == t->order - 1;
+}
+
+// the smaller half of a split on the way down, the separator of an internal node goes up
+static int min_keys(cow_tree_t* t, node_t* n)
+{
+    return n->is_leaf ? (t->order - 1) / 2 : (t->order - 2) / 2;
+}
+
+// a private copy of a shared node, the copy is one more parent of every child
+static node_t* copy_node(cow_tree_t* t, node_t* n)
+{
+    node_t* c = make_node(t, n->is_leaf);
+    c->num_keys = n->num_keys;
+    memcpy(c->keys, n->keys, n->num_keys * sizeof(int));
+    if (n->is_leaf) {
+        memcpy(c->values, n->values, n->num_keys * sizeof(int));
+    } else {
+        memcpy(c->children, n->children, (n->num_keys + 1) * sizeof(node_t*));
+        for (int i = 0; i <= n->num_keys; i++) {
+            atomic_fetch_add_explicit(&c->children[i]->refs, 1, memory_order_relaxed);
+        }
+    }
+    
+    t->copies++;
+    return c;
+}
+
+// make the node in *slot writable, slot is the root or a child slot of a node the writer owns.
+// a node with a single reference is only reachable through slot
+static node_t* own(cow_tree_t* t, node_t** slot)
+{
+    node_t* n = *slot;
+    if (atomic_load_explicit(&n->refs, memory_order_acquire) == 1) {
+        return n;
+    }
+    
+    node_t* c = copy_node(t, n);
+    *slot = c;
+    node_release(t, n);
+    return c;
+}
+
+// split the full child i of p, both are owned, the separator goes into p
+static void split_child(cow_tree_t* t, node_t* p, int i)
+{
+    node_t* n = p->children[i];
+    node_t* right = make_node(t, n->is_leaf);
+    int k = n->num_keys;
+    int mid = k / 2;
+    int sep = 0;
+    
+    if (n->is_leaf) {
+        right->num_keys = k - mid;
+        memcpy(right->keys, n->keys + mid, right->num_keys * sizeof(int));
+        memcpy(right->values, n->values + mid, right->num_keys * sizeof(int));
+        sep = right->keys[0];
+    } else {
+        // keys[mid] moves up, the children move with their references
+        right->num_keys = k - mid - 1;
+        memcpy(right->keys, n->keys + mid + 1, right->num_keys * sizeof(int));
+        memcpy(right->children, n->children + mid + 1, (right->num_keys + 1) * sizeof(node_t*));
+        sep = n->keys[mid];
+    }
+    n->num_keys = mid;
+    
+    memmove(p->keys + i + 1, p->keys + i, (p->num_keys - i) * sizeof(int));
+    memmove(p->children + i + 2, p->children + i + 1, (p->num_keys - i) * sizeof(node_t*));
+    p->keys[i] = sep;
+    p->children[i + 1] = right;
+    p->num_keys++;
+}
+
+// remove key i and child i + 1 of an owned internal node
+static void remove_from_node(node_t* p, int i)
+{
+    memmove(p->keys + i, p->keys + i + 1, (p->num_keys - i - 1) * sizeof(int));
+    memmove(p->children + i + 1, p->children + i + 2, (p->num_keys - i - 1) * sizeof(node_t*));
+    p->num_keys--;
+}
+
+// children li and li + 1 of p are owned and one is underfull, merge them or move one entry
+static void rebalance(cow_tree_t* t, node_t* p, int li)
+{
+    node_t* l = p->children[li];
+    node_t* r = p->children[li + 1];
+    int a = l->num_keys;
+    int b = r->num_keys;
+    
+    if (l->is_leaf) {
+        if (a + b <= t->order - 1) {
+            memcpy(l->keys + a, r->keys, b * sizeof(int));
+            memcpy(l->values + a, r->values, b * sizeof(int));
+            l->num_keys = a + b;
+            remove_from_node(p, li);
+            free_node(t, r);
+        } else if (a < b) {
+            l->keys[a] = r->keys[0];
+            l->values[a] = r->values[0];
+            memmove(r->keys, r->keys + 1, (b - 1) * sizeof(int));
+            memmove(r->values, r->values + 1, (b - 1) * sizeof(int));
+            l->num_keys++;
+            r->num_keys--;
+            p->keys[li] = r->keys[0];
+        } else {
+            memmove(r->keys + 1, r->keys, b * sizeof(int));
+            memmove(r->values + 1, r->values, b * sizeof(int));
+            r->keys[0] = l->keys[a - 1];
+            r->values[0] = l->values[a - 1];
+            l->num_keys--;
+            r->num_keys++;
+            p->keys[li] = r->keys[0];
+        }
+        return;
+    }
+    
+    if (a + b + 1 <= t->order - 1) {
+        // the separator comes down between the keys of l and r
+        l->keys[a] = p->keys[li];
+        memcpy(l->keys + a + 1, r->keys, b * sizeof(int));
+        memcpy(l->children + a + 1, r->children, (b + 1) * sizeof(node_t*));
+        l->num_keys = a + b + 1;
+        remove_from_node(p, li);
+        free_node(t, r);
+    } else if (a < b) {
+        // rotate the first child of r through the separator
+        l->keys[a] = p->keys[li];
+        l->children[a + 1] = r->children[0];
+        l->num_keys++;
+        p->keys[li] = r->keys[0];
+        memmove(r->keys, r->keys + 1, (b - 1) * sizeof(int));
+        memmove(r->children, r->children + 1, b * sizeof(node_t*));
+        r->num_keys--;
+    } else {
+        memmove(r->keys + 1, r->keys, b * sizeof(int));
+        memmove(r->children + 1, r->children, (b + 1) * sizeof(node_t*));
+        r->keys[0] = p->keys[li];
+        r->children[0] = l->children[a];
+        r->num_keys++;
+        p->keys[li] = l->keys[a - 1];
+        l->num_keys--;
+    }
+}
+
+//////////// operations
+
+static bool lookup_in(node_t* n, int key, int* value)
+{
+    if (!n) {
+        return false;
+    }
+    
+    while (!n->is_leaf) {
+        n = n->children[node_search(n->keys, n->num_keys, key)];
+    }
+    
+    int i = node_search(n->keys, n->num_keys, key);
+    if (i == 0 || n->keys[i - 1] != key) {
+        return false;
+    }
+    
+    if (value) {
+        *value = n->values[i - 1];
+    }
+    return true;
+}
+
+// the current tree, for the writer thread
+bool cow_lookup(cow_tree_t* t, int key, int* value)
+{
+    return lookup_in(t->root, key, value);
+}
+
+// return 0 if the key is inserted, -1 if it exists. full nodes are split on the way down, so
+// the path is copied and split in one pass. an existing key is found first without copying,
+// like in cow_delete, so it leaves shared nodes alone
+int cow_insert(cow_tree_t* t, int key, int value)
+{
+    if (lookup_in(t->root, key, NULL)) {
+        return -1;
+    }
+    
+    if (!t->root) {
+        t->root = make_node(t, true);
+    }
+    
+    node_t* n = own(t, &t->root);
+    if (is_full(t, n)) {
+        // the reference of the tree on the old root moves to the new root
+        node_t* root = make_node(t, false);
+        root->children[0] = n;
+        t->root = root;
+        split_child(t, root, 0);
+        n = root;
+    }
+    
+    while (!n->is_leaf) {
+        int i = node_search(n->keys, n->num_keys, key);
+        node_t* c = own(t, &n->children[i]);
+        if (is_full(t, c)) {
+            split_child(t, n, i);
+            if (key >= n->keys[i]) {
+                c = n->children[i + 1];
+            }
+        }
+        n = c;
+    }
+    
+    int idx = node_search(n->keys, n->num_keys, key);
+    if (idx > 0 && n->keys[idx - 1] == key) {
+        return -1;
+    }
+    
+    memmove(n->keys + idx + 1, n->keys + idx, (n->num_keys - idx) * sizeof(int));
+    memmove(n->values + idx + 1, n->values + idx, (n->num_keys - idx) * sizeof(int));
+    n->keys[idx] = key;
+    n->values[idx] = value;
+    n->num_keys++;
+    t->num_keys++;
+    return 0;
+}
+
+// return 0 if the key is deleted, -1 if not found. the path is found first without copying,
+// so a miss leaves shared nodes alone, then copied top down and rebalanced bottom up
+int cow_delete(cow_tree_t* t, int key)
+{
+    node_t* path[MAX_HEIGHT];
+    int idx[MAX_HEIGHT];
+    int depth = 0;
+    
+    node_t* n = t->root;
+    if (!n) {
+        return -1;
+    }
+    
+    while (!n->is_leaf) {
+        idx[depth] = node_search(n->keys, n->num_keys, key);
+        n = n->children[idx[depth]];
+        depth++;
+    }
+    
+    int i = node_search(n->keys, n->num_keys, key);
+    if (i == 0 || n->keys[i - 1] != key) {
+        return -1;
+    }
+    idx[depth] = i - 1;
+    
+    path[0] = own(t, &t->root);
+    for (int d = 0; d < depth; d++) {
+        path[d + 1] = own(t, &path[d]->children[idx[d]]);
+    }
+    
+    n = path[depth];
+    memmove(n->keys + idx[depth], n->keys + idx[depth] + 1, (n->num_keys - idx[depth] - 1) * sizeof(int));
+    memmove(n->values + idx[depth], n->values + idx[depth] + 1, (n->num_keys - idx[depth] - 1) * sizeof(int));
+    n->num_keys--;
+    t->num_keys--;
+    
+    for (int d = depth; d > 0 && path[d]->num_keys < min_keys(t, path[d]); d--) {
+        node_t* p = path[d - 1];
+        int li = idx[d - 1] > 0 ? idx[d - 1] - 1 : 0;
+        own(t, &p->children[li]);
+        own(t, &p->children[li + 1]);
+        rebalance(t, p, li);
+    }
+    
+    node_t* root = t->root;
+    if (root->num_keys == 0) {
+        // the owned root goes, its only child keeps the reference
+        t->root = root->is_leaf ? NULL : root->children[0];
+        free_node(t, root);
+    }
+    
+    return 0;
+}
+
+//////////// snapshots
+
+// O(1), called by the writer, the snapshot stays valid until it is released
+cow_snapshot_t* cow_snapshot(cow_tree_t* t)
+{
+    cow_snapshot_t* s = malloc(sizeof(cow_snapshot_t));
+    if (!s) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    s->t = t;
+    s->root = t->root;
+    s->num_keys = t->num_keys;
+    if (s->root) {
+        atomic_fetch_add_explicit(&s->root->refs, 1, memory_order_relaxed);
+    }
+    
+    return s;
+}
+
+// may be called from any thread
+void cow_release(cow_snapshot_t* s)
+{
+    if (s->root) {
+        node_release(s->t, s->root);
+    }
+    free(s);
+}
+
+bool cow_snapshot_lookup(cow_snapshot_t* s, int key, int* value)
+{
+    return lookup_in(s->root, key, value);
+}
+
+// go down the leftmost path of the child at depth d to the first key
+static bool cursor_descend(cow_cursor_t* c, int d)
+{
+    node_t* n = c->path[d];
+    while (!n->is_leaf) {
+        n = n->children[c->idx[d]];
+        c->path[++d] = n;
+        c->idx[d] = 0;
+    }
+    
+    c->depth = d;
+    return true;
+}
+
+// position on the first key >= key
+bool cow_cursor_seek(cow_cursor_t* c, cow_snapshot_t* s, int key)
+{
+    node_t* n = s->root;
+    int d = 0;
+    c->depth = -1;
+    if (!n) {
+        return false;
+    }
+    
+    while (!n->is_leaf) {
+        c->path[d] = n;
+        c->idx[d] = node_search(n->keys, n->num_keys, key);
+        n = n->children[c->idx[d]];
+        d++;
+    }
+    c->path[d] = n;
+    c->idx[d] = lower_bound(n->keys, n->num_keys, key);
+    c->depth = d;
+    
+    if (c->idx[d] == n->num_keys) {
+        c->idx[d]--;
+        return cow_cursor_next(c);
+    }
+    
+    return true;
+}
+
+bool cow_cursor_next(cow_cursor_t* c)
+{
+    int d = c->depth;
+    if (d < 0) {
+        return false;
+    }
+    
+    if (++c->idx[d] < c->path[d]->num_keys) {
+        return true;
+    }
+    
+    // up to the first ancestor with a child to the right
+    for (d--; d >= 0 && c->idx[d] == c->path[d]->num_keys; d--) {
+    }
+    
+    if (d < 0) {
+        c->depth = -1;
+        return false;
+    }
+    
+    c->idx[d]++;
+    return cursor_descend(c, d);
+}
+
+bool cow_cursor_valid(cow_cursor_t* c)
+{
+    return c->depth >= 0;
+}
+
+int cow_cursor_key(cow_cursor_t* c)
+{
+    return c->path[c->depth]->keys[c->idx[c->depth]];
+}
+
+int cow_cursor_value(cow_cursor_t* c)
+{
+    return c->path[c->depth]->values[c->idx[c->depth]];
+}
+
+// call fn for every key in [lo, hi) of the snapshot in order until it returns false,
+// return the number of calls
+long cow_scan(cow_snapshot_t* s, int lo, int hi, cow_scan_fn fn, void* ctx)
+{
+    cow_cursor_t c;
+    long count = 0;
+    
+    if (lo >= hi || !cow_cursor_seek(&c, s, lo)) {
+        return 0;
+    }
+    
+    // run through the leaf directly, the cursor only moves between leaves
+    while (c.depth >= 0) {
+        node_t* l = c.path[c.depth];
+        int i = c.idx[c.depth];
+        for ( ; i < l->num_keys; i++) {
+            if (l->keys[i] >= hi) {
+                return count;
+            }
+            
+            count++;
+            if (!fn(ctx, l->keys[i], l->values[i])) {
+                return count;
+            }
+        }
+        
+        c.idx[c.depth] = l->num_keys - 1;
+        cow_cursor_next(&c);
+    }
+    
+    return count;
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// keys sorted, separators bound the subtrees, all leaves at one depth, nodes not underfull,
+// return the number of keys and count the nodes
+static long check_node(cow_tree_t* t, node_t* n, long lo, long hi, int depth, int* leaf_depth, long* nodes)
+{
+    (*nodes)++;
+    if (depth > 0 && n->num_keys < min_keys(t, n)) {
+        printf("underfull node at depth %d\n", depth);
+        exit(1);
+    }
+    
+    for (int i = 0; i < n->num_keys; i++) {
+        if (n->keys[i] < lo || n->keys[i] >= hi || (i > 0 && n->keys[i - 1] >= n->keys[i])) {
+            printf("key order broken at depth %d\n", depth);
+            exit(1);
+        }
+    }
+    
+    if (n->is_leaf) {
+        if (*leaf_depth == -1) {
+            *leaf_depth = depth;
+        } else if (*leaf_depth != depth) {
+            printf("leaves at different depth\n");
+            exit(1);
+        }
+        return n->num_keys;
+    }
+    
+    long count = 0;
+    for (int i = 0; i <= n->num_keys; i++) {
+        long clo = i > 0 ? n->keys[i - 1] : lo;
+        long chi = i < n->num_keys ? n->keys[i] : hi;
+        count += check_node(t, n->children[i], clo, chi, depth + 1, leaf_depth, nodes);
+    }
+    
+    return count;
+}
+
+static long check_tree(cow_tree_t* t, node_t* root, long* nodes)
+{
+    int leaf_depth = -1;
+    *nodes = 0;
+    return root ? check_node(t, root, INT32_MIN, (long)INT32_MAX + 1, 0, &leaf_depth, nodes) : 0;
+}
+
+#define TEST_KEYS       2000
+#define TEST_SNAPSHOTS  8
+
+typedef struct test_snapshot {
+    cow_snapshot_t* s;
+    int*            values;     // the value of every key when the snapshot was taken, -1 absent
+} test_snapshot_t;
+
+// every key of the snapshot must still read as it was, through lookups and a full scan
+static bool verify_snapshot(test_snapshot_t* ts)
+{
+    cow_cursor_t c;
+    int prev = -1;
+    for (bool ok = cow_cursor_seek(&c, ts->s, 0); ok; ok = cow_cursor_next(&c)) {
+        for (int k = prev + 1; k < cow_cursor_key(&c); k++) {
+            if (ts->values[k] != -1) {
+                return false;
+            }
+        }
+        
+        prev = cow_cursor_key(&c);
+        if (ts->values[prev] != cow_cursor_value(&c)) {
+            return false;
+        }
+    }
+    for (int k = prev + 1; k < TEST_KEYS; k++) {
+        if (ts->values[k] != -1) {
+            return false;
+        }
+    }
+    
+    for (int k = 0; k < TEST_KEYS; k++) {
+        int value = 0;
+        bool found = cow_snapshot_lookup(ts->s, k, &value);
+        if (found != (ts->values[k] != -1) || (found && value != ts->values[k])) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// random inserts and deletes while up to TEST_SNAPSHOTS snapshots are alive, each one checked
+// against a copy of the reference taken with it. when all are released only the nodes of the
+// tree are left
+static int run_test(int order)
+{
+    cow_tree_t* t = cow_create(order);
+    int values[TEST_KEYS];
+    test_snapshot_t snaps[TEST_SNAPSHOTS] = {{0}};
+    uint64_t seed = 4242 + order;
+    long errors = 0;
+    long nodes = 0;
+    
+    for (int k = 0; k < TEST_KEYS; k++) {
+        values[k] = -1;
+    }
+    
+    for (int step = 0; step < 200000; step++) {
+        int k = (int)(xorshift(&seed) % TEST_KEYS);
+        bool insert = (step / 20000) % 2 == 0 ? xorshift(&seed) % 3 != 0 : xorshift(&seed) % 3 == 0;
+        if (insert) {
+            int v = (int)(xorshift(&seed) % 1000000);
+            if ((cow_insert(t, k, v) == 0) != (values[k] == -1)) {
+                errors++;
+            }
+            if (values[k] == -1) {
+                values[k] = v;
+            }
+        } else {
+            if ((cow_delete(t, k) == 0) != (values[k] != -1)) {
+                errors++;
+            }
+            values[k] = -1;
+        }
+        
+        if (step % 1000 == 0) {
+            test_snapshot_t* ts = &snaps[xorshift(&seed) % TEST_SNAPSHOTS];
+            if (ts->s) {
+                errors += !verify_snapshot(ts);
+                cow_release(ts->s);
+                free(ts->values);
+            }
+            
+            ts->s = cow_snapshot(t);
+            ts->values = malloc(sizeof(values));
+            memcpy(ts->values, values, sizeof(values));
+            
+            // the snapshot shares every node, an insert of an existing key must not copy any
+            long copies = t->copies;
+            long num_nodes = atomic_load(&t->num_nodes);
+            if (values[k] != -1 && (cow_insert(t, k, 0) != -1 || t->copies != copies ||
+                                    atomic_load(&t->num_nodes) != num_nodes)) {
+                errors++;
+            }
+            
+            long expected = 0;
+            for (int i = 0; i < TEST_KEYS; i++) {
+                expected += (values[i] != -1);
+            }
+            if (check_tree(t, t->root, &nodes) != expected || expected != t->num_keys) {
+                errors++;
+            }
+        }
+    }
+    
+    for (int i = 0; i < TEST_SNAPSHOTS; i++) {
+        if (snaps[i].s) {
+            errors += !verify_snapshot(&snaps[i]);
+            cow_release(snaps[i].s);
+            free(snaps[i].values);
+        }
+    }
+    
+    long count = check_tree(t, t->root, &nodes);
+    if (nodes != atomic_load(&t->num_nodes)) {
+        printf("%ld nodes in the tree, %ld allocated\n", nodes, atomic_load(&t->num_nodes));
+        errors++;
+    }
+    
+    printf("order %d: %ld keys, %ld nodes, %ld copies, %s\n", order, count, nodes, t->copies,
+           errors ? "FAILED" : "ok");
+    cow_destroy(t);
+    return errors ? 1 : 0;
+}
+
+typedef struct reader_arg {
+    _Atomic(cow_snapshot_t*) mailbox;   // the writer puts a snapshot here when it is empty
+    _Atomic long expected_sum;
+    atomic_bool* stop;
+    long    scans;
+    long    errors;
+} reader_arg_t;
+
+static bool sum_keys(void* ctx, int key, int value)
+{
+    *(long*)ctx += (long)key * 7 + value;
+    return true;
+}
+
+// scan every snapshot the writer hands over while it keeps writing, the sum must be the one of
+// the tree when the snapshot was taken
+static void* reader_worker(void* p)
+{
+    reader_arg_t* a = p;
+    while (!atomic_load(a->stop)) {
+        cow_snapshot_t* s = atomic_load_explicit(&a->mailbox, memory_order_acquire);
+        if (!s) {
+            sched_yield();
+            continue;
+        }
+        
+        long sum = 0;
+        long count = cow_scan(s, INT_MIN, INT_MAX, sum_keys, &sum);
+        if (count != s->num_keys || sum != atomic_load(&a->expected_sum)) {
+            a->errors++;
+        }
+        a->scans++;
+        
+        atomic_store_explicit(&a->mailbox, NULL, memory_order_release);
+        cow_release(s);
+    }
+    
+    return NULL;
+}
+
+static int run_concurrent_test(int num_readers, int num_ops)
+{
+    cow_tree_t* t = cow_create(16);
+    pthread_t threads[16];
+    reader_arg_t args[16];
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    
+    for (int i = 0; i < num_readers; i++) {
+        atomic_init(&args[i].mailbox, NULL);
+        atomic_init(&args[i].expected_sum, 0);
+        args[i].stop = &stop;
+        args[i].scans = 0;
+        args[i].errors = 0;
+        pthread_create(&threads[i], NULL, reader_worker, &args[i]);
+    }
+    
+    uint64_t seed = 99;
+    long sum = 0;
+    for (int op = 0; op < num_ops; op++) {
+        int k = (int)(xorshift(&seed) % 50000);
+        int v = 0;
+        if (cow_lookup(t, k, &v)) {
+            cow_delete(t, k);
+            sum -= (long)k * 7 + v;
+        } else {
+            v = op;
+            cow_insert(t, k, v);
+            sum += (long)k * 7 + v;
+        }
+        
+        for (int i = 0; i < num_readers; i++) {
+            if (!atomic_load_explicit(&args[i].mailbox, memory_order_acquire)) {
+                atomic_store(&args[i].expected_sum, sum);
+                atomic_store_explicit(&args[i].mailbox, cow_snapshot(t), memory_order_release);
+            }
+        }
+    }
+    
+    atomic_store(&stop, true);
+    long errors = 0;
+    long scans = 0;
+    for (int i = 0; i < num_readers; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+        scans += args[i].scans;
+        cow_snapshot_t* s = atomic_load(&args[i].mailbox);
+        if (s) {
+            cow_release(s);
+        }
+    }
+    
+    long nodes = 0;
+    check_tree(t, t->root, &nodes);
+    if (nodes != atomic_load(&t->num_nodes)) {
+        errors++;
+    }
+    
+    printf("1 writer, %d readers, %d ops: %ld snapshot scans, %ld copies, %s\n", num_readers, num_ops, scans,
+           t->copies, errors ? "FAILED" : "ok");
+    cow_destroy(t);
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+static node_t* clone_node(cow_tree_t* t, node_t* n)
+{
+    node_t* c = make_node(t, n->is_leaf);
+    c->num_keys = n->num_keys;
+    memcpy(c->keys, n->keys, n->num_keys * sizeof(int));
+    if (n->is_leaf) {
+        memcpy(c->values, n->values, n->num_keys * sizeof(int));
+    } else {
+        for (int i = 0; i <= n->num_keys; i++) {
+            c->children[i] = clone_node(t, n->children[i]);
+        }
+    }
+    
+    return c;
+}
+
+// random inserts with a snapshot every `every` inserts, each one held until the next is taken
+// like a reader that finishes its scan, against the deep copy a consistent read needs without
+// snapshots
+static void bench(int num_keys)
+{
+    int intervals[] = {0, 100000, 10000, 100, 1};
+    int ops = 1000000;
+    
+    printf("%d keys preloaded, order %d, %d random inserts per row\n", num_keys, DEFAULT_ORDER, ops);
+    printf("%12s %10s %14s %12s %14s\n", "snapshot", "ns/insert", "copies/insert", "snapshot ns", "peak MB");
+    
+    for (int r = 0; r < (int)(sizeof(intervals) / sizeof(intervals[0])); r++) {
+        cow_tree_t* t = cow_create(DEFAULT_ORDER);
+        uint64_t seed = 7;
+        for (int i = 0; i < num_keys; i++) {
+            cow_insert(t, (int)(xorshift(&seed) >> 33), i);
+        }
+        t->copies = 0;
+        
+        cow_snapshot_t* s = NULL;
+        uint64_t snap_ns = 0;
+        long snaps = 0;
+        long peak = 0;
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < ops; i++) {
+            if (intervals[r] && i % intervals[r] == 0) {
+                if (s) {
+                    cow_release(s);
+                }
+                uint64_t t0 = get_nano_tick();
+                s = cow_snapshot(t);
+                snap_ns += get_nano_tick() - t0;
+                snaps++;
+            }
+            
+            cow_insert(t, (int)(xorshift(&seed) >> 33), i);
+            if (i % 1024 == 0 && atomic_load(&t->num_nodes) > peak) {
+                peak = atomic_load(&t->num_nodes);
+            }
+        }
+        uint64_t ns = get_nano_tick() - start;
+        
+        char label[32];
+        snprintf(label, sizeof(label), intervals[r] ? "every %d" : "none", intervals[r]);
+        printf("%12s %10.1f %14.3f %12.1f %14.1f\n", label, (double)ns / ops, (double)t->copies / ops,
+               snaps ? (double)snap_ns / snaps : 0.0, peak * t->node_size / 1e6);
+        
+        if (r == 0) {
+            start = get_nano_tick();
+            node_t* copy = clone_node(t, t->root);
+            printf("%12s %10s %14s %12.1f %14.1f\n", "deep copy", "-", "-", (double)(get_nano_tick() - start),
+                   atomic_load(&t->num_nodes) * t->node_size / 1e6);
+            node_release(t, copy);
+        }
+        
+        if (s) {
+            cow_release(s);
+        }
+        cow_destroy(t);
+    }
+}
+
+// for test
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: bptree_cow bench [num_keys]
+        bench(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    int failed = 0;
+    failed |= run_test(MIN_ORDER);
+    failed |= run_test(5);
+    failed |= run_test(6);
+    failed |= run_test(8);
+    failed |= run_test(DEFAULT_ORDER);
+    failed |= run_concurrent_test(4, 200000);
+    
+    return failed;
+}
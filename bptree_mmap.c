@@ -0,0 +1,694 @@
+//
+//  bptree_mmap.c
+//  bptree
+//
+//  Created by jianqing.du on 16-3-9.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ persistent B+ Tree, every node is a fixed size page inside a mmap-ed file
+
+ page 0 is the meta page with the root page id, the page count and the head of the free page
+ list. a node addresses its children by page id instead of pointer, so the file can be
+ mapped at any address and a restart only has to map it again to serve lookups.
+
+ the whole address range the file can grow to is reserved by one mapping when the file is
+ opened, growing the file with ftruncate never moves a page, so a page pointer stays valid
+ while the tree is open.
+
+ there are no parent pointers, insert and delete remember the path from the root. a delete
+ does not merge underfull nodes, a page is freed when its last key or child is gone.
+ pages reach the disk on mtree_sync() and mtree_close(), there is no crash consistency
+ between two syncs
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PAGE_SIZE       4096
+#define MTREE_MAGIC     0x52545042      // "BPTR"
+#define MTREE_VERSION   1
+#define MAX_HEIGHT      32
+#define RESERVE_SIZE    (1ULL << 38)    // address space reserved for the file, 256 GiB
+#define INVALID_PAGE    0               // page 0 is the meta page, never a node
+
+typedef uint32_t pgid_t;
+
+typedef struct meta {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    pgid_t   root;
+    uint32_t num_pages;     // pages in use including the meta page and the free pages
+    pgid_t   free_list;     // freed pages linked through page_t.next
+    uint32_t height;
+    uint32_t reserved;
+    uint64_t num_keys;
+} meta_t;
+
+typedef struct page {
+    uint32_t is_leaf;
+    uint32_t num_keys;
+    pgid_t   next;          // leaf: right sibling, free page: next free page
+    pgid_t   prev;          // leaf: left sibling
+    int32_t  keys[];        // KEYS_PER_PAGE keys, then children or values
+} page_t;
+
+// an internal page has one child more than keys, a leaf uses the same slots for its values
+#define KEYS_PER_PAGE   ((PAGE_SIZE - sizeof(page_t) - sizeof(pgid_t)) / (sizeof(int32_t) + sizeof(pgid_t)))
+
+typedef struct mtree {
+    int     fd;
+    char*   base;
+    size_t  file_size;
+    meta_t* meta;
+} mtree_t;
+
+// api
+mtree_t* mtree_open(const char* path);
+int mtree_sync(mtree_t* t);
+void mtree_close(mtree_t* t);
+bool mtree_find(mtree_t* t, int key, int* value);
+int mtree_insert(mtree_t* t, int key, int value);
+int mtree_delete(mtree_t* t, int key);
+
+////////
+
+static page_t* get_page(mtree_t* t, pgid_t id)
+{
+    return (page_t*)(t->base + (size_t)id * PAGE_SIZE);
+}
+
+static pgid_t* page_children(page_t* p)
+{
+    return (pgid_t*)(p->keys + KEYS_PER_PAGE);
+}
+
+static int32_t* page_values(page_t* p)
+{
+    return (int32_t*)(p->keys + KEYS_PER_PAGE);
+}
+
+// the number of keys <= key, the child index in an internal page
+static int page_search(page_t* p, int key)
+{
+    int n = p->num_keys;
+    if (n == 0) {
+        return 0;
+    }
+    
+    const int32_t* base = p->keys;
+    while (n > 1) {
+        int half = n / 2;
+        base += (base[half - 1] <= key) * half;
+        n -= half;
+    }
+    
+    return (int)(base - p->keys) + (*base <= key);
+}
+
+static int grow_file(mtree_t* t, size_t size)
+{
+    if (size > RESERVE_SIZE) {
+        printf("mtree: file exceeds the reserved %llu bytes\n", (unsigned long long)RESERVE_SIZE);
+        return -1;
+    }
+    
+    if (ftruncate(t->fd, size) != 0) {
+        perror("ftruncate failed\n");
+        return -1;
+    }
+    
+    t->file_size = size;
+    return 0;
+}
+
+static pgid_t alloc_page(mtree_t* t, bool is_leaf)
+{
+    meta_t* m = t->meta;
+    pgid_t id = m->free_list;
+    
+    if (id != INVALID_PAGE) {
+        m->free_list = get_page(t, id)->next;
+    } else {
+        size_t need = (size_t)(m->num_pages + 1) * PAGE_SIZE;
+        if (need > t->file_size) {
+            size_t size = t->file_size * 2;
+            if (grow_file(t, size < need ? need : size) != 0) {
+                exit(1);
+            }
+        }
+        id = m->num_pages++;
+    }
+    
+    page_t* p = get_page(t, id);
+    p->is_leaf = is_leaf;
+    p->num_keys = 0;
+    p->next = INVALID_PAGE;
+    p->prev = INVALID_PAGE;
+    return id;
+}
+
+static void free_page(mtree_t* t, pgid_t id)
+{
+    page_t* p = get_page(t, id);
+    p->num_keys = 0;
+    p->next = t->meta->free_list;
+    t->meta->free_list = id;
+}
+
+static int init_file(mtree_t* t)
+{
+    if (grow_file(t, 16 * PAGE_SIZE) != 0) {
+        return -1;
+    }
+    
+    meta_t* m = t->meta;
+    memset(m, 0, PAGE_SIZE);
+    m->magic = MTREE_MAGIC;
+    m->version = MTREE_VERSION;
+    m->page_size = PAGE_SIZE;
+    m->num_pages = 1;
+    m->free_list = INVALID_PAGE;
+    m->root = alloc_page(t, true);
+    m->height = 1;
+    return 0;
+}
+
+// open the tree in path, create an empty one if the file does not exist
+mtree_t* mtree_open(const char* path)
+{
+    mtree_t* t = malloc(sizeof(mtree_t));
+    if (!t) {
+        return NULL;
+    }
+    
+    t->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (t->fd < 0) {
+        perror("open failed\n");
+        free(t);
+        return NULL;
+    }
+    
+    struct stat st;
+    if (fstat(t->fd, &st) != 0) {
+        perror("fstat failed\n");
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    t->file_size = st.st_size;
+    
+    // pages past the end of the file become usable as soon as the file grows over them
+    t->base = mmap(NULL, RESERVE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, t->fd, 0);
+    if (t->base == MAP_FAILED) {
+        perror("mmap failed\n");
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    t->meta = (meta_t*)t->base;
+    
+    int ret = 0;
+    if (t->file_size == 0) {
+        ret = init_file(t);
+    } else if (t->file_size < PAGE_SIZE || t->meta->magic != MTREE_MAGIC ||
+               t->meta->version != MTREE_VERSION || t->meta->page_size != PAGE_SIZE ||
+               (size_t)t->meta->num_pages * PAGE_SIZE > t->file_size) {
+        printf("mtree: %s is not a tree file\n", path);
+        ret = -1;
+    }
+    
+    if (ret != 0) {
+        munmap(t->base, RESERVE_SIZE);
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    
+    return t;
+}
+
+int mtree_sync(mtree_t* t)
+{
+    if (msync(t->base, t->file_size, MS_SYNC) != 0) {
+        perror("msync failed\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+void mtree_close(mtree_t* t)
+{
+    mtree_sync(t);
+    munmap(t->base, RESERVE_SIZE);
+    close(t->fd);
+    free(t);
+}
+
+//////////// lookup
+
+static pgid_t find_leaf(mtree_t* t, int key)
+{
+    pgid_t id = t->meta->root;
+    page_t* p = get_page(t, id);
+    while (!p->is_leaf) {
+        id = page_children(p)[page_search(p, key)];
+        p = get_page(t, id);
+    }
+    
+    return id;
+}
+
+bool mtree_find(mtree_t* t, int key, int* value)
+{
+    page_t* l = get_page(t, find_leaf(t, key));
+    int i = page_search(l, key);
+    if (i > 0 && l->keys[i - 1] == key) {
+        if (value) {
+            *value = page_values(l)[i - 1];
+        }
+        return true;
+    }
+    
+    return false;
+}
+
+//////////// insert
+
+typedef struct path {
+    pgid_t id;
+    int    idx;         // the child taken in this page
+} path_t;
+
+static int descend(mtree_t* t, int key, path_t* path)
+{
+    int depth = 0;
+    pgid_t id = t->meta->root;
+    page_t* p = get_page(t, id);
+    
+    while (!p->is_leaf) {
+        int idx = page_search(p, key);
+        path[depth].id = id;
+        path[depth].idx = idx;
+        depth++;
+        
+        id = page_children(p)[idx];
+        p = get_page(t, id);
+    }
+    
+    path[depth].id = id;
+    path[depth].idx = 0;
+    return depth;
+}
+
+static void insert_in_parent(mtree_t* t, path_t* path, int depth, pgid_t left, int key, pgid_t right)
+{
+    if (depth < 0) {
+        pgid_t root = alloc_page(t, false);
+        page_t* r = get_page(t, root);
+        r->keys[0] = key;
+        page_children(r)[0] = left;
+        page_children(r)[1] = right;
+        r->num_keys = 1;
+        t->meta->root = root;
+        t->meta->height++;
+        return;
+    }
+    
+    page_t* p = get_page(t, path[depth].id);
+    pgid_t* children = page_children(p);
+    int idx = path[depth].idx;
+    int n = p->num_keys;
+    
+    if (n < KEYS_PER_PAGE) {
+        memmove(p->keys + idx + 1, p->keys + idx, (n - idx) * sizeof(int32_t));
+        memmove(children + idx + 2, children + idx + 1, (n - idx) * sizeof(pgid_t));
+        p->keys[idx] = key;
+        children[idx + 1] = right;
+        p->num_keys++;
+        return;
+    }
+    
+    // case: no space in the internal page, split it
+    int32_t tmp_keys[KEYS_PER_PAGE + 1];
+    pgid_t tmp_children[KEYS_PER_PAGE + 2];
+    memcpy(tmp_keys, p->keys, idx * sizeof(int32_t));
+    tmp_keys[idx] = key;
+    memcpy(tmp_keys + idx + 1, p->keys + idx, (n - idx) * sizeof(int32_t));
+    memcpy(tmp_children, children, (idx + 1) * sizeof(pgid_t));
+    tmp_children[idx + 1] = right;
+    memcpy(tmp_children + idx + 2, children + idx + 1, (n - idx) * sizeof(pgid_t));
+    
+    pgid_t new_id = alloc_page(t, false);
+    page_t* q = get_page(t, new_id);
+    int mid = (n + 1) / 2;
+    
+    // tmp_keys[mid] moves up
+    p->num_keys = mid;
+    memcpy(p->keys, tmp_keys, mid * sizeof(int32_t));
+    memcpy(children, tmp_children, (mid + 1) * sizeof(pgid_t));
+    
+    q->num_keys = n - mid;
+    memcpy(q->keys, tmp_keys + mid + 1, q->num_keys * sizeof(int32_t));
+    memcpy(page_children(q), tmp_children + mid + 1, (q->num_keys + 1) * sizeof(pgid_t));
+    
+    insert_in_parent(t, path, depth - 1, path[depth].id, tmp_keys[mid], new_id);
+}
+
+// return 0 if the key is inserted, -1 if the key already exists
+int mtree_insert(mtree_t* t, int key, int value)
+{
+    path_t path[MAX_HEIGHT];
+    int depth = descend(t, key, path);
+    pgid_t leaf_id = path[depth].id;
+    page_t* l = get_page(t, leaf_id);
+    int32_t* values = page_values(l);
+    int n = l->num_keys;
+    
+    int idx = page_search(l, key);
+    if (idx > 0 && l->keys[idx - 1] == key) {
+        return -1;
+    }
+    
+    t->meta->num_keys++;
+    
+    if (n < KEYS_PER_PAGE) {
+        memmove(l->keys + idx + 1, l->keys + idx, (n - idx) * sizeof(int32_t));
+        memmove(values + idx + 1, values + idx, (n - idx) * sizeof(int32_t));
+        l->keys[idx] = key;
+        values[idx] = value;
+        l->num_keys++;
+        return 0;
+    }
+    
+    // case: no space in the leaf, split it
+    int32_t tmp_keys[KEYS_PER_PAGE + 1];
+    int32_t tmp_values[KEYS_PER_PAGE + 1];
+    memcpy(tmp_keys, l->keys, idx * sizeof(int32_t));
+    memcpy(tmp_values, values, idx * sizeof(int32_t));
+    tmp_keys[idx] = key;
+    tmp_values[idx] = value;
+    memcpy(tmp_keys + idx + 1, l->keys + idx, (n - idx) * sizeof(int32_t));
+    memcpy(tmp_values + idx + 1, values + idx, (n - idx) * sizeof(int32_t));
+    
+    pgid_t new_id = alloc_page(t, true);
+    page_t* r = get_page(t, new_id);
+    int mid = (n + 1) / 2;
+    
+    l->num_keys = mid;
+    memcpy(l->keys, tmp_keys, mid * sizeof(int32_t));
+    memcpy(values, tmp_values, mid * sizeof(int32_t));
+    
+    r->num_keys = n + 1 - mid;
+    memcpy(r->keys, tmp_keys + mid, r->num_keys * sizeof(int32_t));
+    memcpy(page_values(r), tmp_values + mid, r->num_keys * sizeof(int32_t));
+    
+    // link the new leaf after l
+    r->next = l->next;
+    r->prev = leaf_id;
+    if (l->next != INVALID_PAGE) {
+        get_page(t, l->next)->prev = new_id;
+    }
+    l->next = new_id;
+    
+    insert_in_parent(t, path, depth - 1, leaf_id, r->keys[0], new_id);
+    return 0;
+}
+
+//////////// delete
+
+// remove the child path[depth].idx from the internal page, free the page when it has no child left
+static void remove_child(mtree_t* t, path_t* path, int depth)
+{
+    pgid_t id = path[depth].id;
+    page_t* p = get_page(t, id);
+    pgid_t* children = page_children(p);
+    int idx = path[depth].idx;
+    int n = p->num_keys;
+    
+    if (n == 0) {
+        // the removed child was the only one
+        free_page(t, id);
+        remove_child(t, path, depth - 1);
+        return;
+    }
+    
+    // drop the key in front of the child, or the one after it for the first child
+    int key_idx = idx > 0 ? idx - 1 : 0;
+    memmove(p->keys + key_idx, p->keys + key_idx + 1, (n - key_idx - 1) * sizeof(int32_t));
+    memmove(children + idx, children + idx + 1, (n - idx) * sizeof(pgid_t));
+    p->num_keys--;
+    
+    // a root with a single child is replaced by the child
+    while (depth == 0 && p->num_keys == 0 && !p->is_leaf) {
+        t->meta->root = children[0];
+        t->meta->height--;
+        free_page(t, id);
+        id = t->meta->root;
+        p = get_page(t, id);
+        children = page_children(p);
+    }
+}
+
+// return 0 if the key is deleted, -1 if the key is not found
+int mtree_delete(mtree_t* t, int key)
+{
+    path_t path[MAX_HEIGHT];
+    int depth = descend(t, key, path);
+    pgid_t leaf_id = path[depth].id;
+    page_t* l = get_page(t, leaf_id);
+    int32_t* values = page_values(l);
+    
+    int idx = page_search(l, key);
+    if (idx == 0 || l->keys[idx - 1] != key) {
+        return -1;
+    }
+    
+    idx--;
+    memmove(l->keys + idx, l->keys + idx + 1, (l->num_keys - idx - 1) * sizeof(int32_t));
+    memmove(values + idx, values + idx + 1, (l->num_keys - idx - 1) * sizeof(int32_t));
+    l->num_keys--;
+    t->meta->num_keys--;
+    
+    if (l->num_keys > 0 || depth == 0) {
+        return 0;
+    }
+    
+    // case: the leaf is empty, unlink it from the leaf chain and from its parent
+    if (l->prev != INVALID_PAGE) {
+        get_page(t, l->prev)->next = l->next;
+    }
+    if (l->next != INVALID_PAGE) {
+        get_page(t, l->next)->prev = l->prev;
+    }
+    free_page(t, leaf_id);
+    remove_child(t, path, depth - 1);
+    return 0;
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// walk the leaf chain both ways and count the keys, -1 if the chain is broken or unsorted
+static long check_leaf_chain(mtree_t* t)
+{
+    pgid_t id = t->meta->root;
+    page_t* p = get_page(t, id);
+    while (!p->is_leaf) {
+        id = page_children(p)[0];
+        p = get_page(t, id);
+    }
+    
+    long count = 0;
+    long last = (long)INT32_MIN - 1;
+    pgid_t prev = INVALID_PAGE;
+    for ( ; id != INVALID_PAGE; prev = id, id = p->next) {
+        p = get_page(t, id);
+        if (p->prev != prev) {
+            return -1;
+        }
+        for (int i = 0; i < p->num_keys; i++) {
+            if (p->keys[i] <= last) {
+                return -1;
+            }
+            last = p->keys[i];
+        }
+        count += p->num_keys;
+    }
+    
+    return count;
+}
+
+static int run_test(const char* path)
+{
+    int num_keys = 200000;
+    char* present = calloc(num_keys, 1);
+    uint64_t seed = 20160309;
+    int errors = 0;
+    
+    unlink(path);
+    mtree_t* t = mtree_open(path);
+    if (!t) {
+        return 1;
+    }
+    
+    for (int i = 0; i < 2 * num_keys; i++) {
+        int k = (int)(xorshift(&seed) % num_keys);
+        if (mtree_insert(t, k, k * 7) == 0) {
+            errors += present[k];
+            present[k] = 1;
+        }
+    }
+    for (int i = 0; i < num_keys; i++) {
+        int k = (int)(xorshift(&seed) % num_keys);
+        if (mtree_delete(t, k) == 0) {
+            errors += !present[k];
+            present[k] = 0;
+        }
+    }
+    mtree_close(t);
+    
+    // reopen and check every key
+    t = mtree_open(path);
+    if (!t) {
+        return 1;
+    }
+    
+    long expected = 0;
+    for (int k = 0; k < num_keys; k++) {
+        int value = 0;
+        bool found = mtree_find(t, k, &value);
+        errors += (found != present[k]) || (found && value != k * 7);
+        expected += present[k];
+    }
+    errors += (check_leaf_chain(t) != expected) || (t->meta->num_keys != expected);
+    
+    // delete everything, the pages go to the free list and get reused
+    uint32_t num_pages = t->meta->num_pages;
+    for (int k = 0; k < num_keys; k++) {
+        mtree_delete(t, k);
+    }
+    errors += (t->meta->height != 1) || (check_leaf_chain(t) != 0);
+    
+    // every page but the meta page and the root leaf is on the free list now
+    uint32_t num_free = 0;
+    for (pgid_t id = t->meta->free_list; id != INVALID_PAGE; id = get_page(t, id)->next) {
+        num_free++;
+    }
+    errors += (num_free != num_pages - 2);
+    
+    for (int k = 0; k < num_keys / 4; k++) {
+        mtree_insert(t, k, k);
+    }
+    errors += (t->meta->num_pages != num_pages) || (check_leaf_chain(t) != num_keys / 4);
+    
+    printf("%ld keys after reopen, height %u, %u pages: %s\n", expected, t->meta->height,
+           t->meta->num_pages, errors ? "FAILED" : "ok");
+    
+    mtree_close(t);
+    unlink(path);
+    free(present);
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+// drop the file from the page cache so the next open starts cold
+static void evict_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// time to the first lookup after a restart: map the existing file against rebuilding the tree
+static void bench(const char* path, int n)
+{
+    int num_lookups = 1000000;
+    
+    unlink(path);
+    mtree_t* t = mtree_open(path);
+    for (int i = 0; i < n; i++) {
+        mtree_insert(t, i, i);
+    }
+    printf("%d keys, height %u, %u pages, %.1f MiB file\n", n, t->meta->height, t->meta->num_pages,
+           (double)t->meta->num_pages * PAGE_SIZE / (1 << 20));
+    mtree_close(t);
+    evict_file(path);
+    
+    uint64_t start = get_nano_tick();
+    t = mtree_open(path);
+    int value = 0;
+    mtree_find(t, n / 2, &value);
+    uint64_t open_ns = get_nano_tick() - start;
+    
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    start = get_nano_tick();
+    for (int i = 0; i < num_lookups; i++) {
+        mtree_find(t, (int)(xorshift(&seed) % n), &value);
+    }
+    uint64_t warm_ns = get_nano_tick() - start;
+    mtree_close(t);
+    
+    // a restart without the file: insert every key again
+    char rebuild_path[1024];
+    snprintf(rebuild_path, sizeof(rebuild_path), "%s.rebuild", path);
+    unlink(rebuild_path);
+    start = get_nano_tick();
+    t = mtree_open(rebuild_path);
+    for (int i = 0; i < n; i++) {
+        mtree_insert(t, i, i);
+    }
+    mtree_find(t, n / 2, &value);
+    uint64_t rebuild_ns = get_nano_tick() - start;
+    mtree_close(t);
+    unlink(rebuild_path);
+    
+    printf("%-28s %12.3f ms\n", "mmap open + first lookup", open_ns / 1e6);
+    printf("%-28s %12.3f ms\n", "rebuild + first lookup", rebuild_ns / 1e6);
+    printf("%-28s %12.1f ns\n", "lookup after open, per op", (double)warm_ns / num_lookups);
+    
+    unlink(path);
+}
+
+// for test
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: bptree_mmap bench [num_keys] [file]
+        bench(argc >= 4 ? argv[3] : "bptree_bench.db", argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+    
+    return run_test(argc >= 2 ? argv[1] : "bptree_test.db");
+}
@@ -0,0 +1,759 @@
+//
+//  bptree_olc.c
+//  bptree
+//
+//  Created by jianqing.du on 16-3-2.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ concurrent B+ Tree with optimistic lock coupling, as described in
+ <<The ART of Practical Synchronization>> (Leis et al., DaMoN 2016)
+
+ every node has a version latch: bit 1 is the write lock, every write unlock bumps the version.
+ readers never write shared memory, they remember the version of each node they read and
+ restart from the root if it changed before they moved on. writers upgrade the version of
+ the node they modify to a write lock, full nodes are split eagerly on the way down so a
+ split only latches the node and its parent.
+
+ a delete only removes the key from its leaf, nodes are never merged, so no node is freed
+ while the tree is shared and readers never touch freed memory
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEFAULT_ORDER   64
+#define MIN_ORDER       3
+#define CACHE_LINE_SIZE 64
+
+#define LOCKED          2ULL
+#define SPIN_BEFORE_YIELD 64
+
+typedef struct node {
+    _Atomic uint64_t version;
+    int     num_keys;
+    bool    is_leaf;
+    int*    keys;
+    void**  children;   // internal node: order children
+    int*    values;     // leaf: order - 1 values, share the space of children
+} node_t;
+
+typedef struct olc_tree {
+    _Atomic(node_t*) root;
+    int     order;
+    size_t  node_size;
+    size_t  children_offset;
+    _Atomic long num_nodes;
+} olc_tree_t;
+
+// api
+olc_tree_t* olc_create(int order);
+void olc_destroy(olc_tree_t* t);
+bool olc_lookup(olc_tree_t* t, int key, int* value);
+void olc_insert(olc_tree_t* t, int key, int value);
+bool olc_remove(olc_tree_t* t, int key);
+
+////////
+
+static size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+static node_t* make_node(olc_tree_t* t, bool is_leaf)
+{
+    char* block = aligned_alloc(CACHE_LINE_SIZE, t->node_size);
+    if (block == NULL) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    node_t* n = (node_t*)block;
+    atomic_init(&n->version, 0);
+    n->num_keys = 0;
+    n->is_leaf = is_leaf;
+    n->keys = (int*)(block + sizeof(node_t));
+    n->children = (void**)(block + t->children_offset);
+    n->values = (int*)n->children;
+    
+    atomic_fetch_add_explicit(&t->num_nodes, 1, memory_order_relaxed);
+    return n;
+}
+
+olc_tree_t* olc_create(int order)
+{
+    if (order < MIN_ORDER) {
+        return NULL;
+    }
+    
+    olc_tree_t* t = malloc(sizeof(olc_tree_t));
+    if (!t) {
+        return NULL;
+    }
+    
+    t->order = order;
+    t->children_offset = round_up(sizeof(node_t) + order * sizeof(int), sizeof(void*));
+    t->node_size = round_up(t->children_offset + order * sizeof(void*), CACHE_LINE_SIZE);
+    atomic_init(&t->num_nodes, 0);
+    atomic_init(&t->root, make_node(t, true));
+    return t;
+}
+
+static void destroy_node(node_t* n)
+{
+    if (!n->is_leaf) {
+        for (int i = 0; i <= n->num_keys; i++) {
+            destroy_node(n->children[i]);
+        }
+    }
+    
+    free(n);
+}
+
+// not thread safe, all other threads must be done with the tree
+void olc_destroy(olc_tree_t* t)
+{
+    destroy_node(atomic_load(&t->root));
+    free(t);
+}
+
+//////////// version latch
+
+static void cpu_relax(int* spins)
+{
+    if (++*spins % SPIN_BEFORE_YIELD == 0) {
+        // the holder may be descheduled, more threads than cores
+        sched_yield();
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+// wait until the node is not write locked and return its version
+static uint64_t read_lock(node_t* n)
+{
+    int spins = 0;
+    uint64_t v = atomic_load_explicit(&n->version, memory_order_acquire);
+    while (v & LOCKED) {
+        cpu_relax(&spins);
+        v = atomic_load_explicit(&n->version, memory_order_acquire);
+    }
+    
+    return v;
+}
+
+// true if nobody wrote the node since read_lock returned v, everything read from the node
+// in between is only valid if this returns true
+static bool read_unlock(node_t* n, uint64_t v)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&n->version, memory_order_relaxed) == v;
+}
+
+static bool upgrade_to_write_lock(node_t* n, uint64_t v)
+{
+    if (!atomic_compare_exchange_strong_explicit(&n->version, &v, v + LOCKED,
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        return false;
+    }
+    
+    // a reader that sees any of the following writes must also see the lock bit
+    atomic_thread_fence(memory_order_release);
+    return true;
+}
+
+static void write_unlock(node_t* n)
+{
+    // clear the lock bit and bump the version in one add
+    atomic_fetch_add_explicit(&n->version, LOCKED, memory_order_release);
+}
+
+//////////// node helpers
+
+// optimistic readers load num_keys, keys, values and children while a writer changes them.
+// both sides go through relaxed atomics so the race is defined, read_unlock tells the reader
+// whether what it loaded was consistent. a writer reads its locked node plainly
+static int load_int(const int* p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void store_int(int* p, int x)
+{
+    __atomic_store_n(p, x, __ATOMIC_RELAXED);
+}
+
+// memmove of ints into a shared node, one relaxed store per slot
+static void move_ints(int* dst, const int* src, int n)
+{
+    if (dst < src) {
+        for (int i = 0; i < n; i++) {
+            store_int(dst + i, src[i]);
+        }
+    } else {
+        for (int i = n - 1; i >= 0; i--) {
+            store_int(dst + i, src[i]);
+        }
+    }
+}
+
+// children only move right, a separator is never removed from an internal node
+static void move_children(void** dst, void* const* src, int n)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        __atomic_store_n(dst + i, src[i], __ATOMIC_RELAXED);
+    }
+}
+
+static int load_num_keys(olc_tree_t* t, node_t* n)
+{
+    // a racing writer may have changed the count, keep the search inside the node
+    int num_keys = load_int(&n->num_keys);
+    if (num_keys < 0) {
+        return 0;
+    }
+    
+    return num_keys < t->order - 1 ? num_keys : t->order - 1;
+}
+
+// the number of keys <= key, the child index in an internal node
+static int node_search(const int* keys, int n, int key)
+{
+    if (n == 0) {
+        return 0;
+    }
+    
+    const int* base = keys;
+    int len = n;
+    while (len > 1) {
+        int half = len / 2;
+        base += (load_int(base + half - 1) <= key) * half;
+        len -= half;
+    }
+    
+    return (int)(base - keys) + (load_int(base) <= key);
+}
+
+static bool is_full(olc_tree_t* t, node_t* n)
+{
+    return load_int(&n->num_keys) == t->order - 1;
+}
+
+// split a write locked full node, return the new right node and the separator in *sep.
+// right is not reachable yet, only the count of n is seen by readers
+static node_t* split(olc_tree_t* t, node_t* n, int* sep)
+{
+    node_t* right = make_node(t, n->is_leaf);
+    int k = n->num_keys;
+    int mid = k / 2;
+    
+    if (n->is_leaf) {
+        right->num_keys = k - mid;
+        memcpy(right->keys, n->keys + mid, right->num_keys * sizeof(int));
+        memcpy(right->values, n->values + mid, right->num_keys * sizeof(int));
+        *sep = right->keys[0];
+    } else {
+        // keys[mid] moves up
+        right->num_keys = k - mid - 1;
+        memcpy(right->keys, n->keys + mid + 1, right->num_keys * sizeof(int));
+        memcpy(right->children, n->children + mid + 1, (right->num_keys + 1) * sizeof(void*));
+        *sep = n->keys[mid];
+    }
+    
+    store_int(&n->num_keys, mid);
+    return right;
+}
+
+static void insert_in_node(node_t* n, int sep, node_t* right)
+{
+    int idx = node_search(n->keys, n->num_keys, sep);
+    move_ints(n->keys + idx + 1, n->keys + idx, n->num_keys - idx);
+    move_children(n->children + idx + 2, n->children + idx + 1, n->num_keys - idx);
+    store_int(&n->keys[idx], sep);
+    __atomic_store_n(&n->children[idx + 1], right, __ATOMIC_RELAXED);
+    store_int(&n->num_keys, n->num_keys + 1);
+}
+
+static void insert_in_leaf(node_t* l, int idx, int key, int value)
+{
+    move_ints(l->keys + idx + 1, l->keys + idx, l->num_keys - idx);
+    move_ints(l->values + idx + 1, l->values + idx, l->num_keys - idx);
+    store_int(&l->keys[idx], key);
+    store_int(&l->values[idx], value);
+    store_int(&l->num_keys, l->num_keys + 1);
+}
+
+// split the write locked node n, parent is write locked or n is the locked root
+static void split_and_link(olc_tree_t* t, node_t* parent, node_t* n)
+{
+    int sep = 0;
+    node_t* right = split(t, n, &sep);
+    
+    if (parent) {
+        insert_in_node(parent, sep, right);
+    } else {
+        node_t* new_root = make_node(t, false);
+        new_root->keys[0] = sep;
+        new_root->children[0] = n;
+        new_root->children[1] = right;
+        new_root->num_keys = 1;
+        atomic_store_explicit(&t->root, new_root, memory_order_release);
+    }
+}
+
+// lock the node to split and its parent, return false if the caller must restart
+static bool lock_for_split(olc_tree_t* t, node_t* parent, uint64_t parent_v, node_t* n, uint64_t v)
+{
+    if (parent && !upgrade_to_write_lock(parent, parent_v)) {
+        return false;
+    }
+    
+    if (!upgrade_to_write_lock(n, v)) {
+        if (parent) {
+            write_unlock(parent);
+        }
+        return false;
+    }
+    
+    if (!parent && n != atomic_load_explicit(&t->root, memory_order_acquire)) {
+        // somebody grew a new root above n
+        write_unlock(n);
+        return false;
+    }
+    
+    return true;
+}
+
+//////////// operations
+
+bool olc_lookup(olc_tree_t* t, int key, int* value)
+{
+restart:;
+    node_t* n = atomic_load_explicit(&t->root, memory_order_acquire);
+    uint64_t v = read_lock(n);
+    if (n != atomic_load_explicit(&t->root, memory_order_acquire)) {
+        goto restart;
+    }
+    
+    node_t* parent = NULL;
+    uint64_t parent_v = 0;
+    
+    while (!n->is_leaf) {
+        node_t* inner = n;
+        if (parent && !read_unlock(parent, parent_v)) {
+            goto restart;
+        }
+        parent = inner;
+        parent_v = v;
+        
+        int idx = node_search(inner->keys, load_num_keys(t, inner), key);
+        n = __atomic_load_n(&inner->children[idx], __ATOMIC_RELAXED);
+        // the child pointer is only safe to follow if inner did not change
+        if (!read_unlock(inner, v)) {
+            goto restart;
+        }
+        v = read_lock(n);
+    }
+    
+    int num_keys = load_num_keys(t, n);
+    int idx = node_search(n->keys, num_keys, key);
+    bool found = idx > 0 && load_int(&n->keys[idx - 1]) == key;
+    int result = found ? load_int(&n->values[idx - 1]) : 0;
+    
+    if (!read_unlock(n, v)) {
+        goto restart;
+    }
+    if (parent && !read_unlock(parent, parent_v)) {
+        goto restart;
+    }
+    
+    if (found && value) {
+        *value = result;
+    }
+    return found;
+}
+
+// insert key or update its value
+void olc_insert(olc_tree_t* t, int key, int value)
+{
+restart:;
+    node_t* n = atomic_load_explicit(&t->root, memory_order_acquire);
+    uint64_t v = read_lock(n);
+    if (n != atomic_load_explicit(&t->root, memory_order_acquire)) {
+        goto restart;
+    }
+    
+    node_t* parent = NULL;
+    uint64_t parent_v = 0;
+    
+    while (!n->is_leaf) {
+        node_t* inner = n;
+        
+        // split full internal nodes on the way down, so the parent always has space
+        if (is_full(t, inner)) {
+            if (!lock_for_split(t, parent, parent_v, inner, v)) {
+                goto restart;
+            }
+            
+            split_and_link(t, parent, inner);
+            write_unlock(inner);
+            if (parent) {
+                write_unlock(parent);
+            }
+            goto restart;
+        }
+        
+        if (parent && !read_unlock(parent, parent_v)) {
+            goto restart;
+        }
+        parent = inner;
+        parent_v = v;
+        
+        int idx = node_search(inner->keys, load_num_keys(t, inner), key);
+        n = __atomic_load_n(&inner->children[idx], __ATOMIC_RELAXED);
+        if (!read_unlock(inner, v)) {
+            goto restart;
+        }
+        v = read_lock(n);
+    }
+    
+    node_t* leaf = n;
+    int idx = node_search(leaf->keys, load_num_keys(t, leaf), key);
+    bool found = idx > 0 && load_int(&leaf->keys[idx - 1]) == key;
+    
+    if (!found && is_full(t, leaf)) {
+        if (!lock_for_split(t, parent, parent_v, leaf, v)) {
+            goto restart;
+        }
+        
+        split_and_link(t, parent, leaf);
+        write_unlock(leaf);
+        if (parent) {
+            write_unlock(parent);
+        }
+        goto restart;
+    }
+    
+    if (!upgrade_to_write_lock(leaf, v)) {
+        goto restart;
+    }
+    // the leaf is still the right one only if its parent did not change
+    if (parent && !read_unlock(parent, parent_v)) {
+        write_unlock(leaf);
+        goto restart;
+    }
+    
+    if (found) {
+        store_int(&leaf->values[idx - 1], value);
+    } else {
+        insert_in_leaf(leaf, idx, key, value);
+    }
+    write_unlock(leaf);
+}
+
+// remove key from its leaf, return false if it is not in the tree
+bool olc_remove(olc_tree_t* t, int key)
+{
+restart:;
+    node_t* n = atomic_load_explicit(&t->root, memory_order_acquire);
+    uint64_t v = read_lock(n);
+    if (n != atomic_load_explicit(&t->root, memory_order_acquire)) {
+        goto restart;
+    }
+    
+    node_t* parent = NULL;
+    uint64_t parent_v = 0;
+    
+    while (!n->is_leaf) {
+        node_t* inner = n;
+        if (parent && !read_unlock(parent, parent_v)) {
+            goto restart;
+        }
+        parent = inner;
+        parent_v = v;
+        
+        int idx = node_search(inner->keys, load_num_keys(t, inner), key);
+        n = __atomic_load_n(&inner->children[idx], __ATOMIC_RELAXED);
+        if (!read_unlock(inner, v)) {
+            goto restart;
+        }
+        v = read_lock(n);
+    }
+    
+    node_t* leaf = n;
+    int idx = node_search(leaf->keys, load_num_keys(t, leaf), key);
+    if (idx == 0 || load_int(&leaf->keys[idx - 1]) != key) {
+        if (!read_unlock(leaf, v) || (parent && !read_unlock(parent, parent_v))) {
+            goto restart;
+        }
+        return false;
+    }
+    
+    if (!upgrade_to_write_lock(leaf, v)) {
+        goto restart;
+    }
+    if (parent && !read_unlock(parent, parent_v)) {
+        write_unlock(leaf);
+        goto restart;
+    }
+    
+    move_ints(leaf->keys + idx - 1, leaf->keys + idx, leaf->num_keys - idx);
+    move_ints(leaf->values + idx - 1, leaf->values + idx, leaf->num_keys - idx);
+    store_int(&leaf->num_keys, leaf->num_keys - 1);
+    write_unlock(leaf);
+    return true;
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// single threaded check: keys sorted, separators bound the subtrees, all leaves at one depth
+static long check_node(node_t* n, long lo, long hi, int depth, int* leaf_depth)
+{
+    for (int i = 0; i < n->num_keys; i++) {
+        if (n->keys[i] < lo || n->keys[i] >= hi || (i > 0 && n->keys[i - 1] >= n->keys[i])) {
+            printf("key order broken at depth %d\n", depth);
+            exit(1);
+        }
+    }
+    
+    if (n->is_leaf) {
+        if (*leaf_depth == -1) {
+            *leaf_depth = depth;
+        } else if (*leaf_depth != depth) {
+            printf("leaves at different depth\n");
+            exit(1);
+        }
+        return n->num_keys;
+    }
+    
+    long count = 0;
+    for (int i = 0; i <= n->num_keys; i++) {
+        long clo = i > 0 ? n->keys[i - 1] : lo;
+        long chi = i < n->num_keys ? n->keys[i] : hi;
+        count += check_node(n->children[i], clo, chi, depth + 1, leaf_depth);
+    }
+    
+    return count;
+}
+
+typedef struct test_arg {
+    olc_tree_t* t;
+    int         id;
+    int         num_threads;
+    int         num_keys;
+    long        errors;
+} test_arg_t;
+
+// every thread owns the keys k with k % num_threads == id: it inserts them, reads them back,
+// removes every third one and reads random keys of the other threads in between
+static void* test_worker(void* p)
+{
+    test_arg_t* a = p;
+    uint64_t seed = 1234567 + a->id;
+    
+    for (int k = a->id; k < a->num_keys; k += a->num_threads) {
+        olc_insert(a->t, k, k * 2);
+        
+        int value = 0;
+        if (!olc_lookup(a->t, k, &value) || value != k * 2) {
+            a->errors++;
+        }
+        
+        if (k % 3 == 0 && !olc_remove(a->t, k)) {
+            a->errors++;
+        }
+        
+        olc_lookup(a->t, (int)(xorshift(&seed) % a->num_keys), &value);
+    }
+    
+    return NULL;
+}
+
+static int run_test(int num_threads, int num_keys, int order)
+{
+    olc_tree_t* t = olc_create(order);
+    pthread_t threads[64];
+    test_arg_t args[64];
+    
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (test_arg_t){t, i, num_threads, num_keys, 0};
+        pthread_create(&threads[i], NULL, test_worker, &args[i]);
+    }
+    
+    long errors = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+    
+    long expected = 0;
+    for (int k = 0; k < num_keys; k++) {
+        int value = 0;
+        bool found = olc_lookup(t, k, &value);
+        if (found != (k % 3 != 0) || (found && value != k * 2)) {
+            errors++;
+        }
+        expected += (k % 3 != 0);
+    }
+    
+    int leaf_depth = -1;
+    long count = check_node(atomic_load(&t->root), INT32_MIN, (long)INT32_MAX + 1, 0, &leaf_depth);
+    if (count != expected) {
+        errors++;
+    }
+    
+    printf("%d threads, %d keys, order %d: %ld keys, height %d, %ld nodes, %s\n", num_threads, num_keys,
+           order, count, leaf_depth + 1, atomic_load(&t->num_nodes), errors ? "FAILED" : "ok");
+    olc_destroy(t);
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+typedef struct bench_arg {
+    olc_tree_t*      t;
+    pthread_mutex_t* mutex;         // not NULL for the global mutex baseline
+    int              id;
+    int              read_percent;
+    int              key_range;
+    atomic_bool*     stop;
+    long             ops;
+} bench_arg_t;
+
+static void* bench_worker(void* p)
+{
+    bench_arg_t* a = p;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL + a->id;
+    long ops = 0;
+    
+    while (!atomic_load_explicit(a->stop, memory_order_relaxed)) {
+        for (int i = 0; i < 256; i++) {
+            uint64_t r = xorshift(&seed);
+            int key = (int)((r >> 8) % a->key_range);
+            bool read = (int)(r % 100) < a->read_percent;
+            int value = 0;
+            
+            if (a->mutex) {
+                pthread_mutex_lock(a->mutex);
+            }
+            if (read) {
+                olc_lookup(a->t, key, &value);
+            } else {
+                olc_insert(a->t, key, key);
+            }
+            if (a->mutex) {
+                pthread_mutex_unlock(a->mutex);
+            }
+        }
+        ops += 256;
+    }
+    
+    a->ops = ops;
+    return NULL;
+}
+
+static double bench_run(olc_tree_t* t, bool use_mutex, int num_threads, int read_percent,
+                        int key_range, double seconds)
+{
+    pthread_t threads[64];
+    bench_arg_t args[64];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (bench_arg_t){t, use_mutex ? &mutex : NULL, i, read_percent, key_range, &stop, 0};
+        pthread_create(&threads[i], NULL, bench_worker, &args[i]);
+    }
+    
+    uint64_t start = get_nano_tick();
+    struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, true);
+    
+    long ops = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        ops += args[i].ops;
+    }
+    uint64_t ns = get_nano_tick() - start;
+    
+    return ops * 1e3 / ns;
+}
+
+// Mops/s for 1 to 64 threads at several read/write mixes, olc against one global mutex
+static void bench(int num_keys, double seconds)
+{
+    int read_percents[] = {100, 95, 50, 0};
+    int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    
+    olc_tree_t* t = olc_create(DEFAULT_ORDER);
+    for (int k = 0; k < num_keys; k += 2) {
+        olc_insert(t, k, k);
+    }
+    
+    printf("%d keys preloaded, key range %d, %.1fs per run (Mops/s)\n", num_keys / 2, num_keys, seconds);
+    printf("%6s %8s", "read%", "mode");
+    for (int i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        printf(" %8d", thread_counts[i]);
+    }
+    printf("\n");
+    
+    for (int r = 0; r < sizeof(read_percents) / sizeof(read_percents[0]); r++) {
+        for (int m = 0; m < 2; m++) {
+            printf("%6d %8s", read_percents[r], m ? "mutex" : "olc");
+            for (int i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+                printf(" %8.2f", bench_run(t, m == 1, thread_counts[i], read_percents[r], num_keys, seconds));
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+    
+    olc_destroy(t);
+}
+
+// for test
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: bptree_olc bench [num_keys] [seconds]
+        bench(argc >= 3 ? atoi(argv[2]) : 2000000, argc >= 4 ? atof(argv[3]) : 0.5);
+        return 0;
+    }
+    
+    int failed = 0;
+    failed |= run_test(1, 100000, MIN_ORDER);
+    failed |= run_test(4, 200000, MIN_ORDER);
+    failed |= run_test(8, 200000, 16);
+    failed |= run_test(16, 1000000, DEFAULT_ORDER);
+    
+    return failed;
+}
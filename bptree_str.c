@@ -0,0 +1,944 @@
+//
+//  bptree_str.c
+//  bptree
+//
+//  Created by jianqing.du on 16-3-21.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ B+ Tree with byte string keys, e.g. tenant names and urls
+
+ a node is one NODE_SIZE block: the slot array grows from the front, a heap of key bytes grows
+ from the back. the bytes every key of a node starts with are stored once as the node prefix
+ (prefix compression). a slot keeps the next HEAD_SIZE key bytes as a big endian integer, so
+ most compares of a node search are one integer compare in the slot array, only keys with
+ the same head read the rest of the key from the heap.
+
+ a leaf split pushes the shortest separator between the two halves to the parent (suffix
+ truncation), which keeps the internal nodes small. keys are up to MAX_KEY_LEN bytes, a tree
+ created with key_len > 0 only takes keys of exactly that length.
+
+ there are no parent pointers, insert and delete remember the path from the root. a delete
+ does not merge underfull nodes, a node is freed when its last key or child is gone
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define NODE_SIZE       4096
+#define HEAD_SIZE       8
+#define MAX_KEY_LEN     1024
+#define MAX_HEIGHT      32
+#define CACHE_LINE_SIZE 64
+
+// build with -DSTREE_PREFIX=0 to store every key in full, for comparison
+#ifndef STREE_PREFIX
+#define STREE_PREFIX    1
+#endif
+
+typedef struct snode snode_t;
+
+typedef struct slot {
+    uint64_t head;          // key bytes after the node prefix, big endian and zero padded
+    uint16_t len;           // key length after the node prefix
+    uint16_t tail;          // heap offset of the key bytes after the head
+    uint32_t reserved;
+    union {
+        snode_t* child;     // internal: the child right of this key
+        uint64_t value;     // leaf
+    };
+} slot_t;
+
+struct snode {
+    uint16_t is_leaf;
+    uint16_t num_keys;
+    uint16_t prefix_len;
+    uint16_t prefix;        // heap offset of the prefix
+    uint16_t heap;          // the heap is [heap, NODE_SIZE), removed keys leave holes till a rebuild
+    uint16_t reserved;
+    snode_t* first;         // internal: the child left of the first key
+    snode_t* prev;          // leaf: siblings
+    snode_t* next;
+    slot_t   slots[];
+};
+
+#define MAX_SLOTS       ((NODE_SIZE - sizeof(snode_t)) / sizeof(slot_t))
+
+// a key in full with its value or right child, the unit of a node rebuild
+typedef struct entry {
+    const uint8_t* key;
+    int      len;
+    union {
+        snode_t* child;
+        uint64_t value;
+    };
+} entry_t;
+
+typedef struct stree {
+    snode_t* root;
+    int      key_len;       // 0 for variable length keys
+    long     num_keys;
+    long     num_nodes;
+    uint8_t* scratch;       // the keys of the node being rebuilt, in full
+    entry_t* entries;
+} stree_t;
+
+typedef bool (*stree_scan_fn)(void* ctx, const uint8_t* key, int len, uint64_t value);
+
+// api
+stree_t* stree_create(int key_len);
+void stree_destroy(stree_t* t);
+bool stree_find(stree_t* t, const void* key, int len, uint64_t* value);
+int stree_insert(stree_t* t, const void* key, int len, uint64_t value);
+int stree_delete(stree_t* t, const void* key, int len);
+long stree_scan(stree_t* t, const void* lo, int lo_len, stree_scan_fn fn, void* ctx);
+
+////////
+
+static uint8_t* node_bytes(snode_t* n, int offset)
+{
+    return (uint8_t*)n + offset;
+}
+
+static int tail_len(int len)
+{
+    return len > HEAD_SIZE ? len - HEAD_SIZE : 0;
+}
+
+static int min_int(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+// the first HEAD_SIZE bytes as a big endian integer, integer order is memcmp order
+static uint64_t load_head(const uint8_t* p, int len)
+{
+    uint64_t head = 0;
+    memcpy(&head, p, min_int(len, HEAD_SIZE));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    head = __builtin_bswap64(head);
+#endif
+    return head;
+}
+
+static int common_prefix(const uint8_t* a, int a_len, const uint8_t* b, int b_len)
+{
+    int n = min_int(a_len, b_len);
+    int i = 0;
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+    
+    return i;
+}
+
+static snode_t* make_node(stree_t* t, bool is_leaf)
+{
+    snode_t* n = aligned_alloc(CACHE_LINE_SIZE, NODE_SIZE);
+    if (!n) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    memset(n, 0, sizeof(snode_t));
+    n->is_leaf = is_leaf;
+    n->heap = NODE_SIZE;
+    t->num_nodes++;
+    return n;
+}
+
+static void free_node(stree_t* t, snode_t* n)
+{
+    t->num_nodes--;
+    free(n);
+}
+
+// compare the key suffix q (after the node prefix) with the key of slot s
+static int slot_cmp(snode_t* n, const slot_t* s, const uint8_t* q, int q_len, uint64_t q_head)
+{
+    if (q_head != s->head) {
+        return q_head < s->head ? -1 : 1;
+    }
+    
+    if (q_len > HEAD_SIZE && s->len > HEAD_SIZE) {
+        int c = memcmp(q + HEAD_SIZE, node_bytes(n, s->tail), min_int(q_len, s->len) - HEAD_SIZE);
+        if (c != 0) {
+            return c;
+        }
+    }
+    
+    // equal heads and one key ends inside its head: the shorter key is a prefix of the other
+    return (q_len > s->len) - (q_len < s->len);
+}
+
+// the number of keys <= key, the child index in an internal node, found tells an exact match
+static int node_search(snode_t* n, const uint8_t* key, int len, bool* found)
+{
+    *found = false;
+
+    int p = n->prefix_len;
+    if (p > 0) {
+        int c = memcmp(key, node_bytes(n, n->prefix), min_int(len, p));
+        if (c < 0 || (c == 0 && len < p)) {
+            return 0;
+        }
+        if (c > 0) {
+            return n->num_keys;
+        }
+    }
+    
+    const uint8_t* q = key + p;
+    int q_len = len - p;
+    uint64_t q_head = load_head(q, q_len);
+    
+    int lo = 0;
+    int hi = n->num_keys;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = slot_cmp(n, &n->slots[mid], q, q_len, q_head);
+        if (c == 0) {
+            *found = true;
+            return mid + 1;
+        }
+        if (c > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo;
+}
+
+// write the full key of slot i to out, return its length
+static int slot_key(snode_t* n, int i, uint8_t* out)
+{
+    const slot_t* s = &n->slots[i];
+    int p = n->prefix_len;
+    
+    memcpy(out, node_bytes(n, n->prefix), p);
+    uint64_t head = s->head;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    head = __builtin_bswap64(head);
+#endif
+    memcpy(out + p, &head, min_int(s->len, HEAD_SIZE));
+    memcpy(out + p + HEAD_SIZE, node_bytes(n, s->tail), tail_len(s->len));
+    return p + s->len;
+}
+
+static int free_space(snode_t* n)
+{
+    return n->heap - (int)(sizeof(snode_t) + n->num_keys * sizeof(slot_t));
+}
+
+static uint16_t heap_alloc(snode_t* n, const uint8_t* bytes, int len)
+{
+    n->heap -= len;
+    memcpy(node_bytes(n, n->heap), bytes, len);
+    return n->heap;
+}
+
+static void set_slot(snode_t* n, slot_t* s, const uint8_t* key, int len)
+{
+    const uint8_t* q = key + n->prefix_len;
+    int q_len = len - n->prefix_len;
+    
+    s->head = load_head(q, q_len);
+    s->len = q_len;
+    s->tail = heap_alloc(n, q + HEAD_SIZE, tail_len(q_len));
+    s->reserved = 0;
+}
+
+//////////// rebuild and split
+
+// the bytes a node of entries [0, count) takes with the prefix of those keys
+static int build_size(const entry_t* e, int count, int* prefix_len)
+{
+    int p = 0;
+#if STREE_PREFIX
+    if (count > 0) {
+        // the keys are sorted, the first and the last one share the prefix of all of them
+        p = common_prefix(e[0].key, e[0].len, e[count - 1].key, e[count - 1].len);
+    }
+#endif
+
+    int size = (int)(sizeof(snode_t) + count * sizeof(slot_t)) + p;
+    for (int i = 0; i < count; i++) {
+        size += tail_len(e[i].len - p);
+    }
+    
+    *prefix_len = p;
+    return size;
+}
+
+static void build_node(snode_t* n, const entry_t* e, int count, int prefix_len, snode_t* first)
+{
+    n->num_keys = 0;
+    n->heap = NODE_SIZE;
+    n->first = first;
+    n->prefix_len = 0;
+    if (count > 0) {
+        n->prefix = heap_alloc(n, e[0].key, prefix_len);
+        n->prefix_len = prefix_len;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        slot_t* s = &n->slots[i];
+        set_slot(n, s, e[i].key, e[i].len);
+        if (n->is_leaf) {
+            s->value = e[i].value;
+        } else {
+            s->child = e[i].child;
+        }
+    }
+    n->num_keys = count;
+}
+
+// the keys of n in full with (key, len, payload) at pos, return the entry count
+static int collect(stree_t* t, snode_t* n, int pos, const uint8_t* key, int len, entry_t payload)
+{
+    uint8_t* buf = t->scratch;
+    int count = 0;
+    
+    for (int i = 0; i <= n->num_keys; i++) {
+        if (i == pos) {
+            memcpy(buf, key, len);
+            t->entries[count] = payload;
+            t->entries[count].key = buf;
+            t->entries[count].len = len;
+            buf += len;
+            count++;
+        }
+        
+        if (i < n->num_keys) {
+            int l = slot_key(n, i, buf);
+            t->entries[count].key = buf;
+            t->entries[count].len = l;
+            t->entries[count].value = n->slots[i].value;
+            buf += l;
+            count++;
+        }
+    }
+    
+    return count;
+}
+
+static void node_insert(stree_t* t, snode_t** path, int* idx, int level, int pos,
+                        const uint8_t* key, int len, entry_t payload);
+
+// split the collected entries of path[level] in two nodes that both fit, closest to the middle
+static void split_node(stree_t* t, snode_t** path, int* idx, int level, int count)
+{
+    snode_t* n = path[level];
+    entry_t* e = t->entries;
+    bool is_leaf = n->is_leaf;
+    
+    // a leaf keeps [0, m) and gives [m, count) away, an internal node pushes key m up
+    int m = -1;
+    int left_prefix = 0;
+    int right_prefix = 0;
+    for (int d = 0; d < count && m < 0; d++) {
+        for (int sign = -1; sign <= 1 && m < 0; sign += 2) {
+            int c = count / 2 + sign * d;
+            int lo = is_leaf ? c : c + 1;
+            if (c < 1 || lo >= count || (!is_leaf && c > count - 2)) {
+                continue;
+            }
+            
+            if (build_size(e, c, &left_prefix) <= NODE_SIZE &&
+                build_size(e + lo, count - lo, &right_prefix) <= NODE_SIZE) {
+                m = c;
+            }
+        }
+    }
+    
+    if (m < 0) {
+        printf("stree: no split point fits in one node\n");
+        exit(1);
+    }
+    
+    // the separator goes up after the entries are rebuilt, keep a copy out of the scratch
+    uint8_t sep[MAX_KEY_LEN];
+    int sep_len = 0;
+    snode_t* right = make_node(t, is_leaf);
+    
+    if (is_leaf) {
+        // the shortest key > the last key of the left half and <= the first of the right half
+        sep_len = common_prefix(e[m - 1].key, e[m - 1].len, e[m].key, e[m].len) + 1;
+        memcpy(sep, e[m].key, sep_len);
+        
+        build_node(right, e + m, count - m, right_prefix, NULL);
+        build_node(n, e, m, left_prefix, NULL);
+        
+        right->next = n->next;
+        right->prev = n;
+        if (n->next) {
+            n->next->prev = right;
+        }
+        n->next = right;
+    } else {
+        sep_len = e[m].len;
+        memcpy(sep, e[m].key, sep_len);
+        
+        build_node(right, e + m + 1, count - m - 1, right_prefix, e[m].child);
+        build_node(n, e, m, left_prefix, n->first);
+    }
+    
+    entry_t payload = {.child = right};
+    if (level == 0) {
+        snode_t* root = make_node(t, false);
+        payload.key = sep;
+        payload.len = sep_len;
+        build_node(root, &payload, 1, 0, n);
+        t->root = root;
+        return;
+    }
+    
+    node_insert(t, path, idx, level - 1, idx[level - 1], sep, sep_len, payload);
+}
+
+// put (key, payload) at slot pos of path[level], rebuild the node if the key does not share
+// its prefix or the heap has no room, split it if the keys do not fit in one node any more
+static void node_insert(stree_t* t, snode_t** path, int* idx, int level, int pos,
+                        const uint8_t* key, int len, entry_t payload)
+{
+    snode_t* n = path[level];
+    int p = n->prefix_len;
+    
+    bool shares_prefix = (len >= p) && memcmp(key, node_bytes(n, n->prefix), p) == 0;
+    if (shares_prefix && free_space(n) >= (int)sizeof(slot_t) + tail_len(len - p)) {
+        memmove(&n->slots[pos + 1], &n->slots[pos], (n->num_keys - pos) * sizeof(slot_t));
+        slot_t* s = &n->slots[pos];
+        set_slot(n, s, key, len);
+        if (n->is_leaf) {
+            s->value = payload.value;
+        } else {
+            s->child = payload.child;
+        }
+        n->num_keys++;
+        return;
+    }
+    
+    int count = collect(t, n, pos, key, len, payload);
+    int prefix_len = 0;
+    if (count <= (int)MAX_SLOTS && build_size(t->entries, count, &prefix_len) <= NODE_SIZE) {
+        build_node(n, t->entries, count, prefix_len, n->first);
+        return;
+    }
+    
+    split_node(t, path, idx, level, count);
+}
+////////////
+
+stree_t* stree_create(int key_len)
+{
+    if (key_len < 0 || key_len > MAX_KEY_LEN) {
+        return NULL;
+    }
+    
+    stree_t* t = calloc(1, sizeof(stree_t));
+    if (!t) {
+        return NULL;
+    }
+    
+    t->key_len = key_len;
+    t->scratch = malloc((MAX_SLOTS + 1) * MAX_KEY_LEN);
+    t->entries = malloc((MAX_SLOTS + 1) * sizeof(entry_t));
+    if (!t->scratch || !t->entries) {
+        free(t->scratch);
+        free(t->entries);
+        free(t);
+        return NULL;
+    }
+    
+    return t;
+}
+
+static void destroy_node(stree_t* t, snode_t* n)
+{
+    if (!n->is_leaf) {
+        destroy_node(t, n->first);
+        for (int i = 0; i < n->num_keys; i++) {
+            destroy_node(t, n->slots[i].child);
+        }
+    }
+    
+    free_node(t, n);
+}
+
+void stree_destroy(stree_t* t)
+{
+    if (!t) {
+        return;
+    }
+    
+    if (t->root) {
+        destroy_node(t, t->root);
+    }
+    
+    free(t->scratch);
+    free(t->entries);
+    free(t);
+}
+
+static bool valid_len(int len)
+{
+    return len >= 0 && len <= MAX_KEY_LEN;
+}
+
+static bool valid_key(stree_t* t, int len)
+{
+    return valid_len(len) && (t->key_len == 0 || len == t->key_len);
+}
+
+static snode_t* child_at(snode_t* n, int i)
+{
+    return i == 0 ? n->first : n->slots[i - 1].child;
+}
+
+// descend to the leaf of key, path[0] is the root, idx[level] the child taken at level
+static int find_path(stree_t* t, const uint8_t* key, int len, snode_t** path, int* idx)
+{
+    int level = 0;
+    snode_t* n = t->root;
+    bool found = false;
+    
+    while (!n->is_leaf) {
+        int i = node_search(n, key, len, &found);
+        path[level] = n;
+        idx[level] = i;
+        level++;
+        n = child_at(n, i);
+    }
+    path[level] = n;
+    
+    return level;
+}
+
+bool stree_find(stree_t* t, const void* key, int len, uint64_t* value)
+{
+    if (!t->root || !valid_key(t, len)) {
+        return false;
+    }
+    
+    snode_t* n = t->root;
+    bool found = false;
+    while (!n->is_leaf) {
+        n = child_at(n, node_search(n, key, len, &found));
+    }
+    
+    int i = node_search(n, key, len, &found);
+    if (found && value) {
+        *value = n->slots[i - 1].value;
+    }
+    
+    return found;
+}
+
+// return 0 if the key is inserted, -1 if it exists or its length is not valid
+int stree_insert(stree_t* t, const void* key, int len, uint64_t value)
+{
+    if (!valid_key(t, len)) {
+        return -1;
+    }
+    
+    if (!t->root) {
+        t->root = make_node(t, true);
+    }
+    
+    snode_t* path[MAX_HEIGHT];
+    int idx[MAX_HEIGHT];
+    int level = find_path(t, key, len, path, idx);
+    
+    bool found = false;
+    int i = node_search(path[level], key, len, &found);
+    if (found) {
+        return -1;
+    }
+    
+    entry_t payload = {.value = value};
+    node_insert(t, path, idx, level, i, key, len, payload);
+    t->num_keys++;
+    return 0;
+}
+
+static void remove_slot(snode_t* n, int i)
+{
+    memmove(&n->slots[i], &n->slots[i + 1], (n->num_keys - i - 1) * sizeof(slot_t));
+    n->num_keys--;
+}
+
+// child c of path[level] is gone, free the node too when it was the last child
+static void remove_child(stree_t* t, snode_t** path, int* idx, int level, int c)
+{
+    snode_t* n = path[level];
+    
+    if (n->num_keys == 0) {
+        if (level == 0) {
+            t->root = NULL;
+        } else {
+            remove_child(t, path, idx, level - 1, idx[level - 1]);
+        }
+        free_node(t, n);
+        return;
+    }
+    
+    // the key left of the child goes with it, the first child takes the key right of it
+    if (c == 0) {
+        n->first = n->slots[0].child;
+        remove_slot(n, 0);
+    } else {
+        remove_slot(n, c - 1);
+    }
+}
+
+// return 0 if the key is deleted, -1 if the key is not found
+int stree_delete(stree_t* t, const void* key, int len)
+{
+    if (!t->root || !valid_key(t, len)) {
+        return -1;
+    }
+    
+    snode_t* path[MAX_HEIGHT];
+    int idx[MAX_HEIGHT];
+    int level = find_path(t, key, len, path, idx);
+    snode_t* leaf = path[level];
+    
+    bool found = false;
+    int i = node_search(leaf, key, len, &found);
+    if (!found) {
+        return -1;
+    }
+    
+    remove_slot(leaf, i - 1);
+    t->num_keys--;
+    
+    if (leaf->num_keys == 0 && level == 0) {
+        free_node(t, leaf);
+        t->root = NULL;
+    } else if (leaf->num_keys == 0) {
+        if (leaf->prev) {
+            leaf->prev->next = leaf->next;
+        }
+        if (leaf->next) {
+            leaf->next->prev = leaf->prev;
+        }
+        remove_child(t, path, idx, level - 1, idx[level - 1]);
+        free_node(t, leaf);
+    }
+    
+    // an internal root with one child left is not needed
+    while (t->root && !t->root->is_leaf && t->root->num_keys == 0) {
+        snode_t* old = t->root;
+        t->root = old->first;
+        free_node(t, old);
+    }
+    
+    return 0;
+}
+
+// call fn for every key >= lo in order until it returns false, return the number of calls,
+// -1 on a bad lo. lo is a bound, not a key, it may be shorter than key_len like a separator
+long stree_scan(stree_t* t, const void* lo, int lo_len, stree_scan_fn fn, void* ctx)
+{
+    if (!valid_len(lo_len)) {
+        return -1;
+    }
+    
+    if (!t->root) {
+        return 0;
+    }
+    
+    snode_t* n = t->root;
+    bool found = false;
+    while (!n->is_leaf) {
+        n = child_at(n, node_search(n, lo, lo_len, &found));
+    }
+    
+    int i = node_search(n, lo, lo_len, &found);
+    if (found) {
+        i--;
+    }
+    
+    uint8_t key[MAX_KEY_LEN];
+    long count = 0;
+    for ( ; n; n = n->next, i = 0) {
+        for ( ; i < n->num_keys; i++) {
+            int len = slot_key(n, i, key);
+            count++;
+            if (!fn(ctx, key, len, n->slots[i].value)) {
+                return count;
+            }
+        }
+    }
+    
+    return count;
+}
+
+//////////// test and benchmark
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+#define KEY_ID8     0
+#define KEY_TENANT  1
+#define KEY_URL     2
+#define KEY_RANDOM  3
+
+// key number k of a key set, the same k always gives the same key
+static int make_key(int kind, uint64_t k, uint8_t* out)
+{
+    uint64_t seed = k * 0x9E3779B97F4A7C15ULL + 1;
+    uint64_t r = xorshift(&seed);
+    
+    switch (kind) {
+        case KEY_ID8:
+            r = __builtin_bswap64(k * 0x9E3779B97F4A7C15ULL);
+            memcpy(out, &r, 8);
+            return 8;
+        case KEY_TENANT:
+            return sprintf((char*)out, "tenant-%llu", (unsigned long long)k);
+        case KEY_URL:
+            return sprintf((char*)out, "https://t%llu.example.com/api/v1/items/%08llx",
+                           (unsigned long long)(k % 1000), (unsigned long long)(r & 0xffffffff));
+        default:
+            break;
+    }
+    
+    // random length up to 300 from a small alphabet with zero bytes, many shared prefixes,
+    // the key number at the end keeps the keys distinct
+    int len = (int)(r % 300);
+    for (int i = 0; i < len; i++) {
+        out[i] = "ab\0c"[xorshift(&seed) % 4];
+    }
+    memcpy(out + len, &k, sizeof(k));
+    return len + (int)sizeof(k);
+}
+
+typedef struct ref_key {
+    uint8_t* key;
+    int      len;
+    uint64_t value;
+} ref_key_t;
+
+static int ref_cmp(const void* a, const void* b)
+{
+    const ref_key_t* x = a;
+    const ref_key_t* y = b;
+    int c = memcmp(x->key, y->key, min_int(x->len, y->len));
+    return c != 0 ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+typedef struct check_ctx {
+    ref_key_t* refs;
+    char*      present;
+    long       pos;
+    long       count;
+    int        errors;
+} check_ctx_t;
+
+static bool check_fn(void* ctx, const uint8_t* key, int len, uint64_t value)
+{
+    check_ctx_t* c = ctx;
+    while (c->pos < c->count && !c->present[c->pos]) {
+        c->pos++;
+    }
+    
+    if (c->pos >= c->count) {
+        c->errors++;
+        return false;
+    }
+    
+    ref_key_t* r = &c->refs[c->pos++];
+    c->errors += (r->len != len) || memcmp(r->key, key, len) != 0 || r->value != value;
+    return true;
+}
+
+// the leaves in order must give exactly the present keys of the sorted reference
+static int check_scan(stree_t* t, ref_key_t* refs, char* present, long count)
+{
+    check_ctx_t c = {refs, present, 0, count, 0};
+    stree_scan(t, "", 0, check_fn, &c);
+    while (c.pos < count && !present[c.pos]) {
+        c.pos++;
+    }
+    
+    return c.errors + (c.pos != count);
+}
+
+static int run_test()
+{
+    int errors = 0;
+    int num_keys = 50000;
+    uint8_t buf[MAX_KEY_LEN];
+    
+    for (int kind = KEY_ID8; kind <= KEY_RANDOM; kind++) {
+        stree_t* t = stree_create(kind == KEY_ID8 ? 8 : 0);
+        ref_key_t* refs = calloc(num_keys, sizeof(ref_key_t));
+        char* present = calloc(num_keys, 1);
+        
+        for (int k = 0; k < num_keys; k++) {
+            refs[k].len = make_key(kind, k, buf);
+            refs[k].key = malloc(refs[k].len);
+            memcpy(refs[k].key, buf, refs[k].len);
+            refs[k].value = k * 7;
+        }
+        qsort(refs, num_keys, sizeof(ref_key_t), ref_cmp);
+        
+        uint64_t seed = 20160321 + kind;
+        for (int i = 0; i < 2 * num_keys; i++) {
+            int k = (int)(xorshift(&seed) % num_keys);
+            if (stree_insert(t, refs[k].key, refs[k].len, refs[k].value) == 0) {
+                errors += present[k];
+                present[k] = 1;
+            } else {
+                errors += !present[k];
+            }
+        }
+        errors += check_scan(t, refs, present, num_keys);
+        
+        for (int i = 0; i < num_keys; i++) {
+            int k = (int)(xorshift(&seed) % num_keys);
+            if (stree_delete(t, refs[k].key, refs[k].len) == 0) {
+                errors += !present[k];
+                present[k] = 0;
+            } else {
+                errors += present[k];
+            }
+        }
+        
+        long expected = 0;
+        for (int k = 0; k < num_keys; k++) {
+            uint64_t value = 0;
+            bool found = stree_find(t, refs[k].key, refs[k].len, &value);
+            errors += (found != present[k]) || (found && value != refs[k].value);
+            expected += present[k];
+        }
+        errors += check_scan(t, refs, present, num_keys) + (t->num_keys != expected);
+        
+        // scan from a key that is not in the tree starts at the next one
+        for (int k = 0; k + 1 < num_keys; k += 997) {
+            if (!present[k]) {
+                check_ctx_t c = {refs, present, k, num_keys, 0};
+                stree_scan(t, refs[k].key, refs[k].len, check_fn, &c);
+                errors += c.errors;
+            }
+        }
+        
+        errors += (kind == KEY_ID8) && stree_insert(t, "short", 5, 0) != -1;
+        errors += stree_scan(t, "", -1, check_fn, NULL) != -1 || stree_scan(t, "", MAX_KEY_LEN + 1, check_fn, NULL) != -1;
+        errors += stree_find(t, "", -1, NULL) || stree_delete(t, "", -1) != -1 || stree_insert(t, "", -1, 0) != -1;
+        
+        for (int k = 0; k < num_keys; k++) {
+            stree_delete(t, refs[k].key, refs[k].len);
+        }
+        errors += (t->root != NULL) || (t->num_nodes != 0) || (t->num_keys != 0);
+        
+        for (int k = 0; k < num_keys; k++) {
+            free(refs[k].key);
+        }
+        free(refs);
+        free(present);
+        stree_destroy(t);
+    }
+    
+    printf("%s, %d errors\n", errors ? "test failed" : "test ok", errors);
+    return errors != 0;
+}
+
+static int tree_height(stree_t* t)
+{
+    int height = 0;
+    for (snode_t* n = t->root; n; n = n->is_leaf ? NULL : n->first) {
+        height++;
+    }
+    
+    return height;
+}
+
+// bytes per key and lookup latency of three key sets, inserted in key number order
+static void bench(int n)
+{
+    const char* names[] = {"id8", "tenant", "url"};
+    int num_lookups = 1000000;
+    uint8_t buf[MAX_KEY_LEN];
+    
+    printf("%d keys, prefix compression %s\n", n, STREE_PREFIX ? "on" : "off");
+    printf("%8s %10s %8s %10s %12s %12s\n", "keys", "key_bytes", "height", "bytes/key", "insert_ns", "lookup_ns");
+    
+    for (int kind = KEY_ID8; kind <= KEY_URL; kind++) {
+        stree_t* t = stree_create(kind == KEY_ID8 ? 8 : 0);
+        long key_bytes = 0;
+        
+        uint64_t start = get_nano_tick();
+        for (int k = 0; k < n; k++) {
+            int len = make_key(kind, k, buf);
+            key_bytes += len;
+            stree_insert(t, buf, len, k);
+        }
+        uint64_t insert_ns = get_nano_tick() - start;
+        
+        // generate the lookup keys first, one after the other in lookups
+        uint64_t seed = 0x9E3779B97F4A7C15ULL;
+        uint8_t* lookups = malloc((size_t)num_lookups * 64);
+        int* lens = malloc(num_lookups * sizeof(int));
+        if (!lookups || !lens) {
+            perror("malloc failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < num_lookups; i++) {
+            lens[i] = make_key(kind, xorshift(&seed) % n, lookups + (size_t)i * 64);
+        }
+        
+        long sum = 0;
+        start = get_nano_tick();
+        for (int i = 0; i < num_lookups; i++) {
+            uint64_t value = 0;
+            stree_find(t, lookups + (size_t)i * 64, lens[i], &value);
+            sum += value;
+        }
+        uint64_t lookup_ns = get_nano_tick() - start;
+        free(lookups);
+        free(lens);
+        
+        printf("%8s %10.1f %8d %10.1f %12.1f %12.1f\n", names[kind], (double)key_bytes / n, tree_height(t),
+               (double)t->num_nodes * NODE_SIZE / t->num_keys, (double)insert_ns / n,
+               (double)lookup_ns / num_lookups);
+        if (sum < 0) {
+            printf("unexpected sum %ld\n", sum);
+        }
+        
+        stree_destroy(t);
+    }
+}
+
+// for test
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: bptree_str bench [num_keys]
+        bench(argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+    
+    return run_test();
+}
@@ -8,144 +8,706 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  *  implement skip list in http://epaperpress.com/sortsearch/download/skiplist.pdf
+ *
+ *  every list has its own xorshift64* generator, one 64-bit draw gives the whole level:
+ *  with p = 1/2 the level is the count of trailing zero bits, with p = 1/4 half of it,
+ *  other p compare the draw with a table of p^i
+ *
+ *  nodes are cut from slabs, one arena per level: the tall nodes that every search passes
+ *  lie together in a few slabs instead of one malloc block each all over the heap
+ *
+ *  every forward pointer carries its span, the number of level 0 steps it skips, like the
+ *  zset skip list of redis. the spans summed on the way down give the rank of a key, and
+ *  the k-th key is found by descending on spans instead of keys
+ *
+ *  the key type and its compare are fixed at compile time, values are value_size opaque bytes
+ *  stored behind the levels of the node. byte string keys are in skiplist_str.c
+ *
+ *  a list created with a capacity holds at most that many keys, an insert over it evicts the
+ *  oldest key, the least recently used key or the smallest key. oldest and lru keep the nodes
+ *  on a doubly linked age list behind the value, other lists do not have the two pointers
+ *
+ *  sl_save writes the list as arrays: the sorted keys and values of level 0, and for every
+ *  upper level the keys of its towers with their position one level down. sl_load maps the
+ *  file and searches the arrays like the list, level by level, without building a node.
+ *  a loaded list is read only
  */
 
-#define MAX_LEVEL 16
+#define MAX_LEVEL 32    // enough for 4G keys at p = 1/2
+#define SLAB_SIZE (64 * 1024)
+#define IMAGE_MAGIC   0x4C504B53    // "SKPL"
+#define IMAGE_VERSION 1
 
+// build with -DNODE_ARENA=0 to malloc every node, for comparison
+#ifndef NODE_ARENA
+#define NODE_ARENA 1
+#endif
+
+typedef enum {
+    SL_P_HALF,          // 2 pointers per node on average
+    SL_P_QUARTER,       // 1.33 pointers per node, more steps per level
+    SL_P_INV_E,         // 1/e, 1.58 pointers per node, fewest expected steps
+} sl_prob_t;
+
+// build with -DSL_KEY_TYPE=<type> -DSL_KEY_CMP(a, b)=<expr> for other fixed size keys. the
+// compare is a macro, so int keys keep the single compare instruction
+#ifndef SL_KEY_TYPE
+#define SL_KEY_TYPE int
+#endif
+#ifndef SL_KEY_CMP
+#define SL_KEY_CMP(a, b) (((a) > (b)) - ((a) < (b)))
+#endif
+#define KEY_LT(a, b) (SL_KEY_CMP(a, b) < 0)
+#define KEY_EQ(a, b) (SL_KEY_CMP(a, b) == 0)
+
+typedef SL_KEY_TYPE sl_key_t;
+
+typedef enum {
+    SL_EVICT_NONE,      // an insert into a full list fails
+    SL_EVICT_OLDEST,    // the key inserted first goes, updates do not renew a key
+    SL_EVICT_LRU,       // the key least recently inserted, updated or found goes
+    SL_EVICT_SMALLEST,  // the smallest key goes, the list keeps the largest keys
+} sl_evict_t;
+
+typedef void (*sl_evict_fn)(void* ctx, sl_key_t key, void* value);
+
+// value_size bytes of value follow level[height], then the age links if the list has them
 typedef struct node {
-	int key;
-	int value;
-	struct node* next[];
+	sl_key_t key;
+	int      height;
+	struct sl_level {
+		struct node* next;
+		long span;      // level 0 steps to next, to the end of the list if next is NULL
+	} level[];
 } node_t;
 
 typedef struct {
-	int     level;
-	node_t* header;
+	node_t* newer;
+	node_t* older;
+} age_link_t;
+
+typedef struct slab {
+	struct slab* next;
+} slab_t;
+
+// nodes of one level cut from slabs, a freed node is linked through level[0].next
+typedef struct {
+	size_t  node_size;
+	slab_t* slabs;
+	char*   bump;       // next unused node of the newest slab
+	char*   bump_end;
+	node_t* free_list;
+} node_arena_t;
+
+// the file of sl_save, the arrays follow at 8 byte aligned offsets
+typedef struct {
+	uint32_t  magic;
+	uint32_t  version;
+	uint32_t  key_size;
+	uint32_t  value_size;
+	uint64_t  length;
+	uint32_t  levels;
+	uint32_t  reserved;
+	uint64_t  value_offset;
+	uint64_t  count[MAX_LEVEL];         // keys of level i, count[0] is length
+	uint64_t  key_offset[MAX_LEVEL];
+	uint64_t  down_offset[MAX_LEVEL];   // uint32_t positions in level i - 1, for i > 0
+} image_header_t;
+
+// a mapped file of sl_save
+typedef struct {
+	void*     base;     // NULL for a list in memory
+	size_t    size;
+	int       levels;
+	long      count[MAX_LEVEL];
+	const sl_key_t* keys[MAX_LEVEL];
+	const uint32_t* down[MAX_LEVEL];
+	const char* values;
+} sl_image_t;
+
+typedef struct {
+	int       level;
+	long      length;
+	long      mods;     // count of inserts and deletes, a finger is stale when it changed
+	size_t    value_size;
+	size_t    value_bytes;  // value_size rounded up to a pointer, the age links follow
+	size_t    node_extra;   // bytes behind the levels of a node
+	size_t    memory;       // bytes taken from malloc
+	node_t*   header;
+	node_arena_t arenas[MAX_LEVEL];  // arenas[i] holds the nodes of level i + 1
+	sl_prob_t prob;
+	uint64_t  seed;                     // xorshift64* state
+	uint64_t  thresholds[MAX_LEVEL];    // p^i * 2^64, level > i if a draw is below
+	long      capacity;     // 0 for no bound
+	sl_evict_t evict;
+	node_t*   newest;       // the age list, for SL_EVICT_OLDEST and SL_EVICT_LRU
+	node_t*   oldest;
+	sl_evict_fn on_evict;
+	void*     evict_ctx;
+	sl_image_t image;
 } skiplist_t;
 
 // api 
 skiplist_t* create_skiplist();
-int sl_insert(skiplist_t* sl, int key, int value);
-int sl_delete(skiplist_t* sl, int key);
-int* sl_search(skiplist_t* sl, int key);
+// seed 0 seeds from the clock, any other seed gives the same levels on every run
+skiplist_t* create_skiplist_with(sl_prob_t prob, uint64_t seed);
+skiplist_t* create_skiplist_ex(sl_prob_t prob, uint64_t seed, size_t value_size);
+// at most capacity keys (> 0), the evict policy picks the key an insert into a full list drops
+skiplist_t* create_skiplist_bounded(sl_prob_t prob, uint64_t seed, size_t value_size, long capacity,
+                                    sl_evict_t evict);
+// called with the key and value before an evicted node is freed
+void sl_set_on_evict(skiplist_t* sl, sl_evict_fn fn, void* ctx);
+void sl_destroy(skiplist_t* sl);
+// delete all keys and give the node memory back, the list stays usable
+void sl_clear(skiplist_t* sl);
+// bytes the list took from malloc: the list, the header, the slabs or the nodes
+size_t sl_memory_usage(skiplist_t* sl);
+// the int value functions are for lists of value_size sizeof(int), return -1 or NULL otherwise.
+// inserts return -1 if a node cannot be allocated or a list without eviction is full.
+// a search of an lru list renews the key, it writes to the list like an insert
+int sl_insert(skiplist_t* sl, sl_key_t key, int value);
+int sl_insert_value(skiplist_t* sl, sl_key_t key, const void* value);
+int sl_delete(skiplist_t* sl, sl_key_t key);
+int* sl_search(skiplist_t* sl, sl_key_t key);
+// the value inside the node, no copy. it stays valid until the key is deleted
+void* sl_search_value(skiplist_t* sl, sl_key_t key);
+bool sl_get(skiplist_t* sl, sl_key_t key, void* value);
+long sl_length(skiplist_t* sl);
+// 0-based position of the key in order, -1 if it is not in the list
+long sl_rank(skiplist_t* sl, sl_key_t key);
+// the k-th smallest key (0-based), return a pointer to its value or NULL if k is out of range
+void* sl_kth(skiplist_t* sl, long k, sl_key_t* key);
+
+// the path of the last finger operation, the next one climbs only as far up as the distance
+// to the new key needs instead of starting at the header
+typedef struct sl_finger {
+	long    mods;       // sl->mods after the last operation
+	node_t* update[MAX_LEVEL];
+	long    rank[MAX_LEVEL];
+} sl_finger_t;
+
+void sl_finger_init(sl_finger_t* f);
+void* sl_finger_search(skiplist_t* sl, sl_finger_t* f, sl_key_t key);
+int sl_finger_insert(skiplist_t* sl, sl_finger_t* f, sl_key_t key, const void* value);
+// keys ascend, a repeated key keeps the last value. values holds n slots of value_size bytes.
+// return the count of new keys or -1 if the keys are not sorted or an insert failed
+long sl_insert_sorted_batch(skiplist_t* sl, const sl_key_t* keys, const void* values, long n);
+
+typedef struct sl_iter {
+	node_t* node;       // NULL past the end
+	const sl_image_t* image;    // a loaded list is walked by position
+	long    pos;
+	size_t  value_size;
+} sl_iter_t;
+
+bool sl_seek(sl_iter_t* it, skiplist_t* sl, sl_key_t key);
+bool sl_first(sl_iter_t* it, skiplist_t* sl);
+bool sl_iter_next(sl_iter_t* it);
+bool sl_iter_valid(sl_iter_t* it);
+sl_key_t sl_iter_key(sl_iter_t* it);
+void* sl_iter_value(sl_iter_t* it);
+long sl_range(skiplist_t* sl, sl_key_t lo, sl_key_t hi, sl_key_t* keys, void* values, long max);
+
+// write the list to path, through a temporary file renamed over it. return 0 or -1
+int sl_save(skiplist_t* sl, const char* path);
+// map a file of sl_save. search, get, rank, kth, iterators and range work on the mapping, the
+// values found point into it and are read only. inserts and deletes return -1, clear does
+// nothing. free with sl_destroy
+skiplist_t* sl_load(const char* path);
 
 ////////
-static int rand_level()
+static uint64_t sl_rand(skiplist_t* sl)
 {
-    int level = 1;
+    // xorshift64*
+    uint64_t x = sl->seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sl->seed = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int rand_level(skiplist_t* sl)
+{
+    uint64_t r = sl_rand(sl);
     
-    while ((rand() % 2 == 0) && (level < MAX_LEVEL)) {
-        level++;
+    switch (sl->prob) {
+        case SL_P_HALF:
+            // each trailing zero is a coin flip, the stop bit caps the level
+            return 1 + __builtin_ctzll(r | (1ULL << (MAX_LEVEL - 1)));
+        case SL_P_QUARTER:
+            return 1 + __builtin_ctzll(r | (1ULL << (2 * (MAX_LEVEL - 1)))) / 2;
+        default: {
+            int level = 1;
+            while (level < MAX_LEVEL && r < sl->thresholds[level]) {
+                level++;
+            }
+            return level;
+        }
+    }
+}
+
+static void* node_value(node_t* n)
+{
+    return &n->level[n->height];
+}
+
+static age_link_t* node_age(skiplist_t* sl, node_t* n)
+{
+    return (age_link_t*)((char*)node_value(n) + sl->value_bytes);
+}
+
+static size_t node_size(skiplist_t* sl, int level)
+{
+    return sizeof(node_t) + level * sizeof(struct sl_level) + sl->node_extra;
+}
+
+static bool has_age(skiplist_t* sl)
+{
+    return sl->evict == SL_EVICT_OLDEST || sl->evict == SL_EVICT_LRU;
+}
+
+static void age_push(skiplist_t* sl, node_t* n)
+{
+    age_link_t* a = node_age(sl, n);
+    a->newer = NULL;
+    a->older = sl->newest;
+    if (sl->newest) {
+        node_age(sl, sl->newest)->newer = n;
+    } else {
+        sl->oldest = n;
+    }
+    sl->newest = n;
+}
+
+static void age_unlink(skiplist_t* sl, node_t* n)
+{
+    age_link_t* a = node_age(sl, n);
+    if (a->newer) {
+        node_age(sl, a->newer)->older = a->older;
+    } else {
+        sl->newest = a->older;
+    }
+    if (a->older) {
+        node_age(sl, a->older)->newer = a->newer;
+    } else {
+        sl->oldest = a->newer;
+    }
+}
+
+// a found or updated key of an lru list becomes the newest
+static void age_touch(skiplist_t* sl, node_t* n)
+{
+    if (sl->evict == SL_EVICT_LRU && sl->newest != n) {
+        age_unlink(sl, n);
+        age_push(sl, n);
     }
-    
-    return level;
 }
 
-static node_t* new_node(int level, int key, int value)
+static node_t* new_node(skiplist_t* sl, int level, sl_key_t key, const void* value)
 {
-    node_t* n = malloc(sizeof(node_t) + level * sizeof(node_t*));
+#if NODE_ARENA
+    node_arena_t* a = &sl->arenas[level - 1];
+    node_t* n = a->free_list;
+    if (n) {
+        a->free_list = n->level[0].next;
+    } else {
+        if (a->bump == a->bump_end) {
+            char* slab = malloc(SLAB_SIZE);
+            if (!slab) {
+                return NULL;
+            }
+            sl->memory += SLAB_SIZE;
+            
+            ((slab_t*)slab)->next = a->slabs;
+            a->slabs = (slab_t*)slab;
+            a->bump = slab + sizeof(slab_t);
+            a->bump_end = a->bump + (SLAB_SIZE - sizeof(slab_t)) / a->node_size * a->node_size;
+        }
+        
+        n = (node_t*)a->bump;
+        a->bump += a->node_size;
+    }
+#else
+    node_t* n = malloc(node_size(sl, level));
     if (!n) {
         return NULL;
     }
-    
+    sl->memory += node_size(sl, level);
+#endif
+
     n->key = key;
-    n->value = value;
+    n->height = level;
+    if (value) {
+        memcpy(node_value(n), value, sl->value_size);
+    }
     return n;
 }
 
+static void free_node(skiplist_t* sl, node_t* n)
+{
+#if NODE_ARENA
+    node_arena_t* a = &sl->arenas[n->height - 1];
+    n->level[0].next = a->free_list;
+    a->free_list = n;
+#else
+    sl->memory -= node_size(sl, n->height);
+    free(n);
+#endif
+}
+
+// free every node but the header, which is not in an arena
+static void release_nodes(skiplist_t* sl)
+{
+#if NODE_ARENA
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        node_arena_t* a = &sl->arenas[i];
+        while (a->slabs) {
+            slab_t* next = a->slabs->next;
+            free(a->slabs);
+            sl->memory -= SLAB_SIZE;
+            a->slabs = next;
+        }
+        
+        a->bump = NULL;
+        a->bump_end = NULL;
+        a->free_list = NULL;
+    }
+#else
+    node_t* n = sl->header->level[0].next;
+    while (n) {
+        node_t* next = n->level[0].next;
+        free_node(sl, n);
+        n = next;
+    }
+#endif
+}
+
 skiplist_t* create_skiplist()
 {
-    srand((unsigned)time(NULL));
+    return create_skiplist_with(SL_P_HALF, 0);
+}
+
+skiplist_t* create_skiplist_with(sl_prob_t prob, uint64_t seed)
+{
+    return create_skiplist_ex(prob, seed, sizeof(int));
+}
+
+skiplist_t* create_skiplist_ex(sl_prob_t prob, uint64_t seed, size_t value_size)
+{
+    return create_skiplist_bounded(prob, seed, value_size, 0, SL_EVICT_NONE);
+}
+
+skiplist_t* create_skiplist_bounded(sl_prob_t prob, uint64_t seed, size_t value_size, long capacity,
+                                    sl_evict_t evict)
+{
+    if (capacity < 0) {
+        return NULL;
+    }
     
     skiplist_t* sl = malloc(sizeof(skiplist_t));
     if (!sl) {
         return NULL;
     }
     
+    sl->capacity = capacity;
+    sl->evict = capacity > 0 ? evict : SL_EVICT_NONE;
+    sl->newest = NULL;
+    sl->oldest = NULL;
+    sl->on_evict = NULL;
+    sl->evict_ctx = NULL;
+    memset(&sl->image, 0, sizeof(sl->image));
+    
+    // the next node in the slab starts at a pointer boundary
+    sl->value_size = value_size;
+    sl->value_bytes = (value_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    sl->node_extra = sl->value_bytes + (has_age(sl) ? sizeof(age_link_t) : 0);
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        node_arena_t* a = &sl->arenas[i];
+        a->node_size = node_size(sl, i + 1);
+        a->slabs = NULL;
+        a->bump = NULL;
+        a->bump_end = NULL;
+        a->free_list = NULL;
+    }
+    
     sl->level = 1;
-    sl->header = new_node(MAX_LEVEL - 1, 0, 0);
+    sl->length = 0;
+    sl->mods = 0;
+    sl->header = malloc(node_size(sl, MAX_LEVEL));
     if (!sl->header) {
+        free(sl);
         return NULL;
     }
+    sl->header->key = (sl_key_t){0};
+    sl->header->height = MAX_LEVEL;
+    sl->memory = sizeof(skiplist_t) + node_size(sl, MAX_LEVEL);
+    
+    if (seed == 0) {
+        seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)sl;
+    }
+    // splitmix64 spreads small seeds over all bits, xorshift must not start at 0
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    seed ^= seed >> 31;
+    sl->seed = seed ? seed : 1;
+    
+    sl->prob = prob;
+    double p = prob == SL_P_HALF ? 0.5 : (prob == SL_P_QUARTER ? 0.25 : 0.36787944117144233);
+    double t = 18446744073709551616.0;
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        sl->thresholds[i] = t >= 18446744073709551615.0 ? UINT64_MAX : (uint64_t)t;
+        t *= p;
+    }
     
     for (int i = 0; i < MAX_LEVEL; ++i) {
-        sl->header->next[i] = NULL;
+        sl->header->level[i].next = NULL;
+        sl->header->level[i].span = 0;
     }
     
     return sl;
+
+}
+
+void sl_set_on_evict(skiplist_t* sl, sl_evict_fn fn, void* ctx)
+{
+    sl->on_evict = fn;
+    sl->evict_ctx = ctx;
+}
+
+void sl_destroy(skiplist_t* sl)
+{
+    if (!sl) {
+        return;
+    }
+    
+    if (sl->image.base) {
+        munmap(sl->image.base, sl->image.size);
+        free(sl);
+        return;
+    }
     
+    release_nodes(sl);
+    free(sl->header);
+    free(sl);
 }
 
-int sl_insert(skiplist_t* sl, int key, int value)
+void sl_clear(skiplist_t* sl)
 {
-    node_t* update[MAX_LEVEL];
-    node_t* current = sl->header;
-    node_t* forward = NULL;
+    if (sl->image.base) {
+        return;
+    }
     
-    int i;
-    for (i = sl->level - 1; i >= 0; i--) {
-        while ((forward = current->next[i]) && (forward->key < key)) {
-            current = forward;
-        }
-        
-        update[i] = current;
+    release_nodes(sl);
+    for (int i = 0; i < MAX_LEVEL; ++i) {
+        sl->header->level[i].next = NULL;
+        sl->header->level[i].span = 0;
     }
     
-    if (forward && forward->key == key) {
-        forward->value = value;
-        return 0;
+    sl->level = 1;
+    sl->length = 0;
+    sl->mods++;
+    sl->newest = NULL;
+    sl->oldest = NULL;
+}
+
+size_t sl_memory_usage(skiplist_t* sl)
+{
+    return sl->memory;
+}
+
+// link a new node for key behind update[], rank[i] is the position of update[i]. the path then
+// ends at the new node: update[i] is the node on the levels it has. return NULL and leave the
+// list as it was if the list is full or the node cannot be allocated
+static node_t* link_node(skiplist_t* sl, node_t** update, long* rank, sl_key_t key, const void* value)
+{
+    if (sl->evict == SL_EVICT_NONE && sl->capacity > 0 && sl->length >= sl->capacity) {
+        return NULL;
+    }
+    
+    int i;
+    int level = rand_level(sl);
+    node_t* n = new_node(sl, level, key, value);
+    if (!n) {
+        return NULL;
     }
     
-    int level = rand_level();
     if (level > sl->level) {
         for (i = sl->level; i < level; ++i) {
+            rank[i] = 0;
             update[i] = sl->header;
+            update[i]->level[i].span = sl->length;
         }
         
         sl->level = level;
     }
     
-    node_t* n = new_node(level, key, value);
     for (i = 0; i < level; i++) {
-        n->next[i] = update[i]->next[i];
+        n->level[i].next = update[i]->level[i].next;
+        
+        update[i]->level[i].next = n;
+        
+        // n splits the span of update[i], it is rank[0] - rank[i] + 1 steps behind it
+        n->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = rank[0] - rank[i] + 1;
+    }
+    
+    // the pointers above n pass one more node
+    for (i = level; i < sl->level; i++) {
+        update[i]->level[i].span++;
+    }
+    sl->length++;
+    sl->mods++;
+    if (has_age(sl)) {
+        age_push(sl, n);
+    }
+    
+    long pos = rank[0] + 1;
+    for (i = 0; i < level; i++) {
+        update[i] = n;
+        rank[i] = pos;
+    }
+    
+    return n;
+}
+
+// the first level 0 position with a key >= key: on every level step forward while the next
+// key is smaller, then go down the tower of the last key passed
+static long image_lower_bound(const sl_image_t* im, sl_key_t key)
+{
+    long current = -1;  // the header
+    for (int i = im->levels - 1; i >= 0; i--) {
+        const sl_key_t* keys = im->keys[i];
+        while (current + 1 < im->count[i] && KEY_LT(keys[current + 1], key)) {
+            current++;
+        }
+        
+        if (i > 0 && current >= 0) {
+            current = im->down[i][current];
+        }
+    }
+    
+    return current + 1;
+}
+
+static void* image_search(const sl_image_t* im, size_t value_size, sl_key_t key)
+{
+    long pos = image_lower_bound(im, key);
+    if (pos < im->count[0] && KEY_EQ(im->keys[0][pos], key)) {
+        return (void*)(im->values + pos * value_size);
+    }
+    
+    return NULL;
+}
+
+// drop keys by the evict policy until the list is within its capacity
+static void evict_over(skiplist_t* sl)
+{
+    while (sl->capacity > 0 && sl->length > sl->capacity) {
+        node_t* victim = sl->evict == SL_EVICT_SMALLEST ? sl->header->level[0].next : sl->oldest;
+        sl_key_t key = victim->key;
+        if (sl->on_evict) {
+            sl->on_evict(sl->evict_ctx, key, node_value(victim));
+        }
+        sl_delete(sl, key);
+    }
+}
+
+int sl_insert(skiplist_t* sl, sl_key_t key, int value)
+{
+    if (sl->value_size != sizeof(int)) {
+        return -1;
+    }
+    
+    return sl_insert_value(sl, key, &value);
+}
+
+int sl_insert_value(skiplist_t* sl, sl_key_t key, const void* value)
+{
+    node_t* update[MAX_LEVEL];
+    long rank[MAX_LEVEL];   // rank[i] is the level 0 position of update[i], the header is 0
+    node_t* current = sl->header;
+    node_t* forward = NULL;
+    
+    if (sl->image.base) {
+        return -1;
+    }
+    
+    int i;
+    for (i = sl->level - 1; i >= 0; i--) {
+        rank[i] = i == sl->level - 1 ? 0 : rank[i + 1];
+        while ((forward = current->level[i].next) && KEY_LT(forward->key, key)) {
+            rank[i] += current->level[i].span;
+            current = forward;
+        }
         
-        update[i]->next[i] = n;
+        update[i] = current;
+    }
+    
+    if (forward && KEY_EQ(forward->key, key)) {
+        memcpy(node_value(forward), value, sl->value_size);
+        age_touch(sl, forward);
+        return 0;
     }
     
+    if (!link_node(sl, update, rank, key, value)) {
+        return -1;
+    }
     
+    evict_over(sl);
     return 0;
 }
 
-int sl_delete(skiplist_t* sl, int key)
+int sl_delete(skiplist_t* sl, sl_key_t key)
 {
     node_t* update[MAX_LEVEL];
     node_t* current = sl->header;
     node_t* forward = NULL;
     
+    if (sl->image.base) {
+        return -1;
+    }
+    
     int i;
     for (i = sl->level - 1; i >= 0; i--) {
-        while ((forward = current->next[i]) && (forward->key < key)) {
+        while ((forward = current->level[i].next) && KEY_LT(forward->key, key)) {
             current = forward;
         }
         
         update[i] = current;
     }
     
-    if (forward && forward->key == key) {
+    if (forward && KEY_EQ(forward->key, key)) {
+        if (has_age(sl)) {
+            age_unlink(sl, forward);
+        }
+        
         for (i = 0; i < sl->level; ++i) {
-            if (update[i]->next[i] != forward)
-                break;
-            
-            update[i]->next[i] = forward->next[i];
+            if (update[i]->level[i].next == forward) {
+                update[i]->level[i].span += forward->level[i].span - 1;
+                update[i]->level[i].next = forward->level[i].next;
+            } else {
+                update[i]->level[i].span--;
+            }
         }
         
-        free(forward);
+        free_node(sl, forward);
+        sl->length--;
+        sl->mods++;
         
-        while ((sl->level >= 1) && (sl->header->next[sl->level - 1] == NULL)) {
+        while ((sl->level >= 1) && (sl->header->level[sl->level - 1].next == NULL)) {
             sl->level--;
         }
     }
@@ -153,48 +715,1295 @@ int sl_delete(skiplist_t* sl, int key)
     return 0;
 }
 
-int* sl_search(skiplist_t* sl, int key)
+int* sl_search(skiplist_t* sl, sl_key_t key)
+{
+    if (sl->value_size != sizeof(int)) {
+        return NULL;
+    }
+    
+    return sl_search_value(sl, key);
+}
+
+void* sl_search_value(skiplist_t* sl, sl_key_t key)
 {
     node_t* current = sl->header;
     node_t* forward = NULL;
     
+    if (sl->image.base) {
+        return image_search(&sl->image, sl->value_size, key);
+    }
+    
     int i;
     for (i = sl->level - 1; i >= 0; i--) {
-        while ((forward = current->next[i]) && (forward->key < key)) {
+        while ((forward = current->level[i].next) && KEY_LT(forward->key, key)) {
             current = forward;
         }
     }
     
-    if (forward && forward->key == key) {
-        return &(forward->value);
+    if (forward && KEY_EQ(forward->key, key)) {
+        age_touch(sl, forward);
+        return node_value(forward);
     } else {
         return NULL;
     }
 }
 
-// for test
-#define MAX_KEY 100
-int main(int argc, const char * argv[])
+bool sl_get(skiplist_t* sl, sl_key_t key, void* value)
 {
+    void* p = sl_search_value(sl, key);
+    if (p) {
+        memcpy(value, p, sl->value_size);
+    }
+    
+    return p != NULL;
+}
 
-    skiplist_t* sl = create_skiplist();
+long sl_length(skiplist_t* sl)
+{
+    return sl->length;
+}
 
-    for (int i = 0; i < MAX_KEY; i++) {
-        sl_insert(sl, i, i);
+long sl_rank(skiplist_t* sl, sl_key_t key)
+{
+    node_t* current = sl->header;
+    node_t* forward = NULL;
+    long rank = 0;
+    
+    if (sl->image.base) {
+        long pos = image_lower_bound(&sl->image, key);
+        return pos < sl->length && KEY_EQ(sl->image.keys[0][pos], key) ? pos : -1;
+    }
+    
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while ((forward = current->level[i].next) && !KEY_LT(key, forward->key)) {
+            rank += current->level[i].span;
+            current = forward;
+        }
+        
+        if (current != sl->header && KEY_EQ(current->key, key)) {
+            return rank - 1;
+        }
     }
+    
+    return -1;
+}
 
-    for (int i = 0; i < MAX_KEY; i += 3) {
-        sl_delete(sl, i);
+void* sl_kth(skiplist_t* sl, long k, sl_key_t* key)
+{
+    if (k < 0 || k >= sl->length) {
+        return NULL;
+    }
+    
+    if (sl->image.base) {
+        if (key) {
+            *key = sl->image.keys[0][k];
+        }
+        return (void*)(sl->image.values + k * sl->value_size);
+    }
+    
+    // take every pointer that does not pass position k + 1
+    node_t* current = sl->header;
+    long traversed = 0;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (current->level[i].next && traversed + current->level[i].span <= k + 1) {
+            traversed += current->level[i].span;
+            current = current->level[i].next;
+        }
+        
+        if (traversed == k + 1) {
+            break;
+        }
+    }
+    
+    if (key) {
+        *key = current->key;
     }
+    return node_value(current);
+}
 
-    for (int i = 0; i < MAX_KEY; i++) {
-        int* p = sl_search(sl, i);
-        if (p) {
-            printf("get value(%d)=%d\n", i, *p);
-        } else {
-            printf("get value(%d)=NULL\n", i);
+//////////// finger
+
+void sl_finger_init(sl_finger_t* f)
+{
+    f->mods = -1;
+}
+
+// set the finger to the path of key, update[i] the last node < key on level i, return the
+// first node >= key
+static node_t* finger_find(skiplist_t* sl, sl_finger_t* f, sl_key_t key)
+{
+    node_t** update = f->update;
+    long* rank = f->rank;
+    int top = sl->level - 1;
+    if (top < 0) {
+        f->mods = sl->mods;
+        return NULL;
+    }
+    
+    int i = 0;
+    if (f->mods != sl->mods) {
+        // a change behind the back of the finger may have freed a node of the path
+        i = top;
+        update[i] = sl->header;
+        rank[i] = 0;
+    } else if (update[0] != sl->header && !KEY_LT(update[0]->key, key)) {
+        // backward: the path nodes move left going up, climb until one is before key
+        while (i < top && update[i] != sl->header && !KEY_LT(update[i]->key, key)) {
+            i++;
+        }
+        if (update[i] != sl->header && !KEY_LT(update[i]->key, key)) {
+            update[i] = sl->header;
+            rank[i] = 0;
+        }
+    } else {
+        // forward: the next nodes move right going up, climb while the next one is before key
+        node_t* next;
+        while (i < top && (next = update[i + 1]->level[i + 1].next) && KEY_LT(next->key, key)) {
+            i++;
+        }
+    }
+    
+    node_t* current = update[i];
+    node_t* forward = NULL;
+    long r = rank[i];
+    for ( ; i >= 0; i--) {
+        while ((forward = current->level[i].next) && KEY_LT(forward->key, key)) {
+            r += current->level[i].span;
+            current = forward;
         }
+        
+        update[i] = current;
+        rank[i] = r;
     }
+    
+    f->mods = sl->mods;
+    return forward;
+}
 
+void* sl_finger_search(skiplist_t* sl, sl_finger_t* f, sl_key_t key)
+{
+    if (sl->image.base) {
+        return sl_search_value(sl, key);
+    }
+    
+    node_t* forward = finger_find(sl, f, key);
+    if (forward && KEY_EQ(forward->key, key)) {
+        age_touch(sl, forward);
+        return node_value(forward);
+    }
+    
+    return NULL;
+}
+
+int sl_finger_insert(skiplist_t* sl, sl_finger_t* f, sl_key_t key, const void* value)
+{
+    if (sl->image.base) {
+        return -1;
+    }
+    
+    node_t* forward = finger_find(sl, f, key);
+    if (forward && KEY_EQ(forward->key, key)) {
+        memcpy(node_value(forward), value, sl->value_size);
+        age_touch(sl, forward);
+        return 0;
+    }
+    
+    if (!link_node(sl, f->update, f->rank, key, value)) {
+        return -1;
+    }
+    
+    // an eviction changes mods again, the next finger operation starts at the header
+    f->mods = sl->mods;
+    evict_over(sl);
     return 0;
 }
+
+// one pass from left to right: the finger ends at every new node, so a key behind it climbs
+// only a level or two and the towers of the batch are linked as they come
+long sl_insert_sorted_batch(skiplist_t* sl, const sl_key_t* keys, const void* values, long n)
+{
+    for (long i = 1; i < n; i++) {
+        if (KEY_LT(keys[i], keys[i - 1])) {
+            return -1;
+        }
+    }
+    
+    sl_finger_t f;
+    sl_finger_init(&f);
+    long length = sl->length;
+    for (long i = 0; i < n; i++) {
+        if (sl_finger_insert(sl, &f, keys[i], (const char*)values + i * sl->value_size) < 0) {
+            return -1;
+        }
+    }
+    
+    return sl->length - length;
+}
+
+//////////// iterator
+
+// position at the first key >= key, return false if there is none
+bool sl_seek(sl_iter_t* it, skiplist_t* sl, sl_key_t key)
+{
+    node_t* current = sl->header;
+    node_t* forward = NULL;
+    
+    it->image = NULL;
+    it->node = NULL;
+    if (sl->image.base) {
+        it->image = &sl->image;
+        it->value_size = sl->value_size;
+        it->pos = image_lower_bound(&sl->image, key);
+        return sl_iter_valid(it);
+    }
+    
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while ((forward = current->level[i].next) && KEY_LT(forward->key, key)) {
+            current = forward;
+        }
+    }
+    
+    it->node = current->level[0].next;
+    return it->node != NULL;
+}
+
+bool sl_first(sl_iter_t* it, skiplist_t* sl)
+{
+    it->image = NULL;
+    it->node = NULL;
+    if (sl->image.base) {
+        it->image = &sl->image;
+        it->value_size = sl->value_size;
+        it->pos = 0;
+        return sl_iter_valid(it);
+    }
+    
+    it->node = sl->header->level[0].next;
+    return it->node != NULL;
+}
+
+bool sl_iter_next(sl_iter_t* it)
+{
+    if (it->image) {
+        it->pos += sl_iter_valid(it);
+        return sl_iter_valid(it);
+    }
+    
+    if (it->node) {
+        it->node = it->node->level[0].next;
+    }
+    
+    return it->node != NULL;
+}
+
+bool sl_iter_valid(sl_iter_t* it)
+{
+    if (it->image) {
+        return it->pos < it->image->count[0];
+    }
+    
+    return it->node != NULL;
+}
+
+sl_key_t sl_iter_key(sl_iter_t* it)
+{
+    if (it->image) {
+        return it->image->keys[0][it->pos];
+    }
+    
+    return it->node->key;
+}
+
+void* sl_iter_value(sl_iter_t* it)
+{
+    if (it->image) {
+        return (void*)(it->image->values + it->pos * it->value_size);
+    }
+    
+    return node_value(it->node);
+}
+
+// copy at most max (key, value) pairs in [lo, hi) out, values is an array of value_size slots
+// and may be NULL, return the count
+long sl_range(skiplist_t* sl, sl_key_t lo, sl_key_t hi, sl_key_t* keys, void* values, long max)
+{
+    sl_iter_t it;
+    long count = 0;
+    
+    if (!KEY_LT(lo, hi) || !sl_seek(&it, sl, lo)) {
+        return 0;
+    }
+    
+    for ( ; sl_iter_valid(&it) && KEY_LT(sl_iter_key(&it), hi) && count < max; sl_iter_next(&it)) {
+        keys[count] = sl_iter_key(&it);
+        if (values) {
+            memcpy((char*)values + count * sl->value_size, sl_iter_value(&it), sl->value_size);
+        }
+        count++;
+    }
+    
+    return count;
+}
+
+//////////// snapshot
+
+static uint64_t align8(uint64_t offset)
+{
+    return (offset + 7) & ~7ULL;
+}
+
+static int write_at(FILE* fp, uint64_t offset, const void* p, size_t size)
+{
+    static const char zeros[8];
+    long pad = (long)offset - ftell(fp);
+    if (pad < 0 || fwrite(zeros, 1, pad, fp) != (size_t)pad || (size && fwrite(p, 1, size, fp) != size)) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int write_image(skiplist_t* sl, FILE* fp)
+{
+    image_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = IMAGE_MAGIC;
+    h.version = IMAGE_VERSION;
+    h.key_size = sizeof(sl_key_t);
+    h.value_size = (uint32_t)sl->value_size;
+    h.length = sl->length;
+    h.levels = sl->length > 0 ? sl->level : 1;
+    
+    // the levels first, the offsets follow from the counts
+    h.count[0] = h.length;
+    for (int i = 1; i < (int)h.levels; i++) {
+        for (node_t* x = sl->header->level[i].next; x; x = x->level[i].next) {
+            h.count[i]++;
+        }
+    }
+    
+    uint64_t offset = align8(sizeof(h));
+    h.key_offset[0] = offset;
+    offset = align8(offset + h.length * sizeof(sl_key_t));
+    h.value_offset = offset;
+    offset = align8(offset + h.length * sl->value_size);
+    for (int i = 1; i < (int)h.levels; i++) {
+        h.key_offset[i] = offset;
+        offset = align8(offset + h.count[i] * sizeof(sl_key_t));
+        h.down_offset[i] = offset;
+        offset = align8(offset + h.count[i] * sizeof(uint32_t));
+    }
+    
+    if (write_at(fp, 0, &h, sizeof(h)) != 0) {
+        return -1;
+    }
+    
+    for (node_t* x = sl->header->level[0].next; x; x = x->level[0].next) {
+        if (fwrite(&x->key, sizeof(sl_key_t), 1, fp) != 1) {
+            return -1;
+        }
+    }
+    if (write_at(fp, h.value_offset, NULL, 0) != 0) {
+        return -1;
+    }
+    for (node_t* x = sl->header->level[0].next; x; x = x->level[0].next) {
+        if (fwrite(node_value(x), 1, sl->value_size, fp) != sl->value_size) {
+            return -1;
+        }
+    }
+    
+    for (int i = 1; i < (int)h.levels; i++) {
+        if (write_at(fp, h.key_offset[i], NULL, 0) != 0) {
+            return -1;
+        }
+        for (node_t* x = sl->header->level[i].next; x; x = x->level[i].next) {
+            if (fwrite(&x->key, sizeof(sl_key_t), 1, fp) != 1) {
+                return -1;
+            }
+        }
+        
+        // the towers of level i are a subsequence of level i - 1, walk both together
+        if (write_at(fp, h.down_offset[i], NULL, 0) != 0) {
+            return -1;
+        }
+        node_t* below = sl->header->level[i - 1].next;
+        uint32_t pos = 0;
+        for (node_t* x = sl->header->level[i].next; x; x = x->level[i].next) {
+            while (below != x) {
+                below = below->level[i - 1].next;
+                pos++;
+            }
+            if (fwrite(&pos, sizeof(pos), 1, fp) != 1) {
+                return -1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+int sl_save(skiplist_t* sl, const char* path)
+{
+    if (sl->length > UINT32_MAX) {
+        return -1;
+    }
+    
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return -1;
+    }
+    
+    FILE* fp = fopen(tmp, "wb");
+    if (!fp) {
+        perror("open failed\n");
+        return -1;
+    }
+    
+    int ret = 0;
+    if (sl->image.base) {
+        ret = fwrite(sl->image.base, 1, sl->image.size, fp) == sl->image.size ? 0 : -1;
+    } else {
+        ret = write_image(sl, fp);
+    }
+    
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        ret = -1;
+    }
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp, path) != 0) {
+        ret = -1;
+    }
+    
+    if (ret != 0) {
+        perror("save failed\n");
+        unlink(tmp);
+    }
+    return ret;
+}
+
+// n elements of elem bytes at offset fit in the file and start 8 byte aligned, the values are
+// handed out as int* and the like. the sums are never formed, a huge offset can not wrap around
+static bool image_range_ok(uint64_t offset, uint64_t n, uint64_t elem, uint64_t size)
+{
+    return offset % 8 == 0 && offset <= size && (elem == 0 || n <= (size - offset) / elem);
+}
+
+// the searches trust the arrays, one pass checks them: level 0 keys strictly increase, and on
+// every upper level the down positions strictly increase, stay inside the level below and
+// point at the same key, so the upper keys are sorted too
+static bool image_ok(const sl_image_t* im)
+{
+    for (long j = 1; j < im->count[0]; j++) {
+        if (!KEY_LT(im->keys[0][j - 1], im->keys[0][j])) {
+            return false;
+        }
+    }
+    
+    for (int i = 1; i < im->levels; i++) {
+        const uint32_t* down = im->down[i];
+        for (long j = 0; j < im->count[i]; j++) {
+            if (down[j] >= im->count[i - 1] || (j > 0 && down[j] <= down[j - 1]) ||
+                !KEY_EQ(im->keys[i][j], im->keys[i - 1][down[j]])) {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+skiplist_t* sl_load(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open failed\n");
+        return NULL;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(image_header_t)) {
+        printf("sl_load: %s is not a skip list file\n", path);
+        close(fd);
+        return NULL;
+    }
+    
+    // the mapping keeps the file, the descriptor is not needed any more
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap failed\n");
+        return NULL;
+    }
+    
+    const image_header_t* h = base;
+    uint64_t size = st.st_size;
+    bool ok = h->magic == IMAGE_MAGIC && h->version == IMAGE_VERSION &&
+              h->key_size == sizeof(sl_key_t) && h->levels >= 1 && h->levels <= MAX_LEVEL &&
+              h->length <= UINT32_MAX && h->count[0] == h->length &&
+              image_range_ok(h->value_offset, h->length, h->value_size, size);
+    for (int i = 0; ok && i < (int)h->levels; i++) {
+        ok = image_range_ok(h->key_offset[i], h->count[i], sizeof(sl_key_t), size) &&
+             (i == 0 || (h->count[i] <= h->count[i - 1] &&
+                         image_range_ok(h->down_offset[i], h->count[i], sizeof(uint32_t), size)));
+    }
+    
+    sl_image_t im;
+    memset(&im, 0, sizeof(im));
+    if (ok) {
+        im.base = base;
+        im.size = st.st_size;
+        im.levels = h->levels;
+        im.values = (const char*)base + h->value_offset;
+        for (int i = 0; i < im.levels; i++) {
+            im.count[i] = h->count[i];
+            im.keys[i] = (const sl_key_t*)((const char*)base + h->key_offset[i]);
+            im.down[i] = i > 0 ? (const uint32_t*)((const char*)base + h->down_offset[i]) : NULL;
+        }
+        ok = image_ok(&im);
+    }
+    
+    skiplist_t* sl = ok ? malloc(sizeof(skiplist_t)) : NULL;
+    if (!sl) {
+        if (!ok) {
+            printf("sl_load: %s is not a skip list file\n", path);
+        }
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    
+    memset(sl, 0, sizeof(skiplist_t));
+    sl->level = h->levels;
+    sl->length = h->length;
+    sl->value_size = h->value_size;
+    sl->memory = sizeof(skiplist_t);
+    sl->evict = SL_EVICT_NONE;
+    sl->image = im;
+    
+    return sl;
+}
+
+//////////// benchmark
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// insert and search n random keys with each p, node memory leaves out the malloc header
+static void bench(int n)
+{
+    const char* names[] = {"1/2", "1/4", "1/e"};
+    sl_key_t* keys = malloc(n * sizeof(sl_key_t));
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        keys[i] = (int)(xorshift(&state) >> 33);
+    }
+    
+    printf("%d random keys, node arena %s\n", n, NODE_ARENA ? "on" : "off");
+    printf("%4s %12s %12s %10s %12s %6s\n", "p", "insert ns", "search ns", "ptrs/node", "bytes/node", "level");
+    for (sl_prob_t prob = SL_P_HALF; prob <= SL_P_INV_E; prob++) {
+        skiplist_t* sl = create_skiplist_with(prob, 42);
+        
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < n; i++) {
+            sl_insert(sl, keys[i], i);
+        }
+        uint64_t insert_ns = get_nano_tick() - start;
+        
+        start = get_nano_tick();
+        long found = 0;
+        for (int i = 0; i < n; i++) {
+            found += sl_search(sl, keys[i]) != NULL;
+        }
+        uint64_t search_ns = get_nano_tick() - start;
+        
+        long nodes = 0;
+        long pointers = 0;
+        for (int i = 0; i < sl->level; i++) {
+            for (node_t* x = sl->header->level[i].next; x; x = x->level[i].next) {
+                nodes += i == 0;
+                pointers++;
+            }
+        }
+        
+        printf("%4s %12.1f %12.1f %10.2f %12.2f %6d\n", names[prob], (double)insert_ns / n,
+               (double)search_ns / n, (double)pointers / nodes,
+               sizeof(node_t) + (double)pointers * sizeof(struct sl_level) / nodes + sl->node_extra,
+               sl->level);
+        if (found != n) {
+            printf("search FAILED\n");
+        }
+        sl_destroy(sl);
+    }
+    
+    free(keys);
+}
+
+//////////// test
+
+// on every level the spans add up to the level 0 positions of the nodes and to the length
+static bool check_spans(skiplist_t* sl)
+{
+    for (int i = 0; i < sl->level; i++) {
+        node_t* below = sl->header;
+        long pos = 0;
+        long below_pos = 0;
+        for (node_t* x = sl->header; x; x = x->level[i].next) {
+            while (below != x) {
+                below = below->level[0].next;
+                below_pos++;
+                if (!below) {
+                    return false;
+                }
+            }
+            if (pos != below_pos) {
+                return false;
+            }
+            
+            pos += x->level[i].span;
+            if (!x->level[i].next && pos != sl->length) {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+// random inserts and deletes, then seek, range, rank and kth against a sorted array
+static int run_test(int key_range, int ops)
+{
+    skiplist_t* sl = create_skiplist_with(SL_P_HALF, 7);
+    int* values = malloc(key_range * sizeof(int));
+    int* keys = malloc(key_range * sizeof(int));
+    sl_key_t* out_keys = malloc(key_range * sizeof(sl_key_t));
+    int* out_values = malloc(key_range * sizeof(int));
+    int errors = 0;
+    uint64_t seed = 99;
+    
+    for (int k = 0; k < key_range; k++) {
+        values[k] = -1;
+    }
+    for (int i = 0; i < ops; i++) {
+        uint64_t r = xorshift(&seed);
+        int k = (int)((r >> 8) % key_range);
+        if (r % 3 != 0) {
+            sl_insert(sl, k, i);
+            values[k] = i;
+        } else {
+            sl_delete(sl, k);
+            values[k] = -1;
+        }
+    }
+    
+    long n = 0;
+    for (int k = 0; k < key_range; k++) {
+        if (values[k] >= 0) {
+            keys[n++] = k;
+        }
+    }
+    errors += sl_length(sl) != n || !check_spans(sl);
+    
+    long pos = 0;
+    for (int k = 0; k < key_range; k++) {
+        sl_key_t key = -1;
+        int* p = sl_kth(sl, pos, &key);
+        long rank = sl_rank(sl, k);
+        
+        sl_iter_t it;
+        bool found = sl_seek(&it, sl, k);
+        errors += found != (pos < n) || (found && sl_iter_key(&it) != keys[pos]);
+        
+        if (values[k] >= 0) {
+            errors += rank != pos || !p || key != k || *p != values[k];
+            pos++;
+        } else {
+            errors += rank != -1;
+        }
+    }
+    errors += sl_kth(sl, n, NULL) != NULL || sl_kth(sl, -1, NULL) != NULL;
+    
+    // ranges of every length at a few starts, and a full iteration
+    for (int lo = -1; lo < key_range; lo += key_range / 7 + 1) {
+        for (int len = 0; len < 300; len += 13) {
+            long count = sl_range(sl, lo, lo + len, out_keys, out_values, 100);
+            long expected = 0;
+            for (int k = lo < 0 ? 0 : lo; k < lo + len && k < key_range && expected < 100; k++) {
+                if (values[k] >= 0) {
+                    errors += out_keys[expected] != k || out_values[expected] != values[k];
+                    expected++;
+                }
+            }
+            errors += count != expected;
+        }
+    }
+    
+    sl_iter_t it;
+    long count = 0;
+    for (bool ok = sl_first(&it, sl); ok; ok = sl_iter_next(&it)) {
+        errors += count >= n || sl_iter_key(&it) != keys[count] || *(int*)sl_iter_value(&it) != values[keys[count]];
+        count++;
+    }
+    errors += count != n;
+    
+    printf("%d keys, %d ops, %ld in the list: %s\n", key_range, ops, n, errors ? "FAILED" : "ok");
+    sl_destroy(sl);
+    free(values);
+    free(keys);
+    free(out_keys);
+    free(out_values);
+    return errors ? 1 : 0;
+}
+
+// finger inserts in runs going up and down and at random, mixed with plain deletes that make
+// the finger stale, then sorted batches, checked like run_test
+static int run_finger_test(int key_range, int ops)
+{
+    skiplist_t* sl = create_skiplist_with(SL_P_QUARTER, 11);
+    int* values = malloc(key_range * sizeof(int));
+    int errors = 0;
+    uint64_t seed = 5;
+    sl_finger_t f;
+    sl_finger_init(&f);
+    
+    for (int k = 0; k < key_range; k++) {
+        values[k] = -1;
+    }
+    
+    int k = 0;
+    int step = 1;
+    for (int i = 0; i < ops; i++) {
+        uint64_t r = xorshift(&seed);
+        if (r % 64 == 0) {
+            step = (int)(r >> 8) % 7 - 3;   // a new run, maybe backwards or random jumps
+        }
+        k = step ? k + step : (int)((r >> 16) % key_range);
+        k = ((k % key_range) + key_range) % key_range;
+        
+        if (r % 11 == 0) {
+            sl_delete(sl, k);
+            values[k] = -1;
+        } else if (r % 7 == 0) {
+            int* p = sl_finger_search(sl, &f, k);
+            errors += values[k] >= 0 ? (!p || *p != values[k]) : p != NULL;
+        } else {
+            sl_finger_insert(sl, &f, k, &i);
+            values[k] = i;
+        }
+    }
+    
+    // sorted batches with repeats over what is there
+    sl_key_t* keys = malloc(1000 * sizeof(sl_key_t));
+    int* batch_values = malloc(1000 * sizeof(int));
+    for (int b = 0; b < 20; b++) {
+        long n = 0;
+        long expected = 0;
+        for (int j = (int)(xorshift(&seed) % 100); j < key_range && n < 1000; j += (int)(xorshift(&seed) % 50)) {
+            expected += values[j] < 0 && (n == 0 || keys[n - 1] != j);
+            keys[n] = j;
+            batch_values[n] = b * 1000 + (int)n;
+            values[j] = batch_values[n];
+            n++;
+        }
+        errors += sl_insert_sorted_batch(sl, keys, batch_values, n) != expected;
+    }
+    keys[0] = 2;
+    keys[1] = 1;
+    errors += sl_insert_sorted_batch(sl, keys, batch_values, 2) != -1;
+    
+    long n = 0;
+    for (int j = 0; j < key_range; j++) {
+        int* p = sl_search(sl, j);
+        errors += values[j] >= 0 ? (!p || *p != values[j] || sl_rank(sl, j) != n++) : p != NULL;
+    }
+    errors += sl_length(sl) != n || !check_spans(sl);
+    
+    printf("finger: %d keys, %d ops, %ld in the list: %s\n", key_range, ops, n, errors ? "FAILED" : "ok");
+    sl_destroy(sl);
+    free(values);
+    free(keys);
+    free(batch_values);
+    return errors ? 1 : 0;
+}
+
+// 20 byte values: copied in, read in place, copied out, in batches and ranges
+static int run_value_test(int n)
+{
+    typedef struct { int a; char name[16]; } payload_t;
+    skiplist_t* sl = create_skiplist_ex(SL_P_QUARTER, 3, sizeof(payload_t));
+    int errors = 0;
+    
+    for (int k = n - 1; k >= 0; k--) {
+        payload_t v = {k * 3, ""};
+        snprintf(v.name, sizeof(v.name), "key-%d", k);
+        sl_insert_value(sl, k * 2, &v);
+    }
+    errors += sl_insert(sl, 1, 1) != -1 || sl_search(sl, 0) != NULL;
+    
+    for (int k = 0; k < n * 2; k++) {
+        payload_t* p = sl_search_value(sl, k);
+        payload_t copy;
+        char name[16];
+        snprintf(name, sizeof(name), "key-%d", k / 2);
+        if (k % 2 == 0) {
+            errors += !p || p->a != k / 2 * 3 || strcmp(p->name, name) != 0;
+            errors += !sl_get(sl, k, &copy) || memcmp(&copy, p, sizeof(copy)) != 0;
+            p->a++;    // written in place
+        } else {
+            errors += p != NULL || sl_get(sl, k, &copy);
+        }
+    }
+    
+    sl_key_t keys[10];
+    payload_t values[10];
+    long count = sl_range(sl, 10, 30, keys, values, 10);
+    for (long i = 0; i < count; i++) {
+        errors += keys[i] != 10 + i * 2 || values[i].a != (5 + i) * 3 + 1;
+    }
+    errors += count != 10;
+    
+    printf("values: %d keys of %zu bytes: %s\n", n, sizeof(payload_t), errors ? "FAILED" : "ok");
+    sl_destroy(sl);
+    return errors ? 1 : 0;
+}
+
+typedef struct {
+    int*  evicted;      // evicted[k] is the value key k had when it was evicted
+    long  count;
+} evict_log_t;
+
+static void log_evict(void* ctx, sl_key_t key, void* value)
+{
+    evict_log_t* log = ctx;
+    log->evicted[key] = *(int*)value;
+    log->count++;
+}
+
+// random inserts, searches and deletes on a full list of every evict policy against a model
+// that stamps keys with the time of their last use, then clear and reuse
+static int run_bounded_test(sl_evict_t evict, int key_range, long capacity, int ops)
+{
+    const char* names[] = {"none", "oldest", "lru", "smallest"};
+    skiplist_t* sl = create_skiplist_bounded(SL_P_HALF, 13, sizeof(int), capacity, evict);
+    int* values = malloc(key_range * sizeof(int));
+    long* stamps = malloc(key_range * sizeof(long));
+    evict_log_t log = {malloc(key_range * sizeof(int)), 0};
+    long evictions = 0;
+    long n = 0;
+    int errors = 0;
+    uint64_t seed = 17;
+    
+    sl_set_on_evict(sl, log_evict, &log);
+    size_t empty = sl_memory_usage(sl);
+    for (int k = 0; k < key_range; k++) {
+        values[k] = -1;
+    }
+    
+    for (int i = 0; i < ops; i++) {
+        uint64_t r = xorshift(&seed);
+        int k = (int)((r >> 8) % key_range);
+        if (r % 8 < 5) {
+            bool full = values[k] < 0 && n == capacity;
+            int ret = sl_insert(sl, k, i);
+            if (evict == SL_EVICT_NONE && full) {
+                errors += ret != -1;
+                continue;
+            }
+            errors += ret != 0;
+            
+            if (values[k] < 0 || evict == SL_EVICT_LRU) {
+                stamps[k] = i;
+            }
+            if (values[k] < 0) {
+                n++;
+            }
+            values[k] = i;
+            
+            if (n > capacity) {
+                // the model victim: the smallest key or the smallest stamp
+                int victim = -1;
+                for (int j = 0; j < key_range; j++) {
+                    if (values[j] >= 0 && (victim < 0 || (evict != SL_EVICT_SMALLEST && stamps[j] < stamps[victim]))) {
+                        victim = j;
+                    }
+                }
+                
+                errors += log.count != ++evictions || log.evicted[victim] != values[victim];
+                values[victim] = -1;
+                n--;
+            }
+        } else if (r % 8 < 7) {
+            int* p = sl_search(sl, k);
+            errors += values[k] >= 0 ? (!p || *p != values[k]) : p != NULL;
+            if (p && evict == SL_EVICT_LRU) {
+                stamps[k] = i;
+            }
+        } else {
+            sl_delete(sl, k);
+            n -= values[k] >= 0;
+            values[k] = -1;
+        }
+        errors += sl_length(sl) != n;
+    }
+    
+    errors += log.count != evictions || !check_spans(sl);
+    for (int k = 0; k < key_range; k++) {
+        int* p = sl_search(sl, k);
+        errors += values[k] >= 0 ? (!p || *p != values[k]) : p != NULL;
+    }
+    
+    size_t full = sl_memory_usage(sl);
+    sl_clear(sl);
+    errors += sl_length(sl) != 0 || sl_search(sl, 1) != NULL || sl_memory_usage(sl) != empty;
+    for (int k = 0; k < 100; k++) {
+        errors += sl_insert(sl, k, k) != 0;
+    }
+    errors += sl_length(sl) != (capacity < 100 ? capacity : 100) || !check_spans(sl);
+    
+    printf("bounded %s: %d keys, capacity %ld, %ld evicted, %zu bytes: %s\n", names[evict], key_range,
+           capacity, evictions, full, errors ? "FAILED" : "ok");
+    sl_destroy(sl);
+    free(values);
+    free(stamps);
+    free(log.evicted);
+    return errors ? 1 : 0;
+}
+
+// save a list, load it and compare every read function, then save the loaded list again
+static int run_snapshot_test(const char* path, int key_range, int ops)
+{
+    skiplist_t* sl = create_skiplist_with(SL_P_INV_E, 23);
+    uint64_t seed = 31;
+    int errors = 0;
+    
+    for (int i = 0; i < ops; i++) {
+        uint64_t r = xorshift(&seed);
+        int k = (int)((r >> 8) % key_range);
+        if (r % 4 != 0) {
+            sl_insert(sl, k, i);
+        } else {
+            sl_delete(sl, k);
+        }
+    }
+    
+    unlink(path);
+    errors += sl_save(sl, path) != 0;
+    skiplist_t* im = sl_load(path);
+    if (!im) {
+        printf("snapshot: load FAILED\n");
+        sl_destroy(sl);
+        return 1;
+    }
+    
+    errors += sl_length(im) != sl_length(sl);
+    for (int k = -1; k <= key_range; k++) {
+        int* p = sl_search(sl, k);
+        int* q = sl_search(im, k);
+        errors += p ? (!q || *q != *p) : q != NULL;
+        errors += sl_rank(im, k) != sl_rank(sl, k);
+        
+        sl_iter_t a;
+        sl_iter_t b;
+        bool found = sl_seek(&a, sl, k);
+        errors += sl_seek(&b, im, k) != found || (found && sl_iter_key(&a) != sl_iter_key(&b));
+    }
+    
+    sl_iter_t a;
+    sl_iter_t b;
+    long pos = 0;
+    bool more = sl_first(&a, sl);
+    errors += sl_first(&b, im) != more;
+    for ( ; more; more = sl_iter_next(&a)) {
+        sl_key_t key;
+        int* p = sl_kth(im, pos++, &key);
+        errors += !sl_iter_valid(&b) || sl_iter_key(&b) != sl_iter_key(&a) || key != sl_iter_key(&a) ||
+                  *(int*)sl_iter_value(&b) != *(int*)sl_iter_value(&a) || p != sl_iter_value(&b);
+        sl_iter_next(&b);
+    }
+    errors += sl_iter_valid(&b) || sl_kth(im, pos, NULL) != NULL;
+    
+    sl_key_t keys[2][50];
+    int values[2][50];
+    for (int lo = 0; lo < key_range; lo += key_range / 5) {
+        long count = sl_range(sl, lo, lo + 100, keys[0], values[0], 50);
+        errors += sl_range(im, lo, lo + 100, keys[1], values[1], 50) != count ||
+                  memcmp(keys[0], keys[1], count * sizeof(sl_key_t)) != 0 ||
+                  memcmp(values[0], values[1], count * sizeof(int)) != 0;
+    }
+    
+    // read only, and a loaded list saves and loads again
+    errors += sl_insert(im, 1, 1) != -1 || sl_delete(im, 1) != -1;
+    errors += sl_save(im, path) != 0;
+    sl_destroy(im);
+    im = sl_load(path);
+    errors += !im || sl_length(im) != sl_length(sl) || sl_rank(im, key_range / 2) != sl_rank(sl, key_range / 2);
+    sl_destroy(im);
+    
+    // a down position out of its level and two swapped keys pass the header checks, the
+    // load must still refuse them
+    image_header_t h;
+    int fd = open(path, O_RDWR);
+    bool header = fd >= 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.levels >= 2 && h.count[1] >= 2;
+    errors += !header;
+    if (header) {
+        uint32_t down = 0;
+        uint32_t bad = (uint32_t)h.count[0];
+        errors += pread(fd, &down, sizeof(down), h.down_offset[1]) != sizeof(down);
+        errors += pwrite(fd, &bad, sizeof(bad), h.down_offset[1]) != sizeof(bad) || sl_load(path) != NULL;
+        errors += pwrite(fd, &down, sizeof(down), h.down_offset[1]) != sizeof(down);
+        
+        sl_key_t pair[2];
+        sl_key_t swapped[2];
+        errors += pread(fd, pair, sizeof(pair), h.key_offset[0]) != sizeof(pair);
+        swapped[0] = pair[1];
+        swapped[1] = pair[0];
+        errors += pwrite(fd, swapped, sizeof(swapped), h.key_offset[0]) != sizeof(swapped) || sl_load(path) != NULL;
+        errors += pwrite(fd, pair, sizeof(pair), h.key_offset[0]) != sizeof(pair);
+        
+        // value_offset + length * value_size wraps around to a small number
+        image_header_t wrapped = h;
+        wrapped.value_size = 0x80000000u;
+        wrapped.value_offset = 64 - h.length * (uint64_t)wrapped.value_size;
+        errors += pwrite(fd, &wrapped, sizeof(wrapped), 0) != sizeof(wrapped) || sl_load(path) != NULL;
+        wrapped = h;
+        wrapped.value_offset = h.value_offset + 4;
+        errors += pwrite(fd, &wrapped, sizeof(wrapped), 0) != sizeof(wrapped) || sl_load(path) != NULL;
+        errors += pwrite(fd, &h, sizeof(h), 0) != sizeof(h);
+        
+        im = sl_load(path);
+        errors += !im;
+        sl_destroy(im);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    // a cut file and an empty list
+    errors += truncate(path, sizeof(image_header_t) + 8) != 0 || sl_load(path) != NULL;
+    sl_clear(sl);
+    errors += sl_save(sl, path) != 0;
+    im = sl_load(path);
+    errors += !im || sl_length(im) != 0 || sl_search(im, 1) != NULL || sl_first(&b, im);
+    sl_destroy(im);
+    
+    printf("snapshot: %d keys, %d ops: %s\n", key_range, ops, errors ? "FAILED" : "ok");
+    unlink(path);
+    sl_destroy(sl);
+    return errors ? 1 : 0;
+}
+
+// drop the file from the page cache so the next load starts cold
+static void evict_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// time to the first lookup after a restart: map a saved list against inserting every key again,
+// from random order and from a sorted dump
+static void bench_load(const char* path, int n)
+{
+    int num_lookups = 1000000;
+    sl_key_t* keys = malloc(n * sizeof(sl_key_t));
+    int* values = malloc(n * sizeof(int));
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        keys[i] = (int)(xorshift(&state) >> 33);
+        values[i] = i;
+    }
+    
+    uint64_t start = get_nano_tick();
+    skiplist_t* sl = create_skiplist();
+    for (int i = 0; i < n; i++) {
+        sl_insert(sl, keys[i], values[i]);
+    }
+    sl_search(sl, keys[n / 2]);
+    uint64_t rebuild_ns = get_nano_tick() - start;
+    
+    // the sorted dump a restart without the file would read
+    long length = sl_length(sl);
+    sl_range(sl, INT32_MIN, INT32_MAX, keys, values, length);
+    
+    start = get_nano_tick();
+    unlink(path);
+    sl_save(sl, path);
+    uint64_t save_ns = get_nano_tick() - start;
+    size_t memory = sl_memory_usage(sl);
+    sl_destroy(sl);
+    
+    start = get_nano_tick();
+    sl = create_skiplist();
+    sl_insert_sorted_batch(sl, keys, values, length);
+    sl_search(sl, keys[length / 2]);
+    uint64_t batch_ns = get_nano_tick() - start;
+    
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    start = get_nano_tick();
+    for (int i = 0; i < num_lookups; i++) {
+        sl_search(sl, keys[xorshift(&seed) % length]);
+    }
+    uint64_t list_ns = get_nano_tick() - start;
+    sl_destroy(sl);
+    
+    evict_file(path);
+    start = get_nano_tick();
+    skiplist_t* im = sl_load(path);
+    sl_search(im, keys[length / 2]);
+    uint64_t load_ns = get_nano_tick() - start;
+    
+    seed = 0x9E3779B97F4A7C15ULL;
+    start = get_nano_tick();
+    for (int i = 0; i < num_lookups; i++) {
+        sl_search(im, keys[xorshift(&seed) % length]);
+    }
+    uint64_t image_ns = get_nano_tick() - start;
+    
+    printf("%ld keys, %d levels, %.1f MiB file, %.1f MiB list\n", length, im->level,
+           (double)im->image.size / (1 << 20), (double)memory / (1 << 20));
+    printf("%-28s %12.3f ms\n", "load + first lookup", load_ns / 1e6);
+    printf("%-28s %12.3f ms\n", "rebuild + first lookup", rebuild_ns / 1e6);
+    printf("%-28s %12.3f ms\n", "sorted batch + first lookup", batch_ns / 1e6);
+    printf("%-28s %12.3f ms\n", "save", save_ns / 1e6);
+    printf("%-28s %12.1f ns\n", "lookup in the list, per op", (double)list_ns / num_lookups);
+    printf("%-28s %12.1f ns\n", "lookup after load, per op", (double)image_ns / num_lookups);
+    
+    sl_destroy(im);
+    unlink(path);
+    free(keys);
+    free(values);
+}
+
+// insert n keys in sorted, reverse sorted and random order, one by one from the header, with
+// a finger, and as one sorted batch where the order allows it
+static void bench_finger(int n)
+{
+    const char* orders[] = {"sorted", "reverse", "random"};
+    sl_key_t* keys = malloc(n * sizeof(sl_key_t));
+    int* values = malloc(n * sizeof(int));
+    uint64_t state = 88172645463325252ULL;
+    
+    printf("%d keys (ns per key)\n", n);
+    printf("%8s %12s %12s %12s\n", "input", "sl_insert", "finger", "batch");
+    for (int o = 0; o < 3; o++) {
+        for (int i = 0; i < n; i++) {
+            keys[i] = o == 0 ? i * 2 : (o == 1 ? (n - i) * 2 : (int)(xorshift(&state) >> 33));
+            values[i] = i;
+        }
+        
+        double ns[3];
+        for (int m = 0; m < 3; m++) {
+            if (m == 2 && o != 0) {
+                ns[m] = 0;
+                continue;
+            }
+            
+            skiplist_t* sl = create_skiplist_with(SL_P_HALF, 42);
+            sl_finger_t f;
+            sl_finger_init(&f);
+            
+            uint64_t start = get_nano_tick();
+            if (m == 0) {
+                for (int i = 0; i < n; i++) {
+                    sl_insert(sl, keys[i], i);
+                }
+            } else if (m == 1) {
+                for (int i = 0; i < n; i++) {
+                    sl_finger_insert(sl, &f, keys[i], &i);
+                }
+            } else {
+                sl_insert_sorted_batch(sl, keys, values, n);
+            }
+            ns[m] = (double)(get_nano_tick() - start) / n;
+            
+            if ((o < 2 && sl_length(sl) != n) || !check_spans(sl)) {
+                printf("insert FAILED\n");
+            }
+            sl_destroy(sl);
+        }
+        
+        printf("%8s %12.1f %12.1f", orders[o], ns[0], ns[1]);
+        if (o == 0) {
+            printf(" %12.1f\n", ns[2]);
+        } else {
+            printf(" %12s\n", "-");
+        }
+    }
+    
+    free(keys);
+    free(values);
+}
+
+// for test
+#define MAX_KEY 100
+int main(int argc, const char * argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: skiplist bench [num_keys]
+        bench(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "bench-load") == 0) {
+        // usage: skiplist bench-load [num_keys] [file]
+        bench_load(argc >= 4 ? argv[3] : "skiplist_bench.img", argc >= 3 ? atoi(argv[2]) : 10000000);
+        return 0;
+    }
+    
+    if (argc >= 2 && strcmp(argv[1], "bench-finger") == 0) {
+        // usage: skiplist bench-finger [num_keys]
+        bench_finger(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    skiplist_t* sl = create_skiplist();
+    
+    for (int i = 0; i < MAX_KEY; i++) {
+        sl_insert(sl, i, i);
+    }
+    
+    for (int i = 0; i < MAX_KEY; i += 3) {
+        sl_delete(sl, i);
+    }
+    
+    for (int i = 0; i < MAX_KEY; i++) {
+        int* p = sl_search(sl, i);
+        if (p) {
+            printf("get value(%d)=%d\n", i, *p);
+        } else {
+            printf("get value(%d)=NULL\n", i);
+        }
+    }
+    
+    int failed = 0;
+    failed |= run_test(1000, 5000);
+    failed |= run_test(100000, 300000);
+    failed |= run_finger_test(1000, 20000);
+    failed |= run_finger_test(100000, 500000);
+    failed |= run_value_test(10000);
+    for (sl_evict_t evict = SL_EVICT_NONE; evict <= SL_EVICT_SMALLEST; evict++) {
+        failed |= run_bounded_test(evict, 1000, 100, 20000);
+    }
+    failed |= run_snapshot_test("skiplist_test.img", 100000, 300000);
+    
+    sl_destroy(sl);
+    return failed;
+}
@@ -0,0 +1,543 @@
+//
+//  skiplist_fat.c
+//  skiplist
+//
+//  Created by jianqing.du on 16-4-12.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ unrolled skip list: every node holds a sorted run of up to run_size keys, the towers only
+ index the smallest key of each node. a search descends the towers like skiplist.c and then
+ binary searches one run, so the last levels that cost a cache miss per hop in skiplist.c
+ become one or two cache lines of keys.
+
+ a full node splits in half, the new node gets its own random level. a node that shrinks to
+ a quarter of run_size together with its successor takes the successor's keys.
+
+ nodes are cut from slabs, one arena per level like skiplist.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LEVEL 32
+#define SLAB_SIZE (64 * 1024)
+#define MAX_RUN_SIZE 1024
+
+// keys[run_size] and values[run_size] follow next[level]
+typedef struct node {
+    int    num_keys;
+    int    level;
+    struct node* next[];
+} node_t;
+
+typedef struct slab {
+    struct slab* next;
+} slab_t;
+
+// nodes of one level cut from slabs, a freed node is linked through next[0]
+typedef struct {
+    size_t  node_size;
+    slab_t* slabs;
+    char*   bump;
+    char*   bump_end;
+    node_t* free_list;
+} node_arena_t;
+
+typedef struct {
+    int       level;
+    int       run_size;
+    long      num_keys;
+    node_t*   header;
+    uint64_t  seed;
+    node_arena_t arenas[MAX_LEVEL];
+} fat_skiplist_t;
+
+// api
+fat_skiplist_t* create_fat_skiplist(int run_size);
+void fat_destroy(fat_skiplist_t* sl);
+int fat_insert(fat_skiplist_t* sl, int key, int value);
+int fat_delete(fat_skiplist_t* sl, int key);
+int* fat_search(fat_skiplist_t* sl, int key);
+
+////////
+
+static int* node_keys(node_t* n)
+{
+    return (int*)&n->next[n->level];
+}
+
+static int* node_values(fat_skiplist_t* sl, node_t* n)
+{
+    return node_keys(n) + sl->run_size;
+}
+
+static uint64_t sl_rand(fat_skiplist_t* sl)
+{
+    // xorshift64*
+    uint64_t x = sl->seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sl->seed = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// p = 1/2, a node stands for run_size / 2 keys or more, so the towers need fewer levels
+static int rand_level(fat_skiplist_t* sl)
+{
+    return 1 + __builtin_ctzll(sl_rand(sl) | (1ULL << (MAX_LEVEL - 1)));
+}
+
+static node_t* new_node(fat_skiplist_t* sl, int level)
+{
+    node_arena_t* a = &sl->arenas[level - 1];
+    node_t* n = a->free_list;
+    if (n) {
+        a->free_list = n->next[0];
+    } else {
+        if (a->bump == a->bump_end) {
+            char* slab = malloc(SLAB_SIZE);
+            if (!slab) {
+                perror("malloc failed\n");
+                exit(1);
+            }
+            
+            ((slab_t*)slab)->next = a->slabs;
+            a->slabs = (slab_t*)slab;
+            a->bump = slab + sizeof(slab_t);
+            a->bump_end = a->bump + (SLAB_SIZE - sizeof(slab_t)) / a->node_size * a->node_size;
+        }
+        
+        n = (node_t*)a->bump;
+        a->bump += a->node_size;
+    }
+    
+    n->num_keys = 0;
+    n->level = level;
+    for (int i = 0; i < level; i++) {
+        n->next[i] = NULL;
+    }
+    
+    return n;
+}
+
+static void free_node(fat_skiplist_t* sl, node_t* n)
+{
+    node_arena_t* a = &sl->arenas[n->level - 1];
+    n->next[0] = a->free_list;
+    a->free_list = n;
+}
+
+fat_skiplist_t* create_fat_skiplist(int run_size)
+{
+    if (run_size < 2 || run_size > MAX_RUN_SIZE) {
+        return NULL;
+    }
+    
+    fat_skiplist_t* sl = malloc(sizeof(fat_skiplist_t));
+    if (!sl) {
+        return NULL;
+    }
+    
+    sl->level = 1;
+    sl->run_size = run_size;
+    sl->num_keys = 0;
+    sl->seed = 0x9E3779B97F4A7C15ULL;
+    // slabs of 64K hold the largest level with runs up to MAX_RUN_SIZE
+    size_t run_bytes = 2 * run_size * sizeof(int);
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        node_arena_t* a = &sl->arenas[i];
+        a->node_size = (sizeof(node_t) + (i + 1) * sizeof(node_t*) + run_bytes + 7) & ~(size_t)7;
+        a->slabs = NULL;
+        a->bump = NULL;
+        a->bump_end = NULL;
+        a->free_list = NULL;
+    }
+    
+    sl->header = new_node(sl, MAX_LEVEL);
+    return sl;
+}
+
+void fat_destroy(fat_skiplist_t* sl)
+{
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        slab_t* s = sl->arenas[i].slabs;
+        while (s) {
+            slab_t* next = s->next;
+            free(s);
+            s = next;
+        }
+    }
+    
+    free(sl);
+}
+
+// first position in the run with keys[pos] >= key
+static int run_search(int* keys, int n, int key)
+{
+    int lo = 0;
+    int hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo;
+}
+
+// update[i] is the last node of level i whose smallest key is < key
+static void find_path(fat_skiplist_t* sl, int key, node_t** update)
+{
+    node_t* current = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        node_t* forward;
+        while ((forward = current->next[i]) && node_keys(forward)[0] < key) {
+            current = forward;
+        }
+        
+        update[i] = current;
+    }
+}
+
+// the node is linked after prev on level 0. on a level it has, its predecessor is prev if prev
+// reaches that level, else the last node before prev, which update holds
+static void link_after(fat_skiplist_t* sl, node_t* n, node_t* prev, node_t** update)
+{
+    for (int i = sl->level; i < n->level; i++) {
+        update[i] = sl->header;
+    }
+    if (n->level > sl->level) {
+        sl->level = n->level;
+    }
+    
+    for (int i = 0; i < n->level; i++) {
+        node_t* p = i < prev->level ? prev : update[i];
+        n->next[i] = p->next[i];
+        p->next[i] = n;
+    }
+}
+
+static void unlink_after(fat_skiplist_t* sl, node_t* n, node_t* prev, node_t** update)
+{
+    for (int i = 0; i < n->level; i++) {
+        node_t* p = i < prev->level ? prev : update[i];
+        p->next[i] = n->next[i];
+    }
+    
+    free_node(sl, n);
+    while (sl->level > 1 && sl->header->next[sl->level - 1] == NULL) {
+        sl->level--;
+    }
+}
+
+// return 0 if the key is inserted, 1 if it existed and its value is replaced
+int fat_insert(fat_skiplist_t* sl, int key, int value)
+{
+    node_t* update[MAX_LEVEL];
+    find_path(sl, key, update);
+    
+    // the key goes into the node with the largest smallest key <= key, or the first node
+    node_t* target = update[0];
+    node_t* forward = target->next[0];
+    if (forward && node_keys(forward)[0] == key) {
+        node_values(sl, forward)[0] = value;
+        return 1;
+    }
+    
+    if (target == sl->header) {
+        if (!forward) {
+            node_t* n = new_node(sl, rand_level(sl));
+            node_keys(n)[0] = key;
+            node_values(sl, n)[0] = value;
+            n->num_keys = 1;
+            link_after(sl, n, sl->header, update);
+            sl->num_keys++;
+            return 0;
+        }
+        
+        target = forward;   // the new key becomes its smallest, the towers stay in order
+    }
+    
+    int* keys = node_keys(target);
+    int pos = run_search(keys, target->num_keys, key);
+    if (pos < target->num_keys && keys[pos] == key) {
+        node_values(sl, target)[pos] = value;
+        return 1;
+    }
+    
+    if (target->num_keys == sl->run_size) {
+        int half = sl->run_size / 2;
+        node_t* n = new_node(sl, rand_level(sl));
+        n->num_keys = target->num_keys - half;
+        memcpy(node_keys(n), keys + half, n->num_keys * sizeof(int));
+        memcpy(node_values(sl, n), node_values(sl, target) + half, n->num_keys * sizeof(int));
+        target->num_keys = half;
+        link_after(sl, n, target, update);
+        
+        if (pos > half) {
+            target = n;
+            keys = node_keys(n);
+            pos -= half;
+        }
+    }
+    
+    int* values = node_values(sl, target);
+    int move = target->num_keys - pos;
+    memmove(keys + pos + 1, keys + pos, move * sizeof(int));
+    memmove(values + pos + 1, values + pos, move * sizeof(int));
+    keys[pos] = key;
+    values[pos] = value;
+    target->num_keys++;
+    sl->num_keys++;
+    
+    return 0;
+}
+
+// return 0 if the key is deleted, -1 if not found
+int fat_delete(fat_skiplist_t* sl, int key)
+{
+    node_t* update[MAX_LEVEL];
+    find_path(sl, key, update);
+    
+    node_t* target = update[0];
+    node_t* prev = NULL;    // the node before target if the key is its smallest
+    if (target->next[0] && node_keys(target->next[0])[0] == key) {
+        prev = target;
+        target = target->next[0];
+    } else if (target == sl->header) {
+        return -1;
+    }
+    
+    int* keys = node_keys(target);
+    int* values = node_values(sl, target);
+    int pos = run_search(keys, target->num_keys, key);
+    if (pos == target->num_keys || keys[pos] != key) {
+        return -1;
+    }
+    
+    int move = target->num_keys - pos - 1;
+    memmove(keys + pos, keys + pos + 1, move * sizeof(int));
+    memmove(values + pos, values + pos + 1, move * sizeof(int));
+    target->num_keys--;
+    sl->num_keys--;
+    
+    if (target->num_keys == 0) {
+        // only the smallest key empties a node, then prev and update are its predecessors
+        unlink_after(sl, target, prev, update);
+        return 0;
+    }
+    
+    // take the keys of a small successor, it is unlinked behind target
+    node_t* n = target->next[0];
+    if (target->num_keys <= sl->run_size / 4 && n && target->num_keys + n->num_keys <= sl->run_size / 2) {
+        memcpy(keys + target->num_keys, node_keys(n), n->num_keys * sizeof(int));
+        memcpy(values + target->num_keys, node_values(sl, n), n->num_keys * sizeof(int));
+        target->num_keys += n->num_keys;
+        
+        // below the level of target, update[i] of n is target; above it the path to key
+        unlink_after(sl, n, target, update);
+    }
+    
+    return 0;
+}
+
+int* fat_search(fat_skiplist_t* sl, int key)
+{
+    node_t* current = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        node_t* forward;
+        while ((forward = current->next[i]) && node_keys(forward)[0] <= key) {
+            current = forward;
+        }
+    }
+    
+    if (current == sl->header) {
+        return NULL;
+    }
+    
+    int* keys = node_keys(current);
+    int pos = run_search(keys, current->num_keys, key);
+    if (pos < current->num_keys && keys[pos] == key) {
+        return &node_values(sl, current)[pos];
+    }
+    
+    return NULL;
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// runs are sorted and non empty, keys ascend across nodes, every level is a subset of level 0
+static int check_list(fat_skiplist_t* sl)
+{
+    long count = 0;
+    long prev = (long)INT32_MIN - 1;
+    for (node_t* n = sl->header->next[0]; n; n = n->next[0]) {
+        if (n->num_keys < 1 || n->num_keys > sl->run_size) {
+            return -1;
+        }
+        
+        int* keys = node_keys(n);
+        for (int j = 0; j < n->num_keys; j++) {
+            if (keys[j] <= prev) {
+                return -1;
+            }
+            prev = keys[j];
+        }
+        count += n->num_keys;
+    }
+    
+    for (int i = 1; i < sl->level; i++) {
+        node_t* below = sl->header->next[0];
+        for (node_t* n = sl->header->next[i]; n; n = n->next[i]) {
+            while (below && below != n) {
+                below = below->next[0];
+            }
+            if (!below || n->level <= i) {
+                return -1;
+            }
+        }
+    }
+    
+    return count == sl->num_keys ? 0 : -1;
+}
+
+// random inserts and deletes against a plain array
+static int run_test(int run_size, int key_range, int ops)
+{
+    fat_skiplist_t* sl = create_fat_skiplist(run_size);
+    int* values = malloc(key_range * sizeof(int));
+    for (int k = 0; k < key_range; k++) {
+        values[k] = -1;
+    }
+    
+    int errors = 0;
+    uint64_t seed = 12345 + run_size;
+    for (int i = 0; i < ops; i++) {
+        uint64_t r = xorshift(&seed);
+        int k = (int)((r >> 8) % key_range);
+        if (r % 3 != 0) {
+            int existed = values[k] >= 0;
+            errors += fat_insert(sl, k, i) != existed;
+            values[k] = i;
+        } else {
+            errors += fat_delete(sl, k) != (values[k] >= 0 ? 0 : -1);
+            values[k] = -1;
+        }
+    }
+    
+    for (int k = 0; k < key_range; k++) {
+        int* p = fat_search(sl, k);
+        errors += values[k] >= 0 ? (!p || *p != values[k]) : p != NULL;
+    }
+    errors += check_list(sl) != 0;
+    
+    // drain in random order, merges and empty nodes
+    for (int k = 0; k < key_range; k++) {
+        int j = (int)((k * 2654435761ULL) % key_range);
+        if (values[j] >= 0) {
+            errors += fat_delete(sl, j) != 0;
+            values[j] = -1;
+        }
+        if (k % 1000 == 0) {
+            errors += check_list(sl) != 0;
+        }
+    }
+    errors += sl->num_keys != 0 || sl->header->next[0] != NULL;
+    
+    printf("run size %d, %d keys, %d ops: %s\n", run_size, key_range, ops, errors ? "FAILED" : "ok");
+    fat_destroy(sl);
+    free(values);
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+// same keys as skiplist bench, compare with its one key per node layout
+static void bench(int n)
+{
+    int run_sizes[] = {2, 4, 8, 16, 32, 64};
+    int* keys = malloc(n * sizeof(int));
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < n; i++) {
+        keys[i] = (int)(xorshift(&state) >> 33);
+    }
+    
+    printf("%d random keys\n", n);
+    printf("%8s %12s %12s %12s %10s\n", "run size", "insert ns", "search ns", "bytes/key", "keys/node");
+    for (int r = 0; r < sizeof(run_sizes) / sizeof(run_sizes[0]); r++) {
+        fat_skiplist_t* sl = create_fat_skiplist(run_sizes[r]);
+        
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < n; i++) {
+            fat_insert(sl, keys[i], i);
+        }
+        uint64_t insert_ns = get_nano_tick() - start;
+        
+        start = get_nano_tick();
+        long found = 0;
+        for (int i = 0; i < n; i++) {
+            found += fat_search(sl, keys[i]) != NULL;
+        }
+        uint64_t search_ns = get_nano_tick() - start;
+        
+        long nodes = 0;
+        size_t bytes = 0;
+        for (node_t* x = sl->header->next[0]; x; x = x->next[0]) {
+            nodes++;
+            bytes += sl->arenas[x->level - 1].node_size;
+        }
+        
+        printf("%8d %12.1f %12.1f %12.2f %10.2f\n", run_sizes[r], (double)insert_ns / n, (double)search_ns / n,
+               (double)bytes / sl->num_keys, (double)sl->num_keys / nodes);
+        if (found != n) {
+            printf("search FAILED\n");
+        }
+        fat_destroy(sl);
+    }
+    
+    free(keys);
+}
+
+// for test
+int main(int argc, const char * argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: skiplist_fat bench [num_keys]
+        bench(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    int failed = 0;
+    failed |= run_test(2, 1000, 200000);
+    failed |= run_test(3, 5000, 200000);
+    failed |= run_test(16, 20000, 500000);
+    failed |= run_test(64, 100000, 500000);
+    
+    return failed;
+}
@@ -0,0 +1,797 @@
+//
+//  skiplist_lf.c
+//  skiplist
+//
+//  Created by jianqing.du on 16-4-6.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ lock-free skip list as described in <<Practical lock-freedom>> (Fraser, 2004) and
+ <<The Art of Multiprocessor Programming>> chapter 14.4
+
+ the lowest bit of next[i] marks the node as deleted at level i. a delete marks the levels
+ from the top down, the thread whose CAS marks level 0 owns the delete. every traversal that
+ passes a marked node unlinks it with a CAS on the next pointer of its predecessor, search
+ only skips marked nodes and never writes.
+
+ an unlinked node is retired to epoch based reclamation: every operation runs inside an
+ epoch, a node retired in epoch e is freed once the global epoch reached e + 3, then no
+ thread can still hold a pointer to it.
+
+ a node that is deleted while its inserter still links the upper levels is handed over: the
+ inserter unlinks and retires it when it is done, so no level is linked after the retire
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX_LEVEL       16
+#define MARK            ((uintptr_t)1)
+#define RETIRE_BATCH    64      // try to advance the epoch after this many retires
+
+#define NODE_LINKING    0       // the inserter is linking the upper levels
+#define NODE_LINKED     1
+#define NODE_HANDED     2       // deleted while linking, the inserter retires it
+
+typedef struct node {
+    int          key;
+    _Atomic int  value;
+    int          level;
+    _Atomic int  state;
+    struct node* retired_next;
+    _Atomic uintptr_t next[];
+} node_t;
+
+typedef struct {
+    node_t* header;
+    _Atomic long count;
+} skiplist_t;
+
+// api, every function may be called from any thread at the same time except sl_destroy, no
+// thread may use the destroyed list. the other lists stay live, the nodes retired from the
+// destroyed list are left to the epochs like any other retired node
+skiplist_t* create_skiplist();
+void sl_destroy(skiplist_t* sl);
+int sl_insert(skiplist_t* sl, int key, int value);
+int sl_delete(skiplist_t* sl, int key);
+bool sl_search(skiplist_t* sl, int key, int* value);
+
+////////
+
+static bool is_marked(uintptr_t p)
+{
+    return (p & MARK) != 0;
+}
+
+static node_t* get_node(uintptr_t p)
+{
+    return (node_t*)(p & ~MARK);
+}
+
+//////////// epoch based reclamation
+
+typedef struct ebr_thread {
+    _Atomic uint64_t epoch;         // the global epoch when the thread entered
+    atomic_bool      active;
+    atomic_bool      in_use;        // owned by a live thread
+    node_t*          retired[3];    // retired in epoch e go to retired[e % 3]
+    long             num_retired;
+    struct ebr_thread* next;
+} ebr_thread_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(ebr_thread_t*) ebr_threads;
+static __thread ebr_thread_t* ebr_self;
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+// a finished thread leaves its record and its retired nodes to the next new thread
+static void ebr_thread_exit(void* p)
+{
+    ebr_thread_t* r = p;
+    atomic_store(&r->active, false);
+    atomic_store(&r->in_use, false);
+}
+
+static void ebr_init()
+{
+    pthread_key_create(&ebr_key, ebr_thread_exit);
+}
+
+static ebr_thread_t* ebr_register()
+{
+    pthread_once(&ebr_once, ebr_init);
+    
+    ebr_thread_t* r = NULL;
+    for (r = atomic_load(&ebr_threads); r; r = r->next) {
+        bool expected = false;
+        if (!atomic_load(&r->in_use) && atomic_compare_exchange_strong(&r->in_use, &expected, true)) {
+            break;
+        }
+    }
+    
+    if (!r) {
+        r = calloc(1, sizeof(ebr_thread_t));
+        if (!r) {
+            perror("malloc failed\n");
+            exit(1);
+        }
+        
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load(&ebr_threads);
+        while (!atomic_compare_exchange_weak(&ebr_threads, &r->next, r)) {
+        }
+    }
+    
+    pthread_setspecific(ebr_key, r);
+    ebr_self = r;
+    return r;
+}
+
+static void free_retired(node_t* n)
+{
+    while (n) {
+        node_t* next = n->retired_next;
+        free(n);
+        n = next;
+    }
+}
+
+static void ebr_enter()
+{
+    ebr_thread_t* r = ebr_self ? ebr_self : ebr_register();
+    
+    // active must be visible before the epoch is read, or an advance could miss this thread.
+    // the seq_cst store also orders the previous operation before an advance that reads it
+    atomic_store(&r->active, true);
+    
+    uint64_t e = atomic_load(&global_epoch);
+    if (e != atomic_load_explicit(&r->epoch, memory_order_relaxed)) {
+        // retired in e - 3 or before. the global epoch may have been one ahead at the retire,
+        // then two more advances wait for every thread that could still reach them
+        free_retired(r->retired[e % 3]);
+        r->retired[e % 3] = NULL;
+        atomic_store(&r->epoch, e);
+    }
+}
+
+static void ebr_exit()
+{
+    atomic_store_explicit(&ebr_self->active, false, memory_order_release);
+}
+
+// the epoch moves on when every active thread has entered the current one
+static void ebr_try_advance()
+{
+    uint64_t e = atomic_load(&global_epoch);
+    for (ebr_thread_t* r = atomic_load(&ebr_threads); r; r = r->next) {
+        if (atomic_load(&r->active) && atomic_load(&r->epoch) != e) {
+            return;
+        }
+    }
+    
+    atomic_compare_exchange_strong(&global_epoch, &e, e + 1);
+}
+
+static void ebr_retire(node_t* n)
+{
+    ebr_thread_t* r = ebr_self;
+    uint64_t e = atomic_load_explicit(&r->epoch, memory_order_relaxed);
+    n->retired_next = r->retired[e % 3];
+    r->retired[e % 3] = n;
+    
+    if (++r->num_retired % RETIRE_BATCH == 0) {
+        ebr_try_advance();
+    }
+}
+
+//////////// skip list
+
+// per thread xorshift, glibc rand() takes a lock
+static __thread uint64_t level_seed;
+
+static int rand_level()
+{
+    if (level_seed == 0) {
+        level_seed = (uint64_t)(uintptr_t)&level_seed ^ 0x9E3779B97F4A7C15ULL;
+    }
+    
+    uint64_t x = level_seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    level_seed = x;
+    x *= 0x2545F4914F6CDD1DULL;
+    
+    // p = 1/2 per level, one bit per level from the high half
+    int level = 1;
+    while ((x & (1ULL << (63 - level))) && level < MAX_LEVEL) {
+        level++;
+    }
+    
+    return level;
+}
+
+static node_t* new_node(int level, int key, int value)
+{
+    node_t* n = malloc(sizeof(node_t) + level * sizeof(uintptr_t));
+    if (!n) {
+        perror("malloc failed\n");
+        exit(1);
+    }
+    
+    n->key = key;
+    atomic_init(&n->value, value);
+    n->level = level;
+    atomic_init(&n->state, NODE_LINKING);
+    n->retired_next = NULL;
+    for (int i = 0; i < level; i++) {
+        atomic_init(&n->next[i], 0);
+    }
+    
+    return n;
+}
+
+skiplist_t* create_skiplist()
+{
+    skiplist_t* sl = malloc(sizeof(skiplist_t));
+    if (!sl) {
+        return NULL;
+    }
+    
+    sl->header = new_node(MAX_LEVEL, 0, 0);
+    atomic_store(&sl->header->state, NODE_LINKED);
+    atomic_init(&sl->count, 0);
+    return sl;
+}
+
+// no thread may use the list. a retired node is unlinked from every level, so the chain holds
+// none of them, they may still be reachable by threads of other lists until their epoch ends
+void sl_destroy(skiplist_t* sl)
+{
+    node_t* n = sl->header;
+    while (n) {
+        node_t* next = get_node(atomic_load(&n->next[0]));
+        free(n);
+        n = next;
+    }
+    
+    free(sl);
+}
+
+// fill preds and succs with the last node < key and the next one on every level, unlink the
+// marked nodes on the way. with a target, equal keys before the target are passed, so the
+// target is unlinked even behind a newer node of the same key.
+// return true if the first node >= key on level 0 has the key
+static bool find(skiplist_t* sl, int key, node_t* target, node_t** preds, node_t** succs)
+{
+retry:
+    ;
+    node_t* pred = sl->header;
+    for (int i = MAX_LEVEL - 1; i >= 0; i--) {
+        node_t* curr = get_node(atomic_load(&pred->next[i]));
+        while (curr) {
+            uintptr_t succ = atomic_load(&curr->next[i]);
+            while (is_marked(succ)) {
+                uintptr_t expected = (uintptr_t)curr;
+                if (!atomic_compare_exchange_strong(&pred->next[i], &expected, succ & ~MARK)) {
+                    goto retry;
+                }
+                
+                curr = get_node(succ);
+                if (!curr) {
+                    break;
+                }
+                succ = atomic_load(&curr->next[i]);
+            }
+            
+            if (curr && (curr->key < key || (target && curr->key == key && curr != target))) {
+                pred = curr;
+                curr = get_node(succ);
+            } else {
+                break;
+            }
+        }
+        
+        preds[i] = pred;
+        succs[i] = curr;
+    }
+    
+    return succs[0] && succs[0]->key == key;
+}
+
+// return 0 if the key is inserted, 1 if it existed and its value is replaced
+int sl_insert(skiplist_t* sl, int key, int value)
+{
+    node_t* preds[MAX_LEVEL];
+    node_t* succs[MAX_LEVEL];
+    node_t* n = NULL;
+    int level = rand_level();
+    
+    ebr_enter();
+    while (true) {
+        if (find(sl, key, NULL, preds, succs)) {
+            atomic_store(&succs[0]->value, value);
+            ebr_exit();
+            free(n);    // never published
+            return 1;
+        }
+        
+        if (!n) {
+            n = new_node(level, key, value);
+        }
+        for (int i = 0; i < level; i++) {
+            atomic_store_explicit(&n->next[i], (uintptr_t)succs[i], memory_order_relaxed);
+        }
+        
+        // the node is in the list once it is on level 0
+        uintptr_t expected = (uintptr_t)succs[0];
+        if (atomic_compare_exchange_strong(&preds[0]->next[0], &expected, (uintptr_t)n)) {
+            break;
+        }
+    }
+    atomic_fetch_add_explicit(&sl->count, 1, memory_order_relaxed);
+    
+    for (int i = 1; i < level; i++) {
+        while (true) {
+            uintptr_t next = atomic_load(&n->next[i]);
+            if (is_marked(next)) {
+                goto done;
+            }
+            
+            // point to the current successor, fails if a delete marked the level meanwhile
+            if (next != (uintptr_t)succs[i] &&
+                !atomic_compare_exchange_strong(&n->next[i], &next, (uintptr_t)succs[i])) {
+                goto done;
+            }
+            
+            uintptr_t expected = (uintptr_t)succs[i];
+            if (atomic_compare_exchange_strong(&preds[i]->next[i], &expected, (uintptr_t)n)) {
+                break;
+            }
+            
+            find(sl, key, n, preds, succs);
+            if (is_marked(atomic_load(&n->next[0]))) {
+                goto done;
+            }
+        }
+    }
+
+done:
+    ;
+    int state = NODE_LINKING;
+    if (!atomic_compare_exchange_strong(&n->state, &state, NODE_LINKED)) {
+        // deleted while linking, take every level out before the retire
+        find(sl, key, n, preds, succs);
+        ebr_retire(n);
+    }
+    
+    ebr_exit();
+    return 0;
+}
+
+// return 0 if the key is deleted, -1 if not found
+int sl_delete(skiplist_t* sl, int key)
+{
+    node_t* preds[MAX_LEVEL];
+    node_t* succs[MAX_LEVEL];
+    
+    ebr_enter();
+    if (!find(sl, key, NULL, preds, succs)) {
+        ebr_exit();
+        return -1;
+    }
+    
+    node_t* n = succs[0];
+    for (int i = n->level - 1; i >= 1; i--) {
+        uintptr_t next = atomic_load(&n->next[i]);
+        while (!is_marked(next) && !atomic_compare_exchange_weak(&n->next[i], &next, next | MARK)) {
+        }
+    }
+    
+    // the thread that marks level 0 deletes the node
+    uintptr_t next = atomic_load(&n->next[0]);
+    while (true) {
+        if (is_marked(next)) {
+            ebr_exit();
+            return -1;
+        }
+        
+        if (atomic_compare_exchange_weak(&n->next[0], &next, next | MARK)) {
+            break;
+        }
+    }
+    atomic_fetch_sub_explicit(&sl->count, 1, memory_order_relaxed);
+    
+    int state = NODE_LINKING;
+    if (!atomic_compare_exchange_strong(&n->state, &state, NODE_HANDED)) {
+        // all levels are linked, unlink them and retire
+        find(sl, key, n, preds, succs);
+        ebr_retire(n);
+    }
+    
+    ebr_exit();
+    return 0;
+}
+
+// wait free, marked nodes are passed without unlinking them
+bool sl_search(skiplist_t* sl, int key, int* value)
+{
+    ebr_enter();
+    
+    node_t* pred = sl->header;
+    node_t* curr = NULL;
+    for (int i = MAX_LEVEL - 1; i >= 0; i--) {
+        curr = get_node(atomic_load(&pred->next[i]));
+        while (curr) {
+            uintptr_t succ = atomic_load(&curr->next[i]);
+            if (is_marked(succ)) {
+                curr = get_node(succ);
+            } else if (curr->key < key) {
+                pred = curr;
+                curr = get_node(succ);
+            } else {
+                break;
+            }
+        }
+    }
+    
+    bool found = curr && curr->key == key;
+    if (found && value) {
+        *value = atomic_load(&curr->value);
+    }
+    
+    ebr_exit();
+    return found;
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// single threaded: level 0 is sorted without marks and every upper level is a sorted subset of
+// it, return the number of nodes
+static long check_list(skiplist_t* sl)
+{
+    long count = 0;
+    for (int i = MAX_LEVEL - 1; i >= 0; i--) {
+        node_t* below = get_node(atomic_load(&sl->header->next[0]));
+        long prev = (long)INT32_MIN - 1;
+        count = 0;
+        for (node_t* n = get_node(atomic_load(&sl->header->next[i])); n; n = get_node(atomic_load(&n->next[i]))) {
+            if (is_marked(atomic_load(&n->next[i])) || n->key <= prev || n->level <= i) {
+                printf("level %d broken at key %d\n", i, n->key);
+                exit(1);
+            }
+            
+            while (below && below != n) {
+                below = get_node(atomic_load(&below->next[0]));
+            }
+            if (!below) {
+                printf("level %d has key %d that is not on level 0\n", i, n->key);
+                exit(1);
+            }
+            
+            prev = n->key;
+            count++;
+        }
+    }
+    
+    return count;
+}
+
+typedef struct test_arg {
+    skiplist_t* sl;
+    int         id;
+    int         num_threads;
+    int         num_keys;
+    int         ops;
+    long*       balance;    // inserts - deletes per key, shared keys only
+    long        errors;
+} test_arg_t;
+
+// every thread owns the keys k with k % num_threads == id: it inserts them, reads them back,
+// removes every third one and reads random keys of the other threads in between
+static void* owner_worker(void* p)
+{
+    test_arg_t* a = p;
+    uint64_t seed = 1234567 + a->id;
+    
+    for (int k = a->id; k < a->num_keys; k += a->num_threads) {
+        if (sl_insert(a->sl, k, k * 2) != 0) {
+            a->errors++;
+        }
+        
+        int value = 0;
+        if (!sl_search(a->sl, k, &value) || value != k * 2) {
+            a->errors++;
+        }
+        
+        if (k % 3 == 0 && sl_delete(a->sl, k) != 0) {
+            a->errors++;
+        }
+        
+        sl_search(a->sl, (int)(xorshift(&seed) % a->num_keys), &value);
+    }
+    
+    return NULL;
+}
+
+// all threads insert and delete random keys of a small range, every success is counted per key
+static void* shared_worker(void* p)
+{
+    test_arg_t* a = p;
+    uint64_t seed = 7654321 + a->id;
+    
+    for (int i = 0; i < a->ops; i++) {
+        uint64_t r = xorshift(&seed);
+        int k = (int)((r >> 8) % a->num_keys);
+        if (r & 1) {
+            if (sl_insert(a->sl, k, k) == 0) {
+                atomic_fetch_add((_Atomic long*)&a->balance[k], 1);
+            }
+        } else if (sl_delete(a->sl, k) == 0) {
+            atomic_fetch_sub((_Atomic long*)&a->balance[k], 1);
+        }
+    }
+    
+    return NULL;
+}
+
+static int run_test(int num_threads, int num_keys, bool shared)
+{
+    skiplist_t* sl = create_skiplist();
+    pthread_t threads[64];
+    test_arg_t args[64];
+    long* balance = calloc(num_keys, sizeof(long));
+    
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (test_arg_t){sl, i, num_threads, num_keys, 200000, balance, 0};
+        pthread_create(&threads[i], NULL, shared ? shared_worker : owner_worker, &args[i]);
+    }
+    
+    long errors = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors;
+    }
+    
+    long expected = 0;
+    for (int k = 0; k < num_keys; k++) {
+        int value = 0;
+        bool present = shared ? balance[k] == 1 : k % 3 != 0;
+        bool found = sl_search(sl, k, &value);
+        if (found != present || (found && value != (shared ? k : k * 2))) {
+            errors++;
+        }
+        if (shared && balance[k] != 0 && balance[k] != 1) {
+            errors++;
+        }
+        expected += present;
+    }
+    
+    long count = check_list(sl);
+    if (count != expected || count != atomic_load(&sl->count)) {
+        errors++;
+    }
+    
+    printf("%d threads, %d %s keys: %ld keys, %s\n", num_threads, num_keys, shared ? "shared" : "owned", count,
+           errors ? "FAILED" : "ok");
+    sl_destroy(sl);
+    free(balance);
+    return errors ? 1 : 0;
+}
+
+typedef struct churn_arg {
+    skiplist_t*  sl;
+    int          id;
+    atomic_bool* stop;
+    long         errors;
+} churn_arg_t;
+
+// inserts and deletes the odd keys of its own residue, reads the even keys that stay
+static void* churn_worker(void* p)
+{
+    churn_arg_t* a = p;
+    while (!atomic_load_explicit(a->stop, memory_order_relaxed)) {
+        for (int k = 2 * a->id + 1; k < 1000; k += 4) {
+            int value = -1;
+            a->errors += sl_insert(a->sl, k, k) != 0 || sl_delete(a->sl, k) != 0;
+            a->errors += !sl_search(a->sl, k - 1, &value) || value != k - 1;
+        }
+    }
+    
+    return NULL;
+}
+
+// the retired lists are per thread, not per list: destroying one list must leave the nodes
+// retired from another live list to the epochs while its threads still read them
+static int run_two_lists_test()
+{
+    int errors = 0;
+    skiplist_t* a = create_skiplist();
+    for (int k = 0; k < 1000; k += 2) {
+        sl_insert(a, k, k);
+    }
+    
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    pthread_t threads[2];
+    churn_arg_t args[2];
+    for (int i = 0; i < 2; i++) {
+        args[i] = (churn_arg_t){a, i, &stop, 0};
+        pthread_create(&threads[i], NULL, churn_worker, &args[i]);
+    }
+    
+    for (int round = 0; round < 20000; round++) {
+        skiplist_t* b = create_skiplist();
+        for (int k = 0; k < 100; k++) {
+            sl_insert(b, k, k);
+        }
+        for (int k = 0; k < 100; k += 2) {
+            errors += sl_delete(b, k) != 0;
+        }
+        sl_destroy(b);
+    }
+    
+    atomic_store(&stop, true);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        errors += args[i].errors != 0;
+    }
+    errors += check_list(a) != 500;
+    sl_destroy(a);
+    
+    printf("two lists, one destroyed 20000 times: %s\n", errors ? "FAILED" : "ok");
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+typedef struct bench_arg {
+    skiplist_t*      sl;
+    pthread_mutex_t* mutex;         // not NULL for the global mutex baseline
+    int              id;
+    int              read_percent;
+    int              key_range;
+    atomic_bool*     stop;
+    long             ops;
+} bench_arg_t;
+
+static void* bench_worker(void* p)
+{
+    bench_arg_t* a = p;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL + a->id;
+    long ops = 0;
+    
+    while (!atomic_load_explicit(a->stop, memory_order_relaxed)) {
+        for (int i = 0; i < 256; i++) {
+            uint64_t r = xorshift(&seed);
+            int key = (int)((r >> 8) % a->key_range);
+            int op = (int)(r % 100);
+            int value = 0;
+            
+            if (a->mutex) {
+                pthread_mutex_lock(a->mutex);
+            }
+            if (op < a->read_percent) {
+                sl_search(a->sl, key, &value);
+            } else if (op % 2 == 0) {
+                sl_insert(a->sl, key, key);
+            } else {
+                sl_delete(a->sl, key);
+            }
+            if (a->mutex) {
+                pthread_mutex_unlock(a->mutex);
+            }
+        }
+        ops += 256;
+    }
+    
+    a->ops = ops;
+    return NULL;
+}
+
+static double bench_run(skiplist_t* sl, bool use_mutex, int num_threads, int read_percent, int key_range,
+                        double seconds)
+{
+    pthread_t threads[64];
+    bench_arg_t args[64];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    atomic_bool stop;
+    atomic_init(&stop, false);
+    
+    for (int i = 0; i < num_threads; i++) {
+        args[i] = (bench_arg_t){sl, use_mutex ? &mutex : NULL, i, read_percent, key_range, &stop, 0};
+        pthread_create(&threads[i], NULL, bench_worker, &args[i]);
+    }
+    
+    uint64_t start = get_nano_tick();
+    struct timespec ts = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    atomic_store(&stop, true);
+    
+    long ops = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        ops += args[i].ops;
+    }
+    uint64_t ns = get_nano_tick() - start;
+    
+    return ops * 1e3 / ns;
+}
+
+// Mops/s for 1 to 64 threads at several read/write mixes, lock-free against one global mutex
+// around the same operations. the writes are half inserts and half deletes, so the size stays
+static void bench(int num_keys, double seconds)
+{
+    int read_percents[] = {100, 95, 50, 0};
+    int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+    
+    skiplist_t* sl = create_skiplist();
+    for (int k = 0; k < num_keys; k += 2) {
+        sl_insert(sl, k, k);
+    }
+    
+    printf("%d keys preloaded, key range %d, %.1fs per run (Mops/s)\n", num_keys / 2, num_keys, seconds);
+    printf("%6s %9s", "read%", "mode");
+    for (int i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        printf(" %8d", thread_counts[i]);
+    }
+    printf("\n");
+    
+    for (int r = 0; r < sizeof(read_percents) / sizeof(read_percents[0]); r++) {
+        for (int m = 0; m < 2; m++) {
+            printf("%6d %9s", read_percents[r], m ? "mutex" : "lock-free");
+            for (int i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+                printf(" %8.2f", bench_run(sl, m == 1, thread_counts[i], read_percents[r], num_keys, seconds));
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+    }
+    
+    sl_destroy(sl);
+}
+
+// for test
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: skiplist_lf bench [num_keys] [seconds]
+        bench(argc >= 3 ? atoi(argv[2]) : 1000000, argc >= 4 ? atof(argv[3]) : 0.5);
+        return 0;
+    }
+    
+    int failed = 0;
+    failed |= run_test(1, 100000, false);
+    failed |= run_test(4, 200000, false);
+    failed |= run_test(16, 200000, false);
+    failed |= run_test(8, 64, true);
+    failed |= run_test(32, 1000, true);
+    failed |= run_two_lists_test();
+    
+    return failed;
+}
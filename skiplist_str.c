@@ -0,0 +1,511 @@
+//
+//  skiplist_str.c
+//  skiplist
+//
+//  Created by jianqing.du on 16-4-20.
+//  Copyright (c) 2016年. All rights reserved.
+//
+
+/*
+ skip list with byte string keys, e.g. urls and tenant names
+
+ a node is one allocation: the levels, then value_size bytes of value, then the key bytes.
+ the node also keeps the first HEAD_SIZE key bytes as a big endian integer, like the slots of
+ bptree_str.c, so most compares on the way down are one integer compare and only keys with
+ the same head read the key bytes of the node. keys compare like memcmp, a prefix first.
+
+ search returns a pointer to the value inside the node, it stays valid until the key is deleted
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LEVEL   32
+#define HEAD_SIZE   8
+#define MAX_KEY_LEN 65535
+
+// build with -DKEY_HEAD=0 to compare every key with memcmp, for comparison
+#ifndef KEY_HEAD
+#define KEY_HEAD    1
+#endif
+
+typedef struct snode {
+    uint64_t head;          // the first HEAD_SIZE key bytes, big endian and zero padded
+    uint32_t len;
+    uint32_t height;
+    struct snode* next[];
+} snode_t;
+
+typedef struct {
+    int       level;
+    long      length;
+    size_t    value_size;
+    uint64_t  seed;
+    snode_t*  header;
+} str_skiplist_t;
+
+typedef bool (*ssl_scan_fn)(void* ctx, const uint8_t* key, int len, void* value);
+
+// api
+str_skiplist_t* create_str_skiplist(size_t value_size);
+void ssl_destroy(str_skiplist_t* sl);
+int ssl_insert(str_skiplist_t* sl, const void* key, int len, const void* value);
+int ssl_delete(str_skiplist_t* sl, const void* key, int len);
+void* ssl_search(str_skiplist_t* sl, const void* key, int len);
+bool ssl_get(str_skiplist_t* sl, const void* key, int len, void* value);
+long ssl_scan(str_skiplist_t* sl, const void* lo, int lo_len, ssl_scan_fn fn, void* ctx);
+
+////////
+
+static void* node_value(snode_t* n)
+{
+    return &n->next[n->height];
+}
+
+static uint8_t* node_key(str_skiplist_t* sl, snode_t* n)
+{
+    return (uint8_t*)node_value(n) + sl->value_size;
+}
+
+static int min_int(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+// every api call checks the key length before it reaches load_head or memcmp
+static bool valid_len(int len)
+{
+    return len >= 0 && len <= MAX_KEY_LEN;
+}
+
+// the first HEAD_SIZE bytes as a big endian integer, integer order is memcmp order
+static uint64_t load_head(const uint8_t* p, int len)
+{
+    uint64_t head = 0;
+    memcpy(&head, p, min_int(len, HEAD_SIZE));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    head = __builtin_bswap64(head);
+#endif
+    return head;
+}
+
+static int key_cmp(str_skiplist_t* sl, snode_t* n, const uint8_t* key, int len, uint64_t head)
+{
+    int skip = 0;
+#if KEY_HEAD
+    if (n->head != head) {
+        return n->head < head ? -1 : 1;
+    }
+    
+    // equal heads: the first HEAD_SIZE bytes, or all bytes of the shorter key, are equal
+    skip = min_int(min_int(n->len, len), HEAD_SIZE);
+#endif
+
+    int m = min_int(n->len, len);
+    int c = memcmp(node_key(sl, n) + skip, key + skip, m - skip);
+    if (c != 0) {
+        return c;
+    }
+    
+    return (int)n->len - len;
+}
+
+static int rand_level(str_skiplist_t* sl)
+{
+    // xorshift64*, one draw and the trailing zeros give a level with p = 1/2
+    uint64_t x = sl->seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sl->seed = x;
+    x *= 0x2545F4914F6CDD1DULL;
+    return 1 + __builtin_ctzll(x | (1ULL << (MAX_LEVEL - 1)));
+}
+
+static snode_t* new_node(str_skiplist_t* sl, int level, const uint8_t* key, int len, const void* value)
+{
+    snode_t* n = malloc(sizeof(snode_t) + level * sizeof(snode_t*) + sl->value_size + len);
+    if (!n) {
+        return NULL;
+    }
+    
+    n->head = load_head(key, len);
+    n->len = len;
+    n->height = level;
+    if (value) {
+        memcpy(node_value(n), value, sl->value_size);
+    }
+    memcpy(node_key(sl, n), key, len);
+    return n;
+}
+
+str_skiplist_t* create_str_skiplist(size_t value_size)
+{
+    str_skiplist_t* sl = malloc(sizeof(str_skiplist_t));
+    if (!sl) {
+        return NULL;
+    }
+    
+    sl->level = 1;
+    sl->length = 0;
+    sl->value_size = value_size;
+    sl->seed = 0x9E3779B97F4A7C15ULL;
+    sl->header = new_node(sl, MAX_LEVEL, (const uint8_t*)"", 0, NULL);
+    if (!sl->header) {
+        free(sl);
+        return NULL;
+    }
+    
+    for (int i = 0; i < MAX_LEVEL; i++) {
+        sl->header->next[i] = NULL;
+    }
+    
+    return sl;
+}
+
+void ssl_destroy(str_skiplist_t* sl)
+{
+    snode_t* n = sl->header;
+    while (n) {
+        snode_t* next = n->next[0];
+        free(n);
+        n = next;
+    }
+    
+    free(sl);
+}
+
+// update[i] is the last node < key on level i, return the first node >= key and its compare
+static snode_t* find(str_skiplist_t* sl, const uint8_t* key, int len, snode_t** update, int* cmp)
+{
+    uint64_t head = load_head(key, len);
+    snode_t* current = sl->header;
+    snode_t* forward = NULL;
+    int c = 1;
+    
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while ((forward = current->next[i]) && (c = key_cmp(sl, forward, key, len, head)) < 0) {
+            current = forward;
+        }
+        
+        if (update) {
+            update[i] = current;
+        }
+    }
+    
+    *cmp = forward ? c : 1;
+    return forward;
+}
+
+// return 0 if the key is inserted, 1 if it existed and its value is replaced, -1 on a bad key
+int ssl_insert(str_skiplist_t* sl, const void* key, int len, const void* value)
+{
+    snode_t* update[MAX_LEVEL];
+    int cmp;
+    
+    if (!valid_len(len)) {
+        return -1;
+    }
+    
+    snode_t* forward = find(sl, key, len, update, &cmp);
+    if (cmp == 0) {
+        memcpy(node_value(forward), value, sl->value_size);
+        return 1;
+    }
+    
+    int level = rand_level(sl);
+    if (level > sl->level) {
+        for (int i = sl->level; i < level; i++) {
+            update[i] = sl->header;
+        }
+        
+        sl->level = level;
+    }
+    
+    snode_t* n = new_node(sl, level, key, len, value);
+    if (!n) {
+        return -1;
+    }
+    
+    for (int i = 0; i < level; i++) {
+        n->next[i] = update[i]->next[i];
+        update[i]->next[i] = n;
+    }
+    sl->length++;
+    
+    return 0;
+}
+
+// return 0 if the key is deleted, -1 if not found or a bad key
+int ssl_delete(str_skiplist_t* sl, const void* key, int len)
+{
+    snode_t* update[MAX_LEVEL];
+    int cmp;
+    
+    if (!valid_len(len)) {
+        return -1;
+    }
+    
+    snode_t* forward = find(sl, key, len, update, &cmp);
+    if (cmp != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < (int)forward->height; i++) {
+        update[i]->next[i] = forward->next[i];
+    }
+    free(forward);
+    sl->length--;
+    
+    while (sl->level > 1 && sl->header->next[sl->level - 1] == NULL) {
+        sl->level--;
+    }
+    
+    return 0;
+}
+
+// NULL if not found or a bad key
+void* ssl_search(str_skiplist_t* sl, const void* key, int len)
+{
+    int cmp;
+    if (!valid_len(len)) {
+        return NULL;
+    }
+    
+    snode_t* forward = find(sl, key, len, NULL, &cmp);
+    return cmp == 0 ? node_value(forward) : NULL;
+}
+
+bool ssl_get(str_skiplist_t* sl, const void* key, int len, void* value)
+{
+    void* p = ssl_search(sl, key, len);
+    if (p) {
+        memcpy(value, p, sl->value_size);
+    }
+    
+    return p != NULL;
+}
+
+// call fn for every key >= lo in order until it returns false, return the number of calls,
+// -1 on a bad lo
+long ssl_scan(str_skiplist_t* sl, const void* lo, int lo_len, ssl_scan_fn fn, void* ctx)
+{
+    int cmp;
+    long count = 0;
+    
+    if (!valid_len(lo_len)) {
+        return -1;
+    }
+    
+    for (snode_t* n = find(sl, lo, lo_len, NULL, &cmp); n; n = n->next[0]) {
+        count++;
+        if (!fn(ctx, node_key(sl, n), n->len, node_value(n))) {
+            break;
+        }
+    }
+    
+    return count;
+}
+
+//////////// test
+
+static uint64_t get_nano_tick()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+typedef struct test_key {
+    uint8_t bytes[40];
+    int     len;
+    long    value;
+    bool    present;
+} test_key_t;
+
+static int test_key_cmp(const void* a, const void* b)
+{
+    const test_key_t* x = a;
+    const test_key_t* y = b;
+    int c = memcmp(x->bytes, y->bytes, min_int(x->len, y->len));
+    return c ? c : x->len - y->len;
+}
+
+// short keys, keys with zero bytes, keys that are prefixes of each other and long shared prefixes
+static void make_key(test_key_t* k, uint64_t r, int i)
+{
+    switch (i % 4) {
+        case 0:
+            k->len = (int)(r % 9);
+            break;
+        case 1:
+            k->len = snprintf((char*)k->bytes, sizeof(k->bytes), "https://host/%d", (int)(r % 100000));
+            return;
+        case 2:
+            k->len = snprintf((char*)k->bytes, sizeof(k->bytes), "tenant-%d", (int)(r % 5000));
+            return;
+        default:
+            k->len = 8 + (int)(r % 24);
+            break;
+    }
+    
+    for (int j = 0; j < k->len; j++) {
+        k->bytes[j] = (uint8_t)((r >> (j % 8 * 8)) % 3);   // few distinct bytes, many shared prefixes
+        r = r * 6364136223846793005ULL + 1;
+    }
+}
+
+static bool collect_fn(void* ctx, const uint8_t* key, int len, void* value)
+{
+    test_key_t** out = ctx;
+    test_key_t* k = (*out)++;
+    memcpy(k->bytes, key, len);
+    k->len = len;
+    memcpy(&k->value, value, sizeof(long));
+    return true;
+}
+
+// random keys against a sorted array, half deleted, then a full scan in memcmp order
+static int run_test(int n)
+{
+    str_skiplist_t* sl = create_str_skiplist(sizeof(long));
+    test_key_t* keys = malloc(n * sizeof(test_key_t));
+    test_key_t* out = malloc(n * sizeof(test_key_t));
+    uint64_t seed = 77;
+    int errors = 0;
+    
+    for (int i = 0; i < n; i++) {
+        make_key(&keys[i], xorshift(&seed), i);
+        keys[i].value = i;
+    }
+    qsort(keys, n, sizeof(test_key_t), test_key_cmp);
+    
+    // drop duplicates, the last one keeps its place
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m > 0 && test_key_cmp(&keys[m - 1], &keys[i]) == 0) {
+            continue;
+        }
+        keys[m++] = keys[i];
+    }
+    
+    for (int i = m - 1; i >= 0; i--) {
+        errors += ssl_insert(sl, keys[i].bytes, keys[i].len, &keys[i].value) != 0;
+        keys[i].present = true;
+    }
+    for (int i = 0; i < m; i += 2) {
+        errors += ssl_delete(sl, keys[i].bytes, keys[i].len) != 0;
+        keys[i].present = false;
+    }
+    
+    long present = 0;
+    for (int i = 0; i < m; i++) {
+        long* v = ssl_search(sl, keys[i].bytes, keys[i].len);
+        long copy = -1;
+        if (keys[i].present) {
+            errors += !v || *v != keys[i].value || !ssl_get(sl, keys[i].bytes, keys[i].len, &copy) || copy != *v;
+            errors += ssl_insert(sl, keys[i].bytes, keys[i].len, &keys[i].value) != 1;
+            present++;
+        } else {
+            errors += v != NULL || ssl_delete(sl, keys[i].bytes, keys[i].len) != -1;
+        }
+    }
+    
+    test_key_t* end = out;
+    errors += ssl_scan(sl, "", 0, collect_fn, &end) != present || sl->length != present;
+    
+    // a bad length is refused before it reaches load_head
+    long dummy = 0;
+    errors += ssl_insert(sl, "", -1, &dummy) != -1 || ssl_delete(sl, "", -1) != -1 ||
+              ssl_search(sl, "", -1) != NULL || ssl_get(sl, "", MAX_KEY_LEN + 1, &dummy) ||
+              ssl_scan(sl, "", -1, collect_fn, &end) != -1 || sl->length != present;
+    test_key_t* k = out;
+    for (int i = 0; i < m; i++) {
+        if (keys[i].present) {
+            errors += test_key_cmp(k, &keys[i]) != 0 || k->value != keys[i].value;
+            k++;
+        }
+    }
+    
+    printf("%d keys, %d distinct, %ld after deletes: %s\n", n, m, present, errors ? "FAILED" : "ok");
+    ssl_destroy(sl);
+    free(keys);
+    free(out);
+    return errors ? 1 : 0;
+}
+
+//////////// benchmark
+
+// random 16 byte hex ids, where the head decides almost every compare, and urls that share
+// their first 20 bytes, where the head never does
+static void bench(int n)
+{
+    const char* names[] = {"hex ids", "urls"};
+    char (*keys)[48] = malloc(n * sizeof(*keys));
+    
+    printf("%d keys, key head %s\n", n, KEY_HEAD ? "on" : "off");
+    printf("%8s %12s %12s\n", "keys", "insert ns", "search ns");
+    for (int d = 0; d < 2; d++) {
+        uint64_t state = 88172645463325252ULL;
+        for (int i = 0; i < n; i++) {
+            uint64_t r = xorshift(&state);
+            if (d == 0) {
+                snprintf(keys[i], sizeof(keys[i]), "%016llx", (unsigned long long)r);
+            } else {
+                snprintf(keys[i], sizeof(keys[i]), "https://example.com/item/%llu", (unsigned long long)(r % 100000000));
+            }
+        }
+        
+        str_skiplist_t* sl = create_str_skiplist(sizeof(int));
+        uint64_t start = get_nano_tick();
+        for (int i = 0; i < n; i++) {
+            ssl_insert(sl, keys[i], (int)strlen(keys[i]), &i);
+        }
+        uint64_t insert_ns = get_nano_tick() - start;
+        
+        start = get_nano_tick();
+        long found = 0;
+        for (int i = 0; i < n; i++) {
+            found += ssl_search(sl, keys[i], (int)strlen(keys[i])) != NULL;
+        }
+        uint64_t search_ns = get_nano_tick() - start;
+        
+        printf("%8s %12.1f %12.1f\n", names[d], (double)insert_ns / n, (double)search_ns / n);
+        if (found != n) {
+            printf("search FAILED\n");
+        }
+        ssl_destroy(sl);
+    }
+    
+    free(keys);
+}
+
+// for test
+int main(int argc, const char * argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        // usage: skiplist_str bench [num_keys]
+        bench(argc >= 3 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+    
+    int failed = 0;
+    failed |= run_test(1000);
+    failed |= run_test(200000);
+    
+    return failed;
+}